@@ -0,0 +1,280 @@
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include "oufs_lib.h"
+/*
+ * Asynchronous reads and writes.
+ *
+ * oufs_aread() and oufs_awrite() queue a request and return at once.  A pool
+ * of worker threads of the handle carries the requests out with
+ * oufs_fread() and oufs_fwrite(), each on its own copy of the file at its
+ * own offset, so many requests may be in flight on one file; the inode
+ * locks order them as they would order calls from as many threads.
+ *
+ * Finished requests wait on the handle until oufs_aio_reap() is called.  An
+ * event loop polls the eventfd from oufs_aio_fd(), which becomes readable
+ * when something is done, and reaps from the loop's own thread: callbacks
+ * run there, never on a worker.
+ */
+
+#define debug 0
+
+/**
+ * Tell the eventfd that requests are done
+ */
+static void aio_signal(OUFS *fs, uint64_t n)
+{
+  if(fs->aio_fd >= 0 && write(fs->aio_fd, &n, sizeof(n)) != sizeof(n) && debug)
+    fprintf(stderr, "aio: eventfd write failed\n");
+}
+
+/**
+ * A worker: carries out queued requests until the handle is closed and the
+ * queue is empty
+ */
+static void *aio_worker(void *arg)
+{
+  OUFS *fs = (OUFS *) arg;
+
+  pthread_mutex_lock(&fs->aio_lock);
+  while(1) {
+    OUFS_AIO *request = fs->aio_queue;
+    if(request == NULL) {
+      if(fs->aio_stop)
+        break;
+      pthread_cond_wait(&fs->aio_cond, &fs->aio_lock);
+      continue;
+    }
+    fs->aio_queue = request->next;
+    if(fs->aio_queue == NULL)
+      fs->aio_queue_tail = NULL;
+    pthread_mutex_unlock(&fs->aio_lock);
+
+    if(request->write)
+      request->result = oufs_fwrite(fs, &request->file, request->buf, request->length);
+    else
+      request->result = oufs_fread(fs, &request->file, request->buf, request->length);
+
+    if(debug)
+      fprintf(stderr, "aio: %s of inode %d returned %d\n", request->write ? "write" : "read",
+              request->file.inode_reference, request->result);
+
+    // Completions are reaped in the order they happen
+    pthread_mutex_lock(&fs->aio_lock);
+    request->next = NULL;
+    OUFS_AIO **last = &fs->aio_done;
+    while(*last != NULL)
+      last = &(*last)->next;
+    *last = request;
+    aio_signal(fs, 1);
+  }
+  pthread_mutex_unlock(&fs->aio_lock);
+  return(NULL);
+}
+
+/**
+ * Initialize the asynchronous I/O state of a new handle
+ *
+ * @param fs The file system being opened
+ */
+void oufs_aio_init(OUFS *fs)
+{
+  pthread_mutex_init(&fs->aio_lock, NULL);
+  pthread_cond_init(&fs->aio_cond, NULL);
+  fs->aio_running = 0;
+  fs->aio_stop = 0;
+  fs->aio_in_flight = 0;
+  fs->aio_fd = -1;
+  fs->aio_queue = NULL;
+  fs->aio_queue_tail = NULL;
+  fs->aio_done = NULL;
+}
+
+/**
+ * Queue a request, starting the workers if they are not running yet
+ *
+ * @return 0 if queued; -1 on bad arguments, if too many requests are in
+ *         flight, or if the handle is being closed
+ */
+static int aio_submit(OUFS *fs, OUFILE *fp, int offset, unsigned char *buf, int len, int write,
+                      OUFS_AIO_CALLBACK callback, void *token)
+{
+  if(fp == NULL || buf == NULL || offset < 0 || len < 0)
+    return(-1);
+
+  OUFS_AIO *request = malloc(sizeof(OUFS_AIO));
+  if(request == NULL)
+    return(-1);
+  request->file = *fp;
+  request->file.offset = offset;
+  request->buf = buf;
+  request->length = len;
+  request->write = write;
+  request->callback = callback;
+  request->token = token;
+  request->result = -1;
+  request->next = NULL;
+
+  pthread_mutex_lock(&fs->aio_lock);
+  if(fs->aio_stop || fs->aio_in_flight >= OUFS_AIO_MAX_IN_FLIGHT) {
+    pthread_mutex_unlock(&fs->aio_lock);
+    free(request);
+    return(-1);
+  }
+  while(fs->aio_running < OUFS_AIO_WORKERS &&
+        pthread_create(&fs->aio_thread[fs->aio_running], NULL, aio_worker, fs) == 0)
+    fs->aio_running++;
+  if(fs->aio_running == 0) {
+    pthread_mutex_unlock(&fs->aio_lock);
+    free(request);
+    return(-1);
+  }
+
+  if(fs->aio_queue_tail != NULL)
+    fs->aio_queue_tail->next = request;
+  else
+    fs->aio_queue = request;
+  fs->aio_queue_tail = request;
+  fs->aio_in_flight++;
+  pthread_cond_signal(&fs->aio_cond);
+  pthread_mutex_unlock(&fs->aio_lock);
+  return(0);
+}
+
+/**
+ * Start reading from a file.  The file must stay open, and the buffer
+ * valid, until the request is reaped
+ *
+ * @param fs The open file system
+ * @param fp The file, opened for reading
+ * @param offset Where in the file to read (fp->offset is not used or moved)
+ * @param buf Receives the bytes
+ * @param len Bytes to read
+ * @param callback Called by oufs_aio_reap() when the read is done; NULL to
+ *                 have it reported as an event instead
+ * @param token Handed back with the result
+ * @return 0 if the read was queued; -1 if not
+ */
+int oufs_aread(OUFS *fs, OUFILE *fp, int offset, unsigned char *buf, int len,
+               OUFS_AIO_CALLBACK callback, void *token)
+{
+  return(aio_submit(fs, fp, offset, buf, len, 0, callback, token));
+}
+
+/**
+ * Start writing to a file.  The file must stay open, and the buffer
+ * valid, until the request is reaped
+ *
+ * @param fs The open file system
+ * @param fp The file, opened for writing
+ * @param offset Where in the file to write (fp->offset is not used or moved)
+ * @param buf The bytes
+ * @param len Bytes to write
+ * @param callback Called by oufs_aio_reap() when the write is done; NULL to
+ *                 have it reported as an event instead
+ * @param token Handed back with the result
+ * @return 0 if the write was queued; -1 if not
+ */
+int oufs_awrite(OUFS *fs, OUFILE *fp, int offset, unsigned char *buf, int len,
+                OUFS_AIO_CALLBACK callback, void *token)
+{
+  return(aio_submit(fs, fp, offset, buf, len, 1, callback, token));
+}
+
+/**
+ * The eventfd to poll for completions.  It is readable while there are
+ * requests to reap
+ *
+ * @param fs The open file system
+ * @return The file descriptor (owned by the handle); -1 on error
+ */
+int oufs_aio_fd(OUFS *fs)
+{
+  pthread_mutex_lock(&fs->aio_lock);
+  if(fs->aio_fd < 0) {
+    int done = 0;
+    for(OUFS_AIO *request = fs->aio_done; request != NULL; request = request->next)
+      ++done;
+    fs->aio_fd = eventfd(done, EFD_NONBLOCK | EFD_CLOEXEC);
+  }
+  int fd = fs->aio_fd;
+  pthread_mutex_unlock(&fs->aio_lock);
+  return(fd);
+}
+
+/**
+ * Reap finished requests, without waiting: the callback of each one that
+ * has one is called, and the others are reported as events
+ *
+ * @param fs The open file system
+ * @param events Receives the events
+ * @param max Most events to report; requests beyond are left for next time
+ * @return Number of events reported
+ */
+int oufs_aio_reap(OUFS *fs, OUFS_AIO_EVENT *events, int max)
+{
+  int n = 0;
+
+  pthread_mutex_lock(&fs->aio_lock);
+  if(fs->aio_fd >= 0) {
+    uint64_t count;
+    if(read(fs->aio_fd, &count, sizeof(count)) != sizeof(count) && debug)
+      fprintf(stderr, "aio: nothing to reap\n");
+  }
+
+  OUFS_AIO *request;
+  while((request = fs->aio_done) != NULL) {
+    if(request->callback == NULL && n == max)
+      break;
+    fs->aio_done = request->next;
+    fs->aio_in_flight--;
+
+    if(request->callback != NULL) {
+      pthread_mutex_unlock(&fs->aio_lock);
+      request->callback(fs, request);
+      pthread_mutex_lock(&fs->aio_lock);
+    }else{
+      events[n].token = request->token;
+      events[n].result = request->result;
+      ++n;
+    }
+    free(request);
+  }
+
+  // What is left over must still wake the loop
+  if(fs->aio_done != NULL)
+    aio_signal(fs, 1);
+  pthread_mutex_unlock(&fs->aio_lock);
+  return(n);
+}
+
+/**
+ * Finish the queued requests and stop the workers.  Requests that are not
+ * reaped are dropped
+ *
+ * @param fs The file system being closed
+ */
+void oufs_aio_shutdown(OUFS *fs)
+{
+  pthread_mutex_lock(&fs->aio_lock);
+  fs->aio_stop = 1;
+  pthread_cond_broadcast(&fs->aio_cond);
+  pthread_mutex_unlock(&fs->aio_lock);
+
+  for(int k = 0; k < fs->aio_running; ++k)
+    pthread_join(fs->aio_thread[k], NULL);
+  fs->aio_running = 0;
+
+  while(fs->aio_done != NULL) {
+    OUFS_AIO *request = fs->aio_done;
+    fs->aio_done = request->next;
+    free(request);
+  }
+  if(fs->aio_fd >= 0)
+    close(fs->aio_fd);
+  fs->aio_fd = -1;
+
+  pthread_mutex_destroy(&fs->aio_lock);
+  pthread_cond_destroy(&fs->aio_cond);
+}
@@ -0,0 +1,444 @@
+#include <stdlib.h>
+#include <string.h>
+#include "oufs_lib.h"
+/*
+ * Compressed files.
+ *
+ * A compressed file (IT_COMPRESSED_FILE) is split into clusters of
+ * OUFS_CLUSTER_SIZE bytes.  Each cluster is compressed on its own with a
+ * small LZ77 compressor (the LZ4 block format: runs of literals and
+ * back-references, no entropy coding, so it is fast both ways) and its
+ * stored bytes are kept in as few blocks as they need.  The file's cluster
+ * map block records, for every cluster, the stored length and the blocks.
+ *
+ * A read only decompresses the clusters it touches.  A write decompresses
+ * the clusters it touches, changes them and compresses them again; the new
+ * stored bytes go to new blocks (or blocks shared with identical data on a
+ * dedup image) before the old ones are released, so running out of space
+ * leaves the cluster as it was.
+ */
+
+#define debug 0
+
+// Shortest back-reference, and bytes at the end of the input that are
+// always left as literals
+#define LZ_MIN_MATCH 4
+#define LZ_END_LITERALS 5
+
+// Size of the match finder's hash table
+#define LZ_HASH_BITS 10
+
+/**
+ * Load 4 bytes, in any alignment
+ */
+static unsigned int lz_read32(const unsigned char *p)
+{
+  unsigned int v;
+  memcpy(&v, p, sizeof(v));
+  return(v);
+}
+
+/**
+ * Append a length that did not fit in its 4 bits of the token
+ *
+ * @return 0 on success; -1 if the output is full
+ */
+static int lz_put_length(unsigned char *dst, int *out, int capacity, int length)
+{
+  for(; length >= 255; length -= 255) {
+    if(*out >= capacity)
+      return(-1);
+    dst[(*out)++] = 255;
+  }
+  if(*out >= capacity)
+    return(-1);
+  dst[(*out)++] = length;
+  return(0);
+}
+
+/**
+ * Append one sequence: literals followed by a back-reference (or nothing,
+ * for the last sequence, when match_length is 0)
+ *
+ * @return 0 on success; -1 if the output is full
+ */
+static int lz_put_sequence(unsigned char *dst, int *out, int capacity, const unsigned char *literals,
+                           int literal_length, int offset, int match_length)
+{
+  int match_code = match_length ? match_length - LZ_MIN_MATCH : 0;
+
+  if(*out >= capacity)
+    return(-1);
+  dst[(*out)++] = (MIN(literal_length, 15) << 4) | MIN(match_code, 15);
+  if(literal_length >= 15 && lz_put_length(dst, out, capacity, literal_length - 15) != 0)
+    return(-1);
+
+  if(*out + literal_length > capacity)
+    return(-1);
+  memcpy(dst + *out, literals, literal_length);
+  *out += literal_length;
+
+  if(match_length == 0)
+    return(0);
+  if(*out + 2 > capacity)
+    return(-1);
+  dst[(*out)++] = offset & 0xff;
+  dst[(*out)++] = offset >> 8;
+  if(match_code >= 15 && lz_put_length(dst, out, capacity, match_code - 15) != 0)
+    return(-1);
+  return(0);
+}
+
+/**
+ * Compress a buffer
+ *
+ * @param src The data
+ * @param length Bytes of data (at most 65535)
+ * @param dst Receives the compressed data
+ * @param capacity Size of dst
+ * @return Bytes of compressed data; -1 if they do not fit in dst
+ */
+int oufs_lz_compress(const unsigned char *src, int length, unsigned char *dst, int capacity)
+{
+  // Last position (+1) at which each hash of 4 bytes was seen
+  unsigned short table[1 << LZ_HASH_BITS];
+  memset(table, 0, sizeof(table));
+
+  int out = 0;
+  int anchor = 0;
+  int limit = length - LZ_END_LITERALS;
+
+  for(int i = 0; i + LZ_MIN_MATCH <= limit; ) {
+    unsigned int sequence = lz_read32(src + i);
+    unsigned int hash = (sequence * 2654435761u) >> (32 - LZ_HASH_BITS);
+    int candidate = table[hash] - 1;
+    table[hash] = i + 1;
+
+    if(candidate < 0 || lz_read32(src + candidate) != sequence) {
+      ++i;
+      continue;
+    }
+
+    // Extend the match as far as it goes
+    int match_length = LZ_MIN_MATCH;
+    while(i + match_length < limit && src[candidate + match_length] == src[i + match_length])
+      ++match_length;
+
+    if(lz_put_sequence(dst, &out, capacity, src + anchor, i - anchor, i - candidate, match_length) != 0)
+      return(-1);
+    i += match_length;
+    anchor = i;
+  }
+
+  // The rest is literals
+  if(lz_put_sequence(dst, &out, capacity, src + anchor, length - anchor, 0, 0) != 0)
+    return(-1);
+  return(out);
+}
+
+/**
+ * Read a length that did not fit in its 4 bits of the token
+ *
+ * @return The extra length; -1 if the input ends first
+ */
+static int lz_get_length(const unsigned char *src, int *in, int length)
+{
+  int total = 0;
+  unsigned char b;
+  do {
+    if(*in >= length)
+      return(-1);
+    b = src[(*in)++];
+    total += b;
+  } while(b == 255);
+  return(total);
+}
+
+/**
+ * Decompress a buffer
+ *
+ * @param src The compressed data
+ * @param length Bytes of compressed data
+ * @param dst Receives the data
+ * @param capacity Size of dst
+ * @return Bytes of data; -1 if the compressed data is not valid
+ */
+int oufs_lz_decompress(const unsigned char *src, int length, unsigned char *dst, int capacity)
+{
+  int in = 0;
+  int out = 0;
+
+  while(in < length) {
+    unsigned char token = src[in++];
+
+    // Literals
+    int literal_length = token >> 4;
+    if(literal_length == 15) {
+      int extra = lz_get_length(src, &in, length);
+      if(extra < 0)
+        return(-1);
+      literal_length += extra;
+    }
+    if(in + literal_length > length || out + literal_length > capacity)
+      return(-1);
+    memcpy(dst + out, src + in, literal_length);
+    in += literal_length;
+    out += literal_length;
+
+    // The last sequence has no back-reference
+    if(in == length)
+      break;
+
+    if(in + 2 > length)
+      return(-1);
+    int offset = src[in] | (src[in + 1] << 8);
+    in += 2;
+    int match_length = (token & 15) + LZ_MIN_MATCH;
+    if((token & 15) == 15) {
+      int extra = lz_get_length(src, &in, length);
+      if(extra < 0)
+        return(-1);
+      match_length += extra;
+    }
+    if(offset == 0 || offset > out || out + match_length > capacity)
+      return(-1);
+
+    // Byte by byte: the reference may overlap what it produces
+    for(int i = 0; i < match_length; ++i, ++out)
+      dst[out] = dst[out - offset];
+  }
+  return(out);
+}
+
+/**
+ * Read a file's cluster map
+ *
+ * @param fs The open file system
+ * @param inode The file's inode
+ * @param map Receives the map; an empty one if the file has none yet
+ */
+static void compress_read_map(OUFS *fs, INODE *inode, OUFS_CLUSTER_MAP *map)
+{
+  if(inode->data[0] == UNALLOCATED_BLOCK) {
+    for(int c = 0; c < OUFS_CLUSTERS_PER_MAP; ++c) {
+      map->cluster[c].stored_length = 0;
+      map->cluster[c].raw = 0;
+      for(int b = 0; b < OUFS_CLUSTER_BLOCKS; ++b)
+        map->cluster[c].block[b] = UNALLOCATED_BLOCK;
+    }
+    return;
+  }
+
+  vdisk_lock_block(fs->disk, inode->data[0], VDISK_LOCK_SHARED);
+  vdisk_read_block(fs->disk, inode->data[0], map);
+  vdisk_unlock_block(fs->disk, inode->data[0]);
+}
+
+/**
+ * Load one cluster of a file, decompressed
+ *
+ * @param fs The open file system
+ * @param cluster Where the cluster is stored
+ * @param data Receives OUFS_CLUSTER_SIZE bytes; zeros past the stored data
+ * @return 0 on success; -1 if the cluster cannot be decompressed
+ */
+static int compress_load_cluster(OUFS *fs, OUFS_CLUSTER *cluster, unsigned char *data)
+{
+  unsigned char stored[OUFS_CLUSTER_SIZE];
+
+  memset(data, 0, OUFS_CLUSTER_SIZE);
+  if(cluster->stored_length == 0)
+    return(0);
+  if(cluster->stored_length > OUFS_CLUSTER_SIZE)
+    return(-1);
+
+  for(int b = 0; b * BLOCK_SIZE < cluster->stored_length; ++b) {
+    if(cluster->block[b] == UNALLOCATED_BLOCK)
+      return(-1);
+    vdisk_lock_block(fs->disk, cluster->block[b], VDISK_LOCK_SHARED);
+    vdisk_read_block(fs->disk, cluster->block[b], stored + b * BLOCK_SIZE);
+    vdisk_unlock_block(fs->disk, cluster->block[b]);
+  }
+
+  if(cluster->raw) {
+    memcpy(data, stored, cluster->stored_length);
+    return(0);
+  }
+  if(oufs_lz_decompress(stored, cluster->stored_length, data, OUFS_CLUSTER_SIZE) < 0) {
+    fprintf(stderr, "oufs: compressed cluster is damaged\n");
+    return(-1);
+  }
+  return(0);
+}
+
+/**
+ * Compress one cluster of a file and store it in new blocks, then release
+ * the blocks it was stored in before
+ *
+ * @param fs The open file system
+ * @param cluster Where the cluster is stored (updated)
+ * @param data The cluster's data
+ * @param length Bytes of data in the cluster
+ * @param goal Where new blocks for the cluster should go
+ * @return 0 on success; -1 if the disk is full (the cluster is unchanged)
+ */
+static int compress_store_cluster(OUFS *fs, OUFS_CLUSTER *cluster, unsigned char *data, int length,
+                                  BLOCK_REFERENCE goal)
+{
+  unsigned char stored[OUFS_CLUSTER_SIZE];
+  OUFS_CLUSTER updated;
+
+  // Keep the data as it is if compressing does not save anything
+  int stored_length = oufs_lz_compress(data, length, stored, length - 1);
+  updated.raw = (stored_length < 0);
+  if(updated.raw) {
+    memcpy(stored, data, length);
+    stored_length = length;
+  }
+  updated.stored_length = stored_length;
+
+  if(debug)
+    fprintf(stderr, "Cluster: %d bytes stored as %d\n", length, stored_length);
+
+  for(int b = 0; b < OUFS_CLUSTER_BLOCKS; ++b) {
+    updated.block[b] = UNALLOCATED_BLOCK;
+    if(b * BLOCK_SIZE >= stored_length)
+      continue;
+
+    BLOCK theblock;
+    memset(&theblock, 0, BLOCK_SIZE);
+    memcpy(theblock.data.data, stored + b * BLOCK_SIZE, MIN(BLOCK_SIZE, stored_length - b * BLOCK_SIZE));
+    if(oufs_store_data_block(fs, &updated.block[b], &theblock, b > 0 ? updated.block[b - 1] + 1 : goal) != 0) {
+      // Out of space: give back what was taken
+      for(int i = 0; i < b; ++i)
+        oufs_release_block(fs, updated.block[i]);
+      return(-1);
+    }
+  }
+
+  for(int b = 0; b < OUFS_CLUSTER_BLOCKS; ++b) {
+    if(cluster->block[b] != UNALLOCATED_BLOCK)
+      oufs_release_block(fs, cluster->block[b]);
+  }
+  *cluster = updated;
+  return(0);
+}
+
+/**
+ * Write to a compressed file.  At most OUFS_COMPRESSED_WRITE_CLUSTERS
+ * clusters are written by one call; the caller holds the file exclusively
+ * and has a transaction open.  The inode is only changed in memory
+ *
+ * @param fs The open file system
+ * @param inode The file's inode
+ * @param goal Where new blocks for the file should go
+ * @param offset Where to write
+ * @param buf The bytes to write
+ * @param len Number of bytes
+ * @return Number of bytes written; -1 on error
+ */
+int oufs_compressed_write(OUFS *fs, INODE *inode, BLOCK_REFERENCE goal, int offset, unsigned char *buf, int len)
+{
+  OUFS_CLUSTER_MAP map;
+  unsigned char data[OUFS_CLUSTER_SIZE];
+
+  int end = MIN(offset + len, OUFS_COMPRESSED_MAX_SIZE);
+  end = MIN(end, (offset / OUFS_CLUSTER_SIZE + OUFS_COMPRESSED_WRITE_CLUSTERS) * OUFS_CLUSTER_SIZE);
+  if(offset >= end)
+    return(0);
+
+  // The map is written back whole, to a new block if a snapshot holds it
+  compress_read_map(fs, inode, &map);
+  if(inode->data[0] == UNALLOCATED_BLOCK) {
+    inode->data[0] = oufs_allocate_new_block(fs, goal);
+    if(inode->data[0] == UNALLOCATED_BLOCK)
+      return(-1);
+  }else if(oufs_cow_block(fs, &inode->data[0]) != 0) {
+    return(-1);
+  }
+
+  int done = 0;
+  while(offset + done < end) {
+    int position = offset + done;
+    int c = position / OUFS_CLUSTER_SIZE;
+    int within = position % OUFS_CLUSTER_SIZE;
+    int n = MIN(OUFS_CLUSTER_SIZE - within, end - position);
+
+    if(compress_load_cluster(fs, &map.cluster[c], data) != 0)
+      break;
+    memcpy(data + within, buf + done, n);
+
+    // The cluster holds data up to the end of the file or of the cluster
+    int file_end = ((int) inode->size > position + n) ? (int) inode->size : position + n;
+    int length = MIN(OUFS_CLUSTER_SIZE, file_end - c * OUFS_CLUSTER_SIZE);
+    if(compress_store_cluster(fs, &map.cluster[c], data, length, inode->data[0] + 1) != 0)
+      break;
+    done += n;
+  }
+
+  vdisk_write_block(fs->disk, inode->data[0], &map);
+  return(done);
+}
+
+/**
+ * Read from a compressed file.  The caller holds the file
+ *
+ * @param fs The open file system
+ * @param inode The file's inode
+ * @param offset Where to read
+ * @param buf Receives the bytes
+ * @param len Most bytes to read
+ * @return Number of bytes read; -1 on error
+ */
+int oufs_compressed_read(OUFS *fs, INODE *inode, int offset, unsigned char *buf, int len)
+{
+  OUFS_CLUSTER_MAP map;
+  unsigned char data[OUFS_CLUSTER_SIZE];
+
+  int end = MIN(offset + len, (int) inode->size);
+  if(offset >= end)
+    return(0);
+  compress_read_map(fs, inode, &map);
+
+  int done = 0;
+  while(offset + done < end) {
+    int position = offset + done;
+    int c = position / OUFS_CLUSTER_SIZE;
+    int within = position % OUFS_CLUSTER_SIZE;
+    int n = MIN(OUFS_CLUSTER_SIZE - within, end - position);
+
+    if(compress_load_cluster(fs, &map.cluster[c], data) != 0)
+      return(done > 0 ? done : -1);
+    memcpy(buf + done, data + within, n);
+    done += n;
+  }
+  return(done);
+}
+
+/**
+ * Drop all of the data of a compressed file, and its cluster map.  The
+ * inode is only changed in memory
+ *
+ * @param fs The open file system
+ * @param inode The file's inode
+ */
+void oufs_compressed_truncate(OUFS *fs, INODE *inode)
+{
+  OUFS_CLUSTER_MAP map;
+  BLOCK_REFERENCE refs[OUFS_CLUSTERS_PER_MAP * OUFS_CLUSTER_BLOCKS + 1];
+  int n = 0;
+
+  if(inode->data[0] != UNALLOCATED_BLOCK) {
+    compress_read_map(fs, inode, &map);
+    for(int c = 0; c < OUFS_CLUSTERS_PER_MAP; ++c) {
+      for(int b = 0; b < OUFS_CLUSTER_BLOCKS; ++b) {
+        if(map.cluster[c].block[b] != UNALLOCATED_BLOCK)
+          refs[n++] = map.cluster[c].block[b];
+      }
+    }
+    refs[n++] = inode->data[0];
+    oufs_release_blocks(fs, refs, n);
+    inode->data[0] = UNALLOCATED_BLOCK;
+  }
+  inode->size = 0;
+}
@@ -0,0 +1,287 @@
+#include <stdlib.h>
+#include <string.h>
+#include "oufs_lib.h"
+/*
+ * Storage of file data blocks, with optional deduplication.
+ *
+ * On an image formatted with OUFS_FEATURE_DEDUP, every file data block that
+ * is written is hashed and looked up in the fingerprint index.  If a block
+ * with the same contents is already stored, the file refers to that block
+ * and its share count in the master block goes up, instead of a new block
+ * being used.  A shared block is never modified: writing to it gives the
+ * writer a block of its own (copy on write).  A block is only freed when
+ * nothing shares it any more.
+ *
+ * The index is kept in memory on the handle and only reread when another
+ * handle has changed it.  Both the index and the share counts change only
+ * while the allocator lock and the master block lock are held.
+ */
+
+#define debug 0
+
+/**
+ * Fingerprint of a block: FNV-1a folded to 16 bits.  Never 0, which marks
+ * blocks without one
+ *
+ * @param block The block contents
+ * @return The fingerprint
+ */
+static unsigned short dedup_fingerprint(BLOCK *block)
+{
+  unsigned int hash = 2166136261u;
+  for(int i = 0; i < BLOCK_SIZE; ++i)
+    hash = (hash ^ block->data.data[i]) * 16777619u;
+  hash = (hash >> 16) ^ (hash & 0xffff);
+  return(hash == 0 ? 1 : hash);
+}
+
+/**
+ * Is a block marked allocated in the master block?
+ */
+static int dedup_allocated(OUFS_MASTER *master, BLOCK_REFERENCE block_ref)
+{
+  return((master->master.block_allocated_flag[block_ref >> 3] >> (block_ref & 0x7)) & 1);
+}
+
+/**
+ * Get the fingerprint index, rereading it only if it changed since it was
+ * cached.  The allocator lock and the master block lock are held
+ *
+ * @param fs The open file system
+ * @param master The master block
+ * @return The index; NULL if the image has none
+ */
+static OUFS_FINGERPRINT_BLOCK *dedup_load_index(OUFS *fs, OUFS_MASTER *master)
+{
+  if(master->fingerprint_block == 0)
+    return(NULL);
+
+  if(!fs->fingerprints_cached || fs->fingerprint_generation != master->fingerprint_generation) {
+    if(debug)
+      fprintf(stderr, "Loading fingerprint index (generation %d)\n", master->fingerprint_generation);
+    if(vdisk_read_block(fs->disk, master->fingerprint_block, &fs->fingerprints) != 0)
+      return(NULL);
+    fs->fingerprints_cached = 1;
+    fs->fingerprint_generation = master->fingerprint_generation;
+  }
+  return(&fs->fingerprints);
+}
+
+/**
+ * Write back the fingerprint index after a change, and move the generation
+ * on so that other handles reread it.  The master block must be written too
+ *
+ * @param fs The open file system
+ * @param master The master block
+ */
+static void dedup_save_index(OUFS *fs, OUFS_MASTER *master)
+{
+  master->fingerprint_generation++;
+  fs->fingerprint_generation = master->fingerprint_generation;
+  vdisk_write_block(fs->disk, master->fingerprint_block, &fs->fingerprints);
+}
+
+/**
+ * Drop one reference to a block: the block is freed with the last one
+ *
+ * @param master The master block (modified)
+ * @param index The fingerprint index, or NULL (modified)
+ * @param block_ref The block
+ * @return 1 if the index was changed; 0 if not
+ */
+static int dedup_drop(OUFS_MASTER *master, OUFS_FINGERPRINT_BLOCK *index, BLOCK_REFERENCE block_ref)
+{
+  if(master->block_shares[block_ref] > 0) {
+    master->block_shares[block_ref]--;
+    return(0);
+  }
+
+  master->master.block_allocated_flag[block_ref >> 3] &= ~(1 << (block_ref & 0x7));
+  if(index != NULL && index->fingerprint[block_ref] != 0) {
+    index->fingerprint[block_ref] = 0;
+    return(1);
+  }
+  return(0);
+}
+
+/**
+ * Store the new contents of a file data block.  The block may be shared
+ * with an identical one, given a block of its own if it was shared, or
+ * written in place.  Runs inside of the caller's transaction
+ *
+ * @param fs The open file system
+ * @param block_ref The file's reference to the block: UNALLOCATED_BLOCK if
+ *                  it has none yet.  Updated to where the contents now are
+ * @param block The new contents
+ * @param goal Where a new block should go if one is needed (see
+ *             oufs_take_open_block_near())
+ * @return 0 on success; -1 if the disk is full
+ */
+int oufs_store_data_block(OUFS *fs, BLOCK_REFERENCE *block_ref, BLOCK *block, BLOCK_REFERENCE goal)
+{
+  BLOCK mb;
+  OUFS_MASTER *master = (OUFS_MASTER *) &mb;
+  BLOCK_REFERENCE old = *block_ref;
+  int master_dirty = 0;
+  int index_dirty = 0;
+  unsigned short fingerprint = 0;
+
+  pthread_mutex_lock(&fs->allocator_lock);
+  vdisk_lock_block(fs->disk, MASTER_BLOCK_REFERENCE, VDISK_LOCK_EXCLUSIVE);
+  vdisk_read_block(fs->disk, MASTER_BLOCK_REFERENCE, &mb);
+
+  OUFS_FINGERPRINT_BLOCK *index = NULL;
+  if(master->features & OUFS_FEATURE_DEDUP)
+    index = dedup_load_index(fs, master);
+
+  if(index != NULL) {
+    // Is the same data stored already?
+    fingerprint = dedup_fingerprint(block);
+    for(BLOCK_REFERENCE b = 0; b < N_BLOCKS_IN_DISK; ++b) {
+      if(index->fingerprint[b] != fingerprint || b == old || !dedup_allocated(master, b) ||
+         master->block_shares[b] == UCHAR_MAX)
+        continue;
+
+      BLOCK candidate;
+      if(vdisk_read_block(fs->disk, b, &candidate) != 0 ||
+         memcmp(&candidate, block, BLOCK_SIZE) != 0)
+        continue;
+
+      // Yes: share it
+      if(debug)
+        fprintf(stderr, "Sharing block %d\n", b);
+      master->block_shares[b]++;
+      if(old != UNALLOCATED_BLOCK)
+        index_dirty |= dedup_drop(master, index, old);
+      *block_ref = b;
+      master_dirty = 1;
+      goto done;
+    }
+  }
+
+  // The data needs a block of its own: a new one if the file has none yet,
+  // or if the one it has is shared or held by a snapshot (copy on write)
+  if(old == UNALLOCATED_BLOCK || master->block_shares[old] > 0 || oufs_block_pinned(master, old)) {
+    BLOCK_REFERENCE new_ref = oufs_take_open_block_near(&mb, goal);
+    if(new_ref == UNALLOCATED_BLOCK) {
+      vdisk_unlock_block(fs->disk, MASTER_BLOCK_REFERENCE);
+      pthread_mutex_unlock(&fs->allocator_lock);
+      return(-1);
+    }
+    if(old != UNALLOCATED_BLOCK)
+      index_dirty |= dedup_drop(master, index, old);
+    *block_ref = new_ref;
+    master_dirty = 1;
+  }
+  vdisk_write_block(fs->disk, *block_ref, block);
+
+  if(index != NULL && index->fingerprint[*block_ref] != fingerprint) {
+    index->fingerprint[*block_ref] = fingerprint;
+    index_dirty = 1;
+  }
+
+ done:
+  if(index_dirty) {
+    dedup_save_index(fs, master);
+    master_dirty = 1;
+  }
+  if(master_dirty)
+    oufs_write_master(fs, &mb);
+  vdisk_unlock_block(fs->disk, MASTER_BLOCK_REFERENCE);
+  pthread_mutex_unlock(&fs->allocator_lock);
+  return(0);
+}
+
+/**
+ * Drop a file's reference to a data block.  The block is freed once
+ * nothing shares it
+ *
+ * @param fs The open file system
+ * @param block_ref The block
+ * @return 0 on success; -1 on error
+ */
+int oufs_release_block(OUFS *fs, BLOCK_REFERENCE block_ref)
+{
+  return(oufs_release_blocks(fs, &block_ref, 1));
+}
+
+/**
+ * Drop references to several blocks with one update of the master block.
+ * Each block is freed once nothing shares it
+ *
+ * @param fs The open file system
+ * @param block_refs The blocks; a block may appear more than once
+ * @param n Number of blocks
+ * @return 0 on success; -1 on error
+ */
+int oufs_release_blocks(OUFS *fs, BLOCK_REFERENCE *block_refs, int n)
+{
+  BLOCK mb;
+  OUFS_MASTER *master = (OUFS_MASTER *) &mb;
+
+  if(n == 0)
+    return(0);
+
+  pthread_mutex_lock(&fs->allocator_lock);
+  vdisk_lock_block(fs->disk, MASTER_BLOCK_REFERENCE, VDISK_LOCK_EXCLUSIVE);
+  vdisk_read_block(fs->disk, MASTER_BLOCK_REFERENCE, &mb);
+
+  OUFS_FINGERPRINT_BLOCK *index = dedup_load_index(fs, master);
+  int index_dirty = 0;
+  for(int k = 0; k < n; ++k) {
+    BLOCK_REFERENCE block_ref = block_refs[k];
+    if(block_ref <= N_INODE_BLOCKS || block_ref >= N_BLOCKS_IN_DISK)
+      continue;
+    index_dirty |= dedup_drop(master, index, block_ref);
+    if(!dedup_allocated(master, block_ref))
+      vdisk_stats_classify(fs->disk, block_ref, VDISK_CLASS_DATA);
+
+    if(debug)
+      fprintf(stderr, "Releasing block=%d (%d shares left)\n", block_ref, master->block_shares[block_ref]);
+  }
+  if(index_dirty)
+    dedup_save_index(fs, master);
+
+  oufs_write_master(fs, &mb);
+  vdisk_unlock_block(fs->disk, MASTER_BLOCK_REFERENCE);
+  pthread_mutex_unlock(&fs->allocator_lock);
+  return(0);
+}
+
+/**
+ * Move a file data block's bookkeeping over to a copy of it: the copy takes
+ * the fingerprint and the old block is freed.  The old block must not be
+ * shared and the copy must already be allocated
+ *
+ * @param fs The open file system
+ * @param old_ref The block the data was in
+ * @param new_ref The block it was copied to
+ * @return 0 on success; -1 on error
+ */
+int oufs_move_data_block(OUFS *fs, BLOCK_REFERENCE old_ref, BLOCK_REFERENCE new_ref)
+{
+  BLOCK mb;
+  OUFS_MASTER *master = (OUFS_MASTER *) &mb;
+
+  pthread_mutex_lock(&fs->allocator_lock);
+  vdisk_lock_block(fs->disk, MASTER_BLOCK_REFERENCE, VDISK_LOCK_EXCLUSIVE);
+  vdisk_read_block(fs->disk, MASTER_BLOCK_REFERENCE, &mb);
+
+  OUFS_FINGERPRINT_BLOCK *index = dedup_load_index(fs, master);
+  unsigned short fingerprint = (index != NULL) ? index->fingerprint[old_ref] : 0;
+  int index_dirty = dedup_drop(master, index, old_ref);
+  if(index != NULL && index->fingerprint[new_ref] != fingerprint) {
+    index->fingerprint[new_ref] = fingerprint;
+    index_dirty = 1;
+  }
+  if(index_dirty)
+    dedup_save_index(fs, master);
+
+  if(debug)
+    fprintf(stderr, "Moving block=%d to %d\n", old_ref, new_ref);
+
+  oufs_write_master(fs, &mb);
+  vdisk_unlock_block(fs->disk, MASTER_BLOCK_REFERENCE);
+  pthread_mutex_unlock(&fs->allocator_lock);
+  return(0);
+}
@@ -0,0 +1,227 @@
+#include <string.h>
+#include "oufs_lib.h"
+/*
+ * Online defragmentation.
+ *
+ * The reverse map tells, for every block, which inode refers to it and where
+ * in the inode.  It is built from a walk of the inode table and is only a
+ * picture of the moment it was taken; it is used for reporting and to pick
+ * the files to work on.
+ *
+ * A regular file is fragmented when its data blocks, taken in file order,
+ * are not one run of consecutive blocks.  Such a file is moved into a run of
+ * free blocks, in its block group if there is room, one file per
+ * transaction, while its inode lock is held exclusively: readers of the file
+ * wait for the move to finish, readers of every other file carry on.  The
+ * data is copied before the inode is updated and the old blocks are freed,
+ * so a crash leaves either the old layout or the new one.
+ *
+ * A file is left where it is if one of its blocks is shared (dedup) or held
+ * by a snapshot: moving it would take a second block instead of freeing one.
+ * Compressed files are left alone too; their clusters are written whole and
+ * come out contiguous when there is room.
+ */
+
+#define debug 0
+
+/**
+ * Build the reverse map of the file system
+ *
+ * @param fs The open file system
+ * @param owner For every block: the inode that refers to it, the position
+ *              in the inode, and the number of inodes that refer to it.  Blocks
+ *              that no inode refers to have n_owners 0
+ * @return 0 on success; -1 on error
+ */
+int oufs_reverse_map(OUFS *fs, OUFS_BLOCK_OWNER owner[N_BLOCKS_IN_DISK])
+{
+  for(int b = 0; b < N_BLOCKS_IN_DISK; ++b) {
+    owner[b].inode = UNALLOCATED_INODE;
+    owner[b].index = 0;
+    owner[b].n_owners = 0;
+  }
+
+  for(INODE_REFERENCE i = 0; i < N_INODES; ++i) {
+    INODE inode;
+    pthread_rwlock_rdlock(&fs->inode_lock[i]);
+    if(oufs_read_inode_by_reference(fs, i, &inode) != 0) {
+      pthread_rwlock_unlock(&fs->inode_lock[i]);
+      return(-1);
+    }
+
+    // Positions and blocks referred to by the inode
+    BLOCK_REFERENCE refs[1 + OUFS_CLUSTERS_PER_MAP * OUFS_CLUSTER_BLOCKS];
+    int n_refs = 0;
+    if(inode.type == IT_DIRECTORY) {
+      refs[n_refs++] = inode.data[0];
+    }else if(inode.type == IT_FILE) {
+      for(int k = 0; k < BLOCKS_PER_INODE; ++k)
+        refs[n_refs++] = inode.data[k];
+    }else if(inode.type == IT_COMPRESSED_FILE) {
+      // The cluster map, then the blocks of each cluster in order
+      refs[n_refs++] = inode.data[0];
+      OUFS_CLUSTER_MAP map;
+      if(inode.data[0] != UNALLOCATED_BLOCK && vdisk_read_block(fs->disk, inode.data[0], &map) == 0) {
+        for(int c = 0; c < OUFS_CLUSTERS_PER_MAP; ++c)
+          for(int k = 0; k < OUFS_CLUSTER_BLOCKS; ++k)
+            refs[n_refs++] = map.cluster[c].block[k];
+      }
+    }
+    pthread_rwlock_unlock(&fs->inode_lock[i]);
+
+    for(int k = 0; k < n_refs; ++k) {
+      BLOCK_REFERENCE b = refs[k];
+      if(b == UNALLOCATED_BLOCK || b >= N_BLOCKS_IN_DISK)
+        continue;
+      if(owner[b].n_owners == 0) {
+        owner[b].inode = i;
+        owner[b].index = k;
+      }
+      if(owner[b].n_owners < UCHAR_MAX)
+        owner[b].n_owners++;
+    }
+  }
+  return(0);
+}
+
+/**
+ * Count the runs of consecutive blocks that hold a file's data
+ *
+ * @param inode The file's inode
+ * @return Number of runs: 0 for an empty file, 1 for a contiguous one
+ */
+int oufs_file_runs(INODE *inode)
+{
+  int runs = 0;
+  BLOCK_REFERENCE last = UNALLOCATED_BLOCK;
+
+  if(inode->type != IT_FILE)
+    return(0);
+  for(int k = 0; k < BLOCKS_PER_INODE; ++k) {
+    if(inode->data[k] == UNALLOCATED_BLOCK)
+      continue;
+    if(last == UNALLOCATED_BLOCK || inode->data[k] != last + 1)
+      ++runs;
+    last = inode->data[k];
+  }
+  return(runs);
+}
+
+/**
+ * Take a run of free blocks for a file's data.  The file's own blocks must
+ * neither be shared nor held by a snapshot
+ *
+ * @param fs The open file system
+ * @param inode The file's inode
+ * @param n Length of the run
+ * @param goal Where to start looking
+ * @return The first block of the run; UNALLOCATED_BLOCK if the file cannot
+ *         be moved or there is no run long enough
+ */
+static BLOCK_REFERENCE defrag_take_run(OUFS *fs, INODE *inode, int n, BLOCK_REFERENCE goal)
+{
+  BLOCK mb;
+  OUFS_MASTER *master = (OUFS_MASTER *) &mb;
+  BLOCK_REFERENCE start = UNALLOCATED_BLOCK;
+
+  pthread_mutex_lock(&fs->allocator_lock);
+  vdisk_lock_block(fs->disk, MASTER_BLOCK_REFERENCE, VDISK_LOCK_EXCLUSIVE);
+  vdisk_read_block(fs->disk, MASTER_BLOCK_REFERENCE, &mb);
+
+  for(int k = 0; k < BLOCKS_PER_INODE; ++k) {
+    BLOCK_REFERENCE b = inode->data[k];
+    if(b != UNALLOCATED_BLOCK && (master->block_shares[b] > 0 || oufs_block_pinned(master, b))) {
+      if(debug)
+        fprintf(stderr, "Defrag: block %d is shared\n", b);
+      goto done;
+    }
+  }
+
+  // The first run at or after the goal; runs do not wrap around the end
+  int length = 0;
+  for(int k = 0; k < N_BLOCKS_IN_DISK; ++k) {
+    BLOCK_REFERENCE b = (goal + k) % N_BLOCKS_IN_DISK;
+    int used = ((master->master.block_allocated_flag[b >> 3] |
+                 master->block_pinned_flag[b >> 3]) >> (b & 0x7)) & 1;
+    length = (used || b == 0) ? !used : length + 1;
+    if(length == n) {
+      start = b + 1 - n;
+      break;
+    }
+  }
+
+  if(start != UNALLOCATED_BLOCK) {
+    for(BLOCK_REFERENCE b = start; b < start + n; ++b)
+      master->master.block_allocated_flag[b >> 3] |= 1 << (b & 0x7);
+    oufs_write_master(fs, &mb);
+  }
+
+ done:
+  vdisk_unlock_block(fs->disk, MASTER_BLOCK_REFERENCE);
+  pthread_mutex_unlock(&fs->allocator_lock);
+  return(start);
+}
+
+/**
+ * Move a fragmented file into one run of consecutive blocks
+ *
+ * @param fs The open file system
+ * @param i The file's inode
+ * @return 0 if the file was moved; 1 if it did not need to be (not a
+ *         regular file, or already contiguous); -1 if it could not be
+ */
+int oufs_defrag_file(OUFS *fs, INODE_REFERENCE i)
+{
+  if(fs->snapshot >= 0 || i >= N_INODES)
+    return(-1);
+
+  pthread_rwlock_rdlock(&fs->snapshot_lock);
+  if(vdisk_txn_begin(fs->disk, OUFS_DEFRAG_CREDITS) != 0) {
+    pthread_rwlock_unlock(&fs->snapshot_lock);
+    return(-1);
+  }
+  pthread_rwlock_wrlock(&fs->inode_lock[i]);
+
+  INODE inode;
+  int ret = 1;
+  if(oufs_read_inode_by_reference(fs, i, &inode) != 0) {
+    ret = -1;
+  }else if(oufs_file_runs(&inode) > 1) {
+    int n = 0;
+    for(int k = 0; k < BLOCKS_PER_INODE; ++k)
+      if(inode.data[k] != UNALLOCATED_BLOCK)
+        ++n;
+
+    BLOCK_REFERENCE start = defrag_take_run(fs, &inode, n, OUFS_GROUP_START(OUFS_INODE_GROUP(i)));
+    if(start == UNALLOCATED_BLOCK) {
+      ret = -1;
+    }else{
+      // Copy the data over, then switch the inode to the copy
+      BLOCK_REFERENCE old[BLOCKS_PER_INODE];
+      BLOCK_REFERENCE next = start;
+      for(int k = 0; k < BLOCKS_PER_INODE; ++k) {
+        old[k] = inode.data[k];
+        if(old[k] == UNALLOCATED_BLOCK)
+          continue;
+        BLOCK block;
+        vdisk_read_block(fs->disk, old[k], &block);
+        vdisk_write_block(fs->disk, next, &block);
+        if(debug)
+          fprintf(stderr, "Defrag: inode %d block %d -> %d\n", i, old[k], next);
+        inode.data[k] = next++;
+      }
+      oufs_write_inode_by_reference(fs, i, &inode);
+
+      for(int k = 0; k < BLOCKS_PER_INODE; ++k)
+        if(old[k] != UNALLOCATED_BLOCK)
+          oufs_move_data_block(fs, old[k], inode.data[k]);
+      ret = 0;
+    }
+  }
+
+  pthread_rwlock_unlock(&fs->inode_lock[i]);
+  if(vdisk_txn_end(fs->disk) != 0)
+    ret = -1;
+  pthread_rwlock_unlock(&fs->snapshot_lock);
+  return(ret);
+}
@@ -1,38 +1,534 @@
 #ifndef OUFS_LIB
 #define OUFS_LIB
+#include <pthread.h>
 #include "oufs.h"
 
 #define MAX_PATH_LENGTH 200
 
+// Most blocks written by one operation (journal transaction credits).  Any
+//  operation may also have to copy two inode blocks out for the snapshots
+//  and update the snapshot table, and update the usage table
+#define OUFS_SNAPSHOT_CREDITS 3
+#define OUFS_USAGE_CREDITS OUFS_USAGE_BLOCKS
+#define OUFS_EXTRA_CREDITS (OUFS_SNAPSHOT_CREDITS + OUFS_USAGE_CREDITS)
+#define OUFS_MKDIR_CREDITS (5 + OUFS_EXTRA_CREDITS)
+#define OUFS_RMDIR_CREDITS (5 + OUFS_EXTRA_CREDITS)
+#define OUFS_FOPEN_CREDITS (5 + OUFS_EXTRA_CREDITS)
+#define OUFS_FWRITE_CREDITS (BLOCKS_PER_INODE + 3 + OUFS_EXTRA_CREDITS)
+#define OUFS_REMOVE_CREDITS (5 + OUFS_EXTRA_CREDITS)
+#define OUFS_LINK_CREDITS (5 + OUFS_EXTRA_CREDITS)
+#define OUFS_DEFRAG_CREDITS OUFS_FWRITE_CREDITS
+#define OUFS_RECLAIM_CREDITS (5 + OUFS_EXTRA_CREDITS)
+
+// A file whose data is stored compressed.  Its data[0] refers to a cluster
+//  map block (or is UNALLOCATED_BLOCK until something is written) and the
+//  other data[] entries are not used
+#define IT_COMPRESSED_FILE 'C'
+
+// Either kind of file
+#define OUFS_IS_FILE(type) ((type) == IT_FILE || (type) == IT_COMPRESSED_FILE)
+
+// Compressed files are split into clusters of this many blocks, each
+//  compressed on its own so that a read only decompresses what it touches
+#define OUFS_CLUSTER_BLOCKS 4
+#define OUFS_CLUSTER_SIZE (OUFS_CLUSTER_BLOCKS * BLOCK_SIZE)
+
+// Where one cluster of a compressed file is stored
+typedef struct oufs_cluster_s
+{
+  // Bytes stored; 0 if the cluster has never been written
+  unsigned short stored_length;
+
+  // Set if the cluster did not compress and is stored as it is
+  unsigned short raw;
+
+  // The blocks holding the stored bytes; UNALLOCATED_BLOCK past the end
+  BLOCK_REFERENCE block[OUFS_CLUSTER_BLOCKS];
+} OUFS_CLUSTER;
+
+#define OUFS_CLUSTERS_PER_MAP (BLOCK_SIZE / sizeof(OUFS_CLUSTER))
+
+// Cluster map block of a compressed file
+typedef struct oufs_cluster_map_s
+{
+  OUFS_CLUSTER cluster[OUFS_CLUSTERS_PER_MAP];
+
+  // Fill the block: blocks are always read and written whole
+  unsigned char unused[BLOCK_SIZE - OUFS_CLUSTERS_PER_MAP * sizeof(OUFS_CLUSTER)];
+} OUFS_CLUSTER_MAP;
+
+// Largest compressed file, and the most clusters one write may touch (its
+//  blocks must fit in OUFS_FWRITE_CREDITS)
+#define OUFS_COMPRESSED_MAX_SIZE (OUFS_CLUSTERS_PER_MAP * OUFS_CLUSTER_SIZE)
+#define OUFS_COMPRESSED_WRITE_CLUSTERS 3
+
+// Block groups: the disk is split into one group of consecutive blocks per
+//  inode block, and inode block k+1 holds the inodes of group k.  A new
+//  directory's inode and block go in one group, and so do the inodes and
+//  data of the files in the directory, so that walking a directory reads
+//  blocks that are close together
+#define OUFS_N_GROUPS N_INODE_BLOCKS
+#define OUFS_GROUP_BLOCKS (N_BLOCKS_IN_DISK / OUFS_N_GROUPS)
+#define OUFS_GROUP_START(g) ((g) * OUFS_GROUP_BLOCKS)
+#define OUFS_BLOCK_GROUP(b) ((b) / OUFS_GROUP_BLOCKS)
+#define OUFS_INODE_GROUP(i) ((i) / INODES_PER_BLOCK)
+
+// Features chosen when the image is formatted (OUFS_MASTER.features)
+#define OUFS_FEATURE_DEDUP 0x01
+#define OUFS_FEATURE_USAGE 0x02
+
+// Usage: what an inode accounts for.  A file's record covers the file, a
+//  directory's its whole subtree, including its own block
+typedef struct oufs_usage_s
+{
+  // Bytes of file data
+  unsigned int bytes;
+
+  // Blocks referred to; a shared block counts for every file using it
+  unsigned short blocks;
+
+  // Directory entries below, not counting "." and ".."
+  unsigned char entries;
+
+  // Directory the inode is charged to; OUFS_USAGE_NO_PARENT for the root
+  unsigned char parent;
+} OUFS_USAGE;
+
+#define OUFS_USAGE_NO_PARENT UCHAR_MAX
+#define OUFS_USAGE_PER_BLOCK (BLOCK_SIZE / sizeof(OUFS_USAGE))
+#define OUFS_USAGE_BLOCKS ((N_INODES + OUFS_USAGE_PER_BLOCK - 1) / OUFS_USAGE_PER_BLOCK)
+
+// An inode reference must fit in OUFS_USAGE.parent
+typedef char oufs_usage_parent_fits[(N_INODES < OUFS_USAGE_NO_PARENT) ? 1 : -1];
+
+// A block of the usage table, which has a record for every inode
+typedef struct oufs_usage_block_s
+{
+  OUFS_USAGE usage[OUFS_USAGE_PER_BLOCK];
+  unsigned char unused[BLOCK_SIZE - OUFS_USAGE_PER_BLOCK * sizeof(OUFS_USAGE)];
+} OUFS_USAGE_BLOCK;
+
+// The master block carries more than the two allocation tables of
+//  MASTER_BLOCK: these fields follow them in the unused part of the block.
+//  An image formatted before a field existed has zeros there, so zero must
+//  always mean "not in use"
+typedef struct oufs_master_s
+{
+  MASTER_BLOCK master;
+
+  // OUFS_FEATURE_* flags
+  unsigned char features;
+
+  // Dedup: references to each block beyond the first.  A block is only
+  //  freed once nothing else shares it
+  unsigned char block_shares[N_BLOCKS_IN_DISK];
+
+  // Dedup: block holding the fingerprint index (0 if there is none), and a
+  //  counter bumped on every change to it, so cached copies can be checked
+  BLOCK_REFERENCE fingerprint_block;
+  unsigned short fingerprint_generation;
+
+  // Snapshots: block holding the snapshot table (0 until the first one is
+  //  taken)
+  BLOCK_REFERENCE snapshot_block;
+
+  // Snapshots: blocks that some snapshot holds.  They are never changed in
+  //  place and never allocated, whether or not the live file system still
+  //  uses them
+  unsigned char block_pinned_flag[N_BLOCKS_IN_DISK >> 3];
+
+  // Snapshots: inode blocks (bit k for block k+1) that some snapshot still
+  //  shares with the live inode table.  They are copied out before they change
+  unsigned char inode_blocks_shared;
+
+  // Counters: set once the counters below are kept up to date
+  unsigned char counters_valid;
+
+  // Blocks that are free (neither allocated nor held by a snapshot), and
+  //  free inodes
+  unsigned short free_blocks;
+  unsigned short free_inodes;
+
+  // Free blocks in each block group, so that the allocator can pass over
+  //  full groups
+  unsigned char group_free_blocks[OUFS_N_GROUPS];
+
+  // Usage: blocks holding the usage table (0 if the image keeps none)
+  BLOCK_REFERENCE usage_block[OUFS_USAGE_BLOCKS];
+
+  // Orphans: inodes that have lost their last name but whose blocks have not
+  //  been freed yet.  They stay allocated until they are reclaimed
+  unsigned char orphan_inode_flag[(N_INODES + 7) >> 3];
+} OUFS_MASTER;
+
+// The master block must still fit in one block
+typedef char oufs_master_fits[(sizeof(OUFS_MASTER) <= BLOCK_SIZE) ? 1 : -1];
+
+// Dedup fingerprint index: a hash of the contents of every file data block
+//  that may be shared; 0 for other blocks
+typedef struct oufs_fingerprint_block_s
+{
+  unsigned short fingerprint[N_BLOCKS_IN_DISK];
+} OUFS_FINGERPRINT_BLOCK;
+
+// A snapshot: a read-only, point-in-time view of the file system
+typedef struct oufs_snapshot_s
+{
+  // Name; empty if the slot is not in use
+  char name[FILE_NAME_SIZE];
+
+  // When it was taken (seconds since the epoch)
+  unsigned int created;
+
+  // Where its inode table is: the live inode block (k+1) until that block
+  //  first changes, then a copy made just before
+  BLOCK_REFERENCE inode_block[N_INODE_BLOCKS];
+
+  // Allocation tables as they were, except that the blocks held are only
+  //  the directory and file blocks, plus the inode block copies
+  MASTER_BLOCK master;
+} OUFS_SNAPSHOT;
+
+#define OUFS_MAX_SNAPSHOTS (BLOCK_SIZE / sizeof(OUFS_SNAPSHOT))
+
+// Snapshot table block
+typedef struct oufs_snapshot_block_s
+{
+  OUFS_SNAPSHOT snapshot[OUFS_MAX_SNAPSHOTS];
+  unsigned char unused[BLOCK_SIZE - OUFS_MAX_SNAPSHOTS * sizeof(OUFS_SNAPSHOT)];
+} OUFS_SNAPSHOT_BLOCK;
+
+// Reverse map entry: who refers to a block
+typedef struct oufs_block_owner_s
+{
+  // The (first) inode that refers to the block; UNALLOCATED_INODE if none
+  INODE_REFERENCE inode;
+
+  // Where in the inode: the data[] slot, or for a compressed file 0 for the
+  //  cluster map and 1 on for the cluster blocks in order
+  unsigned char index;
+
+  // Number of references to the block (more than one if it is shared)
+  unsigned char n_owners;
+} OUFS_BLOCK_OWNER;
+
+// Free space, as reported by oufs_free_space()
+typedef struct oufs_space_s
+{
+  int total_blocks;
+  int free_blocks;
+  int total_inodes;
+  int free_inodes;
+  int group_free_blocks[OUFS_N_GROUPS];
+} OUFS_SPACE;
+
+// Operations in a trace (oufs_trace.c)
+#define OUFS_TRACE_MKDIR 1
+#define OUFS_TRACE_RMDIR 2
+#define OUFS_TRACE_LIST 3
+#define OUFS_TRACE_FOPEN 4
+#define OUFS_TRACE_FCLOSE 5
+#define OUFS_TRACE_READ 6
+#define OUFS_TRACE_WRITE 7
+#define OUFS_TRACE_REMOVE 8
+#define OUFS_N_TRACE_OPS 9
+
+// One operation in a trace.  The path follows it: path_length bytes, without
+//  a terminator
+typedef struct oufs_trace_record_s
+{
+  // When the operation started (microseconds since the epoch)
+  unsigned long usec;
+
+  // What it returned: bytes for reads and writes, 0 or -1 for the others
+  int result;
+
+  // Reads and writes: where in the file, and how many bytes were asked for
+  int offset;
+  int length;
+
+  // The file that fopen opened (UNALLOCATED_INODE if it failed), or that a
+  //  read, write or fclose used
+  INODE_REFERENCE inode;
+
+  unsigned short path_length;
+  unsigned char op;
+
+  // fopen mode ("r", "w", "a", "ac", ...)
+  char mode[3];
+  unsigned char unused[4];
+} OUFS_TRACE_RECORD;
+
+// Asynchronous reads and writes (oufs_aio.c): worker threads per handle,
+//  and the most requests that may be submitted and not yet reaped
+#define OUFS_AIO_WORKERS 4
+#define OUFS_AIO_MAX_IN_FLIGHT 256
+
+struct oufs_s;
+struct oufs_aio_s;
+
+// Called by oufs_aio_reap() for a request that is done
+typedef void (*OUFS_AIO_CALLBACK)(struct oufs_s *fs, struct oufs_aio_s *request);
+
+// An asynchronous read or write.  The request belongs to the handle from
+//  when it is submitted until it is reaped
+typedef struct oufs_aio_s
+{
+  // The file (a copy, so the request has an offset of its own), where, and
+  //  the caller's buffer, which must stay valid until the request is reaped
+  OUFILE file;
+  unsigned char *buf;
+  int length;
+  int write;
+
+  // Called when the request is reaped; NULL to report it as an event
+  OUFS_AIO_CALLBACK callback;
+  void *token;
+
+  // Bytes read or written; -1 on error
+  int result;
+
+  struct oufs_aio_s *next;
+} OUFS_AIO;
+
+// A request reported by oufs_aio_reap()
+typedef struct oufs_aio_event_s
+{
+  void *token;
+  int result;
+} OUFS_AIO_EVENT;
+
+// An open file system.  Every oufs_* call takes the handle, so one process
+//  may have several images open and may call into each from many threads.
+//
+// Lock order: the snapshot lock, the whole-image lock, inode locks (a parent
+//  directory before its children) together with their directory block locks,
+//  inode block locks, the allocator lock with the master block lock, the
+//  snapshot table block lock, then the usage lock with the usage table block
+//  locks.  The block locks (vdisk_lock_block()) exclude other processes; the
+//  pthread locks exclude other threads sharing this handle.
+typedef struct oufs_s
+{
+  // The underlying virtual disk
+  VDISK *disk;
+
+  // Serializes read-modify-write of the master block allocation tables
+  pthread_mutex_t allocator_lock;
+
+  // Serializes read-modify-write of an inode block (several inodes share one)
+  pthread_mutex_t inode_block_lock[N_INODE_BLOCKS];
+
+  // Per-inode locks: readers of a directory or file share, modifiers exclude
+  pthread_rwlock_t inode_lock[N_INODES];
+
+  // Operations that modify the file system hold it shared; taking a snapshot
+  //  holds it exclusively, so that no operation is half done in a snapshot
+  pthread_rwlock_t snapshot_lock;
+
+  // Snapshot slot mounted (read only) through this handle, its name and the
+  //  snapshot table block; -1 for the live file system
+  int snapshot;
+  char snapshot_name[FILE_NAME_SIZE];
+  BLOCK_REFERENCE snapshot_block;
+
+  // Copy of the dedup fingerprint index, valid while the generation in the
+  //  master block matches.  Protected by allocator_lock
+  int fingerprints_cached;
+  unsigned short fingerprint_generation;
+  OUFS_FINGERPRINT_BLOCK fingerprints;
+
+  // Serializes read-modify-write of the usage table
+  pthread_mutex_t usage_lock;
+
+  // Trace that the operations are appended to (ZTRACE); -1 if none
+  int trace_fd;
+
+  // Background reclamation of orphans: the thread is started when there is
+  //  something to reclaim.  Protected by reclaim_lock
+  pthread_mutex_t reclaim_lock;
+  pthread_cond_t reclaim_cond;
+  pthread_t reclaim_thread;
+  int reclaim_running;
+  int reclaim_pending;
+  int reclaim_stop;
+
+  // Asynchronous I/O: requests waiting for a worker and requests done but
+  //  not reaped, and the eventfd that counts completions (-1 until it is
+  //  asked for).  The workers are started with the first request.
+  //  Protected by aio_lock
+  pthread_mutex_t aio_lock;
+  pthread_cond_t aio_cond;
+  pthread_t aio_thread[OUFS_AIO_WORKERS];
+  int aio_running;
+  int aio_stop;
+  int aio_in_flight;
+  int aio_fd;
+  OUFS_AIO *aio_queue;
+  OUFS_AIO *aio_queue_tail;
+  OUFS_AIO *aio_done;
+} OUFS;
+
+// Tree walks (oufs_walk.c): most threads of a parallel walk
+#define OUFS_WALK_MAX_THREADS 16
+
+// What a walk reports.  A size filter only matches files, and a type of
+//  IT_FILE matches compressed files too
+typedef struct oufs_walk_filter_s
+{
+  char *name;          // glob that the name matches (fnmatch()); NULL for any
+  char type;           // inode type; 0 for any
+  int min_size;        // -1 for no bound
+  int max_size;        // -1 for no bound
+  int max_depth;       // levels below the start to go down; -1 for no limit
+} OUFS_WALK_FILTER;
+
+// A file or directory found by a walk
+typedef struct oufs_walk_entry_s
+{
+  char path[MAX_PATH_LENGTH];
+  char name[FILE_NAME_SIZE];
+  INODE_REFERENCE inode_reference;
+  INODE_REFERENCE parent;
+  INODE inode;
+  int depth;
+} OUFS_WALK_ENTRY;
+
+typedef struct oufs_walk_s OUFS_WALK;
+typedef void (*OUFS_WALK_CALLBACK)(OUFS_WALK_ENTRY *entry, void *arg);
+
+// Attributes of a file or directory (oufs_stat_many())
+typedef struct oufs_stat_s
+{
+  INODE_REFERENCE inode_reference;
+  char type;
+  int n_references;
+  unsigned int size;
+  int blocks;          // as counted by oufs_inode_blocks()
+} OUFS_STAT;
+
 // PROVIDED
 void oufs_get_environment(char *cwd, char *disk_name);
 
+// Handle management
+OUFS *oufs_open(char *virtual_disk_name);
+int oufs_close(OUFS *fs);
+
 // PROJECT 3
-int oufs_format_disk(char  *virtual_disk_name);
-int oufs_read_inode_by_reference(INODE_REFERENCE i, INODE *inode);
-int oufs_write_inode_by_reference(INODE_REFERENCE i, INODE *inode);
-int oufs_find_file(char *cwd, char * path, INODE_REFERENCE *parent, INODE_REFERENCE *child, char *local_name);
-int oufs_mkdir(char *cwd, char *path);
-int oufs_list(char *cwd, char *path);
-int oufs_rmdir(char *cwd, char *path);
+int oufs_format_disk(char  *virtual_disk_name, int features);
+int oufs_read_inode_by_reference(OUFS *fs, INODE_REFERENCE i, INODE *inode);
+int oufs_write_inode_by_reference(OUFS *fs, INODE_REFERENCE i, INODE *inode);
+int oufs_find_file(OUFS *fs, char *cwd, char * path, INODE_REFERENCE *parent, INODE_REFERENCE *child, char *local_name);
+int oufs_mkdir(OUFS *fs, char *cwd, char *path);
+int oufs_list(OUFS *fs, char *cwd, char *path);
+int oufs_list_long(OUFS *fs, char *cwd, char *path);
+int oufs_rmdir(OUFS *fs, char *cwd, char *path);
 
 // Helper functions in oufs_lib_support.c
 void oufs_clean_directory_block(INODE_REFERENCE self, INODE_REFERENCE parent, BLOCK *block);
 void oufs_clean_directory_entry(DIRECTORY_ENTRY *entry);
-BLOCK_REFERENCE oufs_allocate_new_block();
-INODE_REFERENCE oufs_allocate_new_inode();
-int oufs_deallocate_block(BLOCK_REFERENCE block_ref);
-int oufs_deallocate_inode(INODE_REFERENCE inode_ref);
+BLOCK_REFERENCE oufs_allocate_new_block(OUFS *fs, BLOCK_REFERENCE goal);
+INODE_REFERENCE oufs_allocate_new_inode(OUFS *fs, int group);
+int oufs_deallocate_block(OUFS *fs, BLOCK_REFERENCE block_ref);
+int oufs_deallocate_inode(OUFS *fs, INODE_REFERENCE inode_ref);
+BLOCK_REFERENCE oufs_take_open_block(BLOCK *master);
+BLOCK_REFERENCE oufs_take_open_block_near(BLOCK *master, BLOCK_REFERENCE goal);
+BLOCK_REFERENCE oufs_take_open_run(BLOCK *master, BLOCK_REFERENCE goal, int n);
+void oufs_update_counters(BLOCK *master);
+int oufs_write_master(OUFS *fs, BLOCK *master);
+int oufs_free_space(OUFS *fs, OUFS_SPACE *space);
+void oufs_truncate_inode(OUFS *fs, INODE *inode);
+char* oufs_relative_path(char* cwd, char* path, char* rel_path);
+
+// Shared data blocks (oufs_dedup.c)
+int oufs_store_data_block(OUFS *fs, BLOCK_REFERENCE *block_ref, BLOCK *block, BLOCK_REFERENCE goal);
+int oufs_release_block(OUFS *fs, BLOCK_REFERENCE block_ref);
+int oufs_release_blocks(OUFS *fs, BLOCK_REFERENCE *block_refs, int n);
+int oufs_move_data_block(OUFS *fs, BLOCK_REFERENCE old_ref, BLOCK_REFERENCE new_ref);
+
+// Snapshots (oufs_snapshot.c)
+int oufs_snapshot_create(OUFS *fs, char *name);
+int oufs_snapshot_delete(OUFS *fs, char *name);
+int oufs_snapshot_list(OUFS *fs);
+int oufs_snapshot_mount(OUFS *fs, char *name);
+int oufs_snapshot_read(OUFS *fs, int slot, OUFS_SNAPSHOT *snapshot);
+int oufs_block_pinned(OUFS_MASTER *master, BLOCK_REFERENCE block_ref);
+int oufs_snapshot_holds(OUFS *fs, BLOCK_REFERENCE block_ref);
+int oufs_cow_block(OUFS *fs, BLOCK_REFERENCE *block_ref);
+int oufs_snapshot_preserve_inodes(OUFS *fs, BLOCK_REFERENCE inode_block, BLOCK *contents);
+BLOCK_REFERENCE oufs_snapshot_inode_block(OUFS *fs, BLOCK_REFERENCE inode_block);
+
+// Compressed files (oufs_compress.c)
+int oufs_lz_compress(const unsigned char *src, int length, unsigned char *dst, int capacity);
+int oufs_lz_decompress(const unsigned char *src, int length, unsigned char *dst, int capacity);
+int oufs_compressed_write(OUFS *fs, INODE *inode, BLOCK_REFERENCE goal, int offset, unsigned char *buf, int len);
+int oufs_compressed_read(OUFS *fs, INODE *inode, int offset, unsigned char *buf, int len);
+void oufs_compressed_truncate(OUFS *fs, INODE *inode);
+
+// Defragmentation (oufs_defrag.c)
+int oufs_reverse_map(OUFS *fs, OUFS_BLOCK_OWNER owner[N_BLOCKS_IN_DISK]);
+int oufs_file_runs(INODE *inode);
+int oufs_defrag_file(OUFS *fs, INODE_REFERENCE i);
+
+// Subtree usage (oufs_usage.c)
+int oufs_inode_blocks(OUFS *fs, INODE *inode);
+int oufs_usage_create(OUFS *fs, INODE_REFERENCE i, INODE_REFERENCE parent, INODE *inode);
+int oufs_usage_update(OUFS *fs, INODE_REFERENCE i, INODE *inode);
+int oufs_usage_delete(OUFS *fs, INODE_REFERENCE i, INODE_REFERENCE parent, int last);
+int oufs_usage_link(OUFS *fs, INODE_REFERENCE i, INODE_REFERENCE parent);
+int oufs_du(OUFS *fs, char *cwd, char *path, OUFS_USAGE *usage);
+int oufs_usage_verify(OUFS *fs, int repair);
+int oufs_usage_format(OUFS *fs, BLOCK *master);
+
+// Operation traces (oufs_trace.c)
+void oufs_trace_open(OUFS *fs);
+void oufs_trace_close(OUFS *fs);
+unsigned long oufs_trace_start(OUFS *fs);
+void oufs_trace_path(OUFS *fs, unsigned long start, int op, char *cwd, char *path, char *mode,
+                     INODE_REFERENCE inode, int result);
+void oufs_trace_io(OUFS *fs, unsigned long start, int op, OUFILE *fp, int offset, int length, int result);
+int oufs_trace_next(FILE *trace, OUFS_TRACE_RECORD *record, char *path);
+extern const char *oufs_trace_op_names[OUFS_N_TRACE_OPS];
+
+// Deferred reclamation (oufs_reclaim.c)
+void oufs_reclaim_init(OUFS *fs);
+int oufs_orphan(OUFS *fs, INODE_REFERENCE i);
+void oufs_reclaim_kick(OUFS *fs);
+void oufs_reclaim_resume(OUFS *fs);
+int oufs_reclaim(OUFS *fs);
+void oufs_reclaim_stop(OUFS *fs);
+
+// Asynchronous reads and writes (oufs_aio.c)
+void oufs_aio_init(OUFS *fs);
+int oufs_aread(OUFS *fs, OUFILE *fp, int offset, unsigned char *buf, int len,
+               OUFS_AIO_CALLBACK callback, void *token);
+int oufs_awrite(OUFS *fs, OUFILE *fp, int offset, unsigned char *buf, int len,
+                OUFS_AIO_CALLBACK callback, void *token);
+int oufs_aio_fd(OUFS *fs);
+int oufs_aio_reap(OUFS *fs, OUFS_AIO_EVENT *events, int max);
+void oufs_aio_shutdown(OUFS *fs);
+
+// Read-only views of files (oufs_mmap.c)
+int oufs_mmap(OUFS *fs, OUFILE *fp, const unsigned char **view);
+int oufs_munmap(const unsigned char *view, int length);
+// Tree walks (oufs_walk.c)
+OUFS_WALK *oufs_walk_open(OUFS *fs, char *cwd, char *path, OUFS_WALK_FILTER *filter);
+int oufs_walk_next(OUFS_WALK *walk, OUFS_WALK_ENTRY *entry);
+void oufs_walk_close(OUFS_WALK *walk);
+int oufs_walk_parallel(OUFS *fs, char *cwd, char *path, OUFS_WALK_FILTER *filter, int threads,
+                       OUFS_WALK_CALLBACK callback, void *arg);
+int oufs_stat_many(OUFS *fs, INODE_REFERENCE *refs, int n, OUFS_STAT *stats);
+int oufs_stat_paths(OUFS *fs, char *cwd, char **paths, int n, OUFS_STAT *stats);
 
 // Helper functions to be provided
 int oufs_find_open_bit(unsigned char value);
 
 // PROJECT 4 ONLY
-OUFILE* oufs_fopen(char *cwd, char *path, char *mode);
-void oufs_fclose(OUFILE *fp);
-int oufs_fwrite(OUFILE *fp, unsigned char * buf, int len);
-int oufs_fread(OUFILE *fp, unsigned char * buf, int len);
-int oufs_remove(char *cwd, char *path);
-int oufs_link(char *cwd, char *path_src, char *path_dst);
+OUFILE* oufs_fopen(OUFS *fs, char *cwd, char *path, char *mode);
+void oufs_fclose(OUFS *fs, OUFILE *fp);
+int oufs_fwrite(OUFS *fs, OUFILE *fp, unsigned char * buf, int len);
+int oufs_fread(OUFS *fs, OUFILE *fp, unsigned char * buf, int len);
+int oufs_fallocate(OUFS *fs, OUFILE *fp, int offset, int len, int keep_size);
+int oufs_remove(OUFS *fs, char *cwd, char *path);
+int oufs_link(OUFS *fs, char *cwd, char *path_src, char *path_dst);
 
 #endif
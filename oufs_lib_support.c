@@ -86,135 +86,345 @@ void oufs_clean_directory_block(INODE_REFERENCE self, INODE_REFERENCE parent, BL
 }
 
 /**
- * Allocate a new data block
- *
- * If one is found, then the corresponding bit in the block allocation table is set
+ * Find a free block in a copy of the master block and mark it allocated.
+ * Blocks that a snapshot holds are not free.  The caller holds the allocator
+ * lock and writes the master block back
  *
+ * @param master The master block
+ * @param goal Where to start looking: the first free block at or after it is
+ *             taken, wrapping around to the start of the disk
  * @return The index of the allocated data block.  If no blocks are available,
  * then UNALLOCATED_BLOCK is returned
- *
  */
-BLOCK_REFERENCE oufs_allocate_new_block()
+BLOCK_REFERENCE oufs_take_open_block_near(BLOCK *master, BLOCK_REFERENCE goal)
 {
-  BLOCK block;
-  // Read the master block
-  vdisk_read_block(MASTER_BLOCK_REFERENCE, &block);
+  OUFS_MASTER *ext = (OUFS_MASTER *) master;
+
+  if(goal >= N_BLOCKS_IN_DISK)
+    goal = 0;
+
+  // Scan for an available block, bit by bit from the goal.  Groups that the
+  // counters say are full are passed over; should that find nothing, the
+  // counters are out of date and every group is scanned
+  for(int pass = ext->counters_valid ? 0 : 1; pass < 2; ++pass) {
+    for(int k = 0; k < N_BLOCKS_IN_DISK; ++k) {
+      BLOCK_REFERENCE block_reference = (goal + k) % N_BLOCKS_IN_DISK;
+      int group = OUFS_BLOCK_GROUP(block_reference);
+      if(pass == 0 && ext->group_free_blocks[group] == 0) {
+        // Skip to the start of the next group
+        k += OUFS_GROUP_START(group + 1) - 1 - block_reference;
+        continue;
+      }
 
-  // Scan for an available block
-  int block_byte;
-  int flag;
+      int block_byte = block_reference >> 3;
+      int block_bit = block_reference & 0x7;
+      if(((master->master.block_allocated_flag[block_byte] | ext->block_pinned_flag[block_byte]) >> block_bit) & 1)
+        continue;
 
-  // Loop over each byte in the allocation table.
-  for(block_byte = 0, flag = 1; flag && block_byte < (N_BLOCKS_IN_DISK / 8); ++block_byte) {
-    if(block.master.block_allocated_flag[block_byte] != 0xff) {
-      // Found a byte that has an opening: stop scanning
-      flag = 0;
-      break;
-    };
-  };
-  // Did we find a candidate byte in the table?
-  if(flag == 1) {
-    // No
-    if(debug)
-      fprintf(stderr, "No blocks\n");
-    return(UNALLOCATED_BLOCK);
+      // Found one: set the bit in the allocation table
+      master->master.block_allocated_flag[block_byte] |= (1 << block_bit);
+      if(ext->counters_valid && ext->free_blocks > 0 && ext->group_free_blocks[group] > 0) {
+        ext->free_blocks--;
+        ext->group_free_blocks[group]--;
+      }
+
+      if(debug)
+        fprintf(stderr, "Allocating block=%d (goal %d)\n", block_reference, goal);
+      return(block_reference);
+    }
   }
 
-  // Found an available data block 
+  if(debug)
+    fprintf(stderr, "No blocks\n");
+  return(UNALLOCATED_BLOCK);
+}
+
+/**
+ * Find a run of consecutive free blocks in a copy of the master block and
+ * mark them allocated.  The caller holds the allocator lock and writes the
+ * master block back
+ *
+ * @param master The master block
+ * @param goal Where to start looking: the first run that starts at or after
+ *             it is taken, then the first one from the start of the disk
+ * @param n Length of the run
+ * @return The first block of the run.  If there is no such run, then
+ * UNALLOCATED_BLOCK is returned and nothing is allocated
+ */
+BLOCK_REFERENCE oufs_take_open_run(BLOCK *master, BLOCK_REFERENCE goal, int n)
+{
+  OUFS_MASTER *ext = (OUFS_MASTER *) master;
 
-  // Set the block allocated bit
-  // Find the FIRST bit in the byte that is 0 (we scan in bit order: 0 ... 7)
-  int block_bit = oufs_find_open_bit(block.master.block_allocated_flag[block_byte]);
+  if(n <= 0 || n > N_BLOCKS_IN_DISK)
+    return(UNALLOCATED_BLOCK);
+  if(goal >= N_BLOCKS_IN_DISK)
+    goal = 0;
+
+  // A run does not wrap around the end of the disk
+  for(int k = 0; k < N_BLOCKS_IN_DISK; ++k) {
+    BLOCK_REFERENCE first = (goal + k) % N_BLOCKS_IN_DISK;
+    if(first + n > N_BLOCKS_IN_DISK)
+      continue;
+
+    int length = 0;
+    while(length < n) {
+      BLOCK_REFERENCE b = first + length;
+      if(((master->master.block_allocated_flag[b >> 3] | ext->block_pinned_flag[b >> 3]) >> (b & 0x7)) & 1)
+        break;
+      ++length;
+    }
+    if(length < n) {
+      // The blocks up to the taken one cannot start a run either
+      k += length;
+      continue;
+    }
 
-  // Now set the bit in the allocation table
-  block.master.block_allocated_flag[block_byte] |= (1 << block_bit);
+    for(BLOCK_REFERENCE b = first; b < first + n; ++b) {
+      master->master.block_allocated_flag[b >> 3] |= (1 << (b & 0x7));
+      int group = OUFS_BLOCK_GROUP(b);
+      if(ext->counters_valid && ext->free_blocks > 0 && ext->group_free_blocks[group] > 0) {
+        ext->free_blocks--;
+        ext->group_free_blocks[group]--;
+      }
+    }
 
-  // Write out the updated master block
-  vdisk_write_block(MASTER_BLOCK_REFERENCE, &block);
+    if(debug)
+      fprintf(stderr, "Allocating blocks %d-%d (goal %d)\n", first, first + n - 1, goal);
+    return(first);
+  }
 
   if(debug)
-    fprintf(stderr, "Allocating block=%d (%d)\n", block_byte, block_bit);
+    fprintf(stderr, "No run of %d blocks\n", n);
+  return(UNALLOCATED_BLOCK);
+}
+
+/**
+ * Recount the free blocks and free inodes of a copy of the master block from
+ * its allocation tables, and mark the counters as kept
+ *
+ * @param master The master block
+ */
+void oufs_update_counters(BLOCK *master)
+{
+  OUFS_MASTER *ext = (OUFS_MASTER *) master;
+
+  ext->free_blocks = 0;
+  for(int g = 0; g < OUFS_N_GROUPS; ++g)
+    ext->group_free_blocks[g] = 0;
+  for(BLOCK_REFERENCE b = 0; b < N_BLOCKS_IN_DISK; ++b) {
+    if(!(((master->master.block_allocated_flag[b >> 3] | ext->block_pinned_flag[b >> 3]) >> (b & 0x7)) & 1)) {
+      ext->free_blocks++;
+      ext->group_free_blocks[OUFS_BLOCK_GROUP(b)]++;
+    }
+  }
 
-  // Compute the block index
-  BLOCK_REFERENCE block_reference = (block_byte << 3) + block_bit;
+  ext->free_inodes = 0;
+  for(INODE_REFERENCE i = 0; i < N_INODES; ++i)
+    if(!((master->master.inode_allocated_flag[i >> 3] >> (i & 0x7)) & 1))
+      ext->free_inodes++;
+  ext->counters_valid = 1;
+}
 
-  if(debug)
-    fprintf(stderr, "Allocating block=%d\n", block_reference);
-  
-  // Done
-  return(block_reference);
+/**
+ * Write back the master block, with its free counters brought up to date.
+ * The caller holds the allocator lock and the master block lock
+ *
+ * @param fs The open file system
+ * @param master The master block
+ * @return 0 on success; -1 on error
+ */
+int oufs_write_master(OUFS *fs, BLOCK *master)
+{
+  // The tables are a few bytes long: recounting them costs less than
+  // following every change to them
+  oufs_update_counters(master);
+  return(vdisk_write_block(fs->disk, MASTER_BLOCK_REFERENCE, master) == 0 ? 0 : -1);
+}
+
+/**
+ * Report the free space.  Only the master block is read
+ *
+ * @param fs The open file system
+ * @param space The free space (filled in)
+ * @return 0 on success; -1 on error
+ */
+int oufs_free_space(OUFS *fs, OUFS_SPACE *space)
+{
+  BLOCK block;
+  OUFS_MASTER *master = (OUFS_MASTER *) &block;
+
+  pthread_mutex_lock(&fs->allocator_lock);
+  vdisk_lock_block(fs->disk, MASTER_BLOCK_REFERENCE, VDISK_LOCK_SHARED);
+  int ret = vdisk_read_block(fs->disk, MASTER_BLOCK_REFERENCE, &block);
+  vdisk_unlock_block(fs->disk, MASTER_BLOCK_REFERENCE);
+  pthread_mutex_unlock(&fs->allocator_lock);
+  if(ret != 0)
+    return(-1);
+
+  // An image that has not been written since the counters came in
+  if(!master->counters_valid)
+    oufs_update_counters(&block);
+
+  space->total_blocks = N_BLOCKS_IN_DISK;
+  space->free_blocks = master->free_blocks;
+  space->total_inodes = N_INODES;
+  space->free_inodes = master->free_inodes;
+  for(int g = 0; g < OUFS_N_GROUPS; ++g)
+    space->group_free_blocks[g] = master->group_free_blocks[g];
+  return(0);
+}
+
+/**
+ * Find the first free block in a copy of the master block and mark it
+ * allocated.  The caller holds the allocator lock and writes the master
+ * block back
+ *
+ * @param master The master block
+ * @return The index of the allocated data block.  If no blocks are available,
+ * then UNALLOCATED_BLOCK is returned
+ */
+BLOCK_REFERENCE oufs_take_open_block(BLOCK *master)
+{
+  return(oufs_take_open_block_near(master, 0));
 }
 
 /**
- * Allocate a new inode block
+ * Allocate a new data block
  *
  * If one is found, then the corresponding bit in the block allocation table is set
  *
+ * @param goal Block to allocate at or after, if it is free (see
+ *             oufs_take_open_block_near())
  * @return The index of the allocated data block.  If no blocks are available,
  * then UNALLOCATED_BLOCK is returned
  *
  */
-BLOCK_REFERENCE oufs_allocate_new_inode()
+BLOCK_REFERENCE oufs_allocate_new_block(OUFS *fs, BLOCK_REFERENCE goal)
 {
   BLOCK block;
   // Read the master block
-  vdisk_read_block(MASTER_BLOCK_REFERENCE, &block);
+  pthread_mutex_lock(&fs->allocator_lock);
+  vdisk_lock_block(fs->disk, MASTER_BLOCK_REFERENCE, VDISK_LOCK_EXCLUSIVE);
+  vdisk_read_block(fs->disk, MASTER_BLOCK_REFERENCE, &block);
+
+  BLOCK_REFERENCE block_reference = oufs_take_open_block_near(&block, goal);
 
-  // Scan for an available block
-  int inode_byte;
-  int flag;
+  // Write out the updated master block
+  if(block_reference != UNALLOCATED_BLOCK)
+    oufs_write_master(fs, &block);
+  vdisk_unlock_block(fs->disk, MASTER_BLOCK_REFERENCE);
+  pthread_mutex_unlock(&fs->allocator_lock);
+
+  // Done
+  return(block_reference);
+}
 
-  // Loop over each byte in the allocation table.
-  for(inode_byte = 0, flag = 1; flag && inode_byte < (N_BLOCKS_IN_DISK / 8); ++inode_byte) {
-    if(block.master.inode_allocated_flag[inode_byte] != 0xff) {
-      // Found a byte that has an opening: stop scanning
-      flag = 0;
+/**
+ * Allocate a new inode
+ *
+ * If one is found, then the corresponding bit in the inode allocation table is set
+ *
+ * @param group Block group whose inodes are tried first; the others follow
+ *              in turn
+ * @return The index of the allocated inode.  If no inodes are available,
+ * then UNALLOCATED_INODE is returned
+ *
+ */
+INODE_REFERENCE oufs_allocate_new_inode(OUFS *fs, int group)
+{
+  BLOCK block;
+  // Read the master block
+  pthread_mutex_lock(&fs->allocator_lock);
+  vdisk_lock_block(fs->disk, MASTER_BLOCK_REFERENCE, VDISK_LOCK_EXCLUSIVE);
+  vdisk_read_block(fs->disk, MASTER_BLOCK_REFERENCE, &block);
+
+  // Scan for an available inode, from the first one of the group
+  INODE_REFERENCE inode_reference = UNALLOCATED_INODE;
+  int first = (group % OUFS_N_GROUPS) * INODES_PER_BLOCK;
+  for(int k = 0; k < N_INODES; ++k) {
+    int i = (first + k) % N_INODES;
+    if(!((block.master.inode_allocated_flag[i >> 3] >> (i & 0x7)) & 1)) {
+      inode_reference = i;
       break;
-    };
-  };
-  // Did we find a candidate byte in the table?
-  if(flag == 1) {
+    }
+  }
+
+  // Did we find one?
+  if(inode_reference == UNALLOCATED_INODE) {
     // No
+    vdisk_unlock_block(fs->disk, MASTER_BLOCK_REFERENCE);
+    pthread_mutex_unlock(&fs->allocator_lock);
     if(debug)
       fprintf(stderr, "No inode\n");
     return(UNALLOCATED_INODE);
   }
 
-  // Found an available data block 
-
-  // Set the block allocated bit
-  // Find the FIRST bit in the byte that is 0 (we scan in bit order: 0 ... 7)
-  int inode_bit = oufs_find_open_bit(block.master.inode_allocated_flag[inode_byte]);
-
   // Now set the bit in the allocation table
-  block.master.inode_allocated_flag[inode_byte] |= (1 << inode_bit);
+  block.master.inode_allocated_flag[inode_reference >> 3] |= (1 << (inode_reference & 0x7));
 
   // Write out the updated master block
-  vdisk_write_block(MASTER_BLOCK_REFERENCE, &block);
-
-  if(debug)
-    fprintf(stderr, "Allocating inode=%d (%d)\n", inode_byte, inode_bit);
-
-  // Compute the block index
-  INODE_REFERENCE inode_reference = (inode_byte << 3) + inode_bit;
+  oufs_write_master(fs, &block);
+  vdisk_unlock_block(fs->disk, MASTER_BLOCK_REFERENCE);
+  pthread_mutex_unlock(&fs->allocator_lock);
 
   if(debug)
-    fprintf(stderr, "Allocating inode=%d\n", inode_reference);
+    fprintf(stderr, "Allocating inode=%d (group %d)\n", inode_reference, group);
   
   // Done
   return(inode_reference);
 }
 
+/**
+ * Choose the block group for a new directory.  Directories made in the root
+ * are spread out: each goes to the group with the most free blocks.  Deeper
+ * ones stay in their parent's group, so that a subtree is kept together
+ *
+ * @param fs The open file system
+ * @param parent The parent directory
+ * @param parent_block_ref The parent directory's block
+ * @return The group
+ */
+static int oufs_directory_group(OUFS *fs, INODE_REFERENCE parent, BLOCK_REFERENCE parent_block_ref)
+{
+  // The root directory is inode 0
+  if(parent != 0)
+    return(OUFS_BLOCK_GROUP(parent_block_ref));
+
+  BLOCK block;
+  OUFS_MASTER *master = (OUFS_MASTER *) &block;
+  pthread_mutex_lock(&fs->allocator_lock);
+  vdisk_lock_block(fs->disk, MASTER_BLOCK_REFERENCE, VDISK_LOCK_SHARED);
+  vdisk_read_block(fs->disk, MASTER_BLOCK_REFERENCE, &block);
+  vdisk_unlock_block(fs->disk, MASTER_BLOCK_REFERENCE);
+  pthread_mutex_unlock(&fs->allocator_lock);
+
+  int best = 0;
+  int best_free = -1;
+  for(int g = 0; g < OUFS_N_GROUPS; ++g) {
+    int n_free = 0;
+    for(int b = OUFS_GROUP_START(g); b < OUFS_GROUP_START(g + 1); ++b)
+      if(!(((master->master.block_allocated_flag[b >> 3] | master->block_pinned_flag[b >> 3]) >> (b & 0x7)) & 1))
+        ++n_free;
+    if(n_free > best_free) {
+      best = g;
+      best_free = n_free;
+    }
+  }
+  return(best);
+}
+
 /**
  * Given a block reference, mark that block as unallocated in the master table
  * @param block_ref block reference of block to deallocate
  * @return 0 if success, -1 if error
  */
-int oufs_deallocate_block(BLOCK_REFERENCE block_ref)
+int oufs_deallocate_block(OUFS *fs, BLOCK_REFERENCE block_ref)
 {
   // Read the master block
   BLOCK block;
-  vdisk_read_block(MASTER_BLOCK_REFERENCE, &block);
+  pthread_mutex_lock(&fs->allocator_lock);
+  vdisk_lock_block(fs->disk, MASTER_BLOCK_REFERENCE, VDISK_LOCK_EXCLUSIVE);
+  vdisk_read_block(fs->disk, MASTER_BLOCK_REFERENCE, &block);
 
   // Calculate the byte and bit to change
   int block_bit = block_ref & 0b111;
@@ -222,6 +432,7 @@ int oufs_deallocate_block(BLOCK_REFERENCE block_ref)
 
   // Flip the desired bit to 0
   block.master.block_allocated_flag[block_byte] &= ~(1 << block_bit);
+  vdisk_stats_classify(fs->disk, block_ref, VDISK_CLASS_DATA);
 
   if(debug)
     fprintf(stderr, "Deallocating block=%d (%d)\n", block_byte, block_bit);
@@ -229,7 +440,9 @@ int oufs_deallocate_block(BLOCK_REFERENCE block_ref)
     fprintf(stderr, "Deallocating block=%d\n", block_ref);
 
   // Write out the updated master block
-  vdisk_write_block(MASTER_BLOCK_REFERENCE, &block);
+  oufs_write_master(fs, &block);
+  vdisk_unlock_block(fs->disk, MASTER_BLOCK_REFERENCE);
+  pthread_mutex_unlock(&fs->allocator_lock);
 
   return 0;
 }
@@ -239,11 +452,13 @@ int oufs_deallocate_block(BLOCK_REFERENCE block_ref)
  * @param inode_ref inode reference of inode to deallocate
  * @return 0 if success, -1 if error
  */
-int oufs_deallocate_inode(INODE_REFERENCE inode_ref)
+int oufs_deallocate_inode(OUFS *fs, INODE_REFERENCE inode_ref)
 {
   // Read the master block
   BLOCK block;
-  vdisk_read_block(MASTER_BLOCK_REFERENCE, &block);
+  pthread_mutex_lock(&fs->allocator_lock);
+  vdisk_lock_block(fs->disk, MASTER_BLOCK_REFERENCE, VDISK_LOCK_EXCLUSIVE);
+  vdisk_read_block(fs->disk, MASTER_BLOCK_REFERENCE, &block);
 
   // Calculate the byte and bit to change
   int inode_bit = inode_ref & 0b111;
@@ -258,7 +473,9 @@ int oufs_deallocate_inode(INODE_REFERENCE inode_ref)
     fprintf(stderr, "Deallocating inode=%d\n", inode_ref);
 
   // Write out the updated master block
-  vdisk_write_block(MASTER_BLOCK_REFERENCE, &block);
+  oufs_write_master(fs, &block);
+  vdisk_unlock_block(fs->disk, MASTER_BLOCK_REFERENCE);
+  pthread_mutex_unlock(&fs->allocator_lock);
 
   return 0;
 }
@@ -273,7 +490,7 @@ int oufs_deallocate_inode(INODE_REFERENCE inode_ref)
  *         -1 = an error has occurred
  *
  */
-int oufs_read_inode_by_reference(INODE_REFERENCE i, INODE *inode)
+int oufs_read_inode_by_reference(OUFS *fs, INODE_REFERENCE i, INODE *inode)
 {
   if(debug)
     fprintf(stderr, "Fetching inode %d\n", i);
@@ -282,13 +499,23 @@ int oufs_read_inode_by_reference(INODE_REFERENCE i, INODE *inode)
   BLOCK_REFERENCE block = i / INODES_PER_BLOCK + 1;
   int element = (i % INODES_PER_BLOCK);
 
+  // A snapshot has its own copy of the block once the live one has changed
   BLOCK b;
-  if(vdisk_read_block(block, &b) == 0) {
+  pthread_mutex_lock(&fs->inode_block_lock[block - 1]);
+  vdisk_lock_block(fs->disk, block, VDISK_LOCK_SHARED);
+  BLOCK_REFERENCE source = block;
+  if(fs->snapshot >= 0)
+    source = oufs_snapshot_inode_block(fs, block);
+  if(source != UNALLOCATED_BLOCK && vdisk_read_block(fs->disk, source, &b) == 0) {
     // Successfully loaded the block: copy just this inode
+    vdisk_unlock_block(fs->disk, block);
+    pthread_mutex_unlock(&fs->inode_block_lock[block - 1]);
     *inode = b.inodes.inode[element];
     return(0);
   }
   // Error case
+  vdisk_unlock_block(fs->disk, block);
+  pthread_mutex_unlock(&fs->inode_block_lock[block - 1]);
   return(-1);
 }
 
@@ -302,7 +529,7 @@ int oufs_read_inode_by_reference(INODE_REFERENCE i, INODE *inode)
  *         -1 = an error has occurred
  *
  */
-int oufs_write_inode_by_reference(INODE_REFERENCE i, INODE *inode)
+int oufs_write_inode_by_reference(OUFS *fs, INODE_REFERENCE i, INODE *inode)
 {
   if(debug)
     fprintf(stderr, "Writing inode %d\n", i);
@@ -311,14 +538,25 @@ int oufs_write_inode_by_reference(INODE_REFERENCE i, INODE *inode)
   BLOCK_REFERENCE block = i / INODES_PER_BLOCK + 1;
   int element = (i % INODES_PER_BLOCK);
 
+  // The other inodes in the block must not change underneath us, and
+  // snapshots that still share the block keep it as it was
   BLOCK b;
-  if(vdisk_read_block(block, &b) == 0) {
+  if(fs->snapshot >= 0)
+    return(-1);
+  pthread_mutex_lock(&fs->inode_block_lock[block - 1]);
+  vdisk_lock_block(fs->disk, block, VDISK_LOCK_EXCLUSIVE);
+  if(vdisk_read_block(fs->disk, block, &b) == 0 &&
+     oufs_snapshot_preserve_inodes(fs, block, &b) == 0) {
     // Successfully loaded the block: copy just this inode
     b.inodes.inode[element] = *inode;
-    vdisk_write_block(block, &b);
+    vdisk_write_block(fs->disk, block, &b);
+    vdisk_unlock_block(fs->disk, block);
+    pthread_mutex_unlock(&fs->inode_block_lock[block - 1]);
     return(0);
   }
   // Error case
+  vdisk_unlock_block(fs->disk, block);
+  pthread_mutex_unlock(&fs->inode_block_lock[block - 1]);
   return(-1);
 }
 
@@ -378,170 +616,372 @@ char* oufs_relative_path(char* cwd, char* path, char* rel_path)
   }
 }
 
+/**
+ *  Tell the statistics of the disk which blocks hold the master block and
+ *  the tables that it points to, inodes, and directories.  The reads that
+ *  this takes are not counted
+ *
+ *  @param fs the open file system
+ */
+static void oufs_classify_blocks(OUFS *fs)
+{
+  VDISK_STATS *stats = fs->disk->stats;
+  unsigned char *block_class = fs->disk->block_class;
+  BLOCK mb;
+  OUFS_MASTER *master = (OUFS_MASTER *) &mb;
+
+  fs->disk->stats = NULL;
+  vdisk_lock_block(fs->disk, MASTER_BLOCK_REFERENCE, VDISK_LOCK_SHARED);
+  vdisk_read_block(fs->disk, MASTER_BLOCK_REFERENCE, &mb);
+  vdisk_unlock_block(fs->disk, MASTER_BLOCK_REFERENCE);
+
+  block_class[MASTER_BLOCK_REFERENCE] = VDISK_CLASS_MASTER;
+  if (master->features & OUFS_FEATURE_DEDUP)
+    block_class[master->fingerprint_block] = VDISK_CLASS_MASTER;
+  if (master->snapshot_block != 0)
+    block_class[master->snapshot_block] = VDISK_CLASS_MASTER;
+  if (master->features & OUFS_FEATURE_USAGE)
+    for (int k = 0; k < OUFS_USAGE_BLOCKS; k++)
+      block_class[master->usage_block[k]] = VDISK_CLASS_MASTER;
+
+  // A mounted snapshot may keep its own copies of the inode blocks
+  for (BLOCK_REFERENCE b = 1; b <= N_INODE_BLOCKS; b++)
+  {
+    block_class[b] = VDISK_CLASS_INODE;
+    if (fs->snapshot >= 0)
+    {
+      BLOCK_REFERENCE source = oufs_snapshot_inode_block(fs, b);
+      if (source < N_BLOCKS_IN_DISK)
+        block_class[source] = VDISK_CLASS_INODE;
+    }
+  }
+
+  for (INODE_REFERENCE i = 0; i < N_INODES; i++)
+  {
+    INODE inode;
+    if (oufs_read_inode_by_reference(fs, i, &inode) == 0 && inode.type == IT_DIRECTORY &&
+        inode.data[0] < N_BLOCKS_IN_DISK)
+      block_class[inode.data[0]] = VDISK_CLASS_DIRECTORY;
+  }
+  fs->disk->stats = stats;
+}
+
+/**
+ *  Open a file system handle on a virtual disk
+ *
+ *  @param virtual_disk_name name of the virtual disk.  "disk@name" opens
+ *         the snapshot called name, read only
+ *  @param resume set to reclaim the orphans left by earlier handles; not
+ *         for an image that is about to be formatted
+ *  @return The new handle; NULL on error
+ */
+static OUFS *oufs_open_handle(char *virtual_disk_name, int resume)
+{
+  OUFS *fs = malloc(sizeof(OUFS));
+  if (fs == NULL)
+    return NULL;
+
+  // Split off the snapshot name
+  char disk_name[MAX_PATH_LENGTH];
+  strncpy(disk_name, virtual_disk_name, MAX_PATH_LENGTH-1);
+  disk_name[MAX_PATH_LENGTH-1] = 0;
+  char *snapshot_name = strrchr(disk_name, '@');
+  if (snapshot_name != NULL)
+    *snapshot_name++ = 0;
+
+  // Open the virtual disk
+  fs->disk = vdisk_disk_open(disk_name);
+  if (fs->disk == NULL)
+  {
+    free(fs);
+    return NULL;
+  }
+
+  // Locks start out free
+  pthread_mutex_init(&fs->allocator_lock, NULL);
+  for (int i = 0; i < N_INODE_BLOCKS; i++)
+    pthread_mutex_init(&fs->inode_block_lock[i], NULL);
+  for (int i = 0; i < N_INODES; i++)
+    pthread_rwlock_init(&fs->inode_lock[i], NULL);
+  pthread_rwlock_init(&fs->snapshot_lock, NULL);
+  pthread_mutex_init(&fs->usage_lock, NULL);
+  fs->fingerprints_cached = 0;
+  fs->snapshot = -1;
+  fs->snapshot_block = 0;
+  oufs_trace_open(fs);
+  oufs_reclaim_init(fs);
+  oufs_aio_init(fs);
+
+  if (snapshot_name != NULL && oufs_snapshot_mount(fs, snapshot_name) != 0)
+  {
+    oufs_close(fs);
+    return NULL;
+  }
+
+  // Finish what an earlier handle left on the orphan list
+  if (resume && fs->snapshot < 0)
+    oufs_reclaim_resume(fs);
+
+  if (fs->disk->stats != NULL)
+    oufs_classify_blocks(fs);
+
+  return fs;
+}
+
+/**
+ *  Open a file system handle on a virtual disk
+ *
+ *  @param virtual_disk_name name of the virtual disk.  "disk@name" opens
+ *         the snapshot called name, read only
+ *  @return The new handle; NULL on error
+ */
+OUFS *oufs_open(char *virtual_disk_name)
+{
+  return oufs_open_handle(virtual_disk_name, 1);
+}
+
+/**
+ *  Close a file system handle and its virtual disk
+ *
+ *  @param fs the open file system.  The handle is released
+ *  @return 0 if success, -1 if error
+ */
+int oufs_close(OUFS *fs)
+{
+  if (fs == NULL)
+    return -1;
+
+  // Queued requests are carried out and orphans are all reclaimed before
+  // the disk goes
+  oufs_aio_shutdown(fs);
+  oufs_reclaim_stop(fs);
+  int ret = vdisk_disk_close(fs->disk);
+  oufs_trace_close(fs);
+
+  pthread_mutex_destroy(&fs->allocator_lock);
+  for (int i = 0; i < N_INODE_BLOCKS; i++)
+    pthread_mutex_destroy(&fs->inode_block_lock[i]);
+  for (int i = 0; i < N_INODES; i++)
+    pthread_rwlock_destroy(&fs->inode_lock[i]);
+  pthread_rwlock_destroy(&fs->snapshot_lock);
+  pthread_mutex_destroy(&fs->usage_lock);
+  pthread_mutex_destroy(&fs->reclaim_lock);
+  pthread_cond_destroy(&fs->reclaim_cond);
+  free(fs);
+
+  return ret;
+}
+
 /**
  *  Format the disk given a virtual disk name
+ *
+ *  Only the blocks that hold something are written: the master block, the
+ *  inode block with the root inode and the root directory.  Everything else
+ *  is left as a hole in a sparse image, which reads back as the zeros that an
+ *  unused block or inode consists of
  * 
  *  @param virtual_disk_name name of the virtual disk
+ *  @param features OUFS_FEATURE_* flags for the new file system
  *  @return success code
  */
-int oufs_format_disk(char  *virtual_disk_name)
+int oufs_format_disk(char  *virtual_disk_name, int features)
 {
-  // Open virtual disk
-  vdisk_disk_open(virtual_disk_name);
-
-  BLOCK theblock;
-  memset(&theblock, 0, BLOCK_SIZE);
-
-  // Write 0 to every block
-  for (int i = 0; i < N_BLOCKS_IN_DISK; i++)
+  // Open virtual disk; whatever is on it is about to go
+  OUFS *fs = oufs_open_handle(virtual_disk_name, 0);
+  if (fs == NULL)
+    return -1;
+  if (fs->snapshot >= 0)
   {
-    vdisk_write_block(i, &theblock);
+    oufs_close(fs);
+    return -1;
   }
 
-  // Allocate master block
-  oufs_allocate_new_block();
+  // No other process may use the image while it is rebuilt
+  vdisk_lock_image(fs->disk, VDISK_LOCK_EXCLUSIVE);
 
-  // Allocate 8 inode blocks, but not the inodes
-  for (int i = 0; i < N_INODE_BLOCKS; i++)
-    oufs_allocate_new_block();
+  // Throw away the old contents: every block becomes zeros
+  if (vdisk_disk_reset(fs->disk) != 0)
+  {
+    vdisk_unlock_image(fs->disk);
+    oufs_close(fs);
+    return -1;
+  }
 
-  // Allocate first data block
-  BLOCK_REFERENCE first_data_block = oufs_allocate_new_block();
+  BLOCK theblock;
+  OUFS_MASTER *master = (OUFS_MASTER *) &theblock;
+  memset(&theblock, 0, BLOCK_SIZE);
 
-  // Allocate the first inode
-  INODE_REFERENCE ref = oufs_allocate_new_inode();
-  BLOCK_REFERENCE first_block = 1;
+  // Allocate the master block, the 8 inode blocks and the root directory
+  // block, and the root inode
+  for (BLOCK_REFERENCE i = 0; i <= ROOT_DIRECTORY_BLOCK; i++)
+    theblock.master.block_allocated_flag[i >> 3] |= (1 << (i & 0x7));
+  theblock.master.inode_allocated_flag[0] |= 1;
+
+  // Dedup keeps its (initially empty) fingerprint index in the next block,
+  // and usage its table in the ones after
+  master->features = features;
+  if (features & OUFS_FEATURE_DEDUP)
+    master->fingerprint_block = oufs_take_open_block(&theblock);
+  if (features & OUFS_FEATURE_USAGE)
+    oufs_usage_format(fs, &theblock);
+  oufs_write_master(fs, &theblock);
 
   // Set the first inode
-  vdisk_read_block(first_block, &theblock);
+  INODE_REFERENCE ref = 0;
+  BLOCK_REFERENCE first_block = 1;
+  memset(&theblock, 0, BLOCK_SIZE);
   theblock.inodes.inode[0].type = IT_DIRECTORY;
   theblock.inodes.inode[0].n_references = 1;
-  theblock.inodes.inode[0].data[0] = N_INODE_BLOCKS + 1;
+  theblock.inodes.inode[0].data[0] = ROOT_DIRECTORY_BLOCK;
   for (int i = 1; i < BLOCKS_PER_INODE; i++)
     theblock.inodes.inode[0].data[i] = UNALLOCATED_BLOCK;
   theblock.inodes.inode[0].size = 2;
-  vdisk_write_block(first_block, &theblock);
+  vdisk_write_block(fs->disk, first_block, &theblock);
 
-  // Make the directory in the first open data
-  vdisk_read_block(first_data_block, &theblock);
+  // Make the root directory
   oufs_clean_directory_block(ref, ref, &theblock);
-  vdisk_write_block(first_data_block, &theblock);
+  vdisk_write_block(fs->disk, ROOT_DIRECTORY_BLOCK, &theblock);
+
+  // Start with an empty journal
+  vdisk_journal_format(fs->disk);
+  vdisk_unlock_image(fs->disk);
 
   // Close the virtual disk
-  vdisk_disk_close();
+  oufs_close(fs);
 
   return 0;
 }
 
 /**
  * Tries to get a file in the file system
+ * @param fs the open file system
  * @param cwd current working directory
  * @param path absolute or relative path of file to look for
  * @param parent parent inode of the found file (output)
  * @param child inode of the found file
- * @param local_name name of the found file
+ * @param local_name name of the found file (output, FILE_NAME_SIZE bytes; may be NULL)
  * @return 1 if the file was found, 0 if not
  */
 
-int oufs_find_file(char *cwd, char * path, INODE_REFERENCE *parent, INODE_REFERENCE *child, char *local_name)
+int oufs_find_file(OUFS *fs, char *cwd, char * path, INODE_REFERENCE *parent, INODE_REFERENCE *child, char *local_name)
 {
+  unsigned long start = vdisk_stats_start(fs->disk);
+
   // Find the directory to list, either a supplied path or the cwd
   char listdir[MAX_PATH_LENGTH];
   memset(listdir, 0, MAX_PATH_LENGTH);
   oufs_relative_path(cwd, path, listdir);
 
   // Declare some variables
-  BLOCK_REFERENCE current_block = N_INODE_BLOCKS + 1;
   BLOCK theblock;
+  INODE inode;
   INODE_REFERENCE ref = 0;
   INODE_REFERENCE lastref = 0;
 
   // Tokenize the path
-  char* token = strtok(listdir, "/");
+  char* saveptr;
+  char* token = strtok_r(listdir, "/", &saveptr);
   char lasttoken[FILE_NAME_SIZE];
   memset(lasttoken, '\0', FILE_NAME_SIZE);
   lasttoken[0] = '/';
   while (token != NULL)
   {
-    // Check if the expected token exists in this directory
+    // Check if the expected token exists in this directory.  The directory
+    // is held shared while its block is scanned
     int flag = 0;
-    vdisk_read_block(current_block, &theblock);
-    for (int i = 0; i < DIRECTORY_ENTRIES_PER_BLOCK; i++)
+    INODE_REFERENCE dir = ref;
+    pthread_rwlock_rdlock(&fs->inode_lock[dir]);
+    oufs_read_inode_by_reference(fs, dir, &inode);
+    if (inode.type == IT_DIRECTORY)
     {
-      if (theblock.directory.entry[i].inode_reference != UNALLOCATED_INODE)
+      vdisk_lock_block(fs->disk, inode.data[0], VDISK_LOCK_SHARED);
+      vdisk_read_block(fs->disk, inode.data[0], &theblock);
+      vdisk_unlock_block(fs->disk, inode.data[0]);
+      for (int i = 0; i < DIRECTORY_ENTRIES_PER_BLOCK; i++)
       {
-        if (!strcmp(theblock.directory.entry[i].name, token))
+        if (theblock.directory.entry[i].inode_reference != UNALLOCATED_INODE)
         {
-          // found it!
-          flag = 1;
-          lastref = ref;
-          ref = theblock.directory.entry[i].inode_reference;
-
-          // load the inode
-          INODE inode;
-          oufs_read_inode_by_reference(ref, &inode);
-
-          // Grab the next level block reference
-          current_block = inode.data[0];
+          if (!strcmp(theblock.directory.entry[i].name, token))
+          {
+            // found it!
+            flag = 1;
+            lastref = ref;
+            ref = theblock.directory.entry[i].inode_reference;
+            break;
+          }
         }
       }
     }
+    pthread_rwlock_unlock(&fs->inode_lock[dir]);
 
     if (flag == 0)
     {
       if (debug)
         fprintf(stderr, "find_file: directory does not exist\n");
+      vdisk_stats_op(fs->disk, VDISK_OP_FIND, start);
       return 0;
     }
 
     // Save the token into the last token variable
     memset(lasttoken, '\0', FILE_NAME_SIZE);
-    strncpy(lasttoken, token, FILE_NAME_SIZE);
+    strncpy(lasttoken, token, FILE_NAME_SIZE-1);
     // Try to get the next token
-    token = strtok(NULL, "/");
+    token = strtok_r(NULL, "/", &saveptr);
 
   } // end while
 
   // We're at the end of the path and we have presumably found the file. set the return values
   *child = ref;
   *parent = lastref;
-  local_name = lasttoken;
+  if (local_name != NULL)
+    strncpy(local_name, lasttoken, FILE_NAME_SIZE);
 
   if (debug)
   {
     fprintf(stderr, "findfile: child - %d\n", *child);
     fprintf(stderr, "findfile: parent - %d\n", *parent);
-    fprintf(stderr, "findfile: local name - %s\n", local_name);
+    fprintf(stderr, "findfile: local name - %s\n", lasttoken);
   }
 
+  vdisk_stats_op(fs->disk, VDISK_OP_FIND, start);
   return 1;
 }
 
-/* qsort C-string comparison function */ 
-int cstring_cmp(const void *a, const void *b) 
-{ 
-    const char **ia = (const char **)a;
-    const char **ib = (const char **)b;
-    return strcmp(*ia, *ib);
-	/* strcmp functions works exactly as expected from
-	comparison function */ 
-} 
+/* qsort comparison function: directory entries by name */
+static int entry_name_cmp(const void *a, const void *b)
+{
+  const DIRECTORY_ENTRY * const *ea = (const DIRECTORY_ENTRY * const *) a;
+  const DIRECTORY_ENTRY * const *eb = (const DIRECTORY_ENTRY * const *) b;
+  return strcmp((*ea)->name, (*eb)->name);
+}
 
 /**
- * List the files in a directory in alphabetical order
+ * The suffix that a listing gives to a name
+ * @param type the inode type
+ * @return "/" for a directory; "" for a file
+ */
+static const char *oufs_type_suffix(char type)
+{
+  return type == IT_DIRECTORY ? "/" : "";
+}
+
+/**
+ * List the files in a directory in alphabetical order, untimed
+ * @param fs the open file system
  * @param cwd current working directory
  * @param path of the directory to list
+ * @param long_format also give each name's type, number of references,
+ *        size and blocks
  * @return 0 if success, -1 if error
  */
-int oufs_list(char *cwd, char *path)
+static int oufs_list_directory(OUFS *fs, char *cwd, char *path, int long_format)
 {
   // Declare some variables which will be assigned by find_file
   INODE_REFERENCE child;
   INODE_REFERENCE parent;
-  char* local_name;
 
   // Find the file
-  if (!oufs_find_file(cwd, path, &parent, &child, local_name))
+  if (!oufs_find_file(fs, cwd, path, &parent, &child, NULL))
   {
     if (debug)
       fprintf(stderr, "zfilez: directory does not exist!\n");
@@ -550,45 +990,144 @@ int oufs_list(char *cwd, char *path)
 
   // get inode object
   INODE inode;
-  oufs_read_inode_by_reference(child, &inode);
+  pthread_rwlock_rdlock(&fs->inode_lock[child]);
+  oufs_read_inode_by_reference(fs, child, &inode);
+  if (inode.type != IT_DIRECTORY)
+  {
+    pthread_rwlock_unlock(&fs->inode_lock[child]);
+    if (debug)
+      fprintf(stderr, "zfilez: not a directory!\n");
+    return -1;
+  }
 
   // Get data block pointed to by inode
   BLOCK_REFERENCE blockref = inode.data[0];
   BLOCK theblock;
-  vdisk_read_block(blockref, &theblock);
+  vdisk_lock_block(fs->disk, blockref, VDISK_LOCK_SHARED);
+  vdisk_read_block(fs->disk, blockref, &theblock);
+  vdisk_unlock_block(fs->disk, blockref);
+  pthread_rwlock_unlock(&fs->inode_lock[child]);
 
   // we're at the end of the path, so list the things
-  char* filelist[DIRECTORY_ENTRIES_PER_BLOCK];
+  DIRECTORY_ENTRY *filelist[DIRECTORY_ENTRIES_PER_BLOCK];
   int numFiles = 0;
   for (int i = 0; i < DIRECTORY_ENTRIES_PER_BLOCK; i++)
   {
     if (theblock.directory.entry[i].inode_reference != UNALLOCATED_INODE)
     {
       // Add name to the list
-      filelist[numFiles] = theblock.directory.entry[i].name;
+      filelist[numFiles] = &theblock.directory.entry[i];
       numFiles++;
     }
   }
 
   // Sort list of names
-  qsort(filelist, numFiles, sizeof(char*), cstring_cmp);
+  qsort(filelist, numFiles, sizeof(DIRECTORY_ENTRY *), entry_name_cmp);
+
+  // The attributes of all of the entries, each inode block read once
+  INODE_REFERENCE refs[DIRECTORY_ENTRIES_PER_BLOCK];
+  OUFS_STAT stats[DIRECTORY_ENTRIES_PER_BLOCK];
+  for (int i = 0; i < numFiles; i++)
+    refs[i] = filelist[i]->inode_reference;
+  if (oufs_stat_many(fs, refs, numFiles, stats) < 0)
+    return -1;
 
-  // Print the sorted list
+  // Print the sorted list: directories end in a /
   for (int i = 0; i < numFiles; i++)
   {
-    printf("%s/\n", filelist[i]);
+    if (long_format)
+      printf("%c %3d %6u %3d ", stats[i].type, stats[i].n_references, stats[i].size, stats[i].blocks);
+    printf("%s%s\n", filelist[i]->name, oufs_type_suffix(stats[i].type));
   }
 
   return 0;
 }
 
 /**
- * makes a directory
+ * List the files in a directory in alphabetical order
+ * @param fs the open file system
+ * @param cwd current working directory
+ * @param path of the directory to list
+ * @return 0 if success, -1 if error
+ */
+int oufs_list(OUFS *fs, char *cwd, char *path)
+{
+  unsigned long start = vdisk_stats_start(fs->disk);
+  unsigned long trace_start = oufs_trace_start(fs);
+  int ret = oufs_list_directory(fs, cwd, path, 0);
+  vdisk_stats_op(fs->disk, VDISK_OP_LIST, start);
+  oufs_trace_path(fs, trace_start, OUFS_TRACE_LIST, cwd, path, NULL, UNALLOCATED_INODE, ret);
+  return ret;
+}
+
+/**
+ * List the files in a directory in alphabetical order, each with its type,
+ * number of references, size in bytes and number of blocks
+ * @param fs the open file system
+ * @param cwd current working directory
+ * @param path of the directory to list
+ * @return 0 if success, -1 if error
+ */
+int oufs_list_long(OUFS *fs, char *cwd, char *path)
+{
+  unsigned long start = vdisk_stats_start(fs->disk);
+  unsigned long trace_start = oufs_trace_start(fs);
+  int ret = oufs_list_directory(fs, cwd, path, 1);
+  vdisk_stats_op(fs->disk, VDISK_OP_LIST, start);
+  oufs_trace_path(fs, trace_start, OUFS_TRACE_LIST, cwd, path, NULL, UNALLOCATED_INODE, ret);
+  return ret;
+}
+
+/**
+ * Lock a directory for modification: its inode exclusively against other
+ * threads and its directory block exclusively against other processes.
+ * The inode is (re)loaded once the block is held, so a directory that another
+ * process removed in the meantime is noticed.  A removed directory that is
+ * waiting to be reclaimed has no references left
+ * @param fs the open file system
+ * @param ref the directory's inode reference
+ * @param inode the directory's inode (output)
+ * @return 0 if locked; -1 if ref is not a directory (nothing is held)
+ */
+static int oufs_lock_directory(OUFS *fs, INODE_REFERENCE ref, INODE *inode)
+{
+  pthread_rwlock_wrlock(&fs->inode_lock[ref]);
+  oufs_read_inode_by_reference(fs, ref, inode);
+  while (inode->type == IT_DIRECTORY && inode->n_references > 0)
+  {
+    BLOCK_REFERENCE block_ref = inode->data[0];
+    vdisk_lock_block(fs->disk, block_ref, VDISK_LOCK_EXCLUSIVE);
+    oufs_read_inode_by_reference(fs, ref, inode);
+    if (inode->type == IT_DIRECTORY && inode->n_references > 0 && inode->data[0] == block_ref)
+      return 0;
+
+    // Changed while we waited for the block: try again
+    vdisk_unlock_block(fs->disk, block_ref);
+  }
+  pthread_rwlock_unlock(&fs->inode_lock[ref]);
+  return -1;
+}
+
+/**
+ * Release a directory locked by oufs_lock_directory()
+ * @param fs the open file system
+ * @param ref the directory's inode reference
+ * @param block_ref the directory block that was locked
+ */
+static void oufs_unlock_directory(OUFS *fs, INODE_REFERENCE ref, BLOCK_REFERENCE block_ref)
+{
+  vdisk_unlock_block(fs->disk, block_ref);
+  pthread_rwlock_unlock(&fs->inode_lock[ref]);
+}
+
+/**
+ * makes a directory, inside of a journal transaction
+ * @param fs the open file system
  * @param cwd current working directory
  * @param path path to create
  * @return status code
  */
-int oufs_mkdir(char *cwd, char *path)
+static int oufs_mkdir_locked(OUFS *fs, char *cwd, char *path)
 {
   // Get relative path
   char rel_path[MAX_PATH_LENGTH];
@@ -596,18 +1135,21 @@ int oufs_mkdir(char *cwd, char *path)
   oufs_relative_path(cwd, path, rel_path);
 
   // Get base and directory names
-  char* dir = dirname(strdup(rel_path));
-  char* base = basename(strdup(rel_path));
+  char dir_copy[MAX_PATH_LENGTH];
+  char base_copy[MAX_PATH_LENGTH];
+  strcpy(dir_copy, rel_path);
+  strcpy(base_copy, rel_path);
+  char* dir = dirname(dir_copy);
+  char* base = basename(base_copy);
 
   // Find file outputs
   INODE_REFERENCE parent;
   INODE_REFERENCE child;
-  char* local_name;
 
   INODE_REFERENCE new_dir_parent;
 
   // Parent directory must exist
-  if (!oufs_find_file(cwd, dir, &parent, &child, local_name))
+  if (!oufs_find_file(fs, cwd, dir, &parent, &child, NULL))
   {
       // Parent directory does not exist
       if (debug)
@@ -618,7 +1160,7 @@ int oufs_mkdir(char *cwd, char *path)
     new_dir_parent = child;
 
   // Child directory must not exist
-  if (oufs_find_file(cwd, rel_path, &parent, &child, local_name))
+  if (oufs_find_file(fs, cwd, rel_path, &parent, &child, NULL))
   {
       // Directory we are trying to make already exists
       if (debug)
@@ -626,94 +1168,164 @@ int oufs_mkdir(char *cwd, char *path)
       return -1;
   }
 
-  // Allocated the new block
-  BLOCK_REFERENCE new_dir_block_ref = oufs_allocate_new_block();
-
-  // Make a new inode for the new directory
-  INODE_REFERENCE new_inode_ref = oufs_allocate_new_inode();
-  if (debug)
-    fprintf(stderr, "new inode ref: %d\n", new_inode_ref);
-
-  // Set the inode for the new directory
-  INODE new_inode;
-  oufs_read_inode_by_reference(new_inode_ref, &new_inode);
-  new_inode.type = IT_DIRECTORY;
-  new_inode.n_references = 1;
-  new_inode.data[0] = new_dir_block_ref;
-  for (int i = 1; i < BLOCKS_PER_INODE; i++)
-    new_inode.data[i] = UNALLOCATED_BLOCK;
-  new_inode.size = 2;
-  oufs_write_inode_by_reference(new_inode_ref, &new_inode);
-
-  // Clean the directory
-  BLOCK theblock;
-  vdisk_read_block(new_dir_block_ref, &theblock);
-  oufs_clean_directory_block(new_inode_ref, new_dir_parent, &theblock);
-  vdisk_write_block(new_dir_block_ref, &theblock);
-
-  // Update entries in parent block
+  // Hold the parent exclusively from here on: the lookups above were not
+  // done under the lock, so they are checked again below
   INODE parent_inode;
-  oufs_read_inode_by_reference(new_dir_parent, &parent_inode);
+  if (oufs_lock_directory(fs, new_dir_parent, &parent_inode) != 0)
+  {
+    if (debug)
+      fprintf(stderr, "mkdir: Parent directory does not exist!\n");
+    return -1;
+  }
   BLOCK_REFERENCE parent_block_ref = parent_inode.data[0];
-  vdisk_read_block(parent_block_ref, &theblock);
+  BLOCK theblock;
+  vdisk_read_block(fs->disk, parent_block_ref, &theblock);
 
-  // Find the first available entry in the block
-  int wrote_entry = 0;
+  // Find the first available entry in the block, making sure that nobody
+  // else has created the name in the meantime
+  int free_entry = -1;
   for (int i = 0; i < DIRECTORY_ENTRIES_PER_BLOCK; i++)
   {
     // Is the directory entry unallocated?
     if (theblock.directory.entry[i].inode_reference == UNALLOCATED_INODE)
     {
-      // Set the empty entry to point to our new inode
-      memset(theblock.directory.entry[i].name, '\0', FILE_NAME_SIZE);
-      strncpy(theblock.directory.entry[i].name, base, FILE_NAME_SIZE-1);
-      theblock.directory.entry[i].inode_reference = new_inode_ref;
-      wrote_entry = 1;
-      vdisk_write_block(parent_block_ref, &theblock);
-
-      // Update file count in inode
-      parent_inode.size++;
-      oufs_write_inode_by_reference(new_dir_parent, &parent_inode);
-
-      // Exit the for loop
-      break;
+      if (free_entry < 0)
+        free_entry = i;
+    }
+    else if (!strncmp(theblock.directory.entry[i].name, base, FILE_NAME_SIZE-1))
+    {
+      oufs_unlock_directory(fs, new_dir_parent, parent_block_ref);
+      if (debug)
+        fprintf(stderr, "mkdir: Directory already exists\n");
+      return -1;
     }
   }
-  
-  if (!wrote_entry)
+
+  if (free_entry < 0)
   {
+    oufs_unlock_directory(fs, new_dir_parent, parent_block_ref);
     if (debug)
       fprintf(stderr, "Directory is full!");
     return -1;
   }
 
-  return 0;
-}
+  // Allocate the new block and a new inode for the new directory, both in
+  // the directory's block group
+  int group = oufs_directory_group(fs, new_dir_parent, parent_block_ref);
+  BLOCK_REFERENCE new_dir_block_ref = oufs_allocate_new_block(fs, OUFS_GROUP_START(group));
+  INODE_REFERENCE new_inode_ref = oufs_allocate_new_inode(fs, group);
+  if (debug)
+    fprintf(stderr, "new inode ref: %d\n", new_inode_ref);
 
-/**
- * Removes a directory
- * @param cwd current working directory
- * @param path path to create
- * @return status code
- */
-int oufs_rmdir(char *cwd, char *path)
-{
-  // Get relative path
-  char rel_path[MAX_PATH_LENGTH];
-  memset(rel_path, 0, MAX_PATH_LENGTH);
-  oufs_relative_path(cwd, path, rel_path);
+  if (new_dir_block_ref == UNALLOCATED_BLOCK || new_inode_ref == UNALLOCATED_INODE)
+  {
+    // Out of space: give back whichever one we did get
+    if (new_dir_block_ref != UNALLOCATED_BLOCK)
+      oufs_deallocate_block(fs, new_dir_block_ref);
+    if (new_inode_ref != UNALLOCATED_INODE)
+      oufs_deallocate_inode(fs, new_inode_ref);
+    oufs_unlock_directory(fs, new_dir_parent, parent_block_ref);
+    if (debug)
+      fprintf(stderr, "mkdir: Disk is full!\n");
+    return -1;
+  }
 
-  // Get base and directory names
-  char* dir = dirname(strdup(rel_path));
-  char* base = basename(strdup(rel_path));
+  // A snapshot may hold the parent's block: then the parent moves to a new one
+  BLOCK_REFERENCE new_parent_block_ref = parent_block_ref;
+  if (oufs_cow_block(fs, &new_parent_block_ref) != 0)
+  {
+    oufs_deallocate_block(fs, new_dir_block_ref);
+    oufs_deallocate_inode(fs, new_inode_ref);
+    oufs_unlock_directory(fs, new_dir_parent, parent_block_ref);
+    if (debug)
+      fprintf(stderr, "mkdir: Disk is full!\n");
+    return -1;
+  }
+
+  // Set the inode for the new directory
+  INODE new_inode;
+  oufs_read_inode_by_reference(fs, new_inode_ref, &new_inode);
+  new_inode.type = IT_DIRECTORY;
+  new_inode.n_references = 1;
+  new_inode.data[0] = new_dir_block_ref;
+  for (int i = 1; i < BLOCKS_PER_INODE; i++)
+    new_inode.data[i] = UNALLOCATED_BLOCK;
+  new_inode.size = 2;
+  oufs_write_inode_by_reference(fs, new_inode_ref, &new_inode);
+
+  // Clean the directory.  Nobody can reach the new block yet
+  BLOCK newblock;
+  oufs_clean_directory_block(new_inode_ref, new_dir_parent, &newblock);
+  vdisk_stats_classify(fs->disk, new_dir_block_ref, VDISK_CLASS_DIRECTORY);
+  vdisk_write_block(fs->disk, new_dir_block_ref, &newblock);
+
+  // Set the empty entry to point to our new inode
+  memset(theblock.directory.entry[free_entry].name, '\0', FILE_NAME_SIZE);
+  strncpy(theblock.directory.entry[free_entry].name, base, FILE_NAME_SIZE-1);
+  theblock.directory.entry[free_entry].inode_reference = new_inode_ref;
+  vdisk_write_block(fs->disk, new_parent_block_ref, &theblock);
+
+  // Update file count in inode
+  parent_inode.data[0] = new_parent_block_ref;
+  parent_inode.size++;
+  oufs_write_inode_by_reference(fs, new_dir_parent, &parent_inode);
+  oufs_usage_create(fs, new_inode_ref, new_dir_parent, &new_inode);
+
+  oufs_unlock_directory(fs, new_dir_parent, parent_block_ref);
+  return 0;
+}
+
+/**
+ * makes a directory
+ * @param fs the open file system
+ * @param cwd current working directory
+ * @param path path to create
+ * @return status code
+ */
+int oufs_mkdir(OUFS *fs, char *cwd, char *path)
+{
+  // Snapshots are read only
+  if (fs->snapshot >= 0)
+    return -1;
+
+  // The updates reach the disk together, or not at all
+  unsigned long start = vdisk_stats_start(fs->disk);
+  unsigned long trace_start = oufs_trace_start(fs);
+  pthread_rwlock_rdlock(&fs->snapshot_lock);
+  int ret = -1;
+  if (vdisk_txn_begin(fs->disk, OUFS_MKDIR_CREDITS) == 0)
+  {
+    ret = oufs_mkdir_locked(fs, cwd, path);
+    if (vdisk_txn_end(fs->disk) != 0)
+      ret = -1;
+  }
+  pthread_rwlock_unlock(&fs->snapshot_lock);
+  vdisk_stats_op(fs->disk, VDISK_OP_MKDIR, start);
+  oufs_trace_path(fs, trace_start, OUFS_TRACE_MKDIR, cwd, path, NULL, UNALLOCATED_INODE, ret);
+  return ret;
+}
+
+/**
+ * Removes a directory, inside of a journal transaction
+ * @param fs the open file system
+ * @param cwd current working directory
+ * @param path path to create
+ * @return status code
+ */
+static int oufs_rmdir_locked(OUFS *fs, char *cwd, char *path)
+{
+  // Get relative path
+  char rel_path[MAX_PATH_LENGTH];
+  memset(rel_path, 0, MAX_PATH_LENGTH);
+  oufs_relative_path(cwd, path, rel_path);
 
   // Find file outputs
   INODE_REFERENCE parent_inode_ref;
   INODE_REFERENCE child_inode_ref;
-  char* local_name;
+  char local_name[FILE_NAME_SIZE];
 
   // Directory must exist
-  if (!oufs_find_file(cwd, rel_path, &parent_inode_ref, &child_inode_ref, local_name))
+  if (!oufs_find_file(fs, cwd, rel_path, &parent_inode_ref, &child_inode_ref, local_name))
   {
       // Directory we are trying to make already exists
       if (debug)
@@ -721,91 +1333,930 @@ int oufs_rmdir(char *cwd, char *path)
       return -1;
   }
 
-  // Get the inode object for the child directory
-  INODE child_inode;
-  oufs_read_inode_by_reference(child_inode_ref, &child_inode);
+  // Directory must not be ., .. or the root
+  if (!strcmp(local_name, ".") || !strcmp(local_name, "..") || child_inode_ref == parent_inode_ref)
+  {
+    if (debug)
+      fprintf(stderr, "rmdir: cannot remove . or ..\n");
+    return -1;
+  }
+
+  // Hold the parent, then the child, exclusively
+  INODE parent_inode;
+  if (oufs_lock_directory(fs, parent_inode_ref, &parent_inode) != 0)
+  {
+    if (debug)
+      fprintf(stderr, "rmdir: Directory does not exist\n");
+    return -1;
+  }
+  BLOCK_REFERENCE parent_block_ref = parent_inode.data[0];
 
   // Inode must point to a directory
-  if (child_inode.type != IT_DIRECTORY)
+  INODE child_inode;
+  if (oufs_lock_directory(fs, child_inode_ref, &child_inode) != 0)
   {
+    oufs_unlock_directory(fs, parent_inode_ref, parent_block_ref);
     if (debug)
       fprintf(stderr, "rmdir: path must be a directory\n");
     return -1;
   }
+  BLOCK_REFERENCE child_block_ref = child_inode.data[0];
 
   // Directory must be empty
   if (child_inode.size > 2)
   {
+    oufs_unlock_directory(fs, child_inode_ref, child_block_ref);
+    oufs_unlock_directory(fs, parent_inode_ref, parent_block_ref);
     if (debug)
       fprintf(stderr, "rmdir: cannot remove non-empty directory\n");
     return -1;
   }
 
-  // Directory must not be . or ..
-  if (!strcmp(local_name, ".") || !strcmp(local_name, ".."))
+  // Read data for parent of deleted directory
+  BLOCK parent_block;
+  vdisk_read_block(fs->disk, parent_block_ref, &parent_block);
+
+  // The directory's entry must still be in its parent directory
+  int entry = -1;
+  for (int i = 0; i < DIRECTORY_ENTRIES_PER_BLOCK; i++)
+  {
+    // Does the directory entry point to the one we're deleting?
+    if (parent_block.directory.entry[i].inode_reference == child_inode_ref)
+    {
+      entry = i;
+      break;
+    }
+  }
+
+  if (entry < 0)
   {
+    oufs_unlock_directory(fs, child_inode_ref, child_block_ref);
+    oufs_unlock_directory(fs, parent_inode_ref, parent_block_ref);
     if (debug)
-      fprintf(stderr, "rmdir: cannot remove . or ..\n");
+      fprintf(stderr, "rmdir: failed to remove entry from parent\n");
     return -1;
   }
 
-  // Deallocate the block and inode in the master block
-  oufs_deallocate_inode(child_inode_ref);
-  BLOCK_REFERENCE child_block_ref = child_inode.data[0];
-  oufs_deallocate_block(child_block_ref);
-
-  // Remove inode properties
-  child_inode.data[0] = 0;
-  child_inode.type = IT_NONE;
-  oufs_write_inode_by_reference(child_inode_ref, &child_inode);
+  // A snapshot may hold the parent's block: then the parent moves to a new one
+  BLOCK_REFERENCE new_parent_block_ref = parent_block_ref;
+  if (oufs_cow_block(fs, &new_parent_block_ref) != 0)
+  {
+    oufs_unlock_directory(fs, child_inode_ref, child_block_ref);
+    oufs_unlock_directory(fs, parent_inode_ref, parent_block_ref);
+    if (debug)
+      fprintf(stderr, "rmdir: Disk is full!\n");
+    return -1;
+  }
 
-  // Read data for parent of deleted directory
-  INODE parent_inode;
-  oufs_read_inode_by_reference(parent_inode_ref, &parent_inode);
-  BLOCK_REFERENCE parent_block_ref = parent_inode.data[0];
-  BLOCK parent_block;
-  vdisk_read_block(parent_block_ref, &parent_block);
+  // The directory loses its name now; its block and inode are freed later
+  // (oufs_reclaim())
+  child_inode.n_references = 0;
+  oufs_write_inode_by_reference(fs, child_inode_ref, &child_inode);
+  oufs_orphan(fs, child_inode_ref);
 
   // Remove the directory's entry from its parent directory
-  int removed_entry = 0;
-  for (int i = 0; i < DIRECTORY_ENTRIES_PER_BLOCK; i++)
+  strncpy(parent_block.directory.entry[entry].name, "", FILE_NAME_SIZE);
+  parent_block.directory.entry[entry].inode_reference = UNALLOCATED_INODE;
+  vdisk_write_block(fs->disk, new_parent_block_ref, &parent_block);
+
+  // Update file count in inode
+  parent_inode.data[0] = new_parent_block_ref;
+  parent_inode.size--;
+  oufs_write_inode_by_reference(fs, parent_inode_ref, &parent_inode);
+  oufs_usage_delete(fs, child_inode_ref, parent_inode_ref, 1);
+
+  oufs_unlock_directory(fs, child_inode_ref, child_block_ref);
+  oufs_unlock_directory(fs, parent_inode_ref, parent_block_ref);
+
+  return 0;
+}
+
+/**
+ * Removes a directory
+ * @param fs the open file system
+ * @param cwd current working directory
+ * @param path path to create
+ * @return status code
+ */
+int oufs_rmdir(OUFS *fs, char *cwd, char *path)
+{
+  // Snapshots are read only
+  if (fs->snapshot >= 0)
+    return -1;
+
+  // The updates reach the disk together, or not at all
+  unsigned long start = vdisk_stats_start(fs->disk);
+  unsigned long trace_start = oufs_trace_start(fs);
+  pthread_rwlock_rdlock(&fs->snapshot_lock);
+  int ret = -1;
+  if (vdisk_txn_begin(fs->disk, OUFS_RMDIR_CREDITS) == 0)
   {
-    // Does the directory entry point to the one we're deleting?
-    if (parent_block.directory.entry[i].inode_reference == child_inode_ref)
+    ret = oufs_rmdir_locked(fs, cwd, path);
+    if (vdisk_txn_end(fs->disk) != 0)
+      ret = -1;
+  }
+  pthread_rwlock_unlock(&fs->snapshot_lock);
+  if (ret == 0)
+    oufs_reclaim_kick(fs);
+  vdisk_stats_op(fs->disk, VDISK_OP_RMDIR, start);
+  oufs_trace_path(fs, trace_start, OUFS_TRACE_RMDIR, cwd, path, NULL, UNALLOCATED_INODE, ret);
+  return ret;
+}
+
+/**
+ * Drop all of the data blocks of a file (or the block of a directory), with
+ * one update of the master block.  The inode is only changed in memory
+ * @param fs the open file system
+ * @param inode the inode
+ */
+void oufs_truncate_inode(OUFS *fs, INODE *inode)
+{
+  if (inode->type == IT_COMPRESSED_FILE)
+  {
+    oufs_compressed_truncate(fs, inode);
+    return;
+  }
+  BLOCK_REFERENCE refs[BLOCKS_PER_INODE];
+  int n = 0;
+  for (int i = 0; i < BLOCKS_PER_INODE; i++)
+  {
+    if (inode->data[i] != UNALLOCATED_BLOCK)
+    {
+      refs[n++] = inode->data[i];
+      inode->data[i] = UNALLOCATED_BLOCK;
+    }
+  }
+  oufs_release_blocks(fs, refs, n);
+  inode->size = 0;
+}
+
+/**
+ * Opens a file for writing, creating it if it does not exist, inside of a
+ * journal transaction
+ * @param fs the open file system
+ * @param cwd current working directory
+ * @param path path of the file
+ * @param mode 'w' (the file is emptied) or 'a' (writes go to its end)
+ * @param type type of the file if it is created: IT_FILE or IT_COMPRESSED_FILE
+ * @param offset where writing starts (output)
+ * @return the file's inode; UNALLOCATED_INODE if it cannot be opened
+ */
+static INODE_REFERENCE oufs_fopen_locked(OUFS *fs, char *cwd, char *path, char mode, char type, int *offset)
+{
+  // Get relative path
+  char rel_path[MAX_PATH_LENGTH];
+  memset(rel_path, 0, MAX_PATH_LENGTH);
+  oufs_relative_path(cwd, path, rel_path);
+
+  // Get base and directory names
+  char dir_copy[MAX_PATH_LENGTH];
+  char base_copy[MAX_PATH_LENGTH];
+  strcpy(dir_copy, rel_path);
+  strcpy(base_copy, rel_path);
+  char* dir = dirname(dir_copy);
+  char* base = basename(base_copy);
+
+  INODE_REFERENCE parent;
+  INODE_REFERENCE child;
+  INODE inode;
+
+  for (;;)
+  {
+    if (oufs_find_file(fs, cwd, rel_path, &parent, &child, NULL))
+    {
+      // Existing file
+      pthread_rwlock_wrlock(&fs->inode_lock[child]);
+      oufs_read_inode_by_reference(fs, child, &inode);
+      if (!OUFS_IS_FILE(inode.type))
+      {
+        pthread_rwlock_unlock(&fs->inode_lock[child]);
+        if (debug)
+          fprintf(stderr, "fopen: not a file\n");
+        return UNALLOCATED_INODE;
+      }
+      if (mode == 'w' && inode.size > 0)
+      {
+        oufs_truncate_inode(fs, &inode);
+        oufs_write_inode_by_reference(fs, child, &inode);
+        oufs_usage_update(fs, child, &inode);
+      }
+      *offset = inode.size;
+      pthread_rwlock_unlock(&fs->inode_lock[child]);
+      return child;
+    }
+
+    // New file: the parent directory must exist
+    INODE_REFERENCE dir_ref;
+    if (!oufs_find_file(fs, cwd, dir, &parent, &dir_ref, NULL))
+    {
+      if (debug)
+        fprintf(stderr, "fopen: Parent directory does not exist!\n");
+      return UNALLOCATED_INODE;
+    }
+
+    INODE dir_inode;
+    if (oufs_lock_directory(fs, dir_ref, &dir_inode) != 0)
+    {
+      if (debug)
+        fprintf(stderr, "fopen: Parent directory does not exist!\n");
+      return UNALLOCATED_INODE;
+    }
+    BLOCK_REFERENCE dir_block_ref = dir_inode.data[0];
+    BLOCK theblock;
+    vdisk_read_block(fs->disk, dir_block_ref, &theblock);
+
+    // Somebody else may have created it in the meantime: then open theirs
+    int free_entry = -1;
+    int exists = 0;
+    for (int i = 0; i < DIRECTORY_ENTRIES_PER_BLOCK; i++)
     {
-      // Set the empty entry to point to our new inode
-      strncpy(parent_block.directory.entry[i].name, "", FILE_NAME_SIZE);
-      parent_block.directory.entry[i].inode_reference = UNALLOCATED_INODE;
-      removed_entry = 1;
-      vdisk_write_block(parent_block_ref, &parent_block);
+      if (theblock.directory.entry[i].inode_reference == UNALLOCATED_INODE)
+      {
+        if (free_entry < 0)
+          free_entry = i;
+      }
+      else if (!strncmp(theblock.directory.entry[i].name, base, FILE_NAME_SIZE-1))
+        exists = 1;
+    }
+    if (exists)
+    {
+      oufs_unlock_directory(fs, dir_ref, dir_block_ref);
+      continue;
+    }
+
+    INODE_REFERENCE new_inode_ref = UNALLOCATED_INODE;
+    if (free_entry >= 0)
+      new_inode_ref = oufs_allocate_new_inode(fs, OUFS_BLOCK_GROUP(dir_block_ref));
+    if (new_inode_ref == UNALLOCATED_INODE)
+    {
+      oufs_unlock_directory(fs, dir_ref, dir_block_ref);
+      if (debug)
+        fprintf(stderr, "fopen: Directory or disk is full!\n");
+      return UNALLOCATED_INODE;
+    }
+
+    // A snapshot may hold the directory's block: then it moves to a new one
+    BLOCK_REFERENCE new_dir_block_ref = dir_block_ref;
+    if (oufs_cow_block(fs, &new_dir_block_ref) != 0)
+    {
+      oufs_deallocate_inode(fs, new_inode_ref);
+      oufs_unlock_directory(fs, dir_ref, dir_block_ref);
+      if (debug)
+        fprintf(stderr, "fopen: Directory or disk is full!\n");
+      return UNALLOCATED_INODE;
+    }
+
+    // An empty file
+    oufs_read_inode_by_reference(fs, new_inode_ref, &inode);
+    inode.type = type;
+    inode.n_references = 1;
+    for (int i = 0; i < BLOCKS_PER_INODE; i++)
+      inode.data[i] = UNALLOCATED_BLOCK;
+    inode.size = 0;
+    oufs_write_inode_by_reference(fs, new_inode_ref, &inode);
+
+    // Set the empty entry to point to the new inode
+    memset(theblock.directory.entry[free_entry].name, '\0', FILE_NAME_SIZE);
+    strncpy(theblock.directory.entry[free_entry].name, base, FILE_NAME_SIZE-1);
+    theblock.directory.entry[free_entry].inode_reference = new_inode_ref;
+    vdisk_write_block(fs->disk, new_dir_block_ref, &theblock);
+
+    dir_inode.data[0] = new_dir_block_ref;
+    dir_inode.size++;
+    oufs_write_inode_by_reference(fs, dir_ref, &dir_inode);
+    oufs_usage_create(fs, new_inode_ref, dir_ref, &inode);
+
+    oufs_unlock_directory(fs, dir_ref, dir_block_ref);
+    *offset = 0;
+    return new_inode_ref;
+  }
+}
+
+/**
+ * Opens a file, untraced
+ * @param fs the open file system
+ * @param cwd current working directory
+ * @param path path of the file
+ * @param mode as for oufs_fopen()
+ * @return the open file; NULL if it cannot be opened
+ */
+static OUFILE* oufs_fopen_file(OUFS *fs, char *cwd, char *path, char *mode)
+{
+  if (mode == NULL || (mode[0] != 'r' && mode[0] != 'w' && mode[0] != 'a'))
+    return NULL;
+
+  INODE_REFERENCE ref;
+  int offset = 0;
+  if (mode[0] == 'r')
+  {
+    // The file must exist
+    INODE_REFERENCE parent;
+    INODE inode;
+    if (!oufs_find_file(fs, cwd, path, &parent, &ref, NULL))
+      return NULL;
+    oufs_read_inode_by_reference(fs, ref, &inode);
+    if (!OUFS_IS_FILE(inode.type))
+      return NULL;
+  }
+  else
+  {
+    // Snapshots are read only
+    if (fs->snapshot >= 0)
+      return NULL;
+
+    pthread_rwlock_rdlock(&fs->snapshot_lock);
+    ref = UNALLOCATED_INODE;
+    if (vdisk_txn_begin(fs->disk, OUFS_FOPEN_CREDITS) == 0)
+    {
+      char type = (mode[1] == 'c') ? IT_COMPRESSED_FILE : IT_FILE;
+      ref = oufs_fopen_locked(fs, cwd, path, mode[0], type, &offset);
+      if (vdisk_txn_end(fs->disk) != 0)
+        ref = UNALLOCATED_INODE;
+    }
+    pthread_rwlock_unlock(&fs->snapshot_lock);
+    if (ref == UNALLOCATED_INODE)
+      return NULL;
+  }
+
+  OUFILE *fp = malloc(sizeof(OUFILE));
+  if (fp == NULL)
+    return NULL;
+  fp->inode_reference = ref;
+  fp->mode = mode[0];
+  fp->offset = offset;
+  return fp;
+}
+
+/**
+ * Opens a file
+ * @param fs the open file system
+ * @param cwd current working directory
+ * @param path path of the file
+ * @param mode "r" to read from the start, "w" to write to an empty file or
+ *        "a" to append to the file.  The file is created for "w" and "a";
+ *        "wc" and "ac" create it compressed
+ * @return the open file; NULL if it cannot be opened
+ */
+OUFILE* oufs_fopen(OUFS *fs, char *cwd, char *path, char *mode)
+{
+  unsigned long trace_start = oufs_trace_start(fs);
+  OUFILE *fp = oufs_fopen_file(fs, cwd, path, mode);
+  oufs_trace_path(fs, trace_start, OUFS_TRACE_FOPEN, cwd, path, mode,
+                  fp != NULL ? fp->inode_reference : UNALLOCATED_INODE, fp != NULL ? 0 : -1);
+  return fp;
+}
+
+/**
+ * Closes a file
+ * @param fs the open file system
+ * @param fp the open file.  It is released
+ */
+void oufs_fclose(OUFS *fs, OUFILE *fp)
+{
+  if (fp != NULL)
+    oufs_trace_io(fs, oufs_trace_start(fs), OUFS_TRACE_FCLOSE, fp, fp->offset, 0, 0);
+  free(fp);
+}
+
+/**
+ * Is a block all zeros?
+ * @param block the block
+ * @return 1 if it is; 0 if not
+ */
+static int oufs_block_is_zero(BLOCK *block)
+{
+  for (int i = 0; i < BLOCK_SIZE; ++i)
+    if (block->data.data[i] != 0)
+      return 0;
+  return 1;
+}
+
+/**
+ * Writes to a file at its current offset, as much as fits in it
+ * @param fs the open file system
+ * @param fp the file, open for writing
+ * @param buf the bytes to write
+ * @param len number of bytes
+ * @return number of bytes written; -1 on error
+ */
+int oufs_fwrite(OUFS *fs, OUFILE *fp, unsigned char * buf, int len)
+{
+  if (fp == NULL || fp->mode == 'r' || len < 0 || fs->snapshot >= 0)
+    return -1;
+
+  unsigned long start = vdisk_stats_start(fs->disk);
+  unsigned long trace_start = oufs_trace_start(fs);
+  int start_offset = fp->offset;
+  pthread_rwlock_rdlock(&fs->snapshot_lock);
+  if (vdisk_txn_begin(fs->disk, OUFS_FWRITE_CREDITS) != 0)
+  {
+    pthread_rwlock_unlock(&fs->snapshot_lock);
+    return -1;
+  }
+  pthread_rwlock_wrlock(&fs->inode_lock[fp->inode_reference]);
 
-      // Update file count in inode
-      parent_inode.size--;
-      oufs_write_inode_by_reference(parent_inode_ref, &parent_inode);
+  INODE inode;
+  oufs_read_inode_by_reference(fs, fp->inode_reference, &inode);
+  if (!OUFS_IS_FILE(inode.type))
+  {
+    pthread_rwlock_unlock(&fs->inode_lock[fp->inode_reference]);
+    vdisk_txn_end(fs->disk);
+    pthread_rwlock_unlock(&fs->snapshot_lock);
+    return -1;
+  }
+
+  // Update block by block, or cluster by cluster.  New blocks go in the
+  // file's block group, each after the one before it
+  BLOCK_REFERENCE goal = OUFS_GROUP_START(OUFS_INODE_GROUP(fp->inode_reference));
+  int end = MIN(fp->offset + len, BLOCKS_PER_INODE * BLOCK_SIZE);
+  int done = 0;
+  if (inode.type == IT_COMPRESSED_FILE)
+  {
+    done = oufs_compressed_write(fs, &inode, goal, fp->offset, buf, len);
+    end = fp->offset;
+    if (done < 0)
+      done = 0;
+  }
+  while (fp->offset + done < end)
+  {
+    int position = fp->offset + done;
+    int b = position / BLOCK_SIZE;
+    int within = position % BLOCK_SIZE;
+    int n = MIN(BLOCK_SIZE - within, end - position);
+
+    BLOCK theblock;
+    if (inode.data[b] == UNALLOCATED_BLOCK)
+      memset(&theblock, 0, BLOCK_SIZE);
+    else
+      vdisk_read_block(fs->disk, inode.data[b], &theblock);
+    memcpy(theblock.data.data + within, buf + done, n);
+
+    // Zeros written into a hole leave it a hole
+    if (inode.data[b] == UNALLOCATED_BLOCK && oufs_block_is_zero(&theblock))
+    {
+      done += n;
+      continue;
+    }
 
-      // Exit the for loop
+    if (b > 0 && inode.data[b - 1] != UNALLOCATED_BLOCK)
+      goal = inode.data[b - 1] + 1;
+    if (oufs_store_data_block(fs, &inode.data[b], &theblock, goal) != 0)
+    {
+      if (debug)
+        fprintf(stderr, "fwrite: Disk is full!\n");
       break;
     }
+    done += n;
+  }
+
+  fp->offset += done;
+  if (fp->offset > inode.size)
+    inode.size = fp->offset;
+  oufs_write_inode_by_reference(fs, fp->inode_reference, &inode);
+  oufs_usage_update(fs, fp->inode_reference, &inode);
+
+  pthread_rwlock_unlock(&fs->inode_lock[fp->inode_reference]);
+  int ret = done;
+  if (vdisk_txn_end(fs->disk) != 0)
+    ret = -1;
+  pthread_rwlock_unlock(&fs->snapshot_lock);
+  vdisk_stats_op(fs->disk, VDISK_OP_WRITE, start);
+  oufs_trace_io(fs, trace_start, OUFS_TRACE_WRITE, fp, start_offset, len, ret);
+  return ret;
+}
+
+/**
+ * Reserves the blocks of part of a file, so that writing it later allocates
+ * nothing.  The holes in the range get blocks of zeros, in one run of
+ * consecutive blocks if the disk has one; blocks the file has are kept
+ * @param fs the open file system
+ * @param fp the file, open for writing.  Compressed files cannot be reserved
+ * @param offset where the range starts
+ * @param len length of the range
+ * @param keep_size 0 to grow the file to the end of the range; otherwise its
+ *        size is kept, and the blocks past its end wait for writes
+ * @return 0 on success; -1 on error or if the disk is too full, in which case
+ *         nothing is allocated
+ */
+int oufs_fallocate(OUFS *fs, OUFILE *fp, int offset, int len, int keep_size)
+{
+  if (fp == NULL || fp->mode == 'r' || offset < 0 || len < 0 ||
+      offset + len > BLOCKS_PER_INODE * BLOCK_SIZE || fs->snapshot >= 0)
+    return -1;
+
+  pthread_rwlock_rdlock(&fs->snapshot_lock);
+  if (vdisk_txn_begin(fs->disk, OUFS_FWRITE_CREDITS) != 0)
+  {
+    pthread_rwlock_unlock(&fs->snapshot_lock);
+    return -1;
+  }
+  pthread_rwlock_wrlock(&fs->inode_lock[fp->inode_reference]);
+
+  INODE inode;
+  oufs_read_inode_by_reference(fs, fp->inode_reference, &inode);
+  int ret = (inode.type == IT_FILE) ? 0 : -1;
+
+  // The holes in the range
+  int first = offset / BLOCK_SIZE;
+  int last = (len > 0) ? (offset + len - 1) / BLOCK_SIZE : first - 1;
+  int holes = 0;
+  for (int b = first; b <= last; ++b)
+    if (inode.data[b] == UNALLOCATED_BLOCK)
+      ++holes;
+
+  // They go after the blocks before them, or at the start of the file's
+  // block group.  Should no run be long enough, they are taken one at a time
+  BLOCK_REFERENCE allocated[BLOCKS_PER_INODE];
+  int n = 0;
+  if (ret == 0 && holes > 0)
+  {
+    BLOCK_REFERENCE goal = OUFS_GROUP_START(OUFS_INODE_GROUP(fp->inode_reference));
+    for (int b = first - 1; b >= 0; --b)
+      if (inode.data[b] != UNALLOCATED_BLOCK)
+      {
+        goal = inode.data[b] + 1;
+        break;
+      }
+
+    BLOCK mb;
+    pthread_mutex_lock(&fs->allocator_lock);
+    vdisk_lock_block(fs->disk, MASTER_BLOCK_REFERENCE, VDISK_LOCK_EXCLUSIVE);
+    vdisk_read_block(fs->disk, MASTER_BLOCK_REFERENCE, &mb);
+    BLOCK_REFERENCE run = oufs_take_open_run(&mb, goal, holes);
+    for (n = 0; n < holes; ++n)
+    {
+      allocated[n] = (run != UNALLOCATED_BLOCK) ? run + n : oufs_take_open_block_near(&mb, goal);
+      if (allocated[n] == UNALLOCATED_BLOCK)
+        break;
+      goal = allocated[n] + 1;
+    }
+
+    // All or nothing: the copy of the master block is only written back if
+    // every hole has a block
+    if (n == holes)
+      oufs_write_master(fs, &mb);
+    else
+      ret = -1;
+    vdisk_unlock_block(fs->disk, MASTER_BLOCK_REFERENCE);
+    pthread_mutex_unlock(&fs->allocator_lock);
   }
 
-  // Reset all directory entries in child
-  BLOCK child_block;
-  vdisk_read_block(child_block_ref, &child_block);
+  if (ret == 0)
+  {
+    BLOCK zeros;
+    memset(&zeros, 0, BLOCK_SIZE);
+    int k = 0;
+    for (int b = first; b <= last; ++b)
+      if (inode.data[b] == UNALLOCATED_BLOCK)
+      {
+        inode.data[b] = allocated[k++];
+        vdisk_write_block(fs->disk, inode.data[b], &zeros);
+      }
+    if (!keep_size && offset + len > inode.size)
+      inode.size = offset + len;
+    oufs_write_inode_by_reference(fs, fp->inode_reference, &inode);
+    oufs_usage_update(fs, fp->inode_reference, &inode);
+    if (debug)
+      fprintf(stderr, "fallocate: inode %d, %d blocks reserved\n", fp->inode_reference, holes);
+  }
+
+  pthread_rwlock_unlock(&fs->inode_lock[fp->inode_reference]);
+  if (vdisk_txn_end(fs->disk) != 0)
+    ret = -1;
+  pthread_rwlock_unlock(&fs->snapshot_lock);
+  return ret;
+}
+
+/**
+ * Reads from a file at its current offset
+ * @param fs the open file system
+ * @param fp the file, open for reading
+ * @param buf receives the bytes
+ * @param len most bytes to read
+ * @return number of bytes read (0 at the end of the file); -1 on error
+ */
+int oufs_fread(OUFS *fs, OUFILE *fp, unsigned char * buf, int len)
+{
+  if (fp == NULL || fp->mode != 'r' || len < 0)
+    return -1;
+
+  unsigned long start = vdisk_stats_start(fs->disk);
+  unsigned long trace_start = oufs_trace_start(fs);
+  pthread_rwlock_rdlock(&fs->inode_lock[fp->inode_reference]);
+
+  INODE inode;
+  oufs_read_inode_by_reference(fs, fp->inode_reference, &inode);
+  if (!OUFS_IS_FILE(inode.type))
+  {
+    pthread_rwlock_unlock(&fs->inode_lock[fp->inode_reference]);
+    return -1;
+  }
+
+  int end = MIN(fp->offset + len, (int) inode.size);
+  int done = 0;
+  if (inode.type == IT_COMPRESSED_FILE)
+  {
+    done = oufs_compressed_read(fs, &inode, fp->offset, buf, len);
+    end = fp->offset;
+    if (done < 0)
+    {
+      pthread_rwlock_unlock(&fs->inode_lock[fp->inode_reference]);
+      return -1;
+    }
+  }
+  while (fp->offset + done < end)
+  {
+    int position = fp->offset + done;
+    int b = position / BLOCK_SIZE;
+    int within = position % BLOCK_SIZE;
+    int n = MIN(BLOCK_SIZE - within, end - position);
+
+    // Never written: zeros
+    BLOCK theblock;
+    if (inode.data[b] == UNALLOCATED_BLOCK)
+      memset(&theblock, 0, BLOCK_SIZE);
+    else
+    {
+      vdisk_lock_block(fs->disk, inode.data[b], VDISK_LOCK_SHARED);
+      vdisk_read_block(fs->disk, inode.data[b], &theblock);
+      vdisk_unlock_block(fs->disk, inode.data[b]);
+    }
+    memcpy(buf + done, theblock.data.data + within, n);
+    done += n;
+  }
+  pthread_rwlock_unlock(&fs->inode_lock[fp->inode_reference]);
+
+  vdisk_stats_op(fs->disk, VDISK_OP_READ, start);
+  oufs_trace_io(fs, trace_start, OUFS_TRACE_READ, fp, fp->offset, len, done);
+  fp->offset += done;
+  return done;
+}
+
+/**
+ * Removes a file, inside of a journal transaction
+ * @param fs the open file system
+ * @param cwd current working directory
+ * @param path path of the file
+ * @return status code
+ */
+static int oufs_remove_locked(OUFS *fs, char *cwd, char *path)
+{
+  INODE_REFERENCE parent_inode_ref;
+  INODE_REFERENCE child_inode_ref;
+  char local_name[FILE_NAME_SIZE];
+
+  // File must exist
+  if (!oufs_find_file(fs, cwd, path, &parent_inode_ref, &child_inode_ref, local_name))
+  {
+    if (debug)
+      fprintf(stderr, "remove: File does not exist\n");
+    return -1;
+  }
+
+  // Never a directory's own entries
+  if (!strcmp(local_name, ".") || !strcmp(local_name, "..") || child_inode_ref == parent_inode_ref)
+    return -1;
+
+  // Hold the parent, then the file
+  INODE parent_inode;
+  if (oufs_lock_directory(fs, parent_inode_ref, &parent_inode) != 0)
+    return -1;
+  BLOCK_REFERENCE parent_block_ref = parent_inode.data[0];
+  pthread_rwlock_wrlock(&fs->inode_lock[child_inode_ref]);
+
+  INODE child_inode;
+  oufs_read_inode_by_reference(fs, child_inode_ref, &child_inode);
+
+  // The name must still refer to the file
+  BLOCK parent_block;
+  vdisk_read_block(fs->disk, parent_block_ref, &parent_block);
+  int entry = -1;
   for (int i = 0; i < DIRECTORY_ENTRIES_PER_BLOCK; i++)
   {
-    strncpy(child_block.directory.entry[i].name, "", FILE_NAME_SIZE);
-    child_block.directory.entry[i].inode_reference = UNALLOCATED_INODE;
+    if (parent_block.directory.entry[i].inode_reference == child_inode_ref &&
+        !strncmp(parent_block.directory.entry[i].name, local_name, FILE_NAME_SIZE))
+    {
+      entry = i;
+      break;
+    }
+  }
 
-    child_inode.size = 0;
-    vdisk_write_block(child_block_ref, &child_block);
+  if (!OUFS_IS_FILE(child_inode.type) || entry < 0)
+  {
+    pthread_rwlock_unlock(&fs->inode_lock[child_inode_ref]);
+    oufs_unlock_directory(fs, parent_inode_ref, parent_block_ref);
+    if (debug)
+      fprintf(stderr, "remove: not a file\n");
+    return -1;
   }
-  
-  if (!removed_entry)
+
+  // A snapshot may hold the parent's block: then the parent moves to a new one
+  BLOCK_REFERENCE new_parent_block_ref = parent_block_ref;
+  if (oufs_cow_block(fs, &new_parent_block_ref) != 0)
   {
+    pthread_rwlock_unlock(&fs->inode_lock[child_inode_ref]);
+    oufs_unlock_directory(fs, parent_inode_ref, parent_block_ref);
     if (debug)
-      fprintf(stderr, "rmdir: failed to remove entry from parent\n");
+      fprintf(stderr, "remove: Disk is full!\n");
     return -1;
   }
 
+  // Remove the entry from the directory
+  oufs_clean_directory_entry(&parent_block.directory.entry[entry]);
+  vdisk_write_block(fs->disk, new_parent_block_ref, &parent_block);
+  parent_inode.data[0] = new_parent_block_ref;
+  parent_inode.size--;
+  oufs_write_inode_by_reference(fs, parent_inode_ref, &parent_inode);
+
+  // The file goes away with its last name: its blocks and inode are freed
+  // later (oufs_reclaim())
+  if (child_inode.n_references > 0)
+    child_inode.n_references--;
+  oufs_write_inode_by_reference(fs, child_inode_ref, &child_inode);
+  if (child_inode.n_references == 0)
+    oufs_orphan(fs, child_inode_ref);
+  oufs_usage_delete(fs, child_inode_ref, parent_inode_ref, child_inode.n_references == 0);
+
+  pthread_rwlock_unlock(&fs->inode_lock[child_inode_ref]);
+  oufs_unlock_directory(fs, parent_inode_ref, parent_block_ref);
   return 0;
 }
+
+/**
+ * Removes a file
+ * @param fs the open file system
+ * @param cwd current working directory
+ * @param path path of the file
+ * @return status code
+ */
+int oufs_remove(OUFS *fs, char *cwd, char *path)
+{
+  // Snapshots are read only
+  if (fs->snapshot >= 0)
+    return -1;
+
+  // The updates reach the disk together, or not at all
+  unsigned long trace_start = oufs_trace_start(fs);
+  pthread_rwlock_rdlock(&fs->snapshot_lock);
+  int ret = -1;
+  if (vdisk_txn_begin(fs->disk, OUFS_REMOVE_CREDITS) == 0)
+  {
+    ret = oufs_remove_locked(fs, cwd, path);
+    if (vdisk_txn_end(fs->disk) != 0)
+      ret = -1;
+  }
+  pthread_rwlock_unlock(&fs->snapshot_lock);
+  if (ret == 0)
+    oufs_reclaim_kick(fs);
+  oufs_trace_path(fs, trace_start, OUFS_TRACE_REMOVE, cwd, path, NULL, UNALLOCATED_INODE, ret);
+  return ret;
+}
+
+/**
+ * Makes a new name for a file, inside of a journal transaction
+ * @param fs the open file system
+ * @param cwd current working directory
+ * @param path_src path of the file
+ * @param path_dst the new name
+ * @return status code
+ */
+static int oufs_link_locked(OUFS *fs, char *cwd, char *path_src, char *path_dst)
+{
+  INODE_REFERENCE parent;
+  INODE_REFERENCE src;
+
+  // The file must exist
+  if (!oufs_find_file(fs, cwd, path_src, &parent, &src, NULL))
+  {
+    if (debug)
+      fprintf(stderr, "link: File does not exist\n");
+    return -1;
+  }
+
+  // Get base and directory names of the new name
+  char rel_path[MAX_PATH_LENGTH];
+  memset(rel_path, 0, MAX_PATH_LENGTH);
+  oufs_relative_path(cwd, path_dst, rel_path);
+  char dir_copy[MAX_PATH_LENGTH];
+  char base_copy[MAX_PATH_LENGTH];
+  strcpy(dir_copy, rel_path);
+  strcpy(base_copy, rel_path);
+  char* dir = dirname(dir_copy);
+  char* base = basename(base_copy);
+
+  // Its directory must exist, and the name must not
+  INODE_REFERENCE dst_parent;
+  INODE_REFERENCE child;
+  if (!oufs_find_file(fs, cwd, dir, &parent, &dst_parent, NULL))
+  {
+    if (debug)
+      fprintf(stderr, "link: Directory does not exist\n");
+    return -1;
+  }
+  if (oufs_find_file(fs, cwd, rel_path, &parent, &child, NULL))
+  {
+    if (debug)
+      fprintf(stderr, "link: %s already exists\n", rel_path);
+    return -1;
+  }
+
+  // Hold the directory, then the file.  The lookups above were not done
+  // under the locks, so they are checked again below
+  INODE parent_inode;
+  if (oufs_lock_directory(fs, dst_parent, &parent_inode) != 0)
+  {
+    if (debug)
+      fprintf(stderr, "link: Directory does not exist\n");
+    return -1;
+  }
+  BLOCK_REFERENCE parent_block_ref = parent_inode.data[0];
+  pthread_rwlock_wrlock(&fs->inode_lock[src]);
+
+  INODE inode;
+  oufs_read_inode_by_reference(fs, src, &inode);
+  BLOCK theblock;
+  vdisk_read_block(fs->disk, parent_block_ref, &theblock);
+
+  // Find the first available entry, making sure that nobody else has made
+  // the name in the meantime
+  int free_entry = -1;
+  int exists = 0;
+  for (int i = 0; i < DIRECTORY_ENTRIES_PER_BLOCK; i++)
+  {
+    if (theblock.directory.entry[i].inode_reference == UNALLOCATED_INODE)
+    {
+      if (free_entry < 0)
+        free_entry = i;
+    }
+    else if (!strncmp(theblock.directory.entry[i].name, base, FILE_NAME_SIZE-1))
+      exists = 1;
+  }
+
+  // Only files have several names.  The new name costs one entry and the
+  // file's reference count: nothing is copied
+  int ret = -1;
+  BLOCK_REFERENCE new_parent_block_ref = parent_block_ref;
+  if (!OUFS_IS_FILE(inode.type) || inode.n_references == 0 || inode.n_references == UCHAR_MAX)
+  {
+    if (debug)
+      fprintf(stderr, "link: not a file\n");
+  }
+  else if (exists || free_entry < 0)
+  {
+    if (debug)
+      fprintf(stderr, "link: name exists or directory is full\n");
+  }
+  else if (oufs_cow_block(fs, &new_parent_block_ref) != 0)
+  {
+    // A snapshot holds the directory's block and there is no room for a copy
+    if (debug)
+      fprintf(stderr, "link: Disk is full!\n");
+  }
+  else
+  {
+    memset(theblock.directory.entry[free_entry].name, '\0', FILE_NAME_SIZE);
+    strncpy(theblock.directory.entry[free_entry].name, base, FILE_NAME_SIZE-1);
+    theblock.directory.entry[free_entry].inode_reference = src;
+    vdisk_write_block(fs->disk, new_parent_block_ref, &theblock);
+
+    parent_inode.data[0] = new_parent_block_ref;
+    parent_inode.size++;
+    oufs_write_inode_by_reference(fs, dst_parent, &parent_inode);
+
+    inode.n_references++;
+    oufs_write_inode_by_reference(fs, src, &inode);
+    oufs_usage_link(fs, src, dst_parent);
+    ret = 0;
+  }
+
+  pthread_rwlock_unlock(&fs->inode_lock[src]);
+  oufs_unlock_directory(fs, dst_parent, parent_block_ref);
+  return ret;
+}
+
+/**
+ * Makes a new name (a hard link) for a file
+ * @param fs the open file system
+ * @param cwd current working directory
+ * @param path_src path of the file
+ * @param path_dst the new name
+ * @return status code
+ */
+int oufs_link(OUFS *fs, char *cwd, char *path_src, char *path_dst)
+{
+  // Snapshots are read only
+  if (fs->snapshot >= 0)
+    return -1;
+
+  // The updates reach the disk together, or not at all
+  pthread_rwlock_rdlock(&fs->snapshot_lock);
+  int ret = -1;
+  if (vdisk_txn_begin(fs->disk, OUFS_LINK_CREDITS) == 0)
+  {
+    ret = oufs_link_locked(fs, cwd, path_src, path_dst);
+    if (vdisk_txn_end(fs->disk) != 0)
+      ret = -1;
+  }
+  pthread_rwlock_unlock(&fs->snapshot_lock);
+  return ret;
+}
@@ -0,0 +1,108 @@
+#include <string.h>
+#include <sys/mman.h>
+#include "oufs_lib.h"
+/*
+ * Read-only views of files.
+ *
+ * oufs_mmap() gives a contiguous view of a whole file.  When the file's
+ * blocks are consecutive on the disk, none of them is waiting in a
+ * transaction, and the backend can map the image (the file and mmap:
+ * backends), the view is a mapping of the image itself: nothing is copied,
+ * and later writes to those blocks show through.  Otherwise (holes,
+ * compressed files, scattered blocks, other backends) the file is read once
+ * into private memory that is then made read only.
+ */
+
+#define debug 0
+
+/**
+ * Are the blocks of a file consecutive, with no holes, and all at home on
+ * the image?  The inode is locked
+ *
+ * @param fs The open file system
+ * @param inode The file's inode
+ * @return 1 if the file can be mapped directly; 0 if not
+ */
+static int mmap_direct(OUFS *fs, INODE *inode)
+{
+  if(inode->type != IT_FILE || inode->size == 0)
+    return(0);
+
+  int n_blocks = (inode->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+  for(int b = 0; b < n_blocks; ++b) {
+    BLOCK theblock;
+    if(inode->data[b] == UNALLOCATED_BLOCK || inode->data[b] != inode->data[0] + b ||
+       vdisk_txn_read_block(fs->disk, inode->data[b], &theblock))
+      return(0);
+  }
+  return(1);
+}
+
+/**
+ * Map a whole file for reading
+ *
+ * @param fs The open file system
+ * @param fp The file (opened in any mode; its offset is not used or moved)
+ * @param view Set to the contents; NULL for an empty file.  Released with
+ *             oufs_munmap()
+ * @return The length of the file; -1 on error
+ */
+int oufs_mmap(OUFS *fs, OUFILE *fp, const unsigned char **view)
+{
+  *view = NULL;
+  if(fp == NULL)
+    return(-1);
+
+  pthread_rwlock_rdlock(&fs->inode_lock[fp->inode_reference]);
+  INODE inode;
+  oufs_read_inode_by_reference(fs, fp->inode_reference, &inode);
+  if(!OUFS_IS_FILE(inode.type)) {
+    pthread_rwlock_unlock(&fs->inode_lock[fp->inode_reference]);
+    return(-1);
+  }
+  int length = inode.size;
+
+  // The image itself
+  if(mmap_direct(fs, &inode)) {
+    *view = vdisk_image_map(fs->disk, length, (off_t) inode.data[0] * BLOCK_SIZE);
+    if(debug && *view != NULL)
+      fprintf(stderr, "mmap: inode %d mapped at block %d\n", fp->inode_reference, inode.data[0]);
+  }
+  pthread_rwlock_unlock(&fs->inode_lock[fp->inode_reference]);
+  if(*view != NULL || length == 0)
+    return(length);
+
+  // A copy.  The file may have changed since its size was read: the view
+  // holds what is read
+  unsigned char *region = mmap(NULL, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if(region == MAP_FAILED)
+    return(-1);
+  OUFILE reader = *fp;
+  reader.mode = 'r';
+  reader.offset = 0;
+  int done = oufs_fread(fs, &reader, region, length);
+  if(done < 0) {
+    munmap(region, length);
+    return(-1);
+  }
+  mprotect(region, length, PROT_READ);
+
+  if(debug)
+    fprintf(stderr, "mmap: inode %d copied (%d bytes)\n", fp->inode_reference, done);
+  *view = region;
+  return(length);
+}
+
+/**
+ * Release a view made by oufs_mmap()
+ *
+ * @param view The view (NULL is ignored)
+ * @param length The length that oufs_mmap() returned
+ * @return 0 on success; -1 on error
+ */
+int oufs_munmap(const unsigned char *view, int length)
+{
+  if(view == NULL)
+    return(0);
+  return(vdisk_image_unmap((void *) view, length) == 0 ? 0 : -1);
+}
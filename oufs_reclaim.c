@@ -0,0 +1,249 @@
+#include <string.h>
+#include "oufs_lib.h"
+/*
+ * Deferred reclamation.
+ *
+ * Removing the last name of a file, or a directory, only puts its inode on
+ * the orphan list in the master block (oufs_orphan()), inside of the
+ * operation's transaction, so that the operation takes the same time however
+ * large the file is.  The blocks and the inode are freed afterwards by a
+ * thread of the handle, one inode per transaction, each with one update of
+ * the master block.  The list is on the image, so what a process did not get
+ * to (it crashed) is picked up by the next handle that is opened on it.
+ *
+ * Until an orphan is reclaimed its inode and blocks stay allocated, and it
+ * has no names, so nothing else can reach it.  Closing a handle waits until
+ * the list is empty.
+ */
+
+#define debug 0
+
+/**
+ * Is an inode on the orphan list?
+ */
+static int reclaim_orphaned(OUFS_MASTER *master, INODE_REFERENCE i)
+{
+  return((master->orphan_inode_flag[i >> 3] >> (i & 0x7)) & 1);
+}
+
+/**
+ * Free the blocks and the inode of one orphan, in a transaction of its own
+ *
+ * @param fs The open file system
+ * @param i The orphan
+ * @return 0 on success (or if another thread got to it first); -1 on error
+ */
+static int reclaim_inode(OUFS *fs, INODE_REFERENCE i)
+{
+  BLOCK mb;
+  OUFS_MASTER *master = (OUFS_MASTER *) &mb;
+
+  pthread_rwlock_rdlock(&fs->snapshot_lock);
+  if(vdisk_txn_begin(fs->disk, OUFS_RECLAIM_CREDITS) != 0) {
+    pthread_rwlock_unlock(&fs->snapshot_lock);
+    return(-1);
+  }
+  pthread_rwlock_wrlock(&fs->inode_lock[i]);
+
+  // Another process may be reclaiming the same orphan.  Holding the inode's
+  // block from the check to the end lets only one of them free it
+  BLOCK_REFERENCE inode_block = i / INODES_PER_BLOCK + 1;
+  vdisk_lock_block(fs->disk, inode_block, VDISK_LOCK_EXCLUSIVE);
+
+  // Still an orphan, now that nothing else can change it?
+  vdisk_lock_block(fs->disk, MASTER_BLOCK_REFERENCE, VDISK_LOCK_SHARED);
+  vdisk_read_block(fs->disk, MASTER_BLOCK_REFERENCE, &mb);
+  vdisk_unlock_block(fs->disk, MASTER_BLOCK_REFERENCE);
+  int orphaned = reclaim_orphaned(master, i);
+
+  INODE inode;
+  oufs_read_inode_by_reference(fs, i, &inode);
+
+  // Only a file or directory without names is freed; anything else is just
+  // taken off the list (zfsck reports it)
+  int free_inode = orphaned && inode.n_references == 0 &&
+    (inode.type == IT_DIRECTORY || OUFS_IS_FILE(inode.type));
+  if(free_inode) {
+    if(debug)
+      fprintf(stderr, "Reclaiming inode %d (%c, %u bytes)\n", i, inode.type, inode.size);
+    oufs_truncate_inode(fs, &inode);
+    inode.type = IT_NONE;
+    oufs_write_inode_by_reference(fs, i, &inode);
+  }
+
+  if(orphaned) {
+    pthread_mutex_lock(&fs->allocator_lock);
+    vdisk_lock_block(fs->disk, MASTER_BLOCK_REFERENCE, VDISK_LOCK_EXCLUSIVE);
+    vdisk_read_block(fs->disk, MASTER_BLOCK_REFERENCE, &mb);
+    master->orphan_inode_flag[i >> 3] &= ~(1 << (i & 0x7));
+    if(free_inode)
+      master->master.inode_allocated_flag[i >> 3] &= ~(1 << (i & 0x7));
+    oufs_write_master(fs, &mb);
+    vdisk_unlock_block(fs->disk, MASTER_BLOCK_REFERENCE);
+    pthread_mutex_unlock(&fs->allocator_lock);
+  }
+
+  vdisk_unlock_block(fs->disk, inode_block);
+  pthread_rwlock_unlock(&fs->inode_lock[i]);
+  int ret = 0;
+  if(vdisk_txn_end(fs->disk) != 0)
+    ret = -1;
+  pthread_rwlock_unlock(&fs->snapshot_lock);
+  return(ret);
+}
+
+/**
+ * The reclaimer: empties the orphan list whenever it is told that there is
+ * something on it, until the handle is closed
+ */
+static void *reclaim_thread(void *arg)
+{
+  OUFS *fs = (OUFS *) arg;
+
+  pthread_mutex_lock(&fs->reclaim_lock);
+  while(1) {
+    if(fs->reclaim_pending) {
+      fs->reclaim_pending = 0;
+      pthread_mutex_unlock(&fs->reclaim_lock);
+      oufs_reclaim(fs);
+      pthread_mutex_lock(&fs->reclaim_lock);
+      continue;
+    }
+    if(fs->reclaim_stop)
+      break;
+    pthread_cond_wait(&fs->reclaim_cond, &fs->reclaim_lock);
+  }
+  pthread_mutex_unlock(&fs->reclaim_lock);
+  return(NULL);
+}
+
+/**
+ * Initialize the reclamation state of a new handle.  The thread is only
+ * started once there is something to reclaim
+ *
+ * @param fs The file system being opened
+ */
+void oufs_reclaim_init(OUFS *fs)
+{
+  pthread_mutex_init(&fs->reclaim_lock, NULL);
+  pthread_cond_init(&fs->reclaim_cond, NULL);
+  fs->reclaim_running = 0;
+  fs->reclaim_pending = 0;
+  fs->reclaim_stop = 0;
+}
+
+/**
+ * Put an inode on the orphan list.  Runs inside of the caller's
+ * transaction, with the inode locked; once the transaction is over, the
+ * caller calls oufs_reclaim_kick()
+ *
+ * @param fs The open file system
+ * @param i The inode, which has no names left
+ * @return 0 on success; -1 on error
+ */
+int oufs_orphan(OUFS *fs, INODE_REFERENCE i)
+{
+  BLOCK mb;
+  OUFS_MASTER *master = (OUFS_MASTER *) &mb;
+
+  if(i >= N_INODES)
+    return(-1);
+
+  pthread_mutex_lock(&fs->allocator_lock);
+  vdisk_lock_block(fs->disk, MASTER_BLOCK_REFERENCE, VDISK_LOCK_EXCLUSIVE);
+  vdisk_read_block(fs->disk, MASTER_BLOCK_REFERENCE, &mb);
+  master->orphan_inode_flag[i >> 3] |= (1 << (i & 0x7));
+  oufs_write_master(fs, &mb);
+  vdisk_unlock_block(fs->disk, MASTER_BLOCK_REFERENCE);
+  pthread_mutex_unlock(&fs->allocator_lock);
+
+  if(debug)
+    fprintf(stderr, "Orphaned inode %d\n", i);
+  return(0);
+}
+
+/**
+ * Tell the reclaimer that there are orphans, starting it if it is not
+ * running yet
+ *
+ * @param fs The open file system
+ */
+void oufs_reclaim_kick(OUFS *fs)
+{
+  pthread_mutex_lock(&fs->reclaim_lock);
+  fs->reclaim_pending = 1;
+  if(!fs->reclaim_running && !fs->reclaim_stop &&
+     pthread_create(&fs->reclaim_thread, NULL, reclaim_thread, fs) == 0)
+    fs->reclaim_running = 1;
+  pthread_cond_signal(&fs->reclaim_cond);
+  pthread_mutex_unlock(&fs->reclaim_lock);
+}
+
+/**
+ * Start reclaiming the orphans that an earlier handle left behind, if there
+ * are any
+ *
+ * @param fs The open file system
+ */
+void oufs_reclaim_resume(OUFS *fs)
+{
+  BLOCK mb;
+  OUFS_MASTER *master = (OUFS_MASTER *) &mb;
+
+  vdisk_lock_block(fs->disk, MASTER_BLOCK_REFERENCE, VDISK_LOCK_SHARED);
+  vdisk_read_block(fs->disk, MASTER_BLOCK_REFERENCE, &mb);
+  vdisk_unlock_block(fs->disk, MASTER_BLOCK_REFERENCE);
+
+  for(int k = 0; k < sizeof(master->orphan_inode_flag); ++k) {
+    if(master->orphan_inode_flag[k] != 0) {
+      oufs_reclaim_kick(fs);
+      return;
+    }
+  }
+}
+
+/**
+ * Reclaim every inode on the orphan list
+ *
+ * @param fs The open file system
+ * @return Number of orphans that were on the list; -1 on error
+ */
+int oufs_reclaim(OUFS *fs)
+{
+  BLOCK mb;
+  OUFS_MASTER *master = (OUFS_MASTER *) &mb;
+
+  if(fs->snapshot >= 0)
+    return(-1);
+
+  vdisk_lock_block(fs->disk, MASTER_BLOCK_REFERENCE, VDISK_LOCK_SHARED);
+  vdisk_read_block(fs->disk, MASTER_BLOCK_REFERENCE, &mb);
+  vdisk_unlock_block(fs->disk, MASTER_BLOCK_REFERENCE);
+
+  int n = 0;
+  for(INODE_REFERENCE i = 0; i < N_INODES; ++i) {
+    if(!reclaim_orphaned(master, i))
+      continue;
+    if(reclaim_inode(fs, i) != 0)
+      return(-1);
+    ++n;
+  }
+  return(n);
+}
+
+/**
+ * Stop the reclaimer once the orphan list is empty
+ *
+ * @param fs The open file system
+ */
+void oufs_reclaim_stop(OUFS *fs)
+{
+  pthread_mutex_lock(&fs->reclaim_lock);
+  fs->reclaim_stop = 1;
+  pthread_cond_broadcast(&fs->reclaim_cond);
+  pthread_mutex_unlock(&fs->reclaim_lock);
+
+  if(fs->reclaim_running)
+    pthread_join(fs->reclaim_thread, NULL);
+  fs->reclaim_running = 0;
+}
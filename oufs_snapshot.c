@@ -0,0 +1,492 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "oufs_lib.h"
+/*
+ * Snapshots.
+ *
+ * A snapshot is a slot in the snapshot table that records the allocation
+ * tables as they were and where its inode table is.  Taking one only writes
+ * the table and the master block, however big the file system is: from then
+ * on, the blocks the snapshot holds are pinned, and the live file system
+ * works around them instead of copying anything up front.
+ *
+ *  - A pinned directory, cluster map or file data block is never changed in
+ *    place: the live file system writes a new block and drops its
+ *    reference to the old one (copy on write).
+ *  - A pinned block is never allocated, even after the live file system has
+ *    dropped it; it is freed by deleting the last snapshot that holds it.
+ *  - The snapshot reads the live inode blocks until one of them is about to
+ *    change; that block is first copied out to a block of the snapshot's own.
+ *
+ * A snapshot is mounted read only by opening "image@name".  It never changes
+ * under its readers, so they only lock a live inode block for the moment it
+ * takes to read one that the snapshot still shares.  A snapshot must not be
+ * deleted while it is mounted.
+ */
+
+#define debug 0
+
+/**
+ * Is a bit set in an allocation table?
+ */
+static int snapshot_test_bit(unsigned char *table, int index)
+{
+  return((table[index >> 3] >> (index & 0x7)) & 1);
+}
+
+/**
+ * Is a block held by a snapshot?
+ *
+ * @param master The master block
+ * @param block_ref The block
+ * @return 1 if it is pinned; 0 if not
+ */
+int oufs_block_pinned(OUFS_MASTER *master, BLOCK_REFERENCE block_ref)
+{
+  return(snapshot_test_bit(master->block_pinned_flag, block_ref));
+}
+
+/**
+ * Is a block held by a snapshot?  Reads the master block
+ *
+ * @param fs The open file system
+ * @param block_ref The block
+ * @return 1 if it is pinned; 0 if not
+ */
+int oufs_snapshot_holds(OUFS *fs, BLOCK_REFERENCE block_ref)
+{
+  BLOCK mb;
+
+  pthread_mutex_lock(&fs->allocator_lock);
+  vdisk_lock_block(fs->disk, MASTER_BLOCK_REFERENCE, VDISK_LOCK_SHARED);
+  vdisk_read_block(fs->disk, MASTER_BLOCK_REFERENCE, &mb);
+  vdisk_unlock_block(fs->disk, MASTER_BLOCK_REFERENCE);
+  pthread_mutex_unlock(&fs->allocator_lock);
+  return(oufs_block_pinned((OUFS_MASTER *) &mb, block_ref));
+}
+
+/**
+ * Find a snapshot in the table by name
+ *
+ * @return Its slot; -1 if there is none
+ */
+static int snapshot_find(OUFS_SNAPSHOT_BLOCK *table, char *name)
+{
+  for(int s = 0; s < OUFS_MAX_SNAPSHOTS; ++s) {
+    if(table->snapshot[s].name[0] != 0 && !strncmp(table->snapshot[s].name, name, FILE_NAME_SIZE))
+      return(s);
+  }
+  return(-1);
+}
+
+/**
+ * Work out the blocks that the snapshots hold, and the inode blocks they
+ * share, from the snapshot table
+ *
+ * @param master The master block (modified)
+ * @param table The snapshot table
+ */
+static void snapshot_summarize(OUFS_MASTER *master, OUFS_SNAPSHOT_BLOCK *table)
+{
+  memset(master->block_pinned_flag, 0, sizeof(master->block_pinned_flag));
+  master->inode_blocks_shared = 0;
+
+  for(int s = 0; s < OUFS_MAX_SNAPSHOTS; ++s) {
+    OUFS_SNAPSHOT *snapshot = &table->snapshot[s];
+    if(snapshot->name[0] == 0)
+      continue;
+    for(int i = 0; i < (N_BLOCKS_IN_DISK >> 3); ++i)
+      master->block_pinned_flag[i] |= snapshot->master.block_allocated_flag[i];
+    for(int k = 0; k < N_INODE_BLOCKS; ++k) {
+      if(snapshot->inode_block[k] == k + 1)
+        master->inode_blocks_shared |= (1 << k);
+    }
+  }
+}
+
+/**
+ * Take a snapshot of the file system
+ *
+ * @param fs The open file system
+ * @param name Name of the snapshot
+ * @return 0 on success; -1 if the name is not valid or is taken, the
+ *         table is full or the disk is full
+ */
+int oufs_snapshot_create(OUFS *fs, char *name)
+{
+  if(fs->snapshot >= 0 || name[0] == 0 || strlen(name) >= FILE_NAME_SIZE || strchr(name, '@') != NULL)
+    return(-1);
+
+  // Orphans would only tie their blocks up in the snapshot
+  oufs_reclaim(fs);
+
+  // No operation may be under way, in this process or (by the image lock
+  // that the transaction holds) in any other
+  pthread_rwlock_wrlock(&fs->snapshot_lock);
+  if(vdisk_txn_begin(fs->disk, 2) != 0) {
+    pthread_rwlock_unlock(&fs->snapshot_lock);
+    return(-1);
+  }
+
+  BLOCK mb;
+  OUFS_MASTER *master = (OUFS_MASTER *) &mb;
+  OUFS_SNAPSHOT_BLOCK table;
+  int ret = -1;
+
+  pthread_mutex_lock(&fs->allocator_lock);
+  vdisk_lock_block(fs->disk, MASTER_BLOCK_REFERENCE, VDISK_LOCK_EXCLUSIVE);
+  vdisk_read_block(fs->disk, MASTER_BLOCK_REFERENCE, &mb);
+
+  // The table is made with the first snapshot
+  BLOCK_REFERENCE table_ref = master->snapshot_block;
+  if(table_ref == 0) {
+    table_ref = oufs_take_open_block(&mb);
+    if(table_ref == UNALLOCATED_BLOCK) {
+      fprintf(stderr, "Disk is full\n");
+      goto out;
+    }
+    master->snapshot_block = table_ref;
+    vdisk_stats_classify(fs->disk, table_ref, VDISK_CLASS_MASTER);
+    memset(&table, 0, sizeof(table));
+  }else{
+    vdisk_lock_block(fs->disk, table_ref, VDISK_LOCK_SHARED);
+    vdisk_read_block(fs->disk, table_ref, &table);
+    vdisk_unlock_block(fs->disk, table_ref);
+  }
+
+  if(snapshot_find(&table, name) >= 0) {
+    fprintf(stderr, "Snapshot %s already exists\n", name);
+    goto out;
+  }
+  int slot;
+  for(slot = 0; slot < OUFS_MAX_SNAPSHOTS && table.snapshot[slot].name[0] != 0; ++slot)
+    ;
+  if(slot == OUFS_MAX_SNAPSHOTS) {
+    fprintf(stderr, "No room for another snapshot\n");
+    goto out;
+  }
+
+  OUFS_SNAPSHOT *snapshot = &table.snapshot[slot];
+  memset(snapshot, 0, sizeof(OUFS_SNAPSHOT));
+  strncpy(snapshot->name, name, FILE_NAME_SIZE - 1);
+  snapshot->created = time(NULL);
+  for(int k = 0; k < N_INODE_BLOCKS; ++k)
+    snapshot->inode_block[k] = k + 1;
+
+  // The snapshot holds the directory and file blocks that are in use; the
+  // master, inode, fingerprint, snapshot table and usage blocks stay live only
+  snapshot->master = master->master;
+  for(BLOCK_REFERENCE b = 0; b <= N_INODE_BLOCKS; ++b)
+    snapshot->master.block_allocated_flag[b >> 3] &= ~(1 << (b & 0x7));
+  if(master->fingerprint_block != 0)
+    snapshot->master.block_allocated_flag[master->fingerprint_block >> 3] &=
+      ~(1 << (master->fingerprint_block & 0x7));
+  snapshot->master.block_allocated_flag[table_ref >> 3] &= ~(1 << (table_ref & 0x7));
+  for(int k = 0; k < OUFS_USAGE_BLOCKS; ++k) {
+    BLOCK_REFERENCE usage_ref = master->usage_block[k];
+    if(usage_ref != 0)
+      snapshot->master.block_allocated_flag[usage_ref >> 3] &= ~(1 << (usage_ref & 0x7));
+  }
+
+  if(debug)
+    fprintf(stderr, "Snapshot %s in slot %d\n", name, slot);
+
+  snapshot_summarize(master, &table);
+  vdisk_lock_block(fs->disk, table_ref, VDISK_LOCK_EXCLUSIVE);
+  vdisk_write_block(fs->disk, table_ref, &table);
+  vdisk_unlock_block(fs->disk, table_ref);
+  oufs_write_master(fs, &mb);
+  ret = 0;
+
+ out:
+  vdisk_unlock_block(fs->disk, MASTER_BLOCK_REFERENCE);
+  pthread_mutex_unlock(&fs->allocator_lock);
+  if(vdisk_txn_end(fs->disk) != 0)
+    ret = -1;
+  pthread_rwlock_unlock(&fs->snapshot_lock);
+  return(ret);
+}
+
+/**
+ * Delete a snapshot.  The blocks that only it held become free
+ *
+ * @param fs The open file system
+ * @param name Name of the snapshot
+ * @return 0 on success; -1 if there is no such snapshot
+ */
+int oufs_snapshot_delete(OUFS *fs, char *name)
+{
+  if(fs->snapshot >= 0)
+    return(-1);
+  if(vdisk_txn_begin(fs->disk, 2) != 0)
+    return(-1);
+
+  BLOCK mb;
+  OUFS_MASTER *master = (OUFS_MASTER *) &mb;
+  OUFS_SNAPSHOT_BLOCK table;
+  int ret = -1;
+
+  pthread_mutex_lock(&fs->allocator_lock);
+  vdisk_lock_block(fs->disk, MASTER_BLOCK_REFERENCE, VDISK_LOCK_EXCLUSIVE);
+  vdisk_read_block(fs->disk, MASTER_BLOCK_REFERENCE, &mb);
+
+  BLOCK_REFERENCE table_ref = master->snapshot_block;
+  if(table_ref != 0) {
+    vdisk_lock_block(fs->disk, table_ref, VDISK_LOCK_EXCLUSIVE);
+    vdisk_read_block(fs->disk, table_ref, &table);
+
+    int slot = snapshot_find(&table, name);
+    if(slot >= 0) {
+      memset(&table.snapshot[slot], 0, sizeof(OUFS_SNAPSHOT));
+      snapshot_summarize(master, &table);
+      vdisk_write_block(fs->disk, table_ref, &table);
+      oufs_write_master(fs, &mb);
+      ret = 0;
+    }
+    vdisk_unlock_block(fs->disk, table_ref);
+  }
+
+  vdisk_unlock_block(fs->disk, MASTER_BLOCK_REFERENCE);
+  pthread_mutex_unlock(&fs->allocator_lock);
+  if(vdisk_txn_end(fs->disk) != 0)
+    ret = -1;
+  return(ret);
+}
+
+/**
+ * Read one slot of the snapshot table
+ *
+ * @param fs The open file system
+ * @param slot The slot
+ * @param snapshot Receives the slot (an empty one if there is no table)
+ * @return 0 on success; -1 on error
+ */
+int oufs_snapshot_read(OUFS *fs, int slot, OUFS_SNAPSHOT *snapshot)
+{
+  BLOCK mb;
+  OUFS_MASTER *master = (OUFS_MASTER *) &mb;
+  OUFS_SNAPSHOT_BLOCK table;
+
+  if(slot < 0 || slot >= OUFS_MAX_SNAPSHOTS)
+    return(-1);
+
+  BLOCK_REFERENCE table_ref = fs->snapshot_block;
+  if(table_ref == 0) {
+    vdisk_lock_block(fs->disk, MASTER_BLOCK_REFERENCE, VDISK_LOCK_SHARED);
+    vdisk_read_block(fs->disk, MASTER_BLOCK_REFERENCE, &mb);
+    vdisk_unlock_block(fs->disk, MASTER_BLOCK_REFERENCE);
+    table_ref = master->snapshot_block;
+  }
+  if(table_ref == 0) {
+    memset(snapshot, 0, sizeof(OUFS_SNAPSHOT));
+    return(0);
+  }
+
+  vdisk_lock_block(fs->disk, table_ref, VDISK_LOCK_SHARED);
+  int ret = vdisk_read_block(fs->disk, table_ref, &table);
+  vdisk_unlock_block(fs->disk, table_ref);
+  if(ret != 0)
+    return(-1);
+  *snapshot = table.snapshot[slot];
+  return(0);
+}
+
+/**
+ * List the snapshots: name, when it was taken, the blocks it holds and the
+ * blocks that deleting it would free
+ *
+ * @param fs The open file system
+ * @return 0 on success; -1 on error
+ */
+int oufs_snapshot_list(OUFS *fs)
+{
+  OUFS_SNAPSHOT snapshot[OUFS_MAX_SNAPSHOTS];
+  BLOCK mb;
+
+  vdisk_lock_block(fs->disk, MASTER_BLOCK_REFERENCE, VDISK_LOCK_SHARED);
+  vdisk_read_block(fs->disk, MASTER_BLOCK_REFERENCE, &mb);
+  vdisk_unlock_block(fs->disk, MASTER_BLOCK_REFERENCE);
+  int ret = 0;
+  for(int s = 0; s < OUFS_MAX_SNAPSHOTS && ret == 0; ++s)
+    ret = oufs_snapshot_read(fs, s, &snapshot[s]);
+  if(ret != 0)
+    return(-1);
+
+  for(int s = 0; s < OUFS_MAX_SNAPSHOTS; ++s) {
+    if(snapshot[s].name[0] == 0)
+      continue;
+
+    int held = 0;
+    int own = 0;
+    for(BLOCK_REFERENCE b = 0; b < N_BLOCKS_IN_DISK; ++b) {
+      if(!snapshot_test_bit(snapshot[s].master.block_allocated_flag, b))
+        continue;
+      ++held;
+      int shared = snapshot_test_bit(mb.master.block_allocated_flag, b);
+      for(int other = 0; other < OUFS_MAX_SNAPSHOTS; ++other) {
+        if(other != s && snapshot[other].name[0] != 0 &&
+           snapshot_test_bit(snapshot[other].master.block_allocated_flag, b))
+          shared = 1;
+      }
+      if(!shared)
+        ++own;
+    }
+
+    char when[32];
+    time_t created = snapshot[s].created;
+    strftime(when, sizeof(when), "%Y-%m-%d %H:%M:%S", localtime(&created));
+    printf("%-*s %s %4d blocks %4d own\n", (int) FILE_NAME_SIZE - 1, snapshot[s].name, when, held, own);
+  }
+  return(0);
+}
+
+/**
+ * Make a handle read the named snapshot instead of the live file system
+ *
+ * @param fs The open file system, not mounted on a snapshot yet
+ * @param name Name of the snapshot
+ * @return 0 on success; -1 if there is no such snapshot
+ */
+int oufs_snapshot_mount(OUFS *fs, char *name)
+{
+  OUFS_SNAPSHOT snapshot;
+
+  for(int s = 0; s < OUFS_MAX_SNAPSHOTS; ++s) {
+    if(oufs_snapshot_read(fs, s, &snapshot) != 0)
+      return(-1);
+    if(snapshot.name[0] != 0 && !strncmp(snapshot.name, name, FILE_NAME_SIZE)) {
+      BLOCK mb;
+      vdisk_lock_block(fs->disk, MASTER_BLOCK_REFERENCE, VDISK_LOCK_SHARED);
+      vdisk_read_block(fs->disk, MASTER_BLOCK_REFERENCE, &mb);
+      vdisk_unlock_block(fs->disk, MASTER_BLOCK_REFERENCE);
+
+      fs->snapshot = s;
+      strncpy(fs->snapshot_name, snapshot.name, FILE_NAME_SIZE);
+      fs->snapshot_block = ((OUFS_MASTER *) &mb)->snapshot_block;
+      return(0);
+    }
+  }
+  fprintf(stderr, "No snapshot named %s\n", name);
+  return(-1);
+}
+
+/**
+ * Where the mounted snapshot's copy of an inode block is.  The caller holds
+ * the live inode block, so that it cannot be copied out in the meantime
+ *
+ * @param fs The file system, mounted on a snapshot
+ * @param inode_block The live inode block (1 ... N_INODE_BLOCKS)
+ * @return The block to read; UNALLOCATED_BLOCK if the snapshot is gone
+ */
+BLOCK_REFERENCE oufs_snapshot_inode_block(OUFS *fs, BLOCK_REFERENCE inode_block)
+{
+  OUFS_SNAPSHOT snapshot;
+
+  if(oufs_snapshot_read(fs, fs->snapshot, &snapshot) != 0 ||
+     strncmp(snapshot.name, fs->snapshot_name, FILE_NAME_SIZE) != 0) {
+    fprintf(stderr, "Snapshot %s has been deleted\n", fs->snapshot_name);
+    return(UNALLOCATED_BLOCK);
+  }
+  return(snapshot.inode_block[inode_block - 1]);
+}
+
+/**
+ * Before a live inode block changes, give the snapshots that still share it
+ * a copy of it.  The caller holds the inode block exclusively
+ *
+ * @param fs The open file system
+ * @param inode_block The inode block (1 ... N_INODE_BLOCKS)
+ * @param contents What the block holds now
+ * @return 0 on success; -1 if the disk is too full for the copy
+ */
+int oufs_snapshot_preserve_inodes(OUFS *fs, BLOCK_REFERENCE inode_block, BLOCK *contents)
+{
+  BLOCK mb;
+  OUFS_MASTER *master = (OUFS_MASTER *) &mb;
+  int bit = 1 << (inode_block - 1);
+  int ret = 0;
+
+  pthread_mutex_lock(&fs->allocator_lock);
+  vdisk_lock_block(fs->disk, MASTER_BLOCK_REFERENCE, VDISK_LOCK_EXCLUSIVE);
+  vdisk_read_block(fs->disk, MASTER_BLOCK_REFERENCE, &mb);
+
+  if(master->inode_blocks_shared & bit) {
+    // The copy belongs to the snapshots only: it is pinned, not allocated
+    BLOCK_REFERENCE copy = oufs_take_open_block(&mb);
+    if(copy == UNALLOCATED_BLOCK) {
+      fprintf(stderr, "oufs: no room to keep inode block %d for the snapshots\n", inode_block);
+      ret = -1;
+    }else{
+      master->master.block_allocated_flag[copy >> 3] &= ~(1 << (copy & 0x7));
+      vdisk_stats_classify(fs->disk, copy, VDISK_CLASS_INODE);
+      vdisk_write_block(fs->disk, copy, contents);
+
+      OUFS_SNAPSHOT_BLOCK table;
+      vdisk_lock_block(fs->disk, master->snapshot_block, VDISK_LOCK_EXCLUSIVE);
+      vdisk_read_block(fs->disk, master->snapshot_block, &table);
+      for(int s = 0; s < OUFS_MAX_SNAPSHOTS; ++s) {
+        OUFS_SNAPSHOT *snapshot = &table.snapshot[s];
+        if(snapshot->name[0] != 0 && snapshot->inode_block[inode_block - 1] == inode_block) {
+          snapshot->inode_block[inode_block - 1] = copy;
+          snapshot->master.block_allocated_flag[copy >> 3] |= (1 << (copy & 0x7));
+        }
+      }
+      snapshot_summarize(master, &table);
+      vdisk_write_block(fs->disk, master->snapshot_block, &table);
+      vdisk_unlock_block(fs->disk, master->snapshot_block);
+      oufs_write_master(fs, &mb);
+
+      if(debug)
+        fprintf(stderr, "Inode block %d copied out to %d\n", inode_block, copy);
+    }
+  }
+
+  vdisk_unlock_block(fs->disk, MASTER_BLOCK_REFERENCE);
+  pthread_mutex_unlock(&fs->allocator_lock);
+  return(ret);
+}
+
+/**
+ * Before a directory or cluster map block is rewritten, make sure that it is
+ * not one a snapshot holds: if it is, the live file system moves to a new
+ * block and leaves the old one to the snapshots.  The caller writes the
+ * whole block to *block_ref and then stores the reference
+ *
+ * @param fs The open file system
+ * @param block_ref The block (updated)
+ * @return 0 on success; -1 if the disk is full
+ */
+int oufs_cow_block(OUFS *fs, BLOCK_REFERENCE *block_ref)
+{
+  BLOCK mb;
+  OUFS_MASTER *master = (OUFS_MASTER *) &mb;
+  BLOCK_REFERENCE old = *block_ref;
+  int ret = 0;
+
+  pthread_mutex_lock(&fs->allocator_lock);
+  vdisk_lock_block(fs->disk, MASTER_BLOCK_REFERENCE, VDISK_LOCK_EXCLUSIVE);
+  vdisk_read_block(fs->disk, MASTER_BLOCK_REFERENCE, &mb);
+
+  if(oufs_block_pinned(master, old)) {
+    BLOCK_REFERENCE new_ref = oufs_take_open_block_near(&mb, old);
+    if(new_ref == UNALLOCATED_BLOCK) {
+      ret = -1;
+    }else{
+      if(master->block_shares[old] > 0)
+        master->block_shares[old]--;
+      else
+        master->master.block_allocated_flag[old >> 3] &= ~(1 << (old & 0x7));
+      oufs_write_master(fs, &mb);
+      *block_ref = new_ref;
+      vdisk_stats_classify(fs->disk, new_ref, fs->disk->block_class[old]);
+
+      if(debug)
+        fprintf(stderr, "Block %d copied on write to %d\n", old, new_ref);
+    }
+  }
+
+  vdisk_unlock_block(fs->disk, MASTER_BLOCK_REFERENCE);
+  pthread_mutex_unlock(&fs->allocator_lock);
+  return(ret);
+}
@@ -0,0 +1,160 @@
+#include <string.h>
+#include <time.h>
+#include "oufs_lib.h"
+/*
+ * Operation traces.
+ *
+ * When the ZTRACE environment variable names a file, every mkdir, rmdir,
+ * list, fopen, fclose, read, write and remove made through a handle is
+ * appended to it once it is done: when it started, the absolute path or the
+ * file, the offset and size of reads and writes, and what it returned.  File
+ * contents are not kept.  Each record goes out in one append, so several
+ * processes (and threads) can share one trace.  zreplay plays a trace back.
+ */
+
+#define debug 0
+
+const char *oufs_trace_op_names[OUFS_N_TRACE_OPS] = {
+  "", "mkdir", "rmdir", "list", "fopen", "fclose", "read", "write", "remove"
+};
+
+/**
+ * Start tracing the handle if ZTRACE names a trace
+ *
+ * @param fs The file system being opened
+ */
+void oufs_trace_open(OUFS *fs)
+{
+  char *trace_name = getenv("ZTRACE");
+
+  fs->trace_fd = -1;
+  if(trace_name != NULL && trace_name[0] != 0) {
+    fs->trace_fd = open(trace_name, O_WRONLY | O_CREAT | O_APPEND, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if(fs->trace_fd < 0)
+      fprintf(stderr, "Unable to open the trace (%s)\n", trace_name);
+  }
+}
+
+/**
+ * Stop tracing
+ *
+ * @param fs The file system being closed
+ */
+void oufs_trace_close(OUFS *fs)
+{
+  if(fs->trace_fd >= 0)
+    close(fs->trace_fd);
+  fs->trace_fd = -1;
+}
+
+/**
+ * Time at which an operation starts
+ *
+ * @param fs The open file system
+ * @return Microseconds since the epoch; 0 if the handle is not traced
+ */
+unsigned long oufs_trace_start(OUFS *fs)
+{
+  if(fs->trace_fd < 0)
+    return(0);
+
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  return(ts.tv_sec * 1000000UL + ts.tv_nsec / 1000);
+}
+
+/**
+ * Append a record and its path to the trace
+ */
+static void oufs_trace_append(OUFS *fs, OUFS_TRACE_RECORD *record, char *path)
+{
+  unsigned char buffer[sizeof(OUFS_TRACE_RECORD) + MAX_PATH_LENGTH];
+
+  memcpy(buffer, record, sizeof(OUFS_TRACE_RECORD));
+  memcpy(buffer + sizeof(OUFS_TRACE_RECORD), path, record->path_length);
+  if(write(fs->trace_fd, buffer, sizeof(OUFS_TRACE_RECORD) + record->path_length) < 0 && debug)
+    fprintf(stderr, "Trace write failed\n");
+}
+
+/**
+ * Trace an operation on a path
+ *
+ * @param fs The open file system
+ * @param start What oufs_trace_start() returned
+ * @param op OUFS_TRACE_*
+ * @param cwd Current working directory
+ * @param path The path, as given
+ * @param mode fopen mode; NULL for other operations
+ * @param inode The file opened; UNALLOCATED_INODE for other operations
+ * @param result What the operation returned
+ */
+void oufs_trace_path(OUFS *fs, unsigned long start, int op, char *cwd, char *path, char *mode,
+                     INODE_REFERENCE inode, int result)
+{
+  if(fs->trace_fd < 0)
+    return;
+
+  char absolute[MAX_PATH_LENGTH * 2];
+  memset(absolute, 0, sizeof(absolute));
+  oufs_relative_path(cwd, path, absolute);
+
+  OUFS_TRACE_RECORD record;
+  memset(&record, 0, sizeof(record));
+  record.usec = start;
+  record.result = result;
+  record.inode = inode;
+  record.path_length = strnlen(absolute, MAX_PATH_LENGTH - 1);
+  record.op = op;
+  if(mode != NULL)
+    memcpy(record.mode, mode, MIN(strlen(mode), sizeof(record.mode)));
+  oufs_trace_append(fs, &record, absolute);
+}
+
+/**
+ * Trace an operation on an open file
+ *
+ * @param fs The open file system
+ * @param start What oufs_trace_start() returned
+ * @param op OUFS_TRACE_*
+ * @param fp The file
+ * @param offset Where in the file it started
+ * @param length Bytes asked for
+ * @param result What the operation returned
+ */
+void oufs_trace_io(OUFS *fs, unsigned long start, int op, OUFILE *fp, int offset, int length, int result)
+{
+  if(fs->trace_fd < 0)
+    return;
+
+  OUFS_TRACE_RECORD record;
+  memset(&record, 0, sizeof(record));
+  record.usec = start;
+  record.result = result;
+  record.offset = offset;
+  record.length = length;
+  record.inode = fp->inode_reference;
+  record.op = op;
+  oufs_trace_append(fs, &record, "");
+}
+
+/**
+ * Read the next record of a trace
+ *
+ * @param trace The trace, open for reading
+ * @param record Receives the record
+ * @param path Receives the path (MAX_PATH_LENGTH bytes; terminated)
+ * @return 1 if a record was read; 0 at the end of the trace; -1 if the trace
+ *         is damaged
+ */
+int oufs_trace_next(FILE *trace, OUFS_TRACE_RECORD *record, char *path)
+{
+  size_t n = fread(record, 1, sizeof(OUFS_TRACE_RECORD), trace);
+  if(n == 0)
+    return(0);
+  if(n != sizeof(OUFS_TRACE_RECORD) || record->op == 0 || record->op >= OUFS_N_TRACE_OPS ||
+     record->path_length >= MAX_PATH_LENGTH ||
+     fread(path, 1, record->path_length, trace) != record->path_length)
+    return(-1);
+  path[record->path_length] = 0;
+  return(1);
+}
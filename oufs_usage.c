@@ -0,0 +1,527 @@
+#include <string.h>
+#include "oufs_lib.h"
+/*
+ * Subtree usage aggregates.
+ *
+ * On an image with a usage table (OUFS_MASTER.usage_block), every inode has
+ * a record of the bytes, blocks and directory entries that it accounts for:
+ * a file its own, a directory the sum over its whole subtree.  The record
+ * also names the directory that the inode is charged to: for a file with
+ * several names (oufs_link()), the lowest numbered directory that names it.
+ * Each operation
+ * that changes the tree or a file's size works out the change and adds it to
+ * the records on the way up to the root, so how much a directory uses is
+ * read from one record.
+ *
+ * The table is changed only while the usage lock and the block locks of its
+ * blocks are held, inside of the caller's transaction.  Nothing else is
+ * locked from here on, so any other lock may be held by the caller.
+ */
+
+#define debug 0
+
+// An inode's record in a loaded copy of the table
+#define USAGE_RECORD(table, i) (&(table)[(i) / OUFS_USAGE_PER_BLOCK].usage[(i) % OUFS_USAGE_PER_BLOCK])
+
+/**
+ * Where is the usage table?  Snapshot mounts have none: the table is not
+ * part of what a snapshot keeps
+ *
+ * @param fs The open file system
+ * @param refs The blocks of the table (filled in)
+ * @return 1 if the image has a table; 0 if not
+ */
+static int usage_find_table(OUFS *fs, BLOCK_REFERENCE refs[OUFS_USAGE_BLOCKS])
+{
+  BLOCK mb;
+  OUFS_MASTER *master = (OUFS_MASTER *) &mb;
+
+  if(fs->snapshot >= 0)
+    return(0);
+
+  vdisk_lock_block(fs->disk, MASTER_BLOCK_REFERENCE, VDISK_LOCK_SHARED);
+  vdisk_read_block(fs->disk, MASTER_BLOCK_REFERENCE, &mb);
+  vdisk_unlock_block(fs->disk, MASTER_BLOCK_REFERENCE);
+
+  for(int k = 0; k < OUFS_USAGE_BLOCKS; ++k)
+    refs[k] = master->usage_block[k];
+  return(refs[0] != 0);
+}
+
+/**
+ * Lock and load the usage table
+ *
+ * @return 1 if it was loaded (and is locked); 0 if the image has none
+ */
+static int usage_load(OUFS *fs, BLOCK_REFERENCE refs[OUFS_USAGE_BLOCKS], OUFS_USAGE_BLOCK table[OUFS_USAGE_BLOCKS])
+{
+  if(!usage_find_table(fs, refs))
+    return(0);
+
+  pthread_mutex_lock(&fs->usage_lock);
+  for(int k = 0; k < OUFS_USAGE_BLOCKS; ++k) {
+    vdisk_lock_block(fs->disk, refs[k], VDISK_LOCK_EXCLUSIVE);
+    vdisk_read_block(fs->disk, refs[k], &table[k]);
+  }
+  return(1);
+}
+
+/**
+ * Write back the usage table and unlock it
+ */
+static void usage_store(OUFS *fs, BLOCK_REFERENCE refs[OUFS_USAGE_BLOCKS], OUFS_USAGE_BLOCK table[OUFS_USAGE_BLOCKS],
+                        int dirty[OUFS_USAGE_BLOCKS])
+{
+  for(int k = OUFS_USAGE_BLOCKS - 1; k >= 0; --k) {
+    if(dirty[k])
+      vdisk_write_block(fs->disk, refs[k], &table[k]);
+    vdisk_unlock_block(fs->disk, refs[k]);
+  }
+  pthread_mutex_unlock(&fs->usage_lock);
+}
+
+/**
+ * Add a change to a directory's record and to those of the directories
+ * above it
+ *
+ * @param table The loaded table
+ * @param dirty Which of its blocks changed (updated)
+ * @param dir The directory
+ */
+static void usage_propagate(OUFS_USAGE_BLOCK table[OUFS_USAGE_BLOCKS], int dirty[OUFS_USAGE_BLOCKS],
+                            INODE_REFERENCE dir, int bytes, int blocks, int entries)
+{
+  // A damaged table could loop: no chain is longer than there are inodes
+  for(int depth = 0; dir < N_INODES && depth < N_INODES; ++depth) {
+    OUFS_USAGE *record = USAGE_RECORD(table, dir);
+    record->bytes += bytes;
+    record->blocks += blocks;
+    record->entries += entries;
+    dirty[dir / OUFS_USAGE_PER_BLOCK] = 1;
+    if(record->parent == OUFS_USAGE_NO_PARENT)
+      break;
+    dir = record->parent;
+  }
+}
+
+/**
+ * Find the directory that each inode is charged to: the lowest numbered
+ * directory that names it.  Nothing is locked: the callers either hold a
+ * transaction over a tree that cannot change, or only move a charge, which a
+ * recount puts right if it went wrong
+ *
+ * @param fs The open file system
+ * @param owner The directory for every inode (filled in); UNALLOCATED_INODE
+ *              for the root and for inodes without a name
+ */
+static void usage_owners(OUFS *fs, INODE_REFERENCE owner[N_INODES])
+{
+  for(INODE_REFERENCE i = 0; i < N_INODES; ++i)
+    owner[i] = UNALLOCATED_INODE;
+
+  for(INODE_REFERENCE d = 0; d < N_INODES; ++d) {
+    INODE inode;
+    BLOCK block;
+    if(oufs_read_inode_by_reference(fs, d, &inode) != 0 || inode.type != IT_DIRECTORY ||
+       vdisk_read_block(fs->disk, inode.data[0], &block) != 0)
+      continue;
+    for(int e = 0; e < DIRECTORY_ENTRIES_PER_BLOCK; ++e) {
+      DIRECTORY_ENTRY *entry = &block.directory.entry[e];
+      if(entry->inode_reference < N_INODES && owner[entry->inode_reference] == UNALLOCATED_INODE &&
+         strcmp(entry->name, ".") && strcmp(entry->name, ".."))
+        owner[entry->inode_reference] = d;
+    }
+  }
+}
+
+/**
+ * Move an inode's charge to another directory
+ */
+static void usage_recharge(OUFS_USAGE_BLOCK table[OUFS_USAGE_BLOCKS], int dirty[OUFS_USAGE_BLOCKS],
+                           INODE_REFERENCE i, INODE_REFERENCE parent)
+{
+  OUFS_USAGE *record = USAGE_RECORD(table, i);
+
+  if(debug)
+    fprintf(stderr, "Usage: inode %d moves from %d to %d\n", i, record->parent, parent);
+  if(record->parent != OUFS_USAGE_NO_PARENT)
+    usage_propagate(table, dirty, record->parent, -(int) record->bytes, -(int) record->blocks,
+                    -(int) record->entries);
+  record->parent = parent;
+  dirty[i / OUFS_USAGE_PER_BLOCK] = 1;
+  usage_propagate(table, dirty, parent, record->bytes, record->blocks, record->entries);
+}
+
+/**
+ * Count the blocks that an inode refers to
+ *
+ * @param fs The open file system
+ * @param inode The inode
+ * @return Number of blocks: the directory block, the file's data blocks, or
+ *         a compressed file's cluster map and cluster blocks
+ */
+int oufs_inode_blocks(OUFS *fs, INODE *inode)
+{
+  int blocks = 0;
+
+  if(inode->type == IT_DIRECTORY) {
+    blocks = 1;
+  }else if(inode->type == IT_FILE) {
+    for(int k = 0; k < BLOCKS_PER_INODE; ++k)
+      if(inode->data[k] != UNALLOCATED_BLOCK)
+        ++blocks;
+  }else if(inode->type == IT_COMPRESSED_FILE && inode->data[0] != UNALLOCATED_BLOCK) {
+    OUFS_CLUSTER_MAP map;
+    blocks = 1;
+    if(vdisk_read_block(fs->disk, inode->data[0], &map) == 0) {
+      for(int c = 0; c < OUFS_CLUSTERS_PER_MAP; ++c)
+        for(int k = 0; k < OUFS_CLUSTER_BLOCKS; ++k)
+          if(map.cluster[c].block[k] != UNALLOCATED_BLOCK)
+            ++blocks;
+    }
+  }
+  return(blocks);
+}
+
+/**
+ * Account for a new directory entry and the inode it names
+ *
+ * @param fs The open file system
+ * @param i The new inode
+ * @param parent The directory holding the entry
+ * @param inode The new inode's contents
+ * @return 0 on success (or if the image keeps no usage); -1 on error
+ */
+int oufs_usage_create(OUFS *fs, INODE_REFERENCE i, INODE_REFERENCE parent, INODE *inode)
+{
+  BLOCK_REFERENCE refs[OUFS_USAGE_BLOCKS];
+  OUFS_USAGE_BLOCK table[OUFS_USAGE_BLOCKS];
+  int dirty[OUFS_USAGE_BLOCKS] = { 0 };
+
+  if(!usage_load(fs, refs, table))
+    return(0);
+
+  OUFS_USAGE *record = USAGE_RECORD(table, i);
+  record->bytes = (inode->type == IT_DIRECTORY) ? 0 : inode->size;
+  record->blocks = oufs_inode_blocks(fs, inode);
+  record->entries = 0;
+  record->parent = parent;
+  dirty[i / OUFS_USAGE_PER_BLOCK] = 1;
+  usage_propagate(table, dirty, parent, record->bytes, record->blocks, 1);
+
+  usage_store(fs, refs, table, dirty);
+  return(0);
+}
+
+/**
+ * Account for a change to a file's size or blocks
+ *
+ * @param fs The open file system
+ * @param i The file
+ * @param inode Its contents, as just written
+ * @return 0 on success (or if the image keeps no usage); -1 on error
+ */
+int oufs_usage_update(OUFS *fs, INODE_REFERENCE i, INODE *inode)
+{
+  BLOCK_REFERENCE refs[OUFS_USAGE_BLOCKS];
+  OUFS_USAGE_BLOCK table[OUFS_USAGE_BLOCKS];
+  int dirty[OUFS_USAGE_BLOCKS] = { 0 };
+
+  // Counting a compressed file's blocks reads its map: do it before locking
+  int blocks = oufs_inode_blocks(fs, inode);
+  if(!usage_load(fs, refs, table))
+    return(0);
+
+  OUFS_USAGE *record = USAGE_RECORD(table, i);
+  int d_bytes = (int) inode->size - (int) record->bytes;
+  int d_blocks = blocks - record->blocks;
+  if(d_bytes != 0 || d_blocks != 0) {
+    if(debug)
+      fprintf(stderr, "Usage: inode %d changes by %d bytes, %d blocks\n", i, d_bytes, d_blocks);
+    record->bytes = inode->size;
+    record->blocks = blocks;
+    dirty[i / OUFS_USAGE_PER_BLOCK] = 1;
+    if(record->parent != OUFS_USAGE_NO_PARENT)
+      usage_propagate(table, dirty, record->parent, d_bytes, d_blocks, 0);
+  }
+
+  usage_store(fs, refs, table, dirty);
+  return(0);
+}
+
+/**
+ * Account for a new name of a file.  The name counts as an entry of the
+ * directory; the file moves there only if it is the lowest numbered
+ * directory that names it
+ *
+ * @param fs The open file system
+ * @param i The file
+ * @param parent The directory holding the new name
+ * @return 0 on success (or if the image keeps no usage); -1 on error
+ */
+int oufs_usage_link(OUFS *fs, INODE_REFERENCE i, INODE_REFERENCE parent)
+{
+  BLOCK_REFERENCE refs[OUFS_USAGE_BLOCKS];
+  OUFS_USAGE_BLOCK table[OUFS_USAGE_BLOCKS];
+  int dirty[OUFS_USAGE_BLOCKS] = { 0 };
+
+  if(!usage_load(fs, refs, table))
+    return(0);
+
+  usage_propagate(table, dirty, parent, 0, 0, 1);
+  if(parent < USAGE_RECORD(table, i)->parent)
+    usage_recharge(table, dirty, i, parent);
+
+  usage_store(fs, refs, table, dirty);
+  return(0);
+}
+
+/**
+ * Account for a directory entry going away, and with the last name of an
+ * inode (an empty directory or a file), the inode too.  A file that keeps
+ * other names moves to the directory that is charged with it next
+ *
+ * @param fs The open file system
+ * @param i The inode
+ * @param parent The directory that held the entry
+ * @param last Set if it was the inode's last name
+ * @return 0 on success (or if the image keeps no usage); -1 on error
+ */
+int oufs_usage_delete(OUFS *fs, INODE_REFERENCE i, INODE_REFERENCE parent, int last)
+{
+  BLOCK_REFERENCE refs[OUFS_USAGE_BLOCKS];
+  OUFS_USAGE_BLOCK table[OUFS_USAGE_BLOCKS];
+  int dirty[OUFS_USAGE_BLOCKS] = { 0 };
+
+  // The names left (the caller has removed this one) are found before the
+  // table is locked
+  INODE_REFERENCE owner[N_INODES];
+  if(!last && usage_find_table(fs, refs))
+    usage_owners(fs, owner);
+
+  if(!usage_load(fs, refs, table))
+    return(0);
+
+  // The name is counted where it was; the inode where it is charged
+  usage_propagate(table, dirty, parent, 0, 0, -1);
+  if(!last) {
+    if(USAGE_RECORD(table, i)->parent == parent && owner[i] < N_INODES && owner[i] != parent)
+      usage_recharge(table, dirty, i, owner[i]);
+  }else{
+    OUFS_USAGE *record = USAGE_RECORD(table, i);
+    if(record->parent != OUFS_USAGE_NO_PARENT)
+      usage_propagate(table, dirty, record->parent, -(int) record->bytes, -(int) record->blocks,
+                      -(int) record->entries);
+    memset(record, 0, sizeof(OUFS_USAGE));
+    dirty[i / OUFS_USAGE_PER_BLOCK] = 1;
+  }
+
+  usage_store(fs, refs, table, dirty);
+  return(0);
+}
+
+/**
+ * Count the usage of a subtree by walking it
+ *
+ * @param fs The open file system
+ * @param i Top of the subtree
+ * @param parent The directory that i is charged to
+ * @param counted Records of everything below (filled in; may be NULL)
+ * @param owner The directory that each inode is charged to: an inode is
+ *              only counted there (below the top)
+ * @param charged Inodes already counted (updated)
+ * @param depth Levels above
+ * @param usage Usage of the subtree (filled in)
+ */
+static void usage_walk(OUFS *fs, INODE_REFERENCE i, INODE_REFERENCE parent, OUFS_USAGE *counted,
+                       INODE_REFERENCE *owner, unsigned char *charged, int depth, OUFS_USAGE *usage)
+{
+  INODE inode;
+  BLOCK block;
+
+  memset(usage, 0, sizeof(OUFS_USAGE));
+  usage->parent = parent;
+  if(i >= N_INODES || depth > N_INODES || charged[i] || (depth > 0 && owner[i] != parent))
+    return;
+  charged[i] = 1;
+
+  pthread_rwlock_rdlock(&fs->inode_lock[i]);
+  oufs_read_inode_by_reference(fs, i, &inode);
+  int is_directory = (inode.type == IT_DIRECTORY);
+  if(is_directory) {
+    vdisk_lock_block(fs->disk, inode.data[0], VDISK_LOCK_SHARED);
+    vdisk_read_block(fs->disk, inode.data[0], &block);
+    vdisk_unlock_block(fs->disk, inode.data[0]);
+  }else{
+    usage->bytes = inode.size;
+  }
+  usage->blocks = oufs_inode_blocks(fs, &inode);
+  pthread_rwlock_unlock(&fs->inode_lock[i]);
+
+  if(is_directory) {
+    for(int e = 0; e < DIRECTORY_ENTRIES_PER_BLOCK; ++e) {
+      DIRECTORY_ENTRY *entry = &block.directory.entry[e];
+      if(entry->inode_reference == UNALLOCATED_INODE || !strcmp(entry->name, ".") ||
+         !strcmp(entry->name, ".."))
+        continue;
+
+      OUFS_USAGE below;
+      usage_walk(fs, entry->inode_reference, i, counted, owner, charged, depth + 1, &below);
+      usage->bytes += below.bytes;
+      usage->blocks += below.blocks;
+      usage->entries += below.entries + 1;
+    }
+  }
+
+  if(counted != NULL)
+    counted[i] = *usage;
+}
+
+/**
+ * How much a file or directory uses.  The aggregate is read when the image
+ * keeps one; otherwise the subtree is walked
+ *
+ * @param fs The open file system
+ * @param cwd Current working directory
+ * @param path The file or directory
+ * @param usage Its usage (filled in)
+ * @return 1 if it came from the aggregate; 0 if from a walk; -1 if there is
+ *         no such file
+ */
+int oufs_du(OUFS *fs, char *cwd, char *path, OUFS_USAGE *usage)
+{
+  INODE_REFERENCE parent;
+  INODE_REFERENCE child;
+  BLOCK_REFERENCE refs[OUFS_USAGE_BLOCKS];
+
+  if(!oufs_find_file(fs, cwd, path, &parent, &child, NULL))
+    return(-1);
+
+  if(usage_find_table(fs, refs)) {
+    OUFS_USAGE_BLOCK table;
+    int k = child / OUFS_USAGE_PER_BLOCK;
+    pthread_mutex_lock(&fs->usage_lock);
+    vdisk_lock_block(fs->disk, refs[k], VDISK_LOCK_SHARED);
+    vdisk_read_block(fs->disk, refs[k], &table);
+    vdisk_unlock_block(fs->disk, refs[k]);
+    pthread_mutex_unlock(&fs->usage_lock);
+    *usage = table.usage[child % OUFS_USAGE_PER_BLOCK];
+    return(1);
+  }
+
+  INODE_REFERENCE owner[N_INODES];
+  unsigned char charged[N_INODES] = { 0 };
+  usage_owners(fs, owner);
+  usage_walk(fs, child, parent, NULL, owner, charged, 0, usage);
+  return(0);
+}
+
+/**
+ * Recount the usage of the whole file system by walking it, and compare it
+ * with the aggregates.  With repair, the counts are written as the new
+ * aggregates; an image without a table gets one
+ *
+ * @param fs The open file system
+ * @param repair Write the counts back
+ * @return Number of records that differ; -1 on error
+ */
+int oufs_usage_verify(OUFS *fs, int repair)
+{
+  if(fs->snapshot >= 0)
+    return(-1);
+
+  // Nothing may change while the tree is walked
+  pthread_rwlock_wrlock(&fs->snapshot_lock);
+  if(vdisk_txn_begin(fs->disk, OUFS_USAGE_BLOCKS + 1) != 0) {
+    pthread_rwlock_unlock(&fs->snapshot_lock);
+    return(-1);
+  }
+
+  OUFS_USAGE counted[N_INODES];
+  INODE_REFERENCE owner[N_INODES];
+  unsigned char charged[N_INODES] = { 0 };
+  OUFS_USAGE top;
+  memset(counted, 0, sizeof(counted));
+  usage_owners(fs, owner);
+  usage_walk(fs, 0, OUFS_USAGE_NO_PARENT, counted, owner, charged, 0, &top);
+
+  BLOCK_REFERENCE refs[OUFS_USAGE_BLOCKS];
+  OUFS_USAGE_BLOCK table[OUFS_USAGE_BLOCKS];
+  int dirty[OUFS_USAGE_BLOCKS] = { 0 };
+  int differences = 0;
+
+  if(usage_load(fs, refs, table)) {
+    for(INODE_REFERENCE i = 0; i < N_INODES; ++i) {
+      OUFS_USAGE *record = USAGE_RECORD(table, i);
+      if(memcmp(record, &counted[i], sizeof(OUFS_USAGE)) == 0)
+        continue;
+      ++differences;
+      printf("Inode %d: recorded %u bytes, %u blocks, %u entries; counted %u bytes, %u blocks, %u entries\n",
+             i, record->bytes, record->blocks, record->entries,
+             counted[i].bytes, counted[i].blocks, counted[i].entries);
+      if(repair) {
+        *record = counted[i];
+        dirty[i / OUFS_USAGE_PER_BLOCK] = 1;
+      }
+    }
+    usage_store(fs, refs, table, dirty);
+  }else if(repair) {
+    // Start keeping usage: the table goes in new blocks
+    BLOCK mb;
+    OUFS_MASTER *master = (OUFS_MASTER *) &mb;
+    pthread_mutex_lock(&fs->allocator_lock);
+    vdisk_lock_block(fs->disk, MASTER_BLOCK_REFERENCE, VDISK_LOCK_EXCLUSIVE);
+    vdisk_read_block(fs->disk, MASTER_BLOCK_REFERENCE, &mb);
+    for(int k = 0; k < OUFS_USAGE_BLOCKS && differences >= 0; ++k) {
+      refs[k] = oufs_take_open_block(&mb);
+      if(refs[k] == UNALLOCATED_BLOCK)
+        differences = -1;
+    }
+    if(differences == 0) {
+      for(int k = 0; k < OUFS_USAGE_BLOCKS; ++k) {
+        memset(&table[k], 0, sizeof(OUFS_USAGE_BLOCK));
+        for(int j = 0; j < OUFS_USAGE_PER_BLOCK && k * OUFS_USAGE_PER_BLOCK + j < N_INODES; ++j)
+          table[k].usage[j] = counted[k * OUFS_USAGE_PER_BLOCK + j];
+        vdisk_stats_classify(fs->disk, refs[k], VDISK_CLASS_MASTER);
+        vdisk_write_block(fs->disk, refs[k], &table[k]);
+        master->usage_block[k] = refs[k];
+      }
+      master->features |= OUFS_FEATURE_USAGE;
+      oufs_write_master(fs, &mb);
+    }
+    vdisk_unlock_block(fs->disk, MASTER_BLOCK_REFERENCE);
+    pthread_mutex_unlock(&fs->allocator_lock);
+  }
+
+  if(vdisk_txn_end(fs->disk) != 0)
+    differences = -1;
+  pthread_rwlock_unlock(&fs->snapshot_lock);
+  return(differences);
+}
+
+/**
+ * Set up the usage table of a newly formatted image: only the root
+ * directory and its block are in use.  The caller writes the master block
+ *
+ * @param fs The open file system
+ * @param master The master block (updated)
+ * @return 0 on success; -1 if the disk is full
+ */
+int oufs_usage_format(OUFS *fs, BLOCK *master)
+{
+  OUFS_MASTER *ext = (OUFS_MASTER *) master;
+  OUFS_USAGE_BLOCK table;
+
+  for(int k = 0; k < OUFS_USAGE_BLOCKS; ++k) {
+    ext->usage_block[k] = oufs_take_open_block(master);
+    if(ext->usage_block[k] == UNALLOCATED_BLOCK)
+      return(-1);
+    memset(&table, 0, sizeof(table));
+    if(k == 0) {
+      table.usage[0].blocks = 1;
+      table.usage[0].parent = OUFS_USAGE_NO_PARENT;
+    }
+    vdisk_write_block(fs->disk, ext->usage_block[k], &table);
+  }
+  return(0);
+}
@@ -0,0 +1,625 @@
+#include <fnmatch.h>
+#include <stdlib.h>
+#include <string.h>
+#include "oufs_lib.h"
+/*
+ * Tree walks.
+ *
+ * oufs_walk_open() and oufs_walk_next() hand out what is below a path
+ * breadth first, one level at a time.  The directory blocks of a whole level
+ * are read together, in runs of consecutive blocks, and then so are the inode
+ * blocks of everything that they name: a block is read once per level, not
+ * once per entry, and no path is resolved from the root again.
+ *
+ * The filter is applied inside of the walk.  The name is matched against the
+ * directory entry before its inode is looked at, then the type and the size
+ * against the inode in the block that was read; what does not match is never
+ * copied out.  Entries do not record a type, so the inode of every entry is
+ * still seen (a directory is followed whatever its name), but below the
+ * depth limit nothing at all is read.
+ *
+ * oufs_walk_parallel() walks with a pool of threads instead.  Each thread
+ * keeps the directories that it finds on a deque of its own and reads the
+ * newest; a thread with nothing left steals the oldest directory of another.
+ * Each directory is followed once, however many names it has.
+ *
+ * oufs_stat_many() reads the attributes of many inodes the same way: each
+ * inode block that holds one of them is read once.
+ */
+
+#define debug 0
+
+// A directory waiting to be read
+typedef struct walk_dir_s
+{
+  INODE_REFERENCE inode_reference;
+  BLOCK_REFERENCE block;
+  int depth;
+  char path[MAX_PATH_LENGTH];
+} WALK_DIR;
+
+struct oufs_walk_s
+{
+  OUFS *fs;
+  OUFS_WALK_FILTER filter;
+
+  // The level being handed out is in ready; the directories that it has are
+  //  in dir[next], to be read once ready is used up
+  WALK_DIR dir[2][N_INODES];
+  int n_dir[2];
+  int next;
+  OUFS_WALK_ENTRY ready[N_INODES * DIRECTORY_ENTRIES_PER_BLOCK];
+  int n_ready;
+  int next_ready;
+
+  unsigned char visited[N_INODES];
+  BLOCK cache[N_BLOCKS_IN_DISK];
+};
+
+// One thread's directories: the owner works at the tail, thieves take from
+//  the head.  Each directory is queued once, so the deque never wraps
+typedef struct walk_deque_s
+{
+  pthread_mutex_t lock;
+  WALK_DIR dir[N_INODES];
+  int head;
+  int tail;
+} WALK_DEQUE;
+
+typedef struct walk_pool_s
+{
+  OUFS *fs;
+  OUFS_WALK_FILTER *filter;
+  OUFS_WALK_CALLBACK callback;
+  void *arg;
+  int threads;
+  WALK_DEQUE deque[OUFS_WALK_MAX_THREADS];
+  unsigned char visited[N_INODES];
+
+  // Directories queued, and queued or being read; the walk is over when
+  //  nothing is pending
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  int queued;
+  int pending;
+  int found;
+  int error;
+} WALK_POOL;
+
+typedef struct walk_worker_s
+{
+  WALK_POOL *pool;
+  int id;
+} WALK_WORKER;
+
+/**
+ * Claim a directory for the walk
+ *
+ * @return 1 if it had not been claimed yet; 0 if it had
+ */
+static int walk_claim(unsigned char *visited, INODE_REFERENCE i)
+{
+  return(i < N_INODES && __atomic_exchange_n(&visited[i], 1, __ATOMIC_RELAXED) == 0);
+}
+
+/**
+ * Read the needed blocks into the cache, each run of consecutive ones in
+ * one transfer
+ *
+ * @param fs The open file system
+ * @param need Which blocks are needed
+ * @param cache Indexed by block
+ * @return 0 on success; -1 on error
+ */
+static int walk_load(OUFS *fs, unsigned char *need, BLOCK *cache)
+{
+  for(BLOCK_REFERENCE first = 0; first < N_BLOCKS_IN_DISK; ++first) {
+    if(!need[first])
+      continue;
+
+    // A snapshot has its own copies of inode blocks: they are read one at a
+    // time, from wherever they are
+    int is_inode = (first >= 1 && first <= N_INODE_BLOCKS);
+    if(is_inode && fs->snapshot >= 0) {
+      pthread_mutex_lock(&fs->inode_block_lock[first - 1]);
+      vdisk_lock_block(fs->disk, first, VDISK_LOCK_SHARED);
+      BLOCK_REFERENCE source = oufs_snapshot_inode_block(fs, first);
+      int ret = (source != UNALLOCATED_BLOCK) ? vdisk_read_block(fs->disk, source, &cache[first]) : -1;
+      vdisk_unlock_block(fs->disk, first);
+      pthread_mutex_unlock(&fs->inode_block_lock[first - 1]);
+      if(ret != 0)
+        return(-1);
+      continue;
+    }
+
+    int n = 1;
+    while(first + n < N_BLOCKS_IN_DISK && need[first + n])
+      ++n;
+
+    // Locked as oufs_read_inode_by_reference() and oufs_find_file() lock
+    // the blocks, in order
+    for(BLOCK_REFERENCE b = first; b < first + n; ++b) {
+      if(b >= 1 && b <= N_INODE_BLOCKS)
+        pthread_mutex_lock(&fs->inode_block_lock[b - 1]);
+      vdisk_lock_block(fs->disk, b, VDISK_LOCK_SHARED);
+    }
+    int ret = vdisk_read_blocks(fs->disk, first, n, &cache[first]);
+    for(BLOCK_REFERENCE b = first + n; b-- > first; ) {
+      vdisk_unlock_block(fs->disk, b);
+      if(b >= 1 && b <= N_INODE_BLOCKS)
+        pthread_mutex_unlock(&fs->inode_block_lock[b - 1]);
+    }
+    if(ret != 0)
+      return(-1);
+
+    if(debug)
+      fprintf(stderr, "walk: read blocks %d-%d\n", first, first + n - 1);
+    first += n - 1;
+  }
+  return(0);
+}
+
+/**
+ * Does an inode pass the type and size parts of a filter?
+ */
+static int walk_match(OUFS_WALK_FILTER *filter, INODE *inode)
+{
+  if(filter->type == IT_FILE && !OUFS_IS_FILE(inode->type))
+    return(0);
+  if(filter->type != 0 && filter->type != IT_FILE && filter->type != inode->type)
+    return(0);
+  if((filter->min_size >= 0 || filter->max_size >= 0) && !OUFS_IS_FILE(inode->type))
+    return(0);
+  if(filter->min_size >= 0 && inode->size < (unsigned int) filter->min_size)
+    return(0);
+  if(filter->max_size >= 0 && inode->size > (unsigned int) filter->max_size)
+    return(0);
+  return(1);
+}
+
+/**
+ * Read directories and everything that they name
+ *
+ * @param fs The open file system
+ * @param filter What to report
+ * @param dirs The directories
+ * @param n Number of directories
+ * @param cache Block cache, indexed by block
+ * @param visited Directories claimed by the walk (updated)
+ * @param found Entries that match (filled in; room for n *
+ *              DIRECTORY_ENTRIES_PER_BLOCK)
+ * @param n_found Number found (output)
+ * @param below Directories to read next (filled in; room for N_INODES)
+ * @param n_below Number of them (output)
+ * @return 0 on success; -1 on error
+ */
+static int walk_expand(OUFS *fs, OUFS_WALK_FILTER *filter, WALK_DIR *dirs, int n, BLOCK *cache,
+                       unsigned char *visited, OUFS_WALK_ENTRY *found, int *n_found,
+                       WALK_DIR *below, int *n_below)
+{
+  unsigned char need[N_BLOCKS_IN_DISK];
+
+  *n_found = 0;
+  *n_below = 0;
+
+  // The directory blocks
+  memset(need, 0, sizeof(need));
+  for(int k = 0; k < n; ++k)
+    need[dirs[k].block] = 1;
+  if(walk_load(fs, need, cache) != 0)
+    return(-1);
+
+  // The inode blocks of their entries
+  memset(need, 0, sizeof(need));
+  for(int k = 0; k < n; ++k) {
+    DIRECTORY_ENTRY *entry = cache[dirs[k].block].directory.entry;
+    for(int e = 0; e < DIRECTORY_ENTRIES_PER_BLOCK; ++e)
+      if(entry[e].inode_reference < N_INODES && strcmp(entry[e].name, ".") && strcmp(entry[e].name, ".."))
+        need[entry[e].inode_reference / INODES_PER_BLOCK + 1] = 1;
+  }
+  if(walk_load(fs, need, cache) != 0)
+    return(-1);
+
+  for(int k = 0; k < n; ++k) {
+    WALK_DIR *dir = &dirs[k];
+    DIRECTORY_ENTRY *entry = cache[dir->block].directory.entry;
+    int slash = (dir->path[0] != 0 && dir->path[strlen(dir->path) - 1] != '/');
+
+    for(int e = 0; e < DIRECTORY_ENTRIES_PER_BLOCK; ++e) {
+      INODE_REFERENCE i = entry[e].inode_reference;
+      if(i >= N_INODES || !strcmp(entry[e].name, ".") || !strcmp(entry[e].name, ".."))
+        continue;
+      INODE *inode = &cache[i / INODES_PER_BLOCK + 1].inodes.inode[i % INODES_PER_BLOCK];
+
+      if(inode->type == IT_DIRECTORY && (filter->max_depth < 0 || dir->depth + 1 < filter->max_depth) &&
+         walk_claim(visited, i)) {
+        WALK_DIR *next = &below[(*n_below)++];
+        next->inode_reference = i;
+        next->block = inode->data[0];
+        next->depth = dir->depth + 1;
+        snprintf(next->path, MAX_PATH_LENGTH, "%s%s%s", dir->path, slash ? "/" : "", entry[e].name);
+      }
+
+      if(filter->name != NULL && fnmatch(filter->name, entry[e].name, 0) != 0)
+        continue;
+      if(!walk_match(filter, inode))
+        continue;
+
+      OUFS_WALK_ENTRY *out = &found[(*n_found)++];
+      snprintf(out->path, MAX_PATH_LENGTH, "%s%s%s", dir->path, slash ? "/" : "", entry[e].name);
+      strncpy(out->name, entry[e].name, FILE_NAME_SIZE - 1);
+      out->name[FILE_NAME_SIZE - 1] = 0;
+      out->inode_reference = i;
+      out->parent = dir->inode_reference;
+      out->inode = *inode;
+      out->depth = dir->depth + 1;
+    }
+  }
+  return(0);
+}
+
+/**
+ * Look up where a walk starts
+ *
+ * @param fs The open file system
+ * @param cwd Current working directory
+ * @param path Where to start
+ * @param filter What to report
+ * @param entry The start (filled in)
+ * @param dir The start as a directory to read (filled in)
+ * @return 2 if the start matches and is a directory to read, 1 if it only
+ *         matches, 3 if it is only to be read, 0 if neither; -1 if there is
+ *         no such path
+ */
+static int walk_start(OUFS *fs, char *cwd, char *path, OUFS_WALK_FILTER *filter,
+                      OUFS_WALK_ENTRY *entry, WALK_DIR *dir)
+{
+  INODE_REFERENCE parent;
+  INODE_REFERENCE child;
+
+  if(!oufs_find_file(fs, cwd, path, &parent, &child, entry->name))
+    return(-1);
+  oufs_read_inode_by_reference(fs, child, &entry->inode);
+  snprintf(entry->path, MAX_PATH_LENGTH, "%s", path);
+  entry->inode_reference = child;
+  entry->parent = parent;
+  entry->depth = 0;
+
+  int matches = (filter->name == NULL || fnmatch(filter->name, entry->name, 0) == 0) &&
+    walk_match(filter, &entry->inode);
+  int follow = (entry->inode.type == IT_DIRECTORY && filter->max_depth != 0);
+  if(follow) {
+    dir->inode_reference = child;
+    dir->block = entry->inode.data[0];
+    dir->depth = 0;
+    snprintf(dir->path, MAX_PATH_LENGTH, "%s", path);
+  }
+  return(follow ? (matches ? 2 : 3) : matches);
+}
+
+/**
+ * Start a breadth-first walk
+ *
+ * @param fs The open file system
+ * @param cwd Current working directory
+ * @param path Where to start: a directory, or a single file
+ * @param filter What to report (NULL for everything)
+ * @return The walk, to be finished with oufs_walk_close(); NULL if there is
+ *         no such path
+ */
+OUFS_WALK *oufs_walk_open(OUFS *fs, char *cwd, char *path, OUFS_WALK_FILTER *filter)
+{
+  OUFS_WALK *walk = malloc(sizeof(OUFS_WALK));
+  if(walk == NULL)
+    return(NULL);
+  memset(walk->visited, 0, sizeof(walk->visited));
+  walk->fs = fs;
+  if(filter != NULL) {
+    walk->filter = *filter;
+  }else{
+    memset(&walk->filter, 0, sizeof(OUFS_WALK_FILTER));
+    walk->filter.min_size = walk->filter.max_size = walk->filter.max_depth = -1;
+  }
+  walk->n_dir[0] = walk->n_dir[1] = 0;
+  walk->next = 0;
+  walk->n_ready = 0;
+  walk->next_ready = 0;
+
+  int start = walk_start(fs, cwd, path, &walk->filter, &walk->ready[0], &walk->dir[0][0]);
+  if(start < 0) {
+    free(walk);
+    return(NULL);
+  }
+  if(start == 1 || start == 2)
+    walk->n_ready = 1;
+  if(start >= 2) {
+    walk->n_dir[0] = 1;
+    walk_claim(walk->visited, walk->dir[0][0].inode_reference);
+  }
+  return(walk);
+}
+
+/**
+ * The next file or directory of a walk
+ *
+ * @param walk The walk
+ * @param entry Filled in
+ * @return 1 if there is one; 0 at the end of the walk; -1 on error
+ */
+int oufs_walk_next(OUFS_WALK *walk, OUFS_WALK_ENTRY *entry)
+{
+  while(walk->next_ready == walk->n_ready) {
+    // The next level, all at once
+    int level = walk->next;
+    if(walk->n_dir[level] == 0)
+      return(0);
+    walk->next = 1 - level;
+    walk->next_ready = 0;
+    if(walk_expand(walk->fs, &walk->filter, walk->dir[level], walk->n_dir[level], walk->cache,
+                   walk->visited, walk->ready, &walk->n_ready, walk->dir[walk->next],
+                   &walk->n_dir[walk->next]) != 0)
+      return(-1);
+    walk->n_dir[level] = 0;
+  }
+  *entry = walk->ready[walk->next_ready++];
+  return(1);
+}
+
+/**
+ * Finish a walk
+ *
+ * @param walk The walk (NULL is ignored)
+ */
+void oufs_walk_close(OUFS_WALK *walk)
+{
+  free(walk);
+}
+
+/**
+ * Take a directory to read: the newest of the thread's own, or else the
+ * oldest of another thread's
+ *
+ * @return 1 if one was taken; 0 if there is none
+ */
+static int walk_take(WALK_POOL *pool, int id, WALK_DIR *dir)
+{
+  for(int k = 0; k < pool->threads; ++k) {
+    WALK_DEQUE *deque = &pool->deque[(id + k) % pool->threads];
+    int taken = 0;
+    pthread_mutex_lock(&deque->lock);
+    if(deque->head < deque->tail) {
+      *dir = (k == 0) ? deque->dir[--deque->tail] : deque->dir[deque->head++];
+      taken = 1;
+    }
+    pthread_mutex_unlock(&deque->lock);
+
+    if(taken) {
+      if(debug && k > 0)
+        fprintf(stderr, "walk: thread %d stole %s\n", id, dir->path);
+      pthread_mutex_lock(&pool->lock);
+      pool->queued--;
+      pthread_mutex_unlock(&pool->lock);
+      return(1);
+    }
+  }
+  return(0);
+}
+
+/**
+ * Queue a directory on a thread's deque
+ */
+static void walk_give(WALK_POOL *pool, int id, WALK_DIR *dir)
+{
+  WALK_DEQUE *deque = &pool->deque[id];
+  pthread_mutex_lock(&deque->lock);
+  deque->dir[deque->tail++] = *dir;
+  pthread_mutex_unlock(&deque->lock);
+
+  pthread_mutex_lock(&pool->lock);
+  pool->queued++;
+  pool->pending++;
+  pthread_cond_signal(&pool->cond);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+/**
+ * A thread of a parallel walk: reads directories until none is pending
+ */
+static void *walk_worker(void *arg)
+{
+  WALK_WORKER *worker = (WALK_WORKER *) arg;
+  WALK_POOL *pool = worker->pool;
+  BLOCK *cache = malloc(N_BLOCKS_IN_DISK * sizeof(BLOCK));
+  OUFS_WALK_ENTRY *found = malloc(DIRECTORY_ENTRIES_PER_BLOCK * sizeof(OUFS_WALK_ENTRY));
+  WALK_DIR *below = malloc(N_INODES * sizeof(WALK_DIR));
+
+  while(1) {
+    WALK_DIR dir;
+    if(!walk_take(pool, worker->id, &dir)) {
+      pthread_mutex_lock(&pool->lock);
+      while(pool->pending > 0 && pool->queued == 0)
+        pthread_cond_wait(&pool->cond, &pool->lock);
+      int over = (pool->pending == 0);
+      pthread_mutex_unlock(&pool->lock);
+      if(over)
+        break;
+      continue;
+    }
+
+    int n_found = 0;
+    int n_below = 0;
+    int ret = -1;
+    if(cache != NULL && found != NULL && below != NULL)
+      ret = walk_expand(pool->fs, pool->filter, &dir, 1, cache, pool->visited, found, &n_found,
+                        below, &n_below);
+    for(int k = 0; k < n_found; ++k)
+      pool->callback(&found[k], pool->arg);
+    for(int k = 0; k < n_below; ++k)
+      walk_give(pool, worker->id, &below[k]);
+
+    pthread_mutex_lock(&pool->lock);
+    pool->found += n_found;
+    if(ret != 0)
+      pool->error = 1;
+    if(--pool->pending == 0)
+      pthread_cond_broadcast(&pool->cond);
+    pthread_mutex_unlock(&pool->lock);
+  }
+
+  free(cache);
+  free(found);
+  free(below);
+  return(NULL);
+}
+
+/**
+ * Walk with a pool of threads.  The callback runs on the threads of the
+ * pool, at the same time on several of them, in no particular order
+ *
+ * @param fs The open file system
+ * @param cwd Current working directory
+ * @param path Where to start: a directory, or a single file
+ * @param filter What to report (NULL for everything)
+ * @param threads Number of threads (at most OUFS_WALK_MAX_THREADS)
+ * @param callback Called with each file or directory that matches
+ * @param arg Handed to the callback
+ * @return Number of files and directories reported; -1 if there is no such
+ *         path or on error
+ */
+int oufs_walk_parallel(OUFS *fs, char *cwd, char *path, OUFS_WALK_FILTER *filter, int threads,
+                       OUFS_WALK_CALLBACK callback, void *arg)
+{
+  OUFS_WALK_FILTER everything = { NULL, 0, -1, -1, -1 };
+  if(filter == NULL)
+    filter = &everything;
+  if(threads < 1)
+    threads = 1;
+  if(threads > OUFS_WALK_MAX_THREADS)
+    threads = OUFS_WALK_MAX_THREADS;
+
+  WALK_POOL *pool = malloc(sizeof(WALK_POOL));
+  if(pool == NULL)
+    return(-1);
+  pool->fs = fs;
+  pool->filter = filter;
+  pool->callback = callback;
+  pool->arg = arg;
+  pool->threads = threads;
+  memset(pool->visited, 0, sizeof(pool->visited));
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->cond, NULL);
+  pool->queued = 0;
+  pool->pending = 0;
+  pool->found = 0;
+  pool->error = 0;
+  for(int k = 0; k < threads; ++k) {
+    pthread_mutex_init(&pool->deque[k].lock, NULL);
+    pool->deque[k].head = 0;
+    pool->deque[k].tail = 0;
+  }
+
+  OUFS_WALK_ENTRY entry;
+  WALK_DIR dir;
+  int start = walk_start(fs, cwd, path, filter, &entry, &dir);
+  if(start == 1 || start == 2) {
+    callback(&entry, arg);
+    pool->found++;
+  }
+  if(start >= 2) {
+    walk_claim(pool->visited, dir.inode_reference);
+    walk_give(pool, 0, &dir);
+  }
+
+  pthread_t thread[OUFS_WALK_MAX_THREADS];
+  WALK_WORKER worker[OUFS_WALK_MAX_THREADS];
+  int running = 0;
+  for(int k = 0; k < threads; ++k) {
+    worker[k].pool = pool;
+    worker[k].id = k;
+    if(pthread_create(&thread[running], NULL, walk_worker, &worker[k]) == 0)
+      ++running;
+  }
+  // No threads at all: the caller's does the work
+  if(running == 0)
+    walk_worker(&worker[0]);
+  for(int k = 0; k < running; ++k)
+    pthread_join(thread[k], NULL);
+
+  int ret = (start < 0 || pool->error) ? -1 : pool->found;
+  for(int k = 0; k < threads; ++k)
+    pthread_mutex_destroy(&pool->deque[k].lock);
+  pthread_mutex_destroy(&pool->lock);
+  pthread_cond_destroy(&pool->cond);
+  free(pool);
+  return(ret);
+}
+
+/**
+ * The attributes of many inodes.  The inodes are grouped by inode block, and
+ * each block is read once
+ *
+ * @param fs The open file system
+ * @param refs The inodes
+ * @param n Number of inodes
+ * @param stats Their attributes (filled in, in the order of refs).  A
+ *              reference out of range gets UNALLOCATED_INODE and type IT_NONE
+ * @return Number of inodes in range; -1 on error
+ */
+int oufs_stat_many(OUFS *fs, INODE_REFERENCE *refs, int n, OUFS_STAT *stats)
+{
+  unsigned char need[N_BLOCKS_IN_DISK];
+  BLOCK cache[N_INODE_BLOCKS + 1];
+
+  memset(need, 0, sizeof(need));
+  for(int k = 0; k < n; ++k)
+    if(refs[k] < N_INODES)
+      need[refs[k] / INODES_PER_BLOCK + 1] = 1;
+  if(walk_load(fs, need, cache) != 0)
+    return(-1);
+
+  int found = 0;
+  for(int k = 0; k < n; ++k) {
+    OUFS_STAT *stat = &stats[k];
+    if(refs[k] >= N_INODES) {
+      memset(stat, 0, sizeof(OUFS_STAT));
+      stat->inode_reference = UNALLOCATED_INODE;
+      stat->type = IT_NONE;
+      continue;
+    }
+    INODE *inode = &cache[refs[k] / INODES_PER_BLOCK + 1].inodes.inode[refs[k] % INODES_PER_BLOCK];
+    stat->inode_reference = refs[k];
+    stat->type = inode->type;
+    stat->n_references = inode->n_references;
+    stat->size = inode->size;
+    stat->blocks = oufs_inode_blocks(fs, inode);
+    ++found;
+  }
+  return(found);
+}
+
+/**
+ * The attributes of the files and directories at many paths
+ *
+ * @param fs The open file system
+ * @param cwd Current working directory
+ * @param paths The paths
+ * @param n Number of paths
+ * @param stats Their attributes (filled in, in the order of paths).  A path
+ *              that does not exist gets UNALLOCATED_INODE and type IT_NONE
+ * @return Number of paths found; -1 on error
+ */
+int oufs_stat_paths(OUFS *fs, char *cwd, char **paths, int n, OUFS_STAT *stats)
+{
+  INODE_REFERENCE *refs = malloc(n * sizeof(INODE_REFERENCE));
+  if(refs == NULL)
+    return(-1);
+
+  for(int k = 0; k < n; ++k) {
+    INODE_REFERENCE parent;
+    if(!oufs_find_file(fs, cwd, paths[k], &parent, &refs[k], NULL))
+      refs[k] = UNALLOCATED_INODE;
+  }
+  int ret = oufs_stat_many(fs, refs, n, stats);
+  free(refs);
+  return(ret);
+}
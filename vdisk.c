@@ -1,84 +1,226 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
 #include "vdisk.h"
 /*
  * Virtual disk implementation.
  *
- * The disk is implemented on top of a file.  Access provided by this
- * library is on a block-by-block basis
+ * The disk is implemented on top of a backend (vdisk_backend.c): a file by
+ * default, or a mapped file or memory.  Access provided by this library is
+ * on a block-by-block basis
+ *
+ * Multi-block updates are made atomic by the journal (vdisk_journal.c).
+ *
+ * Processes sharing an image coordinate with fcntl() byte-range locks on the
+ * blocks that they read or modify.  Open file description locks are used, so
+ * two handles on the same image exclude each other even within one process.
  */
 
 // Debug flag
 #define debug 0
 
-// File descriptor for virtual disk.  Private to this file
-// Yes, global variables are generally a bad idea...
-
-int vdisk_fd = 0;
-
 /**
  * Open the virtual disk
  *
  * @param virtual_disk_name Name of the file containing the virtual disk
- * @return 0 on success; < 0 on error
+ * @return Handle for the open disk on success; NULL on error
  *
  */
-int vdisk_disk_open(char *virtual_disk_name)
+VDISK *vdisk_disk_open(char *virtual_disk_name)
 {
-  if(vdisk_fd != 0) {
-    fprintf(stderr, "A disk is already opened\n");
-    return(-1);
-  };
-
-  // Open file
-  int fd = open(virtual_disk_name, O_RDWR | O_CREAT,
-		S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+  // Open the image with the backend named by the prefix
+  char *path;
+  const VDISK_BACKEND *backend = vdisk_backend_select(virtual_disk_name, &path);
+  int lock_fd = -1;
+  void *state = backend->open(path, &lock_fd);
 
   // Check code
-  if(fd <= 0) {
+  if(state == NULL) {
     fprintf(stderr, "Unable to open virtual disk (%s)\n", virtual_disk_name);
-    return(-1);
+    return(NULL);
   };
 
-  // Remember the fd in the global variable
-  vdisk_fd = fd;
-  return(0);
+  // Remember the backend in the handle
+  VDISK *disk = malloc(sizeof(VDISK));
+  if(disk == NULL) {
+    backend->close(state);
+    fprintf(stderr, "vdisk_disk_open(): out of memory\n");
+    return(NULL);
+  }
+  disk->backend = backend;
+  disk->backend_state = state;
+  disk->lock_fd = lock_fd;
+  pthread_mutex_init(&disk->lock_table_lock, NULL);
+  pthread_cond_init(&disk->lock_table_cond, NULL);
+  memset(disk->lock_count, 0, sizeof(disk->lock_count));
+  memset(disk->lock_mode, 0, sizeof(disk->lock_mode));
+  memset(disk->lock_busy, 0, sizeof(disk->lock_busy));
+  disk->n_block_reads = 0;
+  disk->n_block_writes = 0;
+  vdisk_stats_init(disk);
+
+  // A private copy of the image keeps other processes out until it is closed
+  if(backend->exclusive && vdisk_lock_image(disk, VDISK_LOCK_EXCLUSIVE) != 0) {
+    backend->close(state);
+    pthread_mutex_destroy(&disk->lock_table_lock);
+    pthread_cond_destroy(&disk->lock_table_cond);
+    free(disk->stats);
+    free(disk);
+    return(NULL);
+  }
+
+  // Finish what a process that crashed committed but did not write home,
+  // before anything is read
+  vdisk_journal_init(disk);
+  if(vdisk_journal_recover(disk) != 0) {
+    fprintf(stderr, "vdisk_disk_open(): journal recovery failed (%s)\n", virtual_disk_name);
+    vdisk_disk_close(disk);
+    return(NULL);
+  }
+  return(disk);
 };
 
 /**
  * Close the virtual disk
  *
+ * @param disk The open disk.  The handle is released
  * @return 0 on success; <0 for an error
  */
-int vdisk_disk_close()
+int vdisk_disk_close(VDISK *disk)
 {
-  // Must be initialized to clos it
-  if(vdisk_fd == 0) {
+  // Must be initialized to close it
+  if(disk == NULL) {
     fprintf(stderr, "vdisk_disk_close(): disk not initialized\n");
     exit(-1);
   };
 
-  // Close the file
-  close(vdisk_fd);
+  // Stop journal checkpointing
+  vdisk_journal_shutdown(disk);
+
+  // Hand over the statistics, checkpointing included
+  vdisk_stats_close(disk);
+
+  // Close the backend.  This drops any locks that are still held
+  disk->backend->close(disk->backend_state);
+
+  // Release the handle
+  pthread_mutex_destroy(&disk->lock_table_lock);
+  pthread_cond_destroy(&disk->lock_table_cond);
+  free(disk);
+  return(0);
+}
+
+/**
+ * Discard the contents of the disk.  A file is cut back to nothing and
+ * then extended to the full size of the disk and its journal without
+ * writing anything, so every block reads as zeros and no space is used
+ * until a block is written
+ *
+ * @param disk The open disk
+ * @return 0 on success; <0 for an error
+ */
+int vdisk_disk_reset(VDISK *disk)
+{
+  if(disk == NULL) {
+    fprintf(stderr, "vdisk_disk_reset(): disk not initialized\n");
+    exit(-1);
+  };
+
+  if(disk->backend->discard(disk->backend_state, VDISK_IMAGE_SIZE) != 0) {
+    fprintf(stderr, "vdisk_disk_reset(): discard failed (%s)\n", strerror(errno));
+    return(-4);
+  }
 
-  // Mark as closed
-  vdisk_fd = 0;
+  // Success
   return(0);
 }
 
+/**
+ * Copy the image, journal included, to a file.  The image lock is held
+ * exclusively while it is copied, so the copy is consistent
+ *
+ * @param disk The open disk
+ * @param file_name File that receives the copy; it is replaced
+ * @return 0 on success; <0 for an error
+ */
+int vdisk_disk_snapshot(VDISK *disk, char *file_name)
+{
+  if(disk == NULL) {
+    fprintf(stderr, "vdisk_disk_snapshot(): disk not initialized\n");
+    exit(-1);
+  };
+
+  unsigned char *image = malloc(VDISK_IMAGE_SIZE);
+  if(image == NULL) {
+    fprintf(stderr, "vdisk_disk_snapshot(): out of memory\n");
+    return(-1);
+  }
+
+  int ret = 0;
+  vdisk_lock_image(disk, VDISK_LOCK_EXCLUSIVE);
+  if(vdisk_image_read(disk, image, VDISK_IMAGE_SIZE, 0) != 0)
+    ret = -4;
+  vdisk_unlock_image(disk);
+
+  if(ret == 0) {
+    int fd = open(file_name, O_WRONLY | O_CREAT | O_TRUNC,
+                  S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+    if(fd < 0 || pwrite(fd, image, VDISK_IMAGE_SIZE, 0) != VDISK_IMAGE_SIZE || fsync(fd) != 0) {
+      fprintf(stderr, "vdisk_disk_snapshot(): unable to write %s\n", file_name);
+      ret = -4;
+    }
+    if(fd >= 0)
+      close(fd);
+  }
+  free(image);
+  return(ret);
+}
+
+/**
+ *  Keep the home locations of a run of blocks from changing while they are
+ *  read.  Another process writes a transaction home with the image lock held
+ *  exclusively and the transaction's blocks locked, so a block that this
+ *  handle has locked cannot change; for any other, the image lock is taken
+ *  shared
+ *
+ * @param disk The open disk
+ * @param first The first block
+ * @param n Number of blocks
+ * @return 1 if the image lock was taken; 0 otherwise
+ */
+static int vdisk_read_lock(VDISK *disk, BLOCK_REFERENCE first, int n)
+{
+  int locked = 1;
+
+  pthread_mutex_lock(&disk->lock_table_lock);
+  for(int i = 0; i < n && locked; ++i)
+    locked = (disk->lock_count[first + i] > 0);
+  pthread_mutex_unlock(&disk->lock_table_lock);
+
+  if(locked)
+    return(0);
+  vdisk_lock_image(disk, VDISK_LOCK_SHARED);
+  return(1);
+}
+
 /**
  *  Read a disk block into the provided buffer
  *
+ * @param disk The open disk
  * @param block_ref Index of the block that is to be loaded
  * @param block Pointer to the buffer that the read block will be placed into
  * @return 0 on success; <0 on error
  *
  */
-int vdisk_read_block(BLOCK_REFERENCE block_ref, void *block)
+int vdisk_read_block(VDISK *disk, BLOCK_REFERENCE block_ref, void *block)
 {
   if(debug)
     fprintf(stderr, "##Reading block %d\n", block_ref);
 
   // Make sure that the disk is initialized
-  if(vdisk_fd == 0) {
+  if(disk == NULL) {
     fprintf(stderr, "vdisk_read_block(): disk not initialized\n");
     exit(-1);
   };
@@ -89,14 +231,24 @@ int vdisk_read_block(BLOCK_REFERENCE block_ref, void *block)
     return(-2);
   }
 
-  // Lsek to the correct point in the file
-  if(lseek(vdisk_fd, block_ref * BLOCK_SIZE, SEEK_SET) < 0) {
-    fprintf(stderr, "vdisk_read_block(): seek failed\n");
-    return(-3);
+  __atomic_add_fetch(&disk->n_block_reads, 1, __ATOMIC_RELAXED);
+  vdisk_stats_blocks(disk, block_ref, 1, 0);
+
+  // Updated by a transaction that has not reached the disk yet?
+  if(vdisk_txn_read_block(disk, block_ref, block)) {
+    vdisk_stats_hit(disk);
+    return(0);
   }
+  vdisk_stats_bytes(disk, BLOCK_SIZE, 0);
 
-  // Read the block
-  if(read(vdisk_fd, block, BLOCK_SIZE) != BLOCK_SIZE) {
+  // Read the block at its offset in the image, but not while another
+  // process writes a transaction home
+  int image_locked = vdisk_read_lock(disk, block_ref, 1);
+  ssize_t n_read = disk->backend->read(disk->backend_state, block, BLOCK_SIZE,
+                                       (off_t) block_ref * BLOCK_SIZE);
+  if(image_locked)
+    vdisk_unlock_image(disk);
+  if(n_read != BLOCK_SIZE) {
     fprintf(stderr, "vdisk_read_block(): read failed\n");
     return(-4);
   }
@@ -105,20 +257,81 @@ int vdisk_read_block(BLOCK_REFERENCE block_ref, void *block)
   return(0);
 }
 
+/**
+ *  Read a run of consecutive disk blocks into the provided buffer with a
+ *  single transfer
+ *
+ * @param disk The open disk
+ * @param first Index of the first block that is to be loaded
+ * @param n Number of blocks to load
+ * @param blocks Pointer to a buffer of at least n * BLOCK_SIZE bytes
+ * @return 0 on success; <0 on error
+ *
+ */
+int vdisk_read_blocks(VDISK *disk, BLOCK_REFERENCE first, int n, void *blocks)
+{
+  if(debug)
+    fprintf(stderr, "##Reading blocks %d ... %d\n", first, first + n - 1);
+
+  // Make sure that the disk is initialized
+  if(disk == NULL) {
+    fprintf(stderr, "vdisk_read_blocks(): disk not initialized\n");
+    exit(-1);
+  };
+
+  // Make sure that the whole run is on the disk
+  if(n < 0 || first + n > N_BLOCKS_IN_DISK) {
+    fprintf(stderr, "vdisk_read_blocks(): bad run (%d, %d)\n", first, n);
+    return(-2);
+  }
+
+  __atomic_add_fetch(&disk->n_block_reads, n, __ATOMIC_RELAXED);
+  vdisk_stats_blocks(disk, first, n, 0);
+  vdisk_stats_bytes(disk, n * BLOCK_SIZE, 0);
+
+  // Read the whole run in one transfer, a buffer per block, so a backend
+  // that splits it (stripe:) can hand each member its blocks as they are
+  struct iovec iov[N_BLOCKS_IN_DISK];
+  for(int i = 0; i < n; ++i) {
+    iov[i].iov_base = (char *) blocks + i * BLOCK_SIZE;
+    iov[i].iov_len = BLOCK_SIZE;
+  }
+  ssize_t n_read = 0;
+  if(n > 0) {
+    int image_locked = vdisk_read_lock(disk, first, n);
+    n_read = disk->backend->readv(disk->backend_state, iov, n, (off_t) first * BLOCK_SIZE);
+    if(image_locked)
+      vdisk_unlock_image(disk);
+  }
+  if(n_read != n * BLOCK_SIZE) {
+    fprintf(stderr, "vdisk_read_blocks(): read failed\n");
+    return(-4);
+  }
+
+  // Blocks updated by transactions that have not reached the disk yet
+  for(int i = 0; i < n; ++i)
+    if(vdisk_txn_read_block(disk, first + i, (char *) blocks + i * BLOCK_SIZE))
+      vdisk_stats_hit(disk);
+
+  // Success
+  return(0);
+}
+
 /**
  *  Write a disk block to the virtual disk
  *
+ * @param disk The open disk
  * @param block_ref Index to the block to be written
  * @param block Memory in which the block is currently stored
  *
  */
-int vdisk_write_block(BLOCK_REFERENCE block_ref, void *block)
+int vdisk_write_block(VDISK *disk, BLOCK_REFERENCE block_ref, void *block)
 {
   if(debug)
     fprintf(stderr, "##Writing block %d\n", block_ref);
 
   // File open?
-  if(vdisk_fd == 0) {
+  if(disk == NULL) {
     fprintf(stderr, "vdisk_write_block(): disk not initialized\n");
     exit(-1);
   };
@@ -129,18 +342,319 @@ int vdisk_write_block(BLOCK_REFERENCE block_ref, void *block)
     return(-2);
   }
 
-  // Move to the beginning of the block
-  if(lseek(vdisk_fd, block_ref * BLOCK_SIZE, SEEK_SET) < 0) {
-    fprintf(stderr, "vdisk_write_block(): seek failed\n");
-    return(-3);
-  }
+  __atomic_add_fetch(&disk->n_block_writes, 1, __ATOMIC_RELAXED);
+  vdisk_stats_blocks(disk, block_ref, 1, 1);
 
-  // Read the block
-  if(write(vdisk_fd, block, BLOCK_SIZE) != BLOCK_SIZE) {
-    fprintf(stderr, "vdisk_write_block(): read failed\n");
+  // Inside of a transaction, the journal takes care of the write
+  int ret = vdisk_txn_write_block(disk, block_ref, block);
+  if(ret != 0)
+    return(ret > 0 ? 0 : ret);
+  vdisk_stats_bytes(disk, BLOCK_SIZE, 1);
+
+  // Write the block at its offset in the image
+  if(disk->backend->write(disk->backend_state, block, BLOCK_SIZE,
+                          (off_t) block_ref * BLOCK_SIZE) != BLOCK_SIZE) {
+    fprintf(stderr, "vdisk_write_block(): write failed\n");
     return(-4);
   }
 
   // Success
   return(0);
 }
+
+/**
+ *  Read bytes from the image, bypassing the transaction buffers
+ *
+ * @param disk The open disk
+ * @param buffer Receives the bytes
+ * @param length Number of bytes
+ * @param offset Offset in the image
+ * @return 0 on success; <0 on error
+ */
+int vdisk_image_read(VDISK *disk, void *buffer, size_t length, off_t offset)
+{
+  vdisk_stats_bytes(disk, length, 0);
+  if(disk->backend->read(disk->backend_state, buffer, length, offset) != length)
+    return(-4);
+  return(0);
+}
+
+/**
+ *  Write bytes to the image, bypassing the transaction buffers
+ *
+ * @param disk The open disk
+ * @param buffer The bytes
+ * @param length Number of bytes
+ * @param offset Offset in the image
+ * @return 0 on success; <0 on error
+ */
+int vdisk_image_write(VDISK *disk, const void *buffer, size_t length, off_t offset)
+{
+  vdisk_stats_bytes(disk, length, 1);
+  if(disk->backend->write(disk->backend_state, buffer, length, offset) != length)
+    return(-4);
+  return(0);
+}
+
+/**
+ *  Gather buffers into one contiguous write to the image, bypassing the
+ *  transaction buffers
+ *
+ * @param disk The open disk
+ * @param iov The buffers
+ * @param iovcnt Number of buffers
+ * @param offset Offset in the image
+ * @return 0 on success; <0 on error
+ */
+int vdisk_image_writev(VDISK *disk, const struct iovec *iov, int iovcnt, off_t offset)
+{
+  size_t length = 0;
+  for(int i = 0; i < iovcnt; ++i)
+    length += iov[i].iov_len;
+  vdisk_stats_bytes(disk, length, 1);
+  if(disk->backend->writev(disk->backend_state, iov, iovcnt, offset) != length)
+    return(-4);
+  return(0);
+}
+
+/**
+ *  Make everything written to the image so far durable
+ *
+ * @param disk The open disk
+ * @return 0 on success; <0 on error
+ */
+int vdisk_image_flush(VDISK *disk)
+{
+  if(disk->backend->flush(disk->backend_state) != 0)
+    return(-4);
+  return(0);
+}
+
+/**
+ *  Map part of the image read only, bypassing the transactions: the view
+ *  shows the image as it is, and what is written to it afterwards
+ *
+ * @param disk The open disk
+ * @param length Number of bytes
+ * @param offset Where in the image
+ * @return The view; NULL if the backend cannot map the image
+ */
+void *vdisk_image_map(VDISK *disk, size_t length, off_t offset)
+{
+  if(disk->backend->map == NULL || length == 0 || offset < 0 ||
+     offset + (off_t) length > N_BLOCKS_IN_DISK * BLOCK_SIZE)
+    return(NULL);
+  return(disk->backend->map(disk->backend_state, length, offset));
+}
+
+/**
+ *  Drop a view made by vdisk_image_map(), or any other mapping that starts
+ *  on the page that the view starts on
+ *
+ * @param view The view
+ * @param length Its length
+ * @return 0 on success; <0 on error
+ */
+int vdisk_image_unmap(void *view, size_t length)
+{
+  size_t page = (uintptr_t) view % sysconf(_SC_PAGESIZE);
+  if(munmap((unsigned char *) view - page, length + page) != 0)
+    return(-4);
+  return(0);
+}
+
+/**
+ *  Apply an fcntl() lock to the file region that backs a lock table slot
+ *
+ * @param disk The open disk
+ * @param slot Block reference, or VDISK_IMAGE_LOCK_SLOT
+ * @param type F_RDLCK, F_WRLCK or F_UNLCK
+ * @param wait Set to wait for the lock if another process holds it
+ * @return 0 on success; 1 if the lock is held elsewhere and wait is not set;
+ *         <0 on error
+ */
+static int vdisk_fcntl_lock(VDISK *disk, int slot, short type, int wait)
+{
+  // Nobody to coordinate with
+  if(disk->lock_fd < 0)
+    return(0);
+
+  struct flock fl;
+  memset(&fl, 0, sizeof(fl));
+  fl.l_type = type;
+  fl.l_whence = SEEK_SET;
+  if(slot == VDISK_IMAGE_LOCK_SLOT) {
+    fl.l_start = VDISK_IMAGE_LOCK_OFFSET;
+    fl.l_len = 1;
+  }else{
+    fl.l_start = (off_t) slot * BLOCK_SIZE;
+    fl.l_len = BLOCK_SIZE;
+  }
+
+  // Wait for the lock; a signal only restarts the wait
+  while(fcntl(disk->lock_fd, wait ? F_OFD_SETLKW : F_OFD_SETLK, &fl) < 0) {
+    if(!wait && (errno == EAGAIN || errno == EACCES))
+      return(1);
+    if(errno != EINTR) {
+      fprintf(stderr, "vdisk_lock(): lock of slot %d failed (%s)\n", slot, strerror(errno));
+      return(-5);
+    }
+  }
+  return(0);
+}
+
+/**
+ *  Take a reference on a lock table slot, acquiring the fcntl() lock if this
+ *  handle does not already hold it in a strong enough mode
+ *
+ * @param disk The open disk
+ * @param slot Block reference, or VDISK_IMAGE_LOCK_SLOT
+ * @param mode VDISK_LOCK_SHARED or VDISK_LOCK_EXCLUSIVE
+ * @return 0 on success; <0 on error
+ */
+static int vdisk_lock_slot(VDISK *disk, int slot, int mode)
+{
+  // The image lock is never held while waiting for a block, so whoever is
+  // waiting for it need not leave a transaction
+  int suspended = (slot == VDISK_IMAGE_LOCK_SLOT);
+  int depth = 0;
+
+  pthread_mutex_lock(&disk->lock_table_lock);
+  while(!(disk->lock_count[slot] > 0 && disk->lock_mode[slot] >= mode)) {
+    if(disk->lock_count[slot] == 0 && !disk->lock_busy[slot])
+      break;
+
+    // Another thread is acquiring the slot, or holds it shared when we need
+    // it exclusive.  Shared holds are short; they are let go rather than
+    // upgraded in place, which would leave this handle's shared lock in the
+    // way of another process that is upgrading too
+    if(!suspended) {
+      pthread_mutex_unlock(&disk->lock_table_lock);
+      depth = vdisk_txn_suspend(disk);
+      suspended = 1;
+      pthread_mutex_lock(&disk->lock_table_lock);
+      continue;
+    }
+    pthread_cond_wait(&disk->lock_table_cond, &disk->lock_table_lock);
+  }
+  if(disk->lock_count[slot] > 0) {
+    disk->lock_count[slot]++;
+    pthread_mutex_unlock(&disk->lock_table_lock);
+    vdisk_txn_resume(disk, depth);
+    return(0);
+  }
+  disk->lock_busy[slot] = 1;
+  pthread_mutex_unlock(&disk->lock_table_lock);
+
+  if(debug)
+    fprintf(stderr, "##Locking slot %d (%s)\n", slot, mode ? "exclusive" : "shared");
+
+  // A block that another process holds is not waited for in a transaction
+  // that holds blocks (see vdisk_txn_suspend())
+  short type = (mode == VDISK_LOCK_EXCLUSIVE ? F_WRLCK : F_RDLCK);
+  int ret = vdisk_fcntl_lock(disk, slot, type, suspended);
+  if(ret > 0) {
+    depth = vdisk_txn_suspend(disk);
+    ret = vdisk_fcntl_lock(disk, slot, type, 1);
+  }
+
+  pthread_mutex_lock(&disk->lock_table_lock);
+  disk->lock_busy[slot] = 0;
+  if(ret == 0) {
+    disk->lock_count[slot] = 1;
+    disk->lock_mode[slot] = mode;
+  }
+  pthread_cond_broadcast(&disk->lock_table_cond);
+  pthread_mutex_unlock(&disk->lock_table_lock);
+  vdisk_txn_resume(disk, depth);
+  return(ret);
+}
+
+/**
+ *  Drop a reference on a lock table slot, releasing the fcntl() lock with
+ *  the last one
+ *
+ * @param disk The open disk
+ * @param slot Block reference, or VDISK_IMAGE_LOCK_SLOT
+ * @return 0 on success; <0 on error
+ */
+static int vdisk_unlock_slot(VDISK *disk, int slot)
+{
+  int ret = 0;
+
+  pthread_mutex_lock(&disk->lock_table_lock);
+  if(disk->lock_count[slot] == 0) {
+    pthread_mutex_unlock(&disk->lock_table_lock);
+    fprintf(stderr, "vdisk_unlock(): slot %d is not locked\n", slot);
+    return(-2);
+  }
+  if(--disk->lock_count[slot] == 0) {
+    if(debug)
+      fprintf(stderr, "##Unlocking slot %d\n", slot);
+    ret = vdisk_fcntl_lock(disk, slot, F_UNLCK, 1);
+    disk->lock_mode[slot] = VDISK_LOCK_SHARED;
+    pthread_cond_broadcast(&disk->lock_table_cond);
+  }
+  pthread_mutex_unlock(&disk->lock_table_lock);
+  return(ret);
+}
+
+/**
+ *  Lock one block of the image against other processes.  Locks nest: every
+ *  call must be matched by a call to vdisk_unlock_block()
+ *
+ * @param disk The open disk
+ * @param block_ref Index of the block to lock
+ * @param mode VDISK_LOCK_SHARED for readers; VDISK_LOCK_EXCLUSIVE for writers
+ * @return 0 on success; <0 on error
+ */
+int vdisk_lock_block(VDISK *disk, BLOCK_REFERENCE block_ref, int mode)
+{
+  if(block_ref >= N_BLOCKS_IN_DISK) {
+    fprintf(stderr, "vdisk_lock_block(): bad block_ref(%d)\n", block_ref);
+    return(-2);
+  }
+  return(vdisk_lock_slot(disk, block_ref, mode));
+}
+
+/**
+ *  Release one reference to a block lock
+ *
+ * @param disk The open disk
+ * @param block_ref Index of the block to unlock
+ * @return 0 on success; <0 on error
+ */
+int vdisk_unlock_block(VDISK *disk, BLOCK_REFERENCE block_ref)
+{
+  if(block_ref >= N_BLOCKS_IN_DISK) {
+    fprintf(stderr, "vdisk_unlock_block(): bad block_ref(%d)\n", block_ref);
+    return(-2);
+  }
+  return(vdisk_unlock_slot(disk, block_ref));
+}
+
+/**
+ *  Lock the image as a whole.  It is held exclusively while journal
+ *  transactions are written home or replayed, and by a tool that must see
+ *  the whole image in a consistent state; reads of home locations hold it
+ *  shared.  Whoever holds it must not wait for a block lock
+ *
+ * @param disk The open disk
+ * @param mode VDISK_LOCK_SHARED or VDISK_LOCK_EXCLUSIVE
+ * @return 0 on success; <0 on error
+ */
+int vdisk_lock_image(VDISK *disk, int mode)
+{
+  return(vdisk_lock_slot(disk, VDISK_IMAGE_LOCK_SLOT, mode));
+}
+
+/**
+ *  Release one reference to the whole-image lock
+ *
+ * @param disk The open disk
+ * @return 0 on success; <0 on error
+ */
+int vdisk_unlock_image(VDISK *disk)
+{
+  return(vdisk_unlock_slot(disk, VDISK_IMAGE_LOCK_SLOT));
+}
@@ -1,4 +1,5 @@
 #ifndef VDISK_H
+#define VDISK_H
 
 #include <sys/types.h>
 #include <unistd.h>
@@ -6,6 +7,8 @@
 #include <fcntl.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <pthread.h>
+#include <sys/uio.h>
 
 typedef unsigned short BLOCK_REFERENCE;
 
@@ -15,9 +18,243 @@ typedef unsigned short BLOCK_REFERENCE;
 // Total number of blocks on the virtual disk
 #define N_BLOCKS_IN_DISK 128
 
-int vdisk_disk_open(char *virtual_disk_name);
-int vdisk_disk_close();
-int vdisk_read_block(BLOCK_REFERENCE block_ref, void *block);
-int vdisk_write_block(BLOCK_REFERENCE block_ref, void *block);
+// Lock modes for vdisk_lock_block() and vdisk_lock_image()
+#define VDISK_LOCK_SHARED 0
+#define VDISK_LOCK_EXCLUSIVE 1
+
+// Lock table slot used for the whole-image lock.  It is held exclusively
+//  while journal transactions are written home or replayed, and by tools that
+//  need a stable image; reads of home locations take it shared
+#define VDISK_IMAGE_LOCK_SLOT N_BLOCKS_IN_DISK
+
+// Byte used to represent the whole-image lock in the file: well past the blocks
+#define VDISK_IMAGE_LOCK_OFFSET ((off_t) 1 << 40)
+
+// Metadata journal.  It lives in the image file just past the last block of
+//  the disk, so the disk layout itself is unchanged:
+//   journal block 0: header (where the live transactions start)
+//   journal block 1...: transactions, each a descriptor block followed by
+//                       images of the blocks it updates
+#define N_JOURNAL_BLOCKS 64
+
+// Bytes behind a disk: the blocks followed by the journal
+#define VDISK_IMAGE_SIZE ((off_t) (N_BLOCKS_IN_DISK + N_JOURNAL_BLOCKS) * BLOCK_SIZE)
+
+// Largest number of blocks in one (group) transaction
+#define VDISK_TXN_MAX_BLOCKS 24
+
+// Storage behind a disk.  A backend moves bytes at offsets within the image
+//  (VDISK_IMAGE_SIZE bytes); it is chosen by a prefix on the disk name
+//  ("mem:image"), and a plain name is a file.  Backends must allow transfers
+//  from several threads at once
+typedef struct vdisk_backend_s
+{
+  // Prefix that selects the backend, including the ':'
+  const char *prefix;
+
+  // Set if the backend keeps the image to itself while it is open, so no
+  //  other process may use the image until it is closed
+  int exclusive;
+
+  // Open the image and return the backend's state, or NULL on error.
+  //  *lock_fd is set to the file that carries the cross-process locks, or -1
+  //  if the image cannot be shared
+  void *(*open)(char *name, int *lock_fd);
+  int (*close)(void *state);
+
+  // Transfers return the number of bytes moved, or <0 on error
+  ssize_t (*read)(void *state, void *buffer, size_t length, off_t offset);
+  ssize_t (*write)(void *state, const void *buffer, size_t length, off_t offset);
+  ssize_t (*readv)(void *state, const struct iovec *iov, int iovcnt, off_t offset);
+  ssize_t (*writev)(void *state, const struct iovec *iov, int iovcnt, off_t offset);
+
+  // Make everything written so far durable
+  int (*flush)(void *state);
+
+  // Drop the contents of the image: size bytes of zeros remain
+  int (*discard)(void *state, off_t size);
+
+  // Map part of the image read only and shared, so that it shows what is
+  //  written to the image afterwards; NULL if the backend cannot (then the
+  //  function is NULL too)
+  void *(*map)(void *state, size_t length, off_t offset);
+} VDISK_BACKEND;
+
+// Classes of blocks, for the statistics.  The layer above says which block
+//  is which; a block is data until then
+#define VDISK_CLASS_DATA 0
+#define VDISK_CLASS_MASTER 1
+#define VDISK_CLASS_INODE 2
+#define VDISK_CLASS_DIRECTORY 3
+#define VDISK_N_CLASSES 4
+
+// Operations of the layer above whose latency is kept
+#define VDISK_OP_MKDIR 0
+#define VDISK_OP_RMDIR 1
+#define VDISK_OP_LIST 2
+#define VDISK_OP_FIND 3
+#define VDISK_OP_READ 4
+#define VDISK_OP_WRITE 5
+#define VDISK_N_OPS 6
+
+// Latency histogram buckets: bucket k counts latencies under 2^k
+//  microseconds, and the last one everything longer
+#define VDISK_STATS_BUCKETS 24
+
+// Statistics of a handle (vdisk_stats.c).  Only unsigned longs, so that
+//  counts can be added up field by field
+typedef struct vdisk_stats_s
+{
+  // Blocks read and written, by class
+  unsigned long reads[VDISK_N_CLASSES];
+  unsigned long writes[VDISK_N_CLASSES];
+
+  // Block reads served by a transaction that has not reached the disk
+  unsigned long cache_hits;
+
+  // Bytes moved to and from the backend, journal included
+  unsigned long bytes_read;
+  unsigned long bytes_written;
+
+  // Operations, their total latency, and their latency histogram
+  unsigned long op_count[VDISK_N_OPS];
+  unsigned long op_usec[VDISK_N_OPS];
+  unsigned long op_histogram[VDISK_N_OPS][VDISK_STATS_BUCKETS];
+} VDISK_STATS;
+
+// One group transaction: the block updates of every operation that joined it
+typedef struct vdisk_txn_s
+{
+  // Order in which transactions were opened
+  unsigned long tid;
+
+  // Operations that have joined and not yet ended, and the blocks that they
+  //  reserved when they joined
+  int n_handles;
+  int credits;
+
+  // Error from committing part of the transaction early (journal_yield())
+  int error;
+
+  // Set while the operation that will commit waits for the previous commit
+  int committer_waiting;
+
+  // The updated blocks, latest contents
+  int n_blocks;
+  BLOCK_REFERENCE block_ref[VDISK_TXN_MAX_BLOCKS];
+  unsigned char data[VDISK_TXN_MAX_BLOCKS][BLOCK_SIZE];
+} VDISK_TXN;
+
+// An open virtual disk.  All block accesses go through a handle, so any
+//  number of disks may be open at once.  Backends transfer blocks without a
+//  file position, so a handle may be shared between threads.
+typedef struct vdisk_s
+{
+  // Storage behind the virtual disk
+  const VDISK_BACKEND *backend;
+  void *backend_state;
+
+  // File that carries the cross-process locks; -1 if there is none
+  int lock_fd;
+
+  // Cross-process block locks held through this handle.  The fcntl() lock is
+  //  taken by the first holder and released by the last one, so threads that
+  //  share the handle can nest shared locks on the same block.  Only one
+  //  thread acquires a slot at a time (lock_busy), and the count covers only
+  //  granted holds, so a lock is never left behind for a thread still waiting.
+  pthread_mutex_t lock_table_lock;
+  pthread_cond_t lock_table_cond;
+  unsigned short lock_count[N_BLOCKS_IN_DISK + 1];
+  unsigned char lock_mode[N_BLOCKS_IN_DISK + 1];
+  unsigned char lock_busy[N_BLOCKS_IN_DISK + 1];
+
+  // Journal state, protected by journal_lock.  The transaction that
+  //  operations are joining is running; the one being written is committing.
+  pthread_mutex_t journal_lock;
+  pthread_cond_t journal_cond;
+  VDISK_TXN *running;
+  VDISK_TXN *committing;
+  unsigned long next_tid;
+  unsigned long committed_tid;
+  int commit_error;
+
+  // Where the journal stands on the image: sequence number of the next
+  //  transaction, and the journal block it will be written to.  Revalidated
+  //  from the image before each commit, as other processes append too.
+  int journal_valid;
+  unsigned int journal_start_sequence;
+  unsigned int journal_sequence;
+  int journal_head;
+
+  // Background checkpointing
+  pthread_t checkpoint_thread;
+  int checkpoint_running;
+  int checkpoint_stop;
+
+  // Blocks read and written through the handle (whether or not they came
+  //  from or went to a transaction), for benchmarks.  Updated atomically
+  unsigned long n_block_reads;
+  unsigned long n_block_writes;
+
+  // Statistics, kept only if ZSTATS is set (NULL otherwise), and the class
+  //  of each block
+  VDISK_STATS *stats;
+  unsigned char block_class[N_BLOCKS_IN_DISK];
+} VDISK;
+
+VDISK *vdisk_disk_open(char *virtual_disk_name);
+int vdisk_disk_close(VDISK *disk);
+int vdisk_disk_reset(VDISK *disk);
+int vdisk_disk_snapshot(VDISK *disk, char *file_name);
+int vdisk_read_block(VDISK *disk, BLOCK_REFERENCE block_ref, void *block);
+int vdisk_read_blocks(VDISK *disk, BLOCK_REFERENCE first, int n, void *blocks);
+int vdisk_write_block(VDISK *disk, BLOCK_REFERENCE block_ref, void *block);
+int vdisk_lock_block(VDISK *disk, BLOCK_REFERENCE block_ref, int mode);
+int vdisk_unlock_block(VDISK *disk, BLOCK_REFERENCE block_ref);
+int vdisk_lock_image(VDISK *disk, int mode);
+int vdisk_unlock_image(VDISK *disk);
+
+// Raw transfers at byte offsets in the image, bypassing the transactions
+int vdisk_image_read(VDISK *disk, void *buffer, size_t length, off_t offset);
+int vdisk_image_write(VDISK *disk, const void *buffer, size_t length, off_t offset);
+int vdisk_image_writev(VDISK *disk, const struct iovec *iov, int iovcnt, off_t offset);
+int vdisk_image_flush(VDISK *disk);
+void *vdisk_image_map(VDISK *disk, size_t length, off_t offset);
+int vdisk_image_unmap(void *view, size_t length);
+
+// Backends (vdisk_backend.c)
+extern const VDISK_BACKEND vdisk_backend_file;
+extern const VDISK_BACKEND vdisk_backend_mmap;
+extern const VDISK_BACKEND vdisk_backend_mem;
+extern const VDISK_BACKEND vdisk_backend_stripe;
+extern const VDISK_BACKEND vdisk_backend_mirror;
+const VDISK_BACKEND *vdisk_backend_select(char *name, char **path);
+int vdisk_backend_open_file(char *name);
+int vdisk_backend_truncate_file(int fd, off_t size);
+
+// Journal (vdisk_journal.c)
+int vdisk_txn_begin(VDISK *disk, int credits);
+int vdisk_txn_end(VDISK *disk);
+int vdisk_txn_write_block(VDISK *disk, BLOCK_REFERENCE block_ref, void *block);
+int vdisk_txn_read_block(VDISK *disk, BLOCK_REFERENCE block_ref, void *block);
+int vdisk_txn_suspend(VDISK *disk);
+void vdisk_txn_resume(VDISK *disk, int depth);
+int vdisk_journal_format(VDISK *disk);
+int vdisk_journal_checkpoint(VDISK *disk);
+void vdisk_journal_init(VDISK *disk);
+int vdisk_journal_recover(VDISK *disk);
+void vdisk_journal_shutdown(VDISK *disk);
+
+// Statistics (vdisk_stats.c)
+void vdisk_stats_init(VDISK *disk);
+void vdisk_stats_close(VDISK *disk);
+void vdisk_stats_classify(VDISK *disk, BLOCK_REFERENCE block_ref, int block_class);
+void vdisk_stats_blocks(VDISK *disk, BLOCK_REFERENCE first, int n, int write);
+void vdisk_stats_hit(VDISK *disk);
+void vdisk_stats_bytes(VDISK *disk, size_t length, int write);
+unsigned long vdisk_stats_start(VDISK *disk);
+void vdisk_stats_op(VDISK *disk, int op, unsigned long start);
+int vdisk_stats_load(char *file_name, VDISK_STATS *stats);
+void vdisk_stats_print(FILE *out, VDISK_STATS *stats);
 
 #endif
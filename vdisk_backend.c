@@ -0,0 +1,363 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <string.h>
+#include <sys/mman.h>
+#include "vdisk.h"
+/*
+ * Storage backends for the virtual disk.
+ *
+ * The backend is chosen by a prefix on the disk name:
+ *   image       the image file, accessed with pread()/pwrite()
+ *   mmap:image  the image file, mapped into memory and shared with every
+ *               other process that uses it
+ *   mem:image   a copy of the image in memory, loaded when the disk is
+ *               opened and written back when it is closed.  Other processes
+ *               are kept out of the image in between.  "mem:" alone is an
+ *               empty disk that only lives as long as the handle
+ *   stripe:unit:image,image,...
+ *               the image spread over several files (vdisk_stripe.c)
+ *   mirror:image,image,...
+ *               a copy of the image in each file (vdisk_mirror.c)
+ */
+
+// Debug flag
+#define debug 0
+
+/**
+ * Open (creating if needed) a file that backs an image
+ *
+ * @return File descriptor; <0 on error
+ */
+int vdisk_backend_open_file(char *name)
+{
+  return(open(name, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH));
+}
+
+/**
+ * Make a file size bytes of zeros without using any space.  Punching out
+ * the contents keeps the file at its size throughout, so a process that has
+ * it mapped never finds it short; not every file system can do that, and
+ * then the file is cut back to nothing and extended
+ */
+int vdisk_backend_truncate_file(int fd, off_t size)
+{
+  if(fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, 0, size) == 0 &&
+     ftruncate(fd, size) == 0)
+    return(0);
+  if(ftruncate(fd, 0) != 0 || ftruncate(fd, size) != 0)
+    return(-4);
+  return(0);
+}
+
+/**
+ * Map part of a file read only.  The mapping starts at the page that holds
+ * the offset; the pointer returned is to the offset itself
+ *
+ * @return The view; NULL on error, or if the file does not reach that far
+ */
+static void *backend_map_file(int fd, size_t length, off_t offset)
+{
+  struct stat st;
+  if(fstat(fd, &st) != 0 || offset + (off_t) length > st.st_size)
+    return(NULL);
+
+  off_t page = offset % sysconf(_SC_PAGESIZE);
+  unsigned char *region = mmap(NULL, length + page, PROT_READ, MAP_SHARED, fd, offset - page);
+  if(region == MAP_FAILED)
+    return(NULL);
+  return(region + page);
+}
+
+/**
+ * Is a transfer within the image?
+ */
+static int backend_in_image(size_t length, off_t offset)
+{
+  return(offset >= 0 && offset + (off_t) length <= VDISK_IMAGE_SIZE);
+}
+
+// ---------------------------------------------------------------------------
+// File: the image file, read and written with positioned system calls
+
+typedef struct file_state_s
+{
+  int fd;
+} FILE_STATE;
+
+static void *file_open(char *name, int *lock_fd)
+{
+  FILE_STATE *state = malloc(sizeof(FILE_STATE));
+  if(state == NULL)
+    return(NULL);
+
+  state->fd = vdisk_backend_open_file(name);
+  if(state->fd < 0) {
+    free(state);
+    return(NULL);
+  }
+  *lock_fd = state->fd;
+  return(state);
+}
+
+static int file_close(void *s)
+{
+  FILE_STATE *state = s;
+  close(state->fd);
+  free(state);
+  return(0);
+}
+
+static ssize_t file_read(void *s, void *buffer, size_t length, off_t offset)
+{
+  return(pread(((FILE_STATE *) s)->fd, buffer, length, offset));
+}
+
+static ssize_t file_write(void *s, const void *buffer, size_t length, off_t offset)
+{
+  return(pwrite(((FILE_STATE *) s)->fd, buffer, length, offset));
+}
+
+static ssize_t file_readv(void *s, const struct iovec *iov, int iovcnt, off_t offset)
+{
+  return(preadv(((FILE_STATE *) s)->fd, iov, iovcnt, offset));
+}
+
+static ssize_t file_writev(void *s, const struct iovec *iov, int iovcnt, off_t offset)
+{
+  return(pwritev(((FILE_STATE *) s)->fd, iov, iovcnt, offset));
+}
+
+static int file_flush(void *s)
+{
+  return(fdatasync(((FILE_STATE *) s)->fd));
+}
+
+static int file_discard(void *s, off_t size)
+{
+  return(vdisk_backend_truncate_file(((FILE_STATE *) s)->fd, size));
+}
+
+static void *file_map(void *s, size_t length, off_t offset)
+{
+  return(backend_map_file(((FILE_STATE *) s)->fd, length, offset));
+}
+
+const VDISK_BACKEND vdisk_backend_file = {
+  "", 0, file_open, file_close, file_read, file_write,
+  file_readv, file_writev, file_flush, file_discard, file_map
+};
+
+// ---------------------------------------------------------------------------
+// Memory: transfers are copies to and from a buffer.  Used by the mapped
+//  file and by the in-memory image
+
+typedef struct mem_state_s
+{
+  // The image
+  unsigned char *image;
+
+  // Backing file (mapped, or loaded and written back); -1 if there is none
+  int fd;
+} MEM_STATE;
+
+static ssize_t mem_read(void *s, void *buffer, size_t length, off_t offset)
+{
+  if(!backend_in_image(length, offset)) {
+    errno = EINVAL;
+    return(-1);
+  }
+  memcpy(buffer, ((MEM_STATE *) s)->image + offset, length);
+  return(length);
+}
+
+static ssize_t mem_write(void *s, const void *buffer, size_t length, off_t offset)
+{
+  if(!backend_in_image(length, offset)) {
+    errno = EINVAL;
+    return(-1);
+  }
+  memcpy(((MEM_STATE *) s)->image + offset, buffer, length);
+  return(length);
+}
+
+static ssize_t mem_readv(void *s, const struct iovec *iov, int iovcnt, off_t offset)
+{
+  ssize_t total = 0;
+  for(int i = 0; i < iovcnt; ++i) {
+    if(mem_read(s, iov[i].iov_base, iov[i].iov_len, offset + total) < 0)
+      return(-1);
+    total += iov[i].iov_len;
+  }
+  return(total);
+}
+
+static ssize_t mem_writev(void *s, const struct iovec *iov, int iovcnt, off_t offset)
+{
+  ssize_t total = 0;
+  for(int i = 0; i < iovcnt; ++i) {
+    if(mem_write(s, iov[i].iov_base, iov[i].iov_len, offset + total) < 0)
+      return(-1);
+    total += iov[i].iov_len;
+  }
+  return(total);
+}
+
+// ---------------------------------------------------------------------------
+// Mapped file: the image file is mapped shared, so it stays coherent with
+//  other processes that read and write it
+
+static void *mmap_open(char *name, int *lock_fd)
+{
+  MEM_STATE *state = malloc(sizeof(MEM_STATE));
+  if(state == NULL)
+    return(NULL);
+
+  // The whole image must exist in the file before it is mapped
+  struct stat st;
+  state->fd = vdisk_backend_open_file(name);
+  if(state->fd < 0 || fstat(state->fd, &st) != 0 ||
+     (st.st_size < VDISK_IMAGE_SIZE && ftruncate(state->fd, VDISK_IMAGE_SIZE) != 0)) {
+    if(state->fd >= 0)
+      close(state->fd);
+    free(state);
+    return(NULL);
+  }
+
+  state->image = mmap(NULL, VDISK_IMAGE_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, state->fd, 0);
+  if(state->image == MAP_FAILED) {
+    close(state->fd);
+    free(state);
+    return(NULL);
+  }
+  *lock_fd = state->fd;
+  return(state);
+}
+
+static int mmap_close(void *s)
+{
+  MEM_STATE *state = s;
+  munmap(state->image, VDISK_IMAGE_SIZE);
+  close(state->fd);
+  free(state);
+  return(0);
+}
+
+static int mmap_flush(void *s)
+{
+  return(msync(((MEM_STATE *) s)->image, VDISK_IMAGE_SIZE, MS_SYNC));
+}
+
+static int mmap_discard(void *s, off_t size)
+{
+  return(vdisk_backend_truncate_file(((MEM_STATE *) s)->fd, size));
+}
+
+static void *mmap_map(void *s, size_t length, off_t offset)
+{
+  return(backend_map_file(((MEM_STATE *) s)->fd, length, offset));
+}
+
+const VDISK_BACKEND vdisk_backend_mmap = {
+  "mmap:", 0, mmap_open, mmap_close, mem_read, mem_write,
+  mem_readv, mem_writev, mmap_flush, mmap_discard, mmap_map
+};
+
+// ---------------------------------------------------------------------------
+// In-memory image: loaded from its file when opened, written back when closed
+
+static void *ram_open(char *name, int *lock_fd)
+{
+  MEM_STATE *state = malloc(sizeof(MEM_STATE));
+  if(state == NULL)
+    return(NULL);
+
+  state->image = calloc(1, VDISK_IMAGE_SIZE);
+  state->fd = -1;
+  if(state->image == NULL) {
+    free(state);
+    return(NULL);
+  }
+
+  // Load the image; a short file leaves the rest zero
+  if(name[0] != '\0') {
+    state->fd = vdisk_backend_open_file(name);
+    if(state->fd < 0 || pread(state->fd, state->image, VDISK_IMAGE_SIZE, 0) < 0) {
+      if(state->fd >= 0)
+        close(state->fd);
+      free(state->image);
+      free(state);
+      return(NULL);
+    }
+    if(debug)
+      fprintf(stderr, "##Loaded %s into memory\n", name);
+  }
+  *lock_fd = state->fd;
+  return(state);
+}
+
+static int ram_close(void *s)
+{
+  MEM_STATE *state = s;
+  int ret = 0;
+
+  // Write the image back
+  if(state->fd >= 0) {
+    if(pwrite(state->fd, state->image, VDISK_IMAGE_SIZE, 0) != VDISK_IMAGE_SIZE ||
+       fdatasync(state->fd) != 0) {
+      fprintf(stderr, "vdisk: unable to write back the in-memory image\n");
+      ret = -4;
+    }
+    close(state->fd);
+  }
+  free(state->image);
+  free(state);
+  return(ret);
+}
+
+static int ram_flush(void *s)
+{
+  // Nothing is durable before the image is written back
+  return(0);
+}
+
+static int ram_discard(void *s, off_t size)
+{
+  memset(((MEM_STATE *) s)->image, 0, size);
+  return(0);
+}
+
+const VDISK_BACKEND vdisk_backend_mem = {
+  "mem:", 1, ram_open, ram_close, mem_read, mem_write,
+  mem_readv, mem_writev, ram_flush, ram_discard, NULL
+};
+
+// ---------------------------------------------------------------------------
+
+// Backends selected by a prefix
+static const VDISK_BACKEND *backends[] = {
+  &vdisk_backend_mmap,
+  &vdisk_backend_mem,
+  &vdisk_backend_stripe,
+  &vdisk_backend_mirror,
+  NULL
+};
+
+/**
+ * Find the backend for a disk name
+ *
+ * @param name The disk name, possibly with a backend prefix
+ * @param path Set to the rest of the name, after the prefix
+ * @return The backend; the file backend if there is no known prefix
+ */
+const VDISK_BACKEND *vdisk_backend_select(char *name, char **path)
+{
+  for(int i = 0; backends[i] != NULL; ++i) {
+    size_t length = strlen(backends[i]->prefix);
+    if(!strncmp(name, backends[i]->prefix, length)) {
+      *path = name + length;
+      return(backends[i]);
+    }
+  }
+  *path = name;
+  return(&vdisk_backend_file);
+}
@@ -0,0 +1,882 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include "vdisk.h"
+/*
+ * Write-ahead metadata journal for the virtual disk.
+ *
+ * An operation that updates several blocks brackets its writes with
+ * vdisk_txn_begin()/vdisk_txn_end().  In between, vdisk_write_block() only
+ * records the new block contents in the running transaction, where reads from
+ * any thread sharing the handle find them.  Operations that run at the same
+ * time join the same transaction; the last one to end commits it for all of
+ * them (group commit):
+ *   1. the descriptor and the block images are appended to the journal
+ *   2. one flush (fdatasync() for a file) makes the whole group durable
+ *   3. the blocks are written to their home locations (not synced)
+ * The journal is checkpointed (home locations synced, journal emptied) in the
+ * background once it is half full, or in the foreground if it fills up.
+ *
+ * The journal header says up to which transaction the home locations are
+ * known to be durable.  Transactions after that are replayed when the disk is
+ * opened, and by the next commit, so a crash between steps 2 and 3 (or before
+ * the home writes reach the media) loses nothing.
+ *
+ * Other processes must not see (or build on) a block before the transaction
+ * that changed it is at home.  A transaction holds the block lock of each
+ * block that it writes, exclusively, until then; the block locks that the
+ * operations take order the rest.  The image lock is held exclusively only
+ * while steps 1-3 run and while the journal is replayed or emptied, and reads
+ * of home locations take it shared, so no reader sees half a transaction.
+ * A thread never waits for another process's block lock as part of a
+ * transaction that holds blocks: what the transaction has written so far is
+ * committed, and the thread leaves it until it has the lock, so that the
+ * operations still in the transaction can end and commit the rest
+ * (vdisk_txn_suspend()).  Threads sharing a handle are unaffected by all
+ * this and commit together.
+ */
+
+// Debug flag
+#define debug 0
+
+// Identifies the journal header and transaction descriptors
+#define JOURNAL_MAGIC 0x4c4a554f
+#define TXN_MAGIC 0x5854554f
+
+// Seconds between background checks of the journal
+#define CHECKPOINT_INTERVAL 1
+
+// Journal block 0
+typedef struct journal_header_s
+{
+  unsigned int magic;
+
+  // Sequence number of the first live transaction (at journal block 1)
+  unsigned int sequence;
+
+  // Transactions numbered below this are durable at their home locations,
+  //  so are not replayed
+  unsigned int written;
+} JOURNAL_HEADER;
+
+// First block of every transaction in the journal
+typedef struct journal_descriptor_s
+{
+  unsigned int magic;
+  unsigned int sequence;
+
+  // Covers block_ref[] and the block images, so a torn write is detected
+  unsigned int checksum;
+
+  unsigned short n_blocks;
+  BLOCK_REFERENCE block_ref[VDISK_TXN_MAX_BLOCKS];
+} JOURNAL_DESCRIPTOR;
+
+// The transaction joined by this thread, if any
+static __thread VDISK *thread_disk = NULL;
+static __thread VDISK_TXN *thread_txn = NULL;
+static __thread int thread_depth = 0;
+static __thread int thread_credits = 0;
+
+// Error from committing this thread's updates while it was suspended
+static __thread int thread_error = 0;
+
+/**
+ * Offset in the image file of a journal block
+ */
+static off_t journal_offset(int j)
+{
+  return((off_t) (N_BLOCKS_IN_DISK + j) * BLOCK_SIZE);
+}
+
+/**
+ * Checksum (FNV-1a) of a transaction: its block list and block images
+ *
+ * @param desc The descriptor (block list)
+ * @param data The block images, one after another
+ */
+static unsigned int journal_checksum(JOURNAL_DESCRIPTOR *desc, unsigned char *data)
+{
+  unsigned int hash = 2166136261u;
+  unsigned char *refs = (unsigned char *) desc->block_ref;
+
+  for(int i = 0; i < desc->n_blocks * sizeof(BLOCK_REFERENCE); ++i)
+    hash = (hash ^ refs[i]) * 16777619u;
+  for(int i = 0; i < desc->n_blocks * BLOCK_SIZE; ++i)
+    hash = (hash ^ data[i]) * 16777619u;
+  return(hash);
+}
+
+/**
+ * Write a block to its home location, bypassing the transaction buffers.
+ * The image lock is held exclusively, so readers are kept out while the
+ * block changes
+ *
+ * @param replay Set when replaying: a block that is at home already is not
+ *               written again, so that opening a disk does not write to it
+ */
+static int journal_write_home(VDISK *disk, BLOCK_REFERENCE block_ref, void *block, int replay)
+{
+  unsigned char home[BLOCK_SIZE];
+  off_t offset = (off_t) block_ref * BLOCK_SIZE;
+
+  if(replay && vdisk_image_read(disk, home, BLOCK_SIZE, offset) == 0 &&
+     memcmp(home, block, BLOCK_SIZE) == 0)
+    return(0);
+  if(vdisk_image_write(disk, block, BLOCK_SIZE, offset) != 0) {
+    fprintf(stderr, "vdisk_journal: home write of block %d failed\n", block_ref);
+    return(-4);
+  }
+  return(0);
+}
+
+/**
+ * Write a fresh journal header
+ *
+ * @param sequence Sequence number of the first transaction to be written
+ * @param written Sequence number of the first transaction that may not be
+ *                durable at home yet
+ */
+static int journal_write_header(VDISK *disk, unsigned int sequence, unsigned int written)
+{
+  unsigned char block[BLOCK_SIZE];
+  JOURNAL_HEADER *header = (JOURNAL_HEADER *) block;
+
+  memset(block, 0, BLOCK_SIZE);
+  header->magic = JOURNAL_MAGIC;
+  header->sequence = sequence;
+  header->written = written;
+  if(vdisk_image_write(disk, block, BLOCK_SIZE, journal_offset(0)) != 0) {
+    fprintf(stderr, "vdisk_journal: header write failed\n");
+    return(-4);
+  }
+  return(0);
+}
+
+/**
+ * Read the committed transactions from a point in the journal onward and
+ * write the latest image of every block that they update to its home
+ * location, unless the transaction is known to be there.  The state of the
+ * journal on the handle is brought up to date
+ *
+ * @param disk The open disk; journal_lock and the image lock held
+ * @param head Journal block at which to start
+ * @param sequence Sequence number expected at head
+ * @param written Transactions numbered below this are only skipped
+ * @return Number of transactions found; <0 on error
+ */
+static int journal_replay(VDISK *disk, int head, unsigned int sequence, unsigned int written)
+{
+  unsigned char *latest = NULL;
+  unsigned char present[N_BLOCKS_IN_DISK];
+  unsigned char buffer[(1 + VDISK_TXN_MAX_BLOCKS) * BLOCK_SIZE];
+  JOURNAL_DESCRIPTOR *desc = (JOURNAL_DESCRIPTOR *) buffer;
+  int n_txns = 0;
+
+  memset(present, 0, sizeof(present));
+
+  while(head < N_JOURNAL_BLOCKS) {
+    // Is there a complete transaction with the next sequence number here?
+    if(vdisk_image_read(disk, buffer, BLOCK_SIZE, journal_offset(head)) != 0)
+      break;
+    if(desc->magic != TXN_MAGIC || desc->sequence != sequence ||
+       desc->n_blocks > VDISK_TXN_MAX_BLOCKS || head + 1 + desc->n_blocks > N_JOURNAL_BLOCKS)
+      break;
+
+    // Transactions that are at home were complete: only their length matters
+    if(sequence >= written) {
+      int length = desc->n_blocks * BLOCK_SIZE;
+      if(vdisk_image_read(disk, buffer + BLOCK_SIZE, length, journal_offset(head + 1)) != 0)
+        break;
+      if(journal_checksum(desc, buffer + BLOCK_SIZE) != desc->checksum)
+        break;
+
+      // Later transactions override earlier ones
+      if(latest == NULL && (latest = malloc(N_BLOCKS_IN_DISK * BLOCK_SIZE)) == NULL)
+        return(-1);
+      for(int i = 0; i < desc->n_blocks; ++i) {
+        BLOCK_REFERENCE ref = desc->block_ref[i];
+        if(ref < N_BLOCKS_IN_DISK) {
+          memcpy(latest + ref * BLOCK_SIZE, buffer + (1 + i) * BLOCK_SIZE, BLOCK_SIZE);
+          present[ref] = 1;
+        }
+      }
+    }
+
+    if(debug)
+      fprintf(stderr, "##Journal: transaction %u at %d (%d blocks)\n", sequence, head, desc->n_blocks);
+    head += 1 + desc->n_blocks;
+    ++sequence;
+    ++n_txns;
+  }
+
+  // Each block is written once, with its final contents
+  int ret = 0;
+  for(int ref = 0; ref < N_BLOCKS_IN_DISK; ++ref) {
+    if(present[ref] && journal_write_home(disk, ref, latest + ref * BLOCK_SIZE, 1) != 0)
+      ret = -4;
+  }
+  free(latest);
+
+  disk->journal_head = head;
+  disk->journal_sequence = sequence;
+  return(ret < 0 ? ret : n_txns);
+}
+
+/**
+ * Bring the handle's view of the journal up to date with the image: other
+ * processes may have appended transactions (or emptied the journal) since we
+ * last looked.  Any transaction that may not be at home is replayed.  The
+ * image lock must be held exclusively
+ *
+ * @param disk The open disk; journal_lock held
+ * @return 0 on success; <0 on error
+ */
+static int journal_load(VDISK *disk)
+{
+  unsigned char block[BLOCK_SIZE];
+  JOURNAL_HEADER *header = (JOURNAL_HEADER *) block;
+
+  if(vdisk_image_read(disk, block, BLOCK_SIZE, journal_offset(0)) != 0 ||
+     header->magic != JOURNAL_MAGIC) {
+    // Image without a journal yet: start one
+    if(vdisk_journal_format(disk) != 0)
+      return(-4);
+    header->sequence = disk->journal_start_sequence;
+    header->written = disk->journal_start_sequence;
+  }
+
+  int ret;
+  if(!disk->journal_valid || header->sequence != disk->journal_start_sequence) {
+    // Scan the whole journal
+    disk->journal_start_sequence = header->sequence;
+    ret = journal_replay(disk, 1, header->sequence, header->written);
+  }else{
+    // Only what was appended since our last look
+    ret = journal_replay(disk, disk->journal_head, disk->journal_sequence, header->written);
+  }
+  if(ret < 0)
+    return(ret);
+
+  disk->journal_valid = 1;
+  return(0);
+}
+
+/**
+ * Empty the journal: once the home locations are durable, none of the
+ * transactions in it are needed any more
+ *
+ * @param disk The open disk; journal_lock held and journal loaded
+ * @return 0 on success; <0 on error
+ */
+static int journal_checkpoint(VDISK *disk)
+{
+  if(disk->journal_head == 1)
+    return(0);
+
+  if(debug)
+    fprintf(stderr, "##Journal: checkpoint at %d\n", disk->journal_head);
+
+  if(vdisk_image_flush(disk) != 0 ||
+     journal_write_header(disk, disk->journal_sequence, disk->journal_sequence) != 0 ||
+     vdisk_image_flush(disk) != 0) {
+    fprintf(stderr, "vdisk_journal: checkpoint failed\n");
+    return(-4);
+  }
+  disk->journal_start_sequence = disk->journal_sequence;
+  disk->journal_head = 1;
+  return(0);
+}
+
+/**
+ * Commit a transaction: log it, make the log durable, then write the blocks
+ * to their home locations.  Other processes' commits and readers are kept out
+ * meanwhile
+ *
+ * @param disk The open disk; the transaction is disk->committing
+ * @param txn The transaction
+ * @return 0 on success; <0 on error
+ */
+static int journal_commit(VDISK *disk, VDISK_TXN *txn)
+{
+  unsigned char block[BLOCK_SIZE];
+  JOURNAL_DESCRIPTOR *desc = (JOURNAL_DESCRIPTOR *) block;
+  int ret;
+
+  if(txn->n_blocks == 0)
+    return(0);
+
+  if(vdisk_lock_image(disk, VDISK_LOCK_EXCLUSIVE) != 0)
+    return(-5);
+
+  // Append after what other processes have, finishing whatever one of them
+  // did not write home
+  pthread_mutex_lock(&disk->journal_lock);
+  ret = journal_load(disk);
+  if(ret == 0 && disk->journal_head + 1 + txn->n_blocks > N_JOURNAL_BLOCKS)
+    ret = journal_checkpoint(disk);
+  int head = disk->journal_head;
+  unsigned int sequence = disk->journal_sequence;
+  unsigned int start_sequence = disk->journal_start_sequence;
+  pthread_mutex_unlock(&disk->journal_lock);
+  if(ret != 0) {
+    vdisk_unlock_image(disk);
+    return(ret);
+  }
+
+  // Descriptor and block images go out in a single write
+  memset(block, 0, BLOCK_SIZE);
+  desc->magic = TXN_MAGIC;
+  desc->sequence = sequence;
+  desc->n_blocks = txn->n_blocks;
+  memcpy(desc->block_ref, txn->block_ref, txn->n_blocks * sizeof(BLOCK_REFERENCE));
+  desc->checksum = journal_checksum(desc, &txn->data[0][0]);
+
+  struct iovec iov[2];
+  iov[0].iov_base = block;
+  iov[0].iov_len = BLOCK_SIZE;
+  iov[1].iov_base = txn->data;
+  iov[1].iov_len = txn->n_blocks * BLOCK_SIZE;
+  if(vdisk_image_writev(disk, iov, 2, journal_offset(head)) != 0 || vdisk_image_flush(disk) != 0) {
+    fprintf(stderr, "vdisk_journal: commit of transaction %u failed\n", sequence);
+    vdisk_unlock_image(disk);
+    return(-4);
+  }
+
+  if(debug)
+    fprintf(stderr, "##Journal: committed %u at %d (%d blocks)\n", sequence, head, txn->n_blocks);
+
+  pthread_mutex_lock(&disk->journal_lock);
+  disk->journal_head = head + 1 + txn->n_blocks;
+  disk->journal_sequence = sequence + 1;
+  if(disk->journal_head > N_JOURNAL_BLOCKS / 2)
+    pthread_cond_broadcast(&disk->journal_cond);
+  pthread_mutex_unlock(&disk->journal_lock);
+
+  // Now durable: the home locations may be updated at leisure.  Every
+  // earlier transaction was at home before the flush, so none of them needs
+  // a replay any more
+  for(int i = 0; i < txn->n_blocks; ++i) {
+    if(journal_write_home(disk, txn->block_ref[i], txn->data[i], 0) != 0)
+      ret = -4;
+  }
+  if(journal_write_header(disk, start_sequence, sequence) != 0)
+    ret = -4;
+  vdisk_unlock_image(disk);
+  return(ret);
+}
+
+/**
+ * Release the blocks that a transaction held until they were at home.  Only
+ * once it is no longer disk->committing: readers on this handle would
+ * otherwise take its copies over what another process writes next
+ *
+ * @param disk The open disk
+ * @param txn The transaction, once committed
+ */
+static void journal_release(VDISK *disk, VDISK_TXN *txn)
+{
+  for(int i = 0; i < txn->n_blocks; ++i)
+    vdisk_unlock_block(disk, txn->block_ref[i]);
+}
+
+/**
+ * Background checkpointing: empties the journal once it is half full, while
+ * no transaction is being committed
+ */
+static void *journal_checkpoint_thread(void *arg)
+{
+  VDISK *disk = (VDISK *) arg;
+
+  int wait = 1;
+
+  pthread_mutex_lock(&disk->journal_lock);
+  while(!disk->checkpoint_stop) {
+    if(wait || disk->journal_head <= N_JOURNAL_BLOCKS / 2) {
+      struct timespec until;
+      clock_gettime(CLOCK_REALTIME, &until);
+      until.tv_sec += CHECKPOINT_INTERVAL;
+      pthread_cond_timedwait(&disk->journal_cond, &disk->journal_lock, &until);
+      wait = 0;
+      continue;
+    }
+
+    // Other processes must not commit while the journal is emptied
+    pthread_mutex_unlock(&disk->journal_lock);
+    vdisk_lock_image(disk, VDISK_LOCK_EXCLUSIVE);
+    pthread_mutex_lock(&disk->journal_lock);
+
+    // Take the commit slot
+    while(disk->committing != NULL && !disk->checkpoint_stop)
+      pthread_cond_wait(&disk->journal_cond, &disk->journal_lock);
+    if(!disk->checkpoint_stop && journal_load(disk) == 0)
+      journal_checkpoint(disk);
+
+    // Pause before trying again, even if that failed
+    wait = 1;
+
+    pthread_mutex_unlock(&disk->journal_lock);
+    vdisk_unlock_image(disk);
+    pthread_mutex_lock(&disk->journal_lock);
+  }
+  pthread_mutex_unlock(&disk->journal_lock);
+  return(NULL);
+}
+
+/**
+ * Initialize the journal state of a newly opened disk
+ *
+ * @param disk The open disk
+ */
+void vdisk_journal_init(VDISK *disk)
+{
+  pthread_mutex_init(&disk->journal_lock, NULL);
+  pthread_cond_init(&disk->journal_cond, NULL);
+  disk->running = NULL;
+  disk->committing = NULL;
+  disk->next_tid = 0;
+  disk->committed_tid = 0;
+  disk->commit_error = 0;
+  disk->journal_valid = 0;
+  disk->journal_start_sequence = 0;
+  disk->journal_sequence = 0;
+  disk->journal_head = 1;
+  disk->checkpoint_running = 0;
+  disk->checkpoint_stop = 0;
+}
+
+/**
+ * Stop background checkpointing and release the journal state of a disk
+ * that is being closed
+ *
+ * @param disk The open disk
+ */
+void vdisk_journal_shutdown(VDISK *disk)
+{
+  pthread_mutex_lock(&disk->journal_lock);
+  disk->checkpoint_stop = 1;
+  pthread_cond_broadcast(&disk->journal_cond);
+  pthread_mutex_unlock(&disk->journal_lock);
+
+  if(disk->checkpoint_running)
+    pthread_join(disk->checkpoint_thread, NULL);
+
+  pthread_mutex_destroy(&disk->journal_lock);
+  pthread_cond_destroy(&disk->journal_cond);
+}
+
+/**
+ * Start an empty journal on the disk.  Used when formatting; any transaction
+ * left in the region from an earlier life of the image is discarded
+ *
+ * @param disk The open disk
+ * @return 0 on success; <0 on error
+ */
+int vdisk_journal_format(VDISK *disk)
+{
+  unsigned char block[BLOCK_SIZE];
+  memset(block, 0, BLOCK_SIZE);
+
+  // An invalid first descriptor ends the journal
+  if(journal_write_header(disk, 1, 1) != 0 ||
+     vdisk_image_write(disk, block, BLOCK_SIZE, journal_offset(1)) != 0 ||
+     vdisk_image_flush(disk) != 0) {
+    fprintf(stderr, "vdisk_journal_format(): write failed\n");
+    return(-4);
+  }
+
+  disk->journal_valid = 1;
+  disk->journal_start_sequence = 1;
+  disk->journal_sequence = 1;
+  disk->journal_head = 1;
+  return(0);
+}
+
+/**
+ * Replay whatever the journal holds that may not be at home, as a process
+ * that crashed can leave it.  An image without a journal is left alone
+ *
+ * @param disk The newly opened disk
+ * @return 0 on success; <0 on error
+ */
+int vdisk_journal_recover(VDISK *disk)
+{
+  unsigned char block[BLOCK_SIZE];
+  JOURNAL_HEADER *header = (JOURNAL_HEADER *) block;
+
+  if(vdisk_lock_image(disk, VDISK_LOCK_EXCLUSIVE) != 0)
+    return(-5);
+  pthread_mutex_lock(&disk->journal_lock);
+  int ret = 0;
+  if(vdisk_image_read(disk, block, BLOCK_SIZE, journal_offset(0)) == 0 &&
+     header->magic == JOURNAL_MAGIC)
+    ret = journal_load(disk);
+  pthread_mutex_unlock(&disk->journal_lock);
+  vdisk_unlock_image(disk);
+  return(ret);
+}
+
+/**
+ * Replay and then empty the journal, so that the home locations alone hold
+ * the state of the disk.  For tools that read or repair the image directly.
+ * The caller must hold the image lock exclusively
+ *
+ * @param disk The open disk
+ * @return 0 on success; <0 on error
+ */
+int vdisk_journal_checkpoint(VDISK *disk)
+{
+  pthread_mutex_lock(&disk->journal_lock);
+  while(disk->committing != NULL)
+    pthread_cond_wait(&disk->journal_cond, &disk->journal_lock);
+  int ret = journal_load(disk);
+  if(ret == 0)
+    ret = journal_checkpoint(disk);
+  pthread_mutex_unlock(&disk->journal_lock);
+  return(ret);
+}
+
+/**
+ * Begin an operation that updates the disk.  The calling thread joins the
+ * running transaction; until vdisk_txn_end(), its vdisk_write_block() calls
+ * are recorded there.  Calls nest
+ *
+ * @param disk The open disk
+ * @param credits Largest number of distinct blocks the operation will write
+ * @return 0 on success; <0 on error
+ */
+int vdisk_txn_begin(VDISK *disk, int credits)
+{
+  if(thread_depth > 0) {
+    if(thread_disk != disk) {
+      fprintf(stderr, "vdisk_txn_begin(): already in a transaction on another disk\n");
+      return(-1);
+    }
+    ++thread_depth;
+    return(0);
+  }
+
+  pthread_mutex_lock(&disk->journal_lock);
+
+  // A full transaction commits once its operations end
+  while(disk->running != NULL && disk->running->credits + credits > VDISK_TXN_MAX_BLOCKS)
+    pthread_cond_wait(&disk->journal_cond, &disk->journal_lock);
+
+  if(disk->running == NULL) {
+    disk->running = calloc(1, sizeof(VDISK_TXN));
+    if(disk->running == NULL) {
+      pthread_mutex_unlock(&disk->journal_lock);
+      fprintf(stderr, "vdisk_txn_begin(): out of memory\n");
+      return(-1);
+    }
+    disk->running->tid = ++disk->next_tid;
+  }
+  disk->running->n_handles++;
+  disk->running->credits += credits;
+
+  thread_disk = disk;
+  thread_txn = disk->running;
+  thread_depth = 1;
+  thread_credits = credits;
+
+  if(!disk->checkpoint_running &&
+     pthread_create(&disk->checkpoint_thread, NULL, journal_checkpoint_thread, disk) == 0)
+    disk->checkpoint_running = 1;
+
+  pthread_mutex_unlock(&disk->journal_lock);
+  return(0);
+}
+
+/**
+ * Leave a transaction, committing it if this was the last operation in it
+ *
+ * @param disk The open disk
+ * @param txn The transaction
+ * @param wait Set to wait for another operation to commit it
+ * @return 0 if the transaction is durable (or being committed by another
+ *         operation, if wait is not set); <0 on error
+ */
+static int journal_end(VDISK *disk, VDISK_TXN *txn, int wait)
+{
+  pthread_mutex_lock(&disk->journal_lock);
+  unsigned long tid = txn->tid;
+
+  // The last one out commits, once the previous transaction is written.
+  // Until then the transaction stays open, and operations that join it in
+  // the meantime hand the commit to whichever of them ends last
+  if(--txn->n_handles == 0 && !txn->committer_waiting) {
+    txn->committer_waiting = 1;
+    while(disk->committing != NULL && txn->n_handles == 0)
+      pthread_cond_wait(&disk->journal_cond, &disk->journal_lock);
+    txn->committer_waiting = 0;
+  }
+
+  if(txn->n_handles > 0 || txn->committer_waiting || disk->committing != NULL) {
+    // Someone else will commit: wait for it
+    int ret = 0;
+    if(wait) {
+      while(disk->committed_tid < tid)
+        pthread_cond_wait(&disk->journal_cond, &disk->journal_lock);
+      ret = disk->commit_error;
+    }
+    pthread_mutex_unlock(&disk->journal_lock);
+    return(ret);
+  }
+
+  // Close the transaction to newcomers and commit it
+  disk->running = NULL;
+  disk->committing = txn;
+  pthread_cond_broadcast(&disk->journal_cond);
+  pthread_mutex_unlock(&disk->journal_lock);
+
+  int ret = journal_commit(disk, txn);
+  if(ret == 0)
+    ret = txn->error;
+
+  pthread_mutex_lock(&disk->journal_lock);
+  disk->committing = NULL;
+  disk->committed_tid = txn->tid;
+  disk->commit_error = ret;
+  pthread_cond_broadcast(&disk->journal_cond);
+  pthread_mutex_unlock(&disk->journal_lock);
+
+  journal_release(disk, txn);
+  free(txn);
+  return(ret);
+}
+
+/**
+ * End an operation begun with vdisk_txn_begin().  Returns once the
+ * transaction that the operation joined has committed: the last operation to
+ * end commits it, the others wait for that
+ *
+ * @param disk The open disk
+ * @return 0 if the operation's updates are durable; <0 on error
+ */
+int vdisk_txn_end(VDISK *disk)
+{
+  if(thread_depth == 0 || thread_disk != disk) {
+    fprintf(stderr, "vdisk_txn_end(): no transaction\n");
+    return(-1);
+  }
+  if(--thread_depth > 0)
+    return(0);
+
+  VDISK_TXN *txn = thread_txn;
+  thread_txn = NULL;
+  thread_disk = NULL;
+
+  int ret = journal_end(disk, txn, 1);
+  if(ret == 0)
+    ret = thread_error;
+  thread_error = 0;
+  return(ret);
+}
+
+/**
+ * Commit what a transaction has written so far.  The operations in it carry
+ * on in it; only a crash before they end could leave part of them on the
+ * disk
+ *
+ * @param disk The open disk
+ * @param txn The transaction
+ */
+static void journal_yield(VDISK *disk, VDISK_TXN *txn)
+{
+  pthread_mutex_lock(&disk->journal_lock);
+  while(disk->committing != NULL && txn->n_blocks > 0)
+    pthread_cond_wait(&disk->journal_cond, &disk->journal_lock);
+  VDISK_TXN *part = NULL;
+  if(txn->n_blocks > 0 && (part = malloc(sizeof(VDISK_TXN))) != NULL) {
+    // The blocks move to a transaction of their own
+    part->n_blocks = txn->n_blocks;
+    memcpy(part->block_ref, txn->block_ref, txn->n_blocks * sizeof(BLOCK_REFERENCE));
+    memcpy(part->data, txn->data, txn->n_blocks * BLOCK_SIZE);
+    txn->n_blocks = 0;
+    disk->committing = part;
+  }
+  pthread_mutex_unlock(&disk->journal_lock);
+  if(part == NULL)
+    return;
+
+  if(debug)
+    fprintf(stderr, "##Journal: yielding %d blocks\n", part->n_blocks);
+
+  int ret = journal_commit(disk, part);
+
+  pthread_mutex_lock(&disk->journal_lock);
+  disk->committing = NULL;
+  if(ret != 0 && txn->error == 0)
+    txn->error = ret;
+  pthread_cond_broadcast(&disk->journal_cond);
+  pthread_mutex_unlock(&disk->journal_lock);
+
+  journal_release(disk, part);
+  free(part);
+}
+
+/**
+ * Take the calling thread out of its transaction before it waits for a lock
+ * that another process (or a thread waiting for one) holds.  That process
+ * may be waiting for one of the blocks that the transaction holds, so what
+ * the transaction has written so far is written home and released first.
+ * Leaving lets the other operations in the transaction end without waiting
+ * for this one, so the blocks that they write meanwhile are released too
+ *
+ * @param disk The open disk
+ * @return What vdisk_txn_resume() needs: 0 if the thread has no transaction
+ */
+int vdisk_txn_suspend(VDISK *disk)
+{
+  if(thread_depth == 0 || thread_disk != disk)
+    return(0);
+
+  VDISK_TXN *txn = thread_txn;
+  int depth = thread_depth;
+  journal_yield(disk, txn);
+  if(txn->error != 0 && thread_error == 0)
+    thread_error = txn->error;
+
+  thread_txn = NULL;
+  thread_disk = NULL;
+  thread_depth = 0;
+  int ret = journal_end(disk, txn, 0);
+  if(ret != 0 && thread_error == 0)
+    thread_error = ret;
+  return(depth);
+}
+
+/**
+ * Return the calling thread to a transaction after vdisk_txn_suspend().  It
+ * joins the running transaction even if that is short of room, as it may
+ * hold locks that the operations in it need to end: a transaction that fills
+ * up commits what it has early
+ *
+ * @param disk The open disk
+ * @param depth What vdisk_txn_suspend() returned
+ */
+void vdisk_txn_resume(VDISK *disk, int depth)
+{
+  if(depth == 0)
+    return;
+
+  pthread_mutex_lock(&disk->journal_lock);
+  if(disk->running == NULL) {
+    disk->running = calloc(1, sizeof(VDISK_TXN));
+    if(disk->running == NULL) {
+      // The rest of the operation's updates go straight home
+      pthread_mutex_unlock(&disk->journal_lock);
+      fprintf(stderr, "vdisk_txn_resume(): out of memory\n");
+      return;
+    }
+    disk->running->tid = ++disk->next_tid;
+  }
+  disk->running->n_handles++;
+  disk->running->credits += thread_credits;
+
+  thread_disk = disk;
+  thread_txn = disk->running;
+  thread_depth = depth;
+  pthread_mutex_unlock(&disk->journal_lock);
+}
+
+/**
+ * Find a block in a transaction
+ *
+ * @return Its index; txn->n_blocks if it is not there
+ */
+static int journal_find(VDISK_TXN *txn, BLOCK_REFERENCE block_ref)
+{
+  int i;
+  for(i = 0; i < txn->n_blocks && txn->block_ref[i] != block_ref; ++i)
+    ;
+  return(i);
+}
+
+/**
+ * Record a block update in the calling thread's transaction.  The
+ * transaction holds the block exclusively from now until it is at home
+ *
+ * @param disk The open disk
+ * @param block_ref The block
+ * @param block The new contents
+ * @return 1 if recorded; 0 if the thread has no transaction on this disk;
+ *         <0 on error
+ */
+int vdisk_txn_write_block(VDISK *disk, BLOCK_REFERENCE block_ref, void *block)
+{
+  if(thread_depth == 0 || thread_disk != disk)
+    return(0);
+
+  VDISK_TXN *txn = thread_txn;
+  int ret = 1;
+
+  pthread_mutex_lock(&disk->journal_lock);
+  int i = journal_find(txn, block_ref);
+  if(i == txn->n_blocks) {
+    // Waiting for the block may commit what the transaction has so far, and
+    // move the thread to another transaction
+    pthread_mutex_unlock(&disk->journal_lock);
+    if(vdisk_lock_block(disk, block_ref, VDISK_LOCK_EXCLUSIVE) != 0)
+      return(-5);
+    pthread_mutex_lock(&disk->journal_lock);
+    txn = thread_txn;
+
+    // A transaction that has run out of room commits what it has
+    i = journal_find(txn, block_ref);
+    if(i == VDISK_TXN_MAX_BLOCKS) {
+      pthread_mutex_unlock(&disk->journal_lock);
+      journal_yield(disk, txn);
+      pthread_mutex_lock(&disk->journal_lock);
+      i = journal_find(txn, block_ref);
+    }
+    if(i < txn->n_blocks) {
+      // Another thread added it meanwhile
+      vdisk_unlock_block(disk, block_ref);
+    }else if(i == VDISK_TXN_MAX_BLOCKS) {
+      fprintf(stderr, "vdisk_txn_write_block(): transaction is full\n");
+      vdisk_unlock_block(disk, block_ref);
+      ret = -6;
+    }else{
+      txn->block_ref[i] = block_ref;
+      txn->n_blocks++;
+    }
+  }
+  if(ret > 0)
+    memcpy(txn->data[i], block, BLOCK_SIZE);
+  pthread_mutex_unlock(&disk->journal_lock);
+  return(ret);
+}
+
+/**
+ * Look up the latest contents of a block in the transactions that have not
+ * reached their home locations yet
+ *
+ * @param disk The open disk
+ * @param block_ref The block
+ * @param block Buffer for the contents
+ * @return 1 if found; 0 if the home location is current
+ */
+int vdisk_txn_read_block(VDISK *disk, BLOCK_REFERENCE block_ref, void *block)
+{
+  VDISK_TXN *txns[2];
+  int found = 0;
+
+  pthread_mutex_lock(&disk->journal_lock);
+  txns[0] = disk->running;
+  txns[1] = disk->committing;
+  for(int t = 0; t < 2 && !found; ++t) {
+    if(txns[t] == NULL)
+      continue;
+    for(int i = 0; i < txns[t]->n_blocks; ++i) {
+      if(txns[t]->block_ref[i] == block_ref) {
+        memcpy(block, txns[t]->data[i], BLOCK_SIZE);
+        found = 1;
+        break;
+      }
+    }
+  }
+  pthread_mutex_unlock(&disk->journal_lock);
+  return(found);
+}
@@ -0,0 +1,222 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <string.h>
+#include "vdisk.h"
+/*
+ * Mirrored backend: every replica file holds the whole image.  The disk is
+ * named
+ *
+ *   mirror:replica,replica,...
+ *
+ * Writes and flushes go to every replica.  A read goes to the replica with
+ * the fewest reads in flight; among equally busy ones the block number
+ * picks, so that a single thread reading block after block still spreads
+ * its reads.  A read that fails or comes up short is retried on the other
+ * replicas.  A replica that fails a write is dropped until the disk is
+ * opened again.  Every process must name the replicas in the same order;
+ * the cross-process locks are taken on the first.
+ */
+
+// Debug flag
+#define debug 0
+
+// Most replicas of an image
+#define MIRROR_MAX_REPLICAS 8
+
+typedef struct mirror_replica_s
+{
+  int fd;
+
+  // Reads in flight
+  int queued;
+
+  // Set once a write to the replica has failed
+  int failed;
+} MIRROR_REPLICA;
+
+typedef struct mirror_state_s
+{
+  int n_replicas;
+  MIRROR_REPLICA replica[MIRROR_MAX_REPLICAS];
+} MIRROR_STATE;
+
+/**
+ * Choose the replica to read from first
+ *
+ * @return Index of the replica; <0 if none is left
+ */
+static int mirror_choose(MIRROR_STATE *state, off_t offset)
+{
+  int start = (offset / BLOCK_SIZE) % state->n_replicas;
+  int best = -1;
+  int best_queued = 0;
+
+  for(int i = 0; i < state->n_replicas; ++i) {
+    int r = (start + i) % state->n_replicas;
+    int queued = __atomic_load_n(&state->replica[r].queued, __ATOMIC_RELAXED);
+    if(!state->replica[r].failed && (best < 0 || queued < best_queued)) {
+      best = r;
+      best_queued = queued;
+    }
+  }
+  return(best);
+}
+
+static ssize_t mirror_readv(void *s, const struct iovec *iov, int iovcnt, off_t offset)
+{
+  MIRROR_STATE *state = s;
+  size_t length = 0;
+
+  for(int i = 0; i < iovcnt; ++i)
+    length += iov[i].iov_len;
+
+  int first = mirror_choose(state, offset);
+  if(first < 0) {
+    errno = EIO;
+    return(-1);
+  }
+
+  // The chosen replica, then the others in turn
+  for(int i = 0; i < state->n_replicas; ++i) {
+    MIRROR_REPLICA *replica = &state->replica[(first + i) % state->n_replicas];
+    if(replica->failed)
+      continue;
+
+    __atomic_add_fetch(&replica->queued, 1, __ATOMIC_RELAXED);
+    ssize_t n = preadv(replica->fd, iov, iovcnt, offset);
+    __atomic_sub_fetch(&replica->queued, 1, __ATOMIC_RELAXED);
+
+    if(n == length)
+      return(n);
+    if(debug)
+      fprintf(stderr, "##Mirror: short read at %ld from replica %d\n",
+              (long) offset, (first + i) % state->n_replicas);
+  }
+  errno = EIO;
+  return(-1);
+}
+
+static ssize_t mirror_writev(void *s, const struct iovec *iov, int iovcnt, off_t offset)
+{
+  MIRROR_STATE *state = s;
+  size_t length = 0;
+  int written = 0;
+
+  for(int i = 0; i < iovcnt; ++i)
+    length += iov[i].iov_len;
+
+  for(int r = 0; r < state->n_replicas; ++r) {
+    MIRROR_REPLICA *replica = &state->replica[r];
+    if(replica->failed)
+      continue;
+    if(pwritev(replica->fd, iov, iovcnt, offset) == length) {
+      ++written;
+    }else{
+      fprintf(stderr, "vdisk: write to mirror replica %d failed; dropping it\n", r);
+      replica->failed = 1;
+    }
+  }
+
+  if(written == 0) {
+    errno = EIO;
+    return(-1);
+  }
+  return(length);
+}
+
+static ssize_t mirror_read(void *s, void *buffer, size_t length, off_t offset)
+{
+  struct iovec iov = { buffer, length };
+  return(mirror_readv(s, &iov, 1, offset));
+}
+
+static ssize_t mirror_write(void *s, const void *buffer, size_t length, off_t offset)
+{
+  struct iovec iov = { (void *) buffer, length };
+  return(mirror_writev(s, &iov, 1, offset));
+}
+
+static int mirror_flush(void *s)
+{
+  MIRROR_STATE *state = s;
+  int flushed = 0;
+
+  for(int r = 0; r < state->n_replicas; ++r) {
+    MIRROR_REPLICA *replica = &state->replica[r];
+    if(replica->failed)
+      continue;
+    if(fdatasync(replica->fd) == 0) {
+      ++flushed;
+    }else{
+      fprintf(stderr, "vdisk: flush of mirror replica %d failed; dropping it\n", r);
+      replica->failed = 1;
+    }
+  }
+  return(flushed > 0 ? 0 : -4);
+}
+
+static int mirror_discard(void *s, off_t size)
+{
+  MIRROR_STATE *state = s;
+
+  for(int r = 0; r < state->n_replicas; ++r) {
+    if(vdisk_backend_truncate_file(state->replica[r].fd, size) != 0)
+      return(-4);
+    state->replica[r].failed = 0;
+  }
+  return(0);
+}
+
+static int mirror_close(void *s)
+{
+  MIRROR_STATE *state = s;
+
+  for(int r = 0; r < state->n_replicas; ++r)
+    close(state->replica[r].fd);
+  free(state);
+  return(0);
+}
+
+/**
+ * Open the replicas named by "replica,replica,..."
+ */
+static void *mirror_open(char *name, int *lock_fd)
+{
+  MIRROR_STATE *state = calloc(1, sizeof(MIRROR_STATE));
+  char *names = strdup(name);
+  if(state == NULL || names == NULL) {
+    free(state);
+    free(names);
+    return(NULL);
+  }
+
+  char *saveptr;
+  for(char *replica_name = strtok_r(names, ",", &saveptr); replica_name != NULL;
+      replica_name = strtok_r(NULL, ",", &saveptr)) {
+    int fd = -1;
+    if(state->n_replicas == MIRROR_MAX_REPLICAS)
+      fprintf(stderr, "vdisk: more than %d mirror replicas\n", MIRROR_MAX_REPLICAS);
+    else if((fd = vdisk_backend_open_file(replica_name)) < 0)
+      fprintf(stderr, "vdisk: unable to open mirror replica %s\n", replica_name);
+    if(fd < 0) {
+      free(names);
+      mirror_close(state);
+      return(NULL);
+    }
+    state->replica[state->n_replicas++].fd = fd;
+  }
+  free(names);
+
+  if(state->n_replicas == 0) {
+    free(state);
+    return(NULL);
+  }
+
+  *lock_fd = state->replica[0].fd;
+  return(state);
+}
+
+const VDISK_BACKEND vdisk_backend_mirror = {
+  "mirror:", 0, mirror_open, mirror_close, mirror_read, mirror_write,
+  mirror_readv, mirror_writev, mirror_flush, mirror_discard, NULL
+};
@@ -0,0 +1,244 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <string.h>
+#include <time.h>
+#include "vdisk.h"
+/*
+ * Instrumentation of a virtual disk.
+ *
+ * When the ZSTATS environment variable is set, each handle counts the blocks
+ * it reads and writes by class (the layer above says which block is which),
+ * the reads served by transactions that have not reached the disk, the bytes
+ * moved to and from the backend, and the latency of the file system
+ * operations that the layer above times.  Without ZSTATS, each hook is one
+ * test of a NULL pointer.
+ *
+ * When the handle is closed, the counts are added to the file named by
+ * ZSTATS, so they accumulate over every process that uses the disk (the file
+ * is locked while it is updated); ZSTATS=- prints them to stderr instead.
+ */
+
+// Debug flag
+#define debug 0
+
+static const char *class_names[VDISK_N_CLASSES] = { "data", "master", "inode", "directory" };
+static const char *op_names[VDISK_N_OPS] = { "mkdir", "rmdir", "list", "find", "read", "write" };
+
+/**
+ * Start counting if ZSTATS asks for it.  Every block starts out as data
+ *
+ * @param disk The disk being opened
+ */
+void vdisk_stats_init(VDISK *disk)
+{
+  memset(disk->block_class, VDISK_CLASS_DATA, sizeof(disk->block_class));
+  disk->stats = NULL;
+  if(getenv("ZSTATS") != NULL)
+    disk->stats = calloc(1, sizeof(VDISK_STATS));
+}
+
+/**
+ * Say what a block holds, so that its transfers are counted in its class
+ *
+ * @param disk The open disk
+ * @param block_ref The block
+ * @param block_class VDISK_CLASS_*
+ */
+void vdisk_stats_classify(VDISK *disk, BLOCK_REFERENCE block_ref, int block_class)
+{
+  if(disk->stats != NULL && block_ref < N_BLOCKS_IN_DISK)
+    disk->block_class[block_ref] = block_class;
+}
+
+/**
+ * Count block transfers
+ *
+ * @param disk The open disk
+ * @param first The first block
+ * @param n Number of consecutive blocks
+ * @param write Set for writes
+ */
+void vdisk_stats_blocks(VDISK *disk, BLOCK_REFERENCE first, int n, int write)
+{
+  if(disk->stats == NULL)
+    return;
+  for(int i = 0; i < n; ++i) {
+    int block_class = disk->block_class[first + i];
+    __atomic_add_fetch(write ? &disk->stats->writes[block_class] : &disk->stats->reads[block_class],
+                       1, __ATOMIC_RELAXED);
+  }
+}
+
+/**
+ * Count a block read that a transaction served
+ *
+ * @param disk The open disk
+ */
+void vdisk_stats_hit(VDISK *disk)
+{
+  if(disk->stats != NULL)
+    __atomic_add_fetch(&disk->stats->cache_hits, 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Count bytes moved to or from the backend
+ *
+ * @param disk The open disk
+ * @param length Number of bytes
+ * @param write Set for writes
+ */
+void vdisk_stats_bytes(VDISK *disk, size_t length, int write)
+{
+  if(disk->stats != NULL)
+    __atomic_add_fetch(write ? &disk->stats->bytes_written : &disk->stats->bytes_read,
+                       length, __ATOMIC_RELAXED);
+}
+
+/**
+ * Start timing an operation
+ *
+ * @param disk The open disk
+ * @return The time in nanoseconds, for vdisk_stats_op(); 0 if nothing is counted
+ */
+unsigned long vdisk_stats_start(VDISK *disk)
+{
+  if(disk->stats == NULL)
+    return(0);
+
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return(ts.tv_sec * 1000000000UL + ts.tv_nsec);
+}
+
+/**
+ * Finish timing an operation
+ *
+ * @param disk The open disk
+ * @param op VDISK_OP_*
+ * @param start What vdisk_stats_start() returned
+ */
+void vdisk_stats_op(VDISK *disk, int op, unsigned long start)
+{
+  if(disk->stats == NULL)
+    return;
+
+  unsigned long usec = (vdisk_stats_start(disk) - start) / 1000;
+  int bucket = 0;
+  while(bucket < VDISK_STATS_BUCKETS - 1 && usec >= (1UL << bucket))
+    ++bucket;
+
+  __atomic_add_fetch(&disk->stats->op_count[op], 1, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&disk->stats->op_usec[op], usec, __ATOMIC_RELAXED);
+  __atomic_add_fetch(&disk->stats->op_histogram[op][bucket], 1, __ATOMIC_RELAXED);
+}
+
+/**
+ * Add the counts of the handle to the file named by ZSTATS.  A file that
+ * does not hold counts is started over
+ *
+ * @param disk The open disk
+ * @param file_name The file
+ * @return 0 on success; <0 on error
+ */
+static int vdisk_stats_merge(VDISK *disk, char *file_name)
+{
+  int fd = open(file_name, O_RDWR | O_CREAT, S_IRUSR | S_IWUSR | S_IRGRP | S_IROTH);
+  if(fd < 0)
+    return(-1);
+
+  struct flock lock = { .l_type = F_WRLCK, .l_whence = SEEK_SET, .l_start = 0, .l_len = 0 };
+  if(fcntl(fd, F_OFD_SETLKW, &lock) != 0) {
+    close(fd);
+    return(-1);
+  }
+
+  VDISK_STATS total;
+  if(pread(fd, &total, sizeof(total), 0) != sizeof(total))
+    memset(&total, 0, sizeof(total));
+
+  unsigned long *sum = (unsigned long *) &total;
+  unsigned long *add = (unsigned long *) disk->stats;
+  for(int i = 0; i < sizeof(VDISK_STATS) / sizeof(unsigned long); ++i)
+    sum[i] += add[i];
+
+  int ret = 0;
+  if(pwrite(fd, &total, sizeof(total), 0) != sizeof(total))
+    ret = -1;
+  close(fd);
+  return(ret);
+}
+
+/**
+ * Hand the counts over as ZSTATS asks, and stop counting
+ *
+ * @param disk The disk being closed
+ */
+void vdisk_stats_close(VDISK *disk)
+{
+  if(disk->stats == NULL)
+    return;
+
+  char *target = getenv("ZSTATS");
+  if(target != NULL && !strcmp(target, "-"))
+    vdisk_stats_print(stderr, disk->stats);
+  else if(target != NULL && vdisk_stats_merge(disk, target) != 0)
+    fprintf(stderr, "vdisk_stats_close(): unable to update %s (%s)\n", target, strerror(errno));
+
+  free(disk->stats);
+  disk->stats = NULL;
+}
+
+/**
+ * Load the counts accumulated in a file
+ *
+ * @param file_name The file
+ * @param stats Receives the counts
+ * @return 0 on success; <0 if the file does not hold counts
+ */
+int vdisk_stats_load(char *file_name, VDISK_STATS *stats)
+{
+  int fd = open(file_name, O_RDONLY);
+  if(fd < 0)
+    return(-1);
+
+  struct flock lock = { .l_type = F_RDLCK, .l_whence = SEEK_SET, .l_start = 0, .l_len = 0 };
+  int ret = 0;
+  if(fcntl(fd, F_OFD_SETLKW, &lock) != 0 || pread(fd, stats, sizeof(*stats), 0) != sizeof(*stats))
+    ret = -1;
+  close(fd);
+  return(ret);
+}
+
+/**
+ * Print counts
+ *
+ * @param out Where to print them
+ * @param stats The counts
+ */
+void vdisk_stats_print(FILE *out, VDISK_STATS *stats)
+{
+  fprintf(out, "%-10s %10s %10s\n", "blocks", "reads", "writes");
+  for(int c = 0; c < VDISK_N_CLASSES; ++c)
+    fprintf(out, "%-10s %10lu %10lu\n", class_names[c], stats->reads[c], stats->writes[c]);
+  fprintf(out, "Reads from transactions: %lu\n", stats->cache_hits);
+  fprintf(out, "Bytes read: %lu\n", stats->bytes_read);
+  fprintf(out, "Bytes written: %lu\n", stats->bytes_written);
+
+  // Each bucket holds latencies up to twice those of the one before
+  fprintf(out, "\n%-6s %8s %10s  latency histogram (us: count)\n", "op", "count", "mean us");
+  for(int op = 0; op < VDISK_N_OPS; ++op) {
+    if(stats->op_count[op] == 0)
+      continue;
+    fprintf(out, "%-6s %8lu %10.1f ", op_names[op], stats->op_count[op],
+            (double) stats->op_usec[op] / stats->op_count[op]);
+    for(int b = 0; b < VDISK_STATS_BUCKETS; ++b) {
+      if(stats->op_histogram[op][b] == 0)
+        continue;
+      if(b == VDISK_STATS_BUCKETS - 1)
+        fprintf(out, " >=%lu:%lu", 1UL << (b - 1), stats->op_histogram[op][b]);
+      else
+        fprintf(out, " <%lu:%lu", 1UL << b, stats->op_histogram[op][b]);
+    }
+    fprintf(out, "\n");
+  }
+}
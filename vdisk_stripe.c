@@ -0,0 +1,416 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <string.h>
+#include "vdisk.h"
+/*
+ * Striped backend: the image is spread over several files, possibly on
+ * different devices, in stripe units of a fixed number of blocks.  Unit u of
+ * the image is unit u / n of member u % n.  The disk is named
+ *
+ *   stripe:unit:member,member,...
+ *
+ * e.g. "stripe:4:/mnt/a/disk,/mnt/b/disk" for units of 4 blocks over two
+ * files.  Every process must name the members in the same order.
+ *
+ * Each member has a worker thread.  A transfer that covers several members
+ * is split into one gathered transfer per member (the pieces that land on
+ * one member are contiguous in it); the caller does the first itself and
+ * the workers do the others at the same time.  Flushes go to all members at
+ * once.  The cross-process locks are taken on the first member.
+ */
+
+// Debug flag
+#define debug 0
+
+// Most files that an image can be spread over
+#define STRIPE_MAX_MEMBERS 16
+
+// Kinds of work for a member
+#define STRIPE_READ 0
+#define STRIPE_WRITE 1
+#define STRIPE_FLUSH 2
+
+// A transfer that is split over members: done once every part is
+typedef struct stripe_request_s
+{
+  pthread_mutex_t lock;
+  pthread_cond_t done;
+  int remaining;
+  int error;
+} STRIPE_REQUEST;
+
+// The part of a transfer that goes to one member
+typedef struct stripe_job_s
+{
+  struct stripe_job_s *next;
+  int op;
+  struct iovec *iov;
+  int iovcnt;
+  off_t offset;
+  size_t length;
+  STRIPE_REQUEST *request;
+} STRIPE_JOB;
+
+// One of the files
+typedef struct stripe_member_s
+{
+  int fd;
+
+  // Work queue for the member's thread
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  STRIPE_JOB *head;
+  STRIPE_JOB *tail;
+  int stop;
+} STRIPE_MEMBER;
+
+typedef struct stripe_state_s
+{
+  int n_members;
+
+  // Stripe unit in bytes
+  off_t unit;
+
+  // Bytes of the image held by each member
+  off_t member_size;
+
+  STRIPE_MEMBER member[STRIPE_MAX_MEMBERS];
+} STRIPE_STATE;
+
+/**
+ * Carry out one member's part of a transfer
+ *
+ * @return 0 on success; <0 on error
+ */
+static int stripe_run(STRIPE_MEMBER *member, STRIPE_JOB *job)
+{
+  ssize_t n;
+
+  switch(job->op) {
+  case STRIPE_READ:
+    n = preadv(member->fd, job->iov, job->iovcnt, job->offset);
+    break;
+  case STRIPE_WRITE:
+    n = pwritev(member->fd, job->iov, job->iovcnt, job->offset);
+    break;
+  default:
+    return(fdatasync(member->fd) == 0 ? 0 : -4);
+  }
+  return(n == job->length ? 0 : -4);
+}
+
+/**
+ * Record that a job is done, waking the caller with the last one
+ */
+static void stripe_complete(STRIPE_JOB *job, int ret)
+{
+  STRIPE_REQUEST *request = job->request;
+
+  pthread_mutex_lock(&request->lock);
+  if(ret != 0)
+    request->error = ret;
+  if(--request->remaining == 0)
+    pthread_cond_signal(&request->done);
+  pthread_mutex_unlock(&request->lock);
+}
+
+/**
+ * A member's thread: carries out the jobs queued for it
+ */
+static void *stripe_worker(void *arg)
+{
+  STRIPE_MEMBER *member = arg;
+
+  pthread_mutex_lock(&member->lock);
+  for(;;) {
+    while(member->head == NULL && !member->stop)
+      pthread_cond_wait(&member->wake, &member->lock);
+    STRIPE_JOB *job = member->head;
+    if(job == NULL)
+      break;
+    member->head = job->next;
+    if(member->head == NULL)
+      member->tail = NULL;
+    pthread_mutex_unlock(&member->lock);
+
+    stripe_complete(job, stripe_run(member, job));
+
+    pthread_mutex_lock(&member->lock);
+  }
+  pthread_mutex_unlock(&member->lock);
+  return(NULL);
+}
+
+/**
+ * Give a job to a member's thread
+ */
+static void stripe_queue(STRIPE_MEMBER *member, STRIPE_JOB *job)
+{
+  job->next = NULL;
+  pthread_mutex_lock(&member->lock);
+  if(member->tail == NULL)
+    member->head = job;
+  else
+    member->tail->next = job;
+  member->tail = job;
+  pthread_cond_signal(&member->wake);
+  pthread_mutex_unlock(&member->lock);
+}
+
+/**
+ * Carry out jobs on their members at the same time: the first in the
+ * calling thread, the others in the members' threads
+ *
+ * @param jobs One job per member; those with length 0 are skipped, except
+ *             that flushes are always done
+ * @return 0 on success; <0 on error
+ */
+static int stripe_dispatch(STRIPE_STATE *state, STRIPE_JOB *jobs)
+{
+  STRIPE_REQUEST request;
+  int first = -1;
+
+  request.remaining = 0;
+  request.error = 0;
+  for(int m = 0; m < state->n_members; ++m) {
+    jobs[m].request = &request;
+    if(jobs[m].op == STRIPE_FLUSH || jobs[m].length > 0) {
+      if(first < 0)
+        first = m;
+      else
+        ++request.remaining;
+    }
+  }
+  if(first < 0)
+    return(0);
+
+  pthread_mutex_init(&request.lock, NULL);
+  pthread_cond_init(&request.done, NULL);
+  for(int m = first + 1; m < state->n_members; ++m) {
+    if(jobs[m].op == STRIPE_FLUSH || jobs[m].length > 0)
+      stripe_queue(&state->member[m], &jobs[m]);
+  }
+
+  int ret = stripe_run(&state->member[first], &jobs[first]);
+
+  pthread_mutex_lock(&request.lock);
+  while(request.remaining > 0)
+    pthread_cond_wait(&request.done, &request.lock);
+  if(ret == 0)
+    ret = request.error;
+  pthread_mutex_unlock(&request.lock);
+
+  pthread_mutex_destroy(&request.lock);
+  pthread_cond_destroy(&request.done);
+  return(ret);
+}
+
+/**
+ * Split a transfer over the members and carry it out
+ *
+ * @return Number of bytes transferred; <0 on error
+ */
+static ssize_t stripe_transfer(STRIPE_STATE *state, int op, const struct iovec *iov,
+                               int iovcnt, off_t offset)
+{
+  STRIPE_JOB jobs[STRIPE_MAX_MEMBERS];
+  size_t length = 0;
+
+  for(int i = 0; i < iovcnt; ++i)
+    length += iov[i].iov_len;
+  if(offset < 0 || offset + (off_t) length > VDISK_IMAGE_SIZE) {
+    errno = EINVAL;
+    return(-1);
+  }
+
+  // Every piece ends at the end of a stripe unit or of a buffer
+  int max_pieces = length / state->unit + 2 + iovcnt;
+  struct iovec *pieces = malloc(state->n_members * max_pieces * sizeof(struct iovec));
+  if(pieces == NULL)
+    return(-1);
+
+  memset(jobs, 0, sizeof(jobs));
+  for(int m = 0; m < state->n_members; ++m) {
+    jobs[m].op = op;
+    jobs[m].iov = pieces + m * max_pieces;
+  }
+
+  size_t done = 0;
+  int v = 0;
+  size_t used = 0;
+  while(done < length) {
+    off_t position = offset + done;
+    off_t unit = position / state->unit;
+    int m = unit % state->n_members;
+    size_t piece = state->unit - position % state->unit;
+
+    // Next byte of the caller's buffers
+    while(used == iov[v].iov_len) {
+      ++v;
+      used = 0;
+    }
+    if(piece > length - done)
+      piece = length - done;
+    if(piece > iov[v].iov_len - used)
+      piece = iov[v].iov_len - used;
+
+    STRIPE_JOB *job = &jobs[m];
+    if(job->iovcnt == 0)
+      job->offset = (unit / state->n_members) * state->unit + position % state->unit;
+    job->iov[job->iovcnt].iov_base = (char *) iov[v].iov_base + used;
+    job->iov[job->iovcnt].iov_len = piece;
+    job->iovcnt++;
+    job->length += piece;
+
+    done += piece;
+    used += piece;
+  }
+
+  if(debug)
+    fprintf(stderr, "##Stripe: %s of %zu bytes at %ld\n", op == STRIPE_READ ? "read" : "write",
+            length, (long) offset);
+
+  int ret = stripe_dispatch(state, jobs);
+  free(pieces);
+  return(ret == 0 ? (ssize_t) length : -1);
+}
+
+static ssize_t stripe_readv(void *s, const struct iovec *iov, int iovcnt, off_t offset)
+{
+  return(stripe_transfer(s, STRIPE_READ, iov, iovcnt, offset));
+}
+
+static ssize_t stripe_writev(void *s, const struct iovec *iov, int iovcnt, off_t offset)
+{
+  return(stripe_transfer(s, STRIPE_WRITE, iov, iovcnt, offset));
+}
+
+static ssize_t stripe_read(void *s, void *buffer, size_t length, off_t offset)
+{
+  struct iovec iov = { buffer, length };
+  return(stripe_transfer(s, STRIPE_READ, &iov, 1, offset));
+}
+
+static ssize_t stripe_write(void *s, const void *buffer, size_t length, off_t offset)
+{
+  struct iovec iov = { (void *) buffer, length };
+  return(stripe_transfer(s, STRIPE_WRITE, &iov, 1, offset));
+}
+
+static int stripe_flush(void *s)
+{
+  STRIPE_STATE *state = s;
+  STRIPE_JOB jobs[STRIPE_MAX_MEMBERS];
+
+  memset(jobs, 0, sizeof(jobs));
+  for(int m = 0; m < state->n_members; ++m)
+    jobs[m].op = STRIPE_FLUSH;
+  return(stripe_dispatch(state, jobs));
+}
+
+static int stripe_discard(void *s, off_t size)
+{
+  STRIPE_STATE *state = s;
+
+  for(int m = 0; m < state->n_members; ++m) {
+    if(vdisk_backend_truncate_file(state->member[m].fd, state->member_size) != 0)
+      return(-4);
+  }
+  return(0);
+}
+
+static int stripe_close(void *s)
+{
+  STRIPE_STATE *state = s;
+
+  for(int m = 0; m < state->n_members; ++m) {
+    STRIPE_MEMBER *member = &state->member[m];
+    pthread_mutex_lock(&member->lock);
+    member->stop = 1;
+    pthread_cond_signal(&member->wake);
+    pthread_mutex_unlock(&member->lock);
+    pthread_join(member->thread, NULL);
+    pthread_mutex_destroy(&member->lock);
+    pthread_cond_destroy(&member->wake);
+    close(member->fd);
+  }
+  free(state);
+  return(0);
+}
+
+/**
+ * Open the members named by "unit:member,member,..."
+ */
+static void *stripe_open(char *name, int *lock_fd)
+{
+  char *end;
+  long unit = strtol(name, &end, 10);
+  if(unit <= 0 || *end != ':') {
+    fprintf(stderr, "vdisk: stripe unit missing in \"%s\"\n", name);
+    return(NULL);
+  }
+
+  STRIPE_STATE *state = calloc(1, sizeof(STRIPE_STATE));
+  char *names = strdup(end + 1);
+  if(state == NULL || names == NULL) {
+    free(state);
+    free(names);
+    return(NULL);
+  }
+  state->unit = unit * BLOCK_SIZE;
+
+  // Each member holds every n-th unit
+  int n_members = 1;
+  for(char *c = names; *c != '\0'; ++c)
+    n_members += (*c == ',');
+  if(n_members > STRIPE_MAX_MEMBERS) {
+    fprintf(stderr, "vdisk: more than %d stripe members\n", STRIPE_MAX_MEMBERS);
+    free(names);
+    free(state);
+    return(NULL);
+  }
+  off_t n_units = (VDISK_IMAGE_SIZE + state->unit - 1) / state->unit;
+  state->member_size = (n_units + n_members - 1) / n_members * state->unit;
+
+  char *saveptr;
+  for(char *member_name = strtok_r(names, ",", &saveptr); member_name != NULL;
+      member_name = strtok_r(NULL, ",", &saveptr)) {
+    STRIPE_MEMBER *member = &state->member[state->n_members];
+
+    // Every member must hold its whole share before it is read
+    struct stat st;
+    member->fd = vdisk_backend_open_file(member_name);
+    if(member->fd < 0 || fstat(member->fd, &st) != 0 ||
+       (st.st_size < state->member_size && ftruncate(member->fd, state->member_size) != 0)) {
+      fprintf(stderr, "vdisk: unable to open stripe member %s\n", member_name);
+      if(member->fd >= 0)
+        close(member->fd);
+      break;
+    }
+
+    pthread_mutex_init(&member->lock, NULL);
+    pthread_cond_init(&member->wake, NULL);
+    if(pthread_create(&member->thread, NULL, stripe_worker, member) != 0) {
+      pthread_mutex_destroy(&member->lock);
+      pthread_cond_destroy(&member->wake);
+      close(member->fd);
+      break;
+    }
+    state->n_members++;
+  }
+  free(names);
+
+  if(state->n_members != n_members) {
+    stripe_close(state);
+    return(NULL);
+  }
+
+  *lock_fd = state->member[0].fd;
+  return(state);
+}
+
+const VDISK_BACKEND vdisk_backend_stripe = {
+  "stripe:", 0, stripe_open, stripe_close, stripe_read, stripe_write,
+  stripe_readv, stripe_writev, stripe_flush, stripe_discard, NULL
+};
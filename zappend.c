@@ -0,0 +1,62 @@
+/**
+Append standard input to a file in the OU File System.  The file is
+created if it does not exist; with -c it is created compressed.
+
+CS3113
+
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "oufs_lib.h"
+
+int main(int argc, char** argv) {
+  // Fetch the key environment vars
+  char cwd[MAX_PATH_LENGTH];
+  char disk_name[MAX_PATH_LENGTH];
+  oufs_get_environment(cwd, disk_name);
+
+  // Check arguments
+  int compress = (argc == 3 && !strcmp(argv[1], "-c"));
+  if(argc == 2 || compress) {
+    // Open the virtual disk
+    OUFS *fs = oufs_open(disk_name);
+    if(fs == NULL) {
+      return(-1);
+    }
+
+    // Open the file for appending
+    OUFILE *fp = oufs_fopen(fs, cwd, argv[argc - 1], compress ? "ac" : "a");
+    if(fp == NULL) {
+      fprintf(stderr, "Error opening file\n");
+    }else{
+      // Input of a known length has its blocks reserved first, so that
+      // they lie together
+      struct stat st;
+      if(!compress && fstat(0, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0 &&
+         fp->offset + st.st_size <= BLOCKS_PER_INODE * BLOCK_SIZE)
+        oufs_fallocate(fs, fp, fp->offset, st.st_size, 1);
+
+      // Copy until the input ends or the file is full
+      unsigned char buf[BLOCK_SIZE];
+      int n;
+      while((n = fread(buf, 1, sizeof(buf), stdin)) > 0) {
+        if(oufs_fwrite(fs, fp, buf, n) != n) {
+          fprintf(stderr, "File is full\n");
+          break;
+        }
+      }
+      oufs_fclose(fs, fp);
+    }
+
+    // Clean up
+    oufs_close(fs);
+    
+  }else{
+    // Wrong number of parameters
+    fprintf(stderr, "Usage: zappend [-c] <filename>\n");
+  }
+
+}
@@ -0,0 +1,581 @@
+/**
+Benchmarks for the virtual disk and the file system.
+
+Usage: zbench stripe [dir ...]
+       zbench fs [-d disk] [-l label] [-o file] [workload ...]
+
+  stripe  bulk reads, bulk writes and flushes of a striped disk with 1, 2,
+          4 and 8 members; the member files are spread over the given
+          directories (default /tmp), so give one per device to see the
+          bandwidth of several devices add up
+
+  fs      file system operations on a freshly formatted disk (default
+          /tmp/zbench.img; any disk name, such as mmap:..., may be given).
+          The workloads (default: all of them) are
+            deep    mkdir, find and rmdir along a path as deep as it goes
+            wide    create, list, find and remove in a full directory
+            full    block allocation with nearly all of the disk in use
+            churn   files created and removed over and over
+            seqio   whole-file writes and reads, a block at a time
+            randio  block-sized reads and writes at random offsets
+            aio     the randio reads and writes, submitted asynchronously
+                    with many in flight and reaped through the eventfd;
+                    latency is from submission to reaping
+          For each operation: ops/sec, latency percentiles, and blocks
+          read and written per operation.  With -o, the results are also
+          appended to a CSV file, one row per operation, tagged with the
+          label (default "current") so that versions can be compared
+
+CS3113
+
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include "oufs_lib.h"
+
+// Rounds of each test
+#define BENCH_ROUNDS 200
+
+// Most operations timed for one phase, and most phases in a run
+#define BENCH_MAX_OPS 20000
+#define BENCH_MAX_PHASES 16
+
+// Depth of the deep path; it has to fit in MAX_PATH_LENGTH
+#define BENCH_DEPTH 24
+
+// Asynchronous requests kept in flight
+#define BENCH_AIO_DEPTH 32
+
+/**
+ * Current time in seconds
+ */
+static double bench_now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return(ts.tv_sec + ts.tv_nsec / 1e9);
+}
+
+/**
+ * Whole-disk writes with a flush after each, and whole-disk reads, on
+ * striped disks of a growing number of members
+ *
+ * @param n_dirs Number of directories to hold the members
+ * @param dirs The directories
+ * @return 0 on success; <0 on error
+ */
+static int bench_stripe(int n_dirs, char **dirs)
+{
+  static BLOCK image[N_BLOCKS_IN_DISK];
+  double mbytes = (double) BENCH_ROUNDS * N_BLOCKS_IN_DISK * BLOCK_SIZE / (1 << 20);
+
+  memset(image, 0x5a, sizeof(image));
+  printf("%-8s %-6s %12s %12s %12s\n", "members", "unit", "write MB/s", "read MB/s", "flush/s");
+  for(int n_members = 1; n_members <= 8; n_members *= 2) {
+    // stripe:1:dir/zbench.0,dir/zbench.1,...
+    char name[MAX_PATH_LENGTH * 8];
+    int length = snprintf(name, sizeof(name), "stripe:1:");
+    for(int m = 0; m < n_members; ++m)
+      length += snprintf(name + length, sizeof(name) - length, "%s%s/zbench.%d",
+                         m ? "," : "", dirs[m % n_dirs], m);
+
+    VDISK *disk = vdisk_disk_open(name);
+    if(disk == NULL)
+      return(-1);
+
+    double start = bench_now();
+    for(int r = 0; r < BENCH_ROUNDS; ++r) {
+      if(vdisk_image_write(disk, image, sizeof(image), 0) != 0 || vdisk_image_flush(disk) != 0) {
+        fprintf(stderr, "zbench: write failed\n");
+        vdisk_disk_close(disk);
+        return(-1);
+      }
+    }
+    double write_time = bench_now() - start;
+
+    start = bench_now();
+    for(int r = 0; r < BENCH_ROUNDS; ++r) {
+      if(vdisk_read_blocks(disk, 0, N_BLOCKS_IN_DISK, image) != 0) {
+        fprintf(stderr, "zbench: read failed\n");
+        vdisk_disk_close(disk);
+        return(-1);
+      }
+    }
+    double read_time = bench_now() - start;
+
+    printf("%-8d %-6d %12.1f %12.1f %12.1f\n", n_members, 1, mbytes / write_time,
+           mbytes / read_time, BENCH_ROUNDS / write_time);
+    vdisk_disk_close(disk);
+
+    for(int m = 0; m < n_members; ++m) {
+      snprintf(name, sizeof(name), "%s/zbench.%d", dirs[m % n_dirs], m);
+      unlink(name);
+    }
+  }
+  return(0);
+}
+
+// Measurements of one kind of operation
+typedef struct bench_phase_s
+{
+  const char *name;
+  int n_ops;
+  unsigned long reads;
+  unsigned long writes;
+
+  // Wall clock time of the phase if its operations overlap; 0 if they run
+  //  one at a time
+  double elapsed;
+  double latency[BENCH_MAX_OPS];
+} BENCH_PHASE;
+
+static BENCH_PHASE phases[BENCH_MAX_PHASES];
+static int n_phases = 0;
+
+/**
+ * Find the measurements of an operation, starting them if need be
+ */
+static BENCH_PHASE *bench_phase(const char *name)
+{
+  for(int p = 0; p < n_phases; ++p)
+    if(!strcmp(phases[p].name, name))
+      return(&phases[p]);
+  if(n_phases == BENCH_MAX_PHASES) {
+    fprintf(stderr, "zbench: too many phases\n");
+    exit(1);
+  }
+  phases[n_phases].name = name;
+  phases[n_phases].n_ops = 0;
+  phases[n_phases].reads = 0;
+  phases[n_phases].writes = 0;
+  phases[n_phases].elapsed = 0;
+  return(&phases[n_phases++]);
+}
+
+/**
+ * Time one operation and count the blocks it moves
+ */
+#define BENCH_OP(fs, name, op) do {                                     \
+    BENCH_PHASE *phase_ = bench_phase(name);                            \
+    unsigned long reads_ = (fs)->disk->n_block_reads;                   \
+    unsigned long writes_ = (fs)->disk->n_block_writes;                 \
+    double start_ = bench_now();                                        \
+    op;                                                                 \
+    double latency_ = bench_now() - start_;                             \
+    if(phase_->n_ops < BENCH_MAX_OPS) {                                 \
+      phase_->latency[phase_->n_ops++] = latency_;                      \
+      phase_->reads += (fs)->disk->n_block_reads - reads_;              \
+      phase_->writes += (fs)->disk->n_block_writes - writes_;           \
+    }                                                                   \
+  } while(0)
+
+static int bench_compare(const void *a, const void *b)
+{
+  double x = *(const double *) a;
+  double y = *(const double *) b;
+  return((x > y) - (x < y));
+}
+
+/**
+ * Print the measurements (and append them to the CSV file), then start over
+ *
+ * @param label Tag for the CSV rows
+ * @param csv The CSV file, or NULL
+ */
+static void bench_report(const char *label, FILE *csv)
+{
+  for(int p = 0; p < n_phases; ++p) {
+    BENCH_PHASE *phase = &phases[p];
+    int n = phase->n_ops;
+    if(n == 0)
+      continue;
+
+    double total = 0;
+    for(int i = 0; i < n; ++i)
+      total += phase->latency[i];
+    qsort(phase->latency, n, sizeof(double), bench_compare);
+    double p50 = phase->latency[n / 2] * 1e6;
+    double p90 = phase->latency[n * 9 / 10] * 1e6;
+    double p99 = phase->latency[n * 99 / 100] * 1e6;
+    double max = phase->latency[n - 1] * 1e6;
+    double reads = (double) phase->reads / n;
+    double writes = (double) phase->writes / n;
+    if(phase->elapsed > 0)
+      total = phase->elapsed;
+
+    printf("%-14s %7d %11.0f %9.1f %9.1f %9.1f %9.1f %8.2f %8.2f\n", phase->name, n,
+           n / total, p50, p90, p99, max, reads, writes);
+    if(csv != NULL)
+      fprintf(csv, "%s,%s,%d,%.0f,%.2f,%.2f,%.2f,%.2f,%.3f,%.3f\n", label, phase->name, n,
+              n / total, p50, p90, p99, max, reads, writes);
+  }
+  n_phases = 0;
+}
+
+/**
+ * Format the disk and open it
+ */
+static OUFS *bench_fresh(char *disk_name)
+{
+  if(oufs_format_disk(disk_name, 0) != 0)
+    return(NULL);
+  return(oufs_open(disk_name));
+}
+
+/**
+ * Make and remove a chain of nested directories, and look up its end
+ */
+static void bench_deep(OUFS *fs)
+{
+  char path[BENCH_DEPTH][MAX_PATH_LENGTH];
+  INODE_REFERENCE parent;
+  INODE_REFERENCE child;
+
+  for(int d = 0; d < BENCH_DEPTH; ++d)
+    snprintf(path[d], MAX_PATH_LENGTH, "%s/d", d ? path[d - 1] : "");
+
+  for(int r = 0; r < BENCH_ROUNDS / 10; ++r) {
+    for(int d = 0; d < BENCH_DEPTH; ++d)
+      BENCH_OP(fs, "deep.mkdir", oufs_mkdir(fs, "/", path[d]));
+    for(int k = 0; k < 50; ++k)
+      BENCH_OP(fs, "deep.find", oufs_find_file(fs, "/", path[BENCH_DEPTH - 1], &parent, &child, NULL));
+    for(int d = BENCH_DEPTH - 1; d >= 0; --d)
+      BENCH_OP(fs, "deep.rmdir", oufs_rmdir(fs, "/", path[d]));
+  }
+}
+
+/**
+ * Fill a directory with files, list it and look them up, then empty it
+ */
+static void bench_wide(OUFS *fs)
+{
+  // Every entry but "." and ".."
+  int width = DIRECTORY_ENTRIES_PER_BLOCK - 2;
+  char name[FILE_NAME_SIZE];
+  INODE_REFERENCE parent;
+  INODE_REFERENCE child;
+
+  oufs_mkdir(fs, "/", "w");
+
+  // Listing prints: send it nowhere while it is timed
+  fflush(stdout);
+  int saved_stdout = dup(1);
+  int null_fd = open("/dev/null", O_WRONLY);
+
+  for(int r = 0; r < BENCH_ROUNDS / 10; ++r) {
+    for(int i = 0; i < width; ++i) {
+      snprintf(name, sizeof(name), "f%d", i);
+      BENCH_OP(fs, "wide.create", oufs_fclose(fs, oufs_fopen(fs, "/w", name, "w")));
+    }
+
+    dup2(null_fd, 1);
+    for(int k = 0; k < 20; ++k)
+      BENCH_OP(fs, "wide.list", oufs_list(fs, "/", "w"));
+    fflush(stdout);
+    dup2(saved_stdout, 1);
+
+    for(int i = 0; i < width; ++i) {
+      snprintf(name, sizeof(name), "/w/f%d", i);
+      BENCH_OP(fs, "wide.find", oufs_find_file(fs, "/", name, &parent, &child, NULL));
+    }
+    for(int i = 0; i < width; ++i) {
+      snprintf(name, sizeof(name), "f%d", i);
+      BENCH_OP(fs, "wide.remove", oufs_remove(fs, "/w", name));
+    }
+  }
+
+  close(null_fd);
+  close(saved_stdout);
+}
+
+/**
+ * Take and give back a block while all but a few blocks at the end of the
+ * disk are in use
+ */
+static void bench_full(OUFS *fs)
+{
+  BLOCK_REFERENCE taken[N_BLOCKS_IN_DISK];
+  int n_taken = 0;
+  BLOCK_REFERENCE block_ref;
+
+  while((block_ref = oufs_allocate_new_block(fs, 0)) != UNALLOCATED_BLOCK)
+    taken[n_taken++] = block_ref;
+  for(int i = 0; i < 2 && n_taken > 0; ++i)
+    oufs_deallocate_block(fs, taken[--n_taken]);
+
+  for(int r = 0; r < BENCH_ROUNDS * 10; ++r) {
+    BENCH_OP(fs, "full.alloc", block_ref = oufs_allocate_new_block(fs, 0));
+    oufs_deallocate_block(fs, block_ref);
+  }
+}
+
+/**
+ * Create and remove files, keeping a few of them around
+ */
+static void bench_churn(OUFS *fs)
+{
+  char name[FILE_NAME_SIZE];
+  unsigned char buf[BLOCK_SIZE];
+
+  memset(buf, 'c', sizeof(buf));
+  for(int i = 0; i < BENCH_ROUNDS * 5; ++i) {
+    snprintf(name, sizeof(name), "c%d", i % 20);
+    BENCH_OP(fs, "churn.create", {
+        OUFILE *fp = oufs_fopen(fs, "/", name, "w");
+        oufs_fwrite(fs, fp, buf, sizeof(buf));
+        oufs_fclose(fs, fp);
+      });
+    if(i >= 10) {
+      snprintf(name, sizeof(name), "c%d", (i - 10) % 20);
+      BENCH_OP(fs, "churn.remove", oufs_remove(fs, "/", name));
+    }
+  }
+}
+
+/**
+ * Write whole files and read them back, a block at a time
+ */
+static void bench_seqio(OUFS *fs)
+{
+  unsigned char buf[BLOCK_SIZE];
+
+  memset(buf, 's', sizeof(buf));
+  for(int r = 0; r < BENCH_ROUNDS; ++r) {
+    OUFILE *fp = oufs_fopen(fs, "/", "seq", "w");
+    for(int b = 0; b < BLOCKS_PER_INODE; ++b)
+      BENCH_OP(fs, "seqio.write", oufs_fwrite(fs, fp, buf, sizeof(buf)));
+    oufs_fclose(fs, fp);
+
+    fp = oufs_fopen(fs, "/", "seq", "r");
+    for(int b = 0; b < BLOCKS_PER_INODE; ++b)
+      BENCH_OP(fs, "seqio.read", oufs_fread(fs, fp, buf, sizeof(buf)));
+    oufs_fclose(fs, fp);
+  }
+}
+
+/**
+ * Read and overwrite blocks of a file in random order
+ */
+static void bench_randio(OUFS *fs)
+{
+  unsigned char buf[BLOCK_SIZE];
+
+  memset(buf, 'r', sizeof(buf));
+  OUFILE *fp = oufs_fopen(fs, "/", "rand", "w");
+  for(int b = 0; b < BLOCKS_PER_INODE; ++b)
+    oufs_fwrite(fs, fp, buf, sizeof(buf));
+  oufs_fclose(fs, fp);
+
+  srand(1);
+  fp = oufs_fopen(fs, "/", "rand", "r");
+  for(int i = 0; i < BENCH_ROUNDS * 10; ++i) {
+    fp->offset = (rand() % BLOCKS_PER_INODE) * BLOCK_SIZE;
+    BENCH_OP(fs, "randio.read", oufs_fread(fs, fp, buf, sizeof(buf)));
+  }
+  oufs_fclose(fs, fp);
+
+  fp = oufs_fopen(fs, "/", "rand", "a");
+  for(int i = 0; i < BENCH_ROUNDS * 10; ++i) {
+    fp->offset = (rand() % BLOCKS_PER_INODE) * BLOCK_SIZE;
+    buf[0] = i;
+    BENCH_OP(fs, "randio.write", oufs_fwrite(fs, fp, buf, sizeof(buf)));
+  }
+  oufs_fclose(fs, fp);
+}
+
+/**
+ * Keep BENCH_AIO_DEPTH block-sized requests at random offsets in flight
+ *
+ * @param fs The open file system
+ * @param name Name of the operation
+ * @param fp The file
+ * @param write Set for writes
+ */
+static void bench_aio_phase(OUFS *fs, const char *name, OUFILE *fp, int write)
+{
+  static unsigned char bufs[BENCH_AIO_DEPTH][BLOCK_SIZE];
+  double submitted[BENCH_AIO_DEPTH];
+  int free_slots[BENCH_AIO_DEPTH];
+  OUFS_AIO_EVENT events[BENCH_AIO_DEPTH];
+  struct pollfd pfd = { .fd = oufs_aio_fd(fs), .events = POLLIN };
+
+  BENCH_PHASE *phase = bench_phase(name);
+  unsigned long reads = fs->disk->n_block_reads;
+  unsigned long writes = fs->disk->n_block_writes;
+  double start = bench_now();
+
+  for(int k = 0; k < BENCH_AIO_DEPTH; ++k)
+    free_slots[k] = k;
+  int n_free = BENCH_AIO_DEPTH;
+  int issued = 0;
+  int reaped = 0;
+  int total = BENCH_ROUNDS * 10;
+  while(reaped < total) {
+    while(n_free > 0 && issued < total) {
+      int slot = free_slots[--n_free];
+      int offset = (rand() % BLOCKS_PER_INODE) * BLOCK_SIZE;
+      if(write)
+        bufs[slot][0] = issued;
+      submitted[slot] = bench_now();
+      int ret = write ?
+        oufs_awrite(fs, fp, offset, bufs[slot], BLOCK_SIZE, NULL, (void *) (long) slot) :
+        oufs_aread(fs, fp, offset, bufs[slot], BLOCK_SIZE, NULL, (void *) (long) slot);
+      if(ret != 0) {
+        free_slots[n_free++] = slot;
+        break;
+      }
+      ++issued;
+    }
+
+    poll(&pfd, 1, -1);
+    int n = oufs_aio_reap(fs, events, BENCH_AIO_DEPTH);
+    double now = bench_now();
+    for(int e = 0; e < n; ++e) {
+      int slot = (int) (long) events[e].token;
+      if(phase->n_ops < BENCH_MAX_OPS)
+        phase->latency[phase->n_ops++] = now - submitted[slot];
+      free_slots[n_free++] = slot;
+    }
+    reaped += n;
+  }
+
+  phase->elapsed = bench_now() - start;
+  phase->reads += fs->disk->n_block_reads - reads;
+  phase->writes += fs->disk->n_block_writes - writes;
+}
+
+/**
+ * Read and overwrite blocks of a file in random order, asynchronously
+ */
+static void bench_aio(OUFS *fs)
+{
+  unsigned char buf[BLOCK_SIZE];
+
+  memset(buf, 'a', sizeof(buf));
+  OUFILE *fp = oufs_fopen(fs, "/", "aio", "w");
+  for(int b = 0; b < BLOCKS_PER_INODE; ++b)
+    oufs_fwrite(fs, fp, buf, sizeof(buf));
+  oufs_fclose(fs, fp);
+
+  srand(1);
+  fp = oufs_fopen(fs, "/", "aio", "r");
+  bench_aio_phase(fs, "aio.read", fp, 0);
+  oufs_fclose(fs, fp);
+
+  fp = oufs_fopen(fs, "/", "aio", "a");
+  bench_aio_phase(fs, "aio.write", fp, 1);
+  oufs_fclose(fs, fp);
+}
+
+// The file system workloads, in the order they run
+static const struct {
+  const char *name;
+  void (*run)(OUFS *fs);
+} workloads[] = {
+  { "deep", bench_deep },
+  { "wide", bench_wide },
+  { "full", bench_full },
+  { "churn", bench_churn },
+  { "seqio", bench_seqio },
+  { "randio", bench_randio },
+  { "aio", bench_aio },
+};
+#define N_WORKLOADS (sizeof(workloads) / sizeof(workloads[0]))
+
+/**
+ * Run file system workloads, each on a freshly formatted disk
+ *
+ * @param argc, argv The arguments after "fs"
+ * @return 0 on success; -1 on bad arguments; -2 if a workload failed
+ */
+static int bench_fs(int argc, char **argv)
+{
+  char *disk_name = "/tmp/zbench.img";
+  char *label = "current";
+  char *csv_name = NULL;
+  int first = 0;
+
+  for(; first < argc && argv[first][0] == '-'; first += 2) {
+    if(first + 1 == argc)
+      return(-1);
+    if(!strcmp(argv[first], "-d"))
+      disk_name = argv[first + 1];
+    else if(!strcmp(argv[first], "-l"))
+      label = argv[first + 1];
+    else if(!strcmp(argv[first], "-o"))
+      csv_name = argv[first + 1];
+    else
+      return(-1);
+  }
+
+  for(int i = first; i < argc; ++i) {
+    int known = 0;
+    for(int w = 0; w < N_WORKLOADS; ++w)
+      known |= !strcmp(argv[i], workloads[w].name);
+    if(!known) {
+      fprintf(stderr, "zbench: no workload %s\n", argv[i]);
+      return(-1);
+    }
+  }
+
+  FILE *csv = NULL;
+  if(csv_name != NULL) {
+    csv = fopen(csv_name, "a");
+    if(csv == NULL) {
+      perror(csv_name);
+      return(-2);
+    }
+    if(ftell(csv) == 0)
+      fprintf(csv, "label,operation,ops,ops_per_sec,p50_us,p90_us,p99_us,max_us,reads_per_op,writes_per_op\n");
+  }
+
+  printf("%-14s %7s %11s %9s %9s %9s %9s %8s %8s\n", "operation", "ops", "ops/s",
+         "p50 us", "p90 us", "p99 us", "max us", "reads", "writes");
+  int ret = 0;
+  for(int w = 0; w < N_WORKLOADS; ++w) {
+    int chosen = (first == argc);
+    for(int i = first; i < argc; ++i)
+      chosen |= !strcmp(argv[i], workloads[w].name);
+    if(!chosen)
+      continue;
+
+    OUFS *fs = bench_fresh(disk_name);
+    if(fs == NULL) {
+      ret = -2;
+      break;
+    }
+    workloads[w].run(fs);
+    oufs_close(fs);
+    bench_report(label, csv);
+  }
+
+  if(csv != NULL)
+    fclose(csv);
+  return(ret);
+}
+
+int main(int argc, char** argv) {
+  char *default_dirs[] = { "/tmp" };
+
+  if(argc >= 2 && !strcmp(argv[1], "stripe")) {
+    if(argc == 2)
+      return(bench_stripe(1, default_dirs) == 0 ? 0 : 1);
+    return(bench_stripe(argc - 2, argv + 2) == 0 ? 0 : 1);
+  }
+  if(argc >= 2 && !strcmp(argv[1], "fs")) {
+    int ret = bench_fs(argc - 2, argv + 2);
+    if(ret != -1)
+      return(ret == 0 ? 0 : 1);
+  }
+
+  fprintf(stderr, "Usage: zbench stripe [dir ...]\n"
+          "       zbench fs [-d disk] [-l label] [-o file] [deep|wide|full|churn|seqio|randio|aio ...]\n");
+  return(1);
+}
@@ -0,0 +1,49 @@
+/**
+Create an empty file in the OU File System, or empty an existing one.
+With -s, the file is given its size up front: its blocks are reserved (in
+one run, if the disk has one) and read back as zeros until written.
+
+CS3113
+
+*/
+
+#include <stdio.h>
+#include <string.h>
+
+#include "oufs_lib.h"
+
+int main(int argc, char** argv) {
+  // Fetch the key environment vars
+  char cwd[MAX_PATH_LENGTH];
+  char disk_name[MAX_PATH_LENGTH];
+  oufs_get_environment(cwd, disk_name);
+
+  // Check arguments
+  int size = -1;
+  int sized = (argc == 4 && !strcmp(argv[1], "-s") && sscanf(argv[2], "%d", &size) == 1 && size >= 0);
+  if(argc == 2 || sized) {
+    // Open the virtual disk
+    OUFS *fs = oufs_open(disk_name);
+    if(fs == NULL) {
+      return(-1);
+    }
+
+    // Open the file for writing, which creates it
+    OUFILE *fp = oufs_fopen(fs, cwd, argv[argc - 1], "w");
+    if(fp == NULL) {
+      fprintf(stderr, "Error creating file\n");
+    }else{
+      if(sized && oufs_fallocate(fs, fp, 0, size, 0) != 0)
+        fprintf(stderr, "Unable to reserve %d bytes\n", size);
+      oufs_fclose(fs, fp);
+    }
+
+    // Clean up
+    oufs_close(fs);
+    
+  }else{
+    // Wrong number of parameters
+    fprintf(stderr, "Usage: zcreate [-s <size>] <filename>\n");
+  }
+
+}
@@ -0,0 +1,92 @@
+/**
+Defragment the OU File System while it is in use.
+
+Usage: zdefrag      move every fragmented file into consecutive blocks
+       zdefrag -n   only list the fragmented files
+       zdefrag -m   print the reverse map: the inode that refers to each block
+
+CS3113
+
+*/
+
+#include <stdio.h>
+#include <string.h>
+
+#include "oufs_lib.h"
+
+/**
+ * Print the owner of every block that an inode refers to
+ */
+static void print_reverse_map(OUFS_BLOCK_OWNER *owner)
+{
+  for(int b = 0; b < N_BLOCKS_IN_DISK; ++b) {
+    if(owner[b].n_owners == 0)
+      continue;
+    printf("%3d: inode %d [%d]", b, owner[b].inode, owner[b].index);
+    if(owner[b].n_owners > 1)
+      printf(" shared by %d", owner[b].n_owners);
+    printf("\n");
+  }
+}
+
+int main(int argc, char** argv) {
+  // Fetch the key environment vars
+  char cwd[MAX_PATH_LENGTH];
+  char disk_name[MAX_PATH_LENGTH];
+  oufs_get_environment(cwd, disk_name);
+
+  // Check arguments
+  if(argc == 1 || (argc == 2 && (!strcmp(argv[1], "-n") || !strcmp(argv[1], "-m")))) {
+    // Open the virtual disk
+    OUFS *fs = oufs_open(disk_name);
+    if(fs == NULL) {
+      return(-1);
+    }
+
+    OUFS_BLOCK_OWNER owner[N_BLOCKS_IN_DISK];
+    if(oufs_reverse_map(fs, owner) != 0) {
+      fprintf(stderr, "Error reading the inodes\n");
+    }else if(argc == 2 && !strcmp(argv[1], "-m")) {
+      print_reverse_map(owner);
+    }else{
+      // The files to look at: those that own a block in the map
+      int seen[N_INODES] = { 0 };
+      int fragmented = 0;
+      int moved = 0;
+      for(int b = 0; b < N_BLOCKS_IN_DISK; ++b) {
+        INODE_REFERENCE i = owner[b].inode;
+        if(owner[b].n_owners == 0 || seen[i])
+          continue;
+        seen[i] = 1;
+
+        INODE inode;
+        if(oufs_read_inode_by_reference(fs, i, &inode) != 0 || oufs_file_runs(&inode) <= 1)
+          continue;
+        ++fragmented;
+        printf("inode %d: %d bytes in %d runs", i, inode.size, oufs_file_runs(&inode));
+        if(argc == 1) {
+          int ret = oufs_defrag_file(fs, i);
+          if(ret == 0) {
+            ++moved;
+            printf(": moved");
+          }else if(ret < 0) {
+            printf(": left (shared, or no room)");
+          }
+        }
+        printf("\n");
+      }
+      if(argc == 1)
+        printf("%d fragmented files, %d moved\n", fragmented, moved);
+      else
+        printf("%d fragmented files\n", fragmented);
+    }
+
+    // Clean up
+    oufs_close(fs);
+
+  }else{
+    // Wrong number of parameters
+    fprintf(stderr, "Usage: zdefrag [-n | -m]\n");
+  }
+
+}
@@ -0,0 +1,60 @@
+/**
+Report the free space of the OU File System.  Only the master block is read.
+
+Usage: zdf      free blocks and inodes
+       zdf -g   also the free blocks of each block group
+
+CS3113
+
+*/
+
+#include <stdio.h>
+#include <string.h>
+
+#include "oufs_lib.h"
+
+int main(int argc, char** argv) {
+  // Fetch the key environment vars
+  char cwd[MAX_PATH_LENGTH];
+  char disk_name[MAX_PATH_LENGTH];
+  oufs_get_environment(cwd, disk_name);
+
+  // Check arguments
+  if(argc == 1 || (argc == 2 && !strcmp(argv[1], "-g"))) {
+    // Open the virtual disk
+    OUFS *fs = oufs_open(disk_name);
+    if(fs == NULL) {
+      return(-1);
+    }
+
+    OUFS_SPACE space;
+    if(oufs_free_space(fs, &space) != 0) {
+      fprintf(stderr, "Error reading the master block\n");
+    }else{
+      printf("%-8s %8s %8s %8s %5s\n", "", "total", "used", "free", "use%");
+      printf("%-8s %8d %8d %8d %4d%%\n", "blocks", space.total_blocks,
+             space.total_blocks - space.free_blocks, space.free_blocks,
+             100 * (space.total_blocks - space.free_blocks) / space.total_blocks);
+      printf("%-8s %8d %8d %8d %4d%%\n", "inodes", space.total_inodes,
+             space.total_inodes - space.free_inodes, space.free_inodes,
+             100 * (space.total_inodes - space.free_inodes) / space.total_inodes);
+      printf("%-8s %8d %8d %8d\n", "bytes", space.total_blocks * BLOCK_SIZE,
+             (space.total_blocks - space.free_blocks) * BLOCK_SIZE, space.free_blocks * BLOCK_SIZE);
+
+      if(argc == 2) {
+        printf("\n%-8s %8s %8s\n", "group", "blocks", "free");
+        for(int g = 0; g < OUFS_N_GROUPS; ++g)
+          printf("%-8d %3d-%-4d %8d\n", g, OUFS_GROUP_START(g), OUFS_GROUP_START(g + 1) - 1,
+                 space.group_free_blocks[g]);
+      }
+    }
+
+    // Clean up
+    oufs_close(fs);
+
+  }else{
+    // Wrong number of parameters
+    fprintf(stderr, "Usage: zdf [-g]\n");
+  }
+
+}
@@ -0,0 +1,63 @@
+/**
+Report how much a file or a directory's subtree uses in the OU File System.
+
+Usage: zdu [<path>]   bytes, blocks and entries below the path (default: the
+                      current directory)
+       zdu -v         recount the usage of every directory and compare it
+                      with what is kept
+       zdu -r         recount it and keep the counts; on an image formatted
+                      without -u, this starts keeping usage
+
+On an image that keeps usage (zformat -u), the answer comes from one record;
+otherwise, and on snapshots, the subtree is walked.
+
+CS3113
+
+*/
+
+#include <stdio.h>
+#include <string.h>
+
+#include "oufs_lib.h"
+
+int main(int argc, char** argv) {
+  // Fetch the key environment vars
+  char cwd[MAX_PATH_LENGTH];
+  char disk_name[MAX_PATH_LENGTH];
+  oufs_get_environment(cwd, disk_name);
+
+  // Check arguments
+  if(argc <= 2) {
+    // Open the virtual disk
+    OUFS *fs = oufs_open(disk_name);
+    if(fs == NULL) {
+      return(-1);
+    }
+
+    if(argc == 2 && (!strcmp(argv[1], "-v") || !strcmp(argv[1], "-r"))) {
+      int repair = !strcmp(argv[1], "-r");
+      int ret = oufs_usage_verify(fs, repair);
+      if(ret < 0)
+        fprintf(stderr, "Error (%d)\n", ret);
+      else
+        printf("%d record(s) differ%s\n", ret, (repair && ret) ? " and were fixed" : "");
+    }else{
+      OUFS_USAGE usage;
+      char *path = (argc == 2) ? argv[1] : cwd;
+      int ret = oufs_du(fs, cwd, path, &usage);
+      if(ret < 0)
+        fprintf(stderr, "Error (%d)\n", ret);
+      else
+        printf("%u bytes, %u blocks, %u entries\t%s%s\n", usage.bytes, usage.blocks, usage.entries, path,
+               ret ? "" : " (counted)");
+    }
+
+    // Clean up
+    oufs_close(fs);
+
+  }else{
+    // Wrong number of parameters
+    fprintf(stderr, "Usage: zdu [-v | -r | <path>]\n");
+  }
+
+}
@@ -8,19 +8,25 @@ int main(int argc, char** argv)
   oufs_get_environment(cwd, disk_name);
 
   // Open virtual disk
-  vdisk_disk_open(disk_name);
+  OUFS *fs = oufs_open(disk_name);
+  if (fs == NULL)
+    return -1;
 
-  if (argc == 1)
+  // -l lists each name's type, references, size and blocks too
+  int long_format = (argc > 1 && !strcmp(argv[1], "-l"));
+  int (*list)(OUFS *, char *, char *) = long_format ? oufs_list_long : oufs_list;
+
+  if (argc == 1 + long_format)
     // No path supplied, use cwd
-    oufs_list(strdup(cwd), "");
+    list(fs, strdup(cwd), "");
   else
   {
     // Path is supplied, so send both the path amd the cwd
-    oufs_list(strdup(cwd), strdup(argv[1]));
+    list(fs, strdup(cwd), strdup(argv[1 + long_format]));
   }
 
   // Close vdisk
-  vdisk_disk_close();
+  oufs_close(fs);
 
   return 0;
 }
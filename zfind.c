@@ -0,0 +1,115 @@
+/**
+Find files and directories in the OU File System.
+
+Usage: zfind [-P <threads>] [<path>] [-name <glob>] [-type f|c|d]
+             [-size [+|-]<bytes>] [-maxdepth <levels>]
+
+  <path>     where to start (default: the current directory)
+  -name      the name matches the glob (quote it for the shell)
+  -type      f: files (compressed or not), c: compressed files,
+             d: directories
+  -size      files of exactly, more than (+) or less than (-) that many bytes
+  -maxdepth  go down at most that many levels below the start
+  -P         walk with that many threads; the order of the output is then
+             not fixed
+
+The tests are handed to the walk, which applies them as it reads the
+directories, breadth first.  Each match is printed with its path.
+
+CS3113
+
+*/
+
+#include <stdio.h>
+#include <string.h>
+
+#include "oufs_lib.h"
+
+/**
+ * Print a match (from the threads of a parallel walk)
+ */
+static void find_print(OUFS_WALK_ENTRY *entry, void *arg)
+{
+  printf("%s\n", entry->path);
+}
+
+int main(int argc, char** argv) {
+  // Fetch the key environment vars
+  char cwd[MAX_PATH_LENGTH];
+  char disk_name[MAX_PATH_LENGTH];
+  oufs_get_environment(cwd, disk_name);
+
+  // Check arguments
+  OUFS_WALK_FILTER filter = { NULL, 0, -1, -1, -1 };
+  char *path = cwd;
+  int threads = 0;
+  int ok = 1;
+  int a = 1;
+  if(a + 1 < argc && !strcmp(argv[a], "-P")) {
+    ok = (sscanf(argv[a + 1], "%d", &threads) == 1 && threads > 0);
+    a += 2;
+  }
+  if(a < argc && argv[a][0] != '-')
+    path = argv[a++];
+  for(; ok && a < argc; a += 2) {
+    if(a + 1 == argc) {
+      ok = 0;
+    }else if(!strcmp(argv[a], "-name")) {
+      filter.name = argv[a + 1];
+    }else if(!strcmp(argv[a], "-type")) {
+      char *type = argv[a + 1];
+      filter.type = !strcmp(type, "f") ? IT_FILE : !strcmp(type, "c") ? IT_COMPRESSED_FILE :
+        !strcmp(type, "d") ? IT_DIRECTORY : 0;
+      ok = (filter.type != 0);
+    }else if(!strcmp(argv[a], "-size")) {
+      char *size = argv[a + 1];
+      int bytes;
+      ok = (sscanf(size + (size[0] == '+' || size[0] == '-'), "%d", &bytes) == 1 && bytes >= 0);
+      if(size[0] == '+') {
+        filter.min_size = bytes + 1;
+      }else if(size[0] == '-') {
+        filter.max_size = bytes - 1;
+        ok = ok && bytes > 0;
+      }else{
+        filter.min_size = filter.max_size = bytes;
+      }
+    }else if(!strcmp(argv[a], "-maxdepth")) {
+      ok = (sscanf(argv[a + 1], "%d", &filter.max_depth) == 1 && filter.max_depth >= 0);
+    }else{
+      ok = 0;
+    }
+  }
+  if(!ok) {
+    fprintf(stderr, "Usage: zfind [-P <threads>] [<path>] [-name <glob>] [-type f|c|d] "
+            "[-size [+|-]<bytes>] [-maxdepth <levels>]\n");
+    return(-1);
+  }
+
+  // Open the virtual disk
+  OUFS *fs = oufs_open(disk_name);
+  if(fs == NULL) {
+    return(-1);
+  }
+
+  int ret = 0;
+  if(threads > 0) {
+    if(oufs_walk_parallel(fs, cwd, path, &filter, threads, find_print, NULL) < 0)
+      ret = -1;
+  }else{
+    OUFS_WALK *walk = oufs_walk_open(fs, cwd, path, &filter);
+    OUFS_WALK_ENTRY entry;
+    if(walk == NULL) {
+      ret = -1;
+    }else{
+      while((ret = oufs_walk_next(walk, &entry)) == 1)
+        printf("%s\n", entry.path);
+      oufs_walk_close(walk);
+    }
+  }
+  if(ret < 0)
+    fprintf(stderr, "Error walking %s\n", path);
+
+  // Clean up
+  oufs_close(fs);
+  return(ret < 0 ? -1 : 0);
+}
@@ -1,14 +1,41 @@
+/**
+Format the OU File System.
+
+Usage: zformat [-d] [-u]
+  -d  deduplicate file data blocks
+  -u  keep the usage of every directory's subtree (see zdu)
+
+CS3113
+
+*/
+
+#include <stdio.h>
+#include <string.h>
+
 #include "oufs_lib.h"
 #include "vdisk.h"
 
-int main()
+int main(int argc, char** argv)
 {
   // Fetch the key environment vars
   char cwd[MAX_PATH_LENGTH];
   char disk_name[MAX_PATH_LENGTH];
   oufs_get_environment(cwd, disk_name);
+
+  // Check arguments
+  int features = 0;
+  for(int i = 1; i < argc; ++i) {
+    if(!strcmp(argv[i], "-d")) {
+      features |= OUFS_FEATURE_DEDUP;
+    }else if(!strcmp(argv[i], "-u")) {
+      features |= OUFS_FEATURE_USAGE;
+    }else{
+      fprintf(stderr, "Usage: zformat [-d] [-u]\n");
+      return(-1);
+    }
+  }
   
-  oufs_format_disk(disk_name);
+  oufs_format_disk(disk_name, features);
 
   return 0;
-}
\ No newline at end of file
+}
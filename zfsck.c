@@ -0,0 +1,625 @@
+/**
+Check (and optionally repair) the consistency of an OU File System.
+
+The whole image is loaded with one bulk read and then checked in memory:
+ - the directory tree is walked from the root inode, recording which inodes
+   and blocks are reachable and how many directory entries name each inode
+ - dangling directory entries (out of range or unused inodes) are reported
+ - inodes on the orphan list (removed, waiting to be reclaimed) must have no
+   names; their blocks are accounted to them
+ - directory sizes are compared with their number of directory entries
+ - n_references is compared with the number of entries naming the inode
+ - the master block bitmaps are reconciled with what the walk reached
+ - the share counts of deduplicated blocks are compared with the number of
+   files using them, and fingerprints of blocks no file uses are reported
+ - the snapshot table is checked, and the blocks held by snapshots are
+   compared with what the snapshots record
+ - the free block and inode counters are compared with the bitmaps
+
+Usage: zfsck [-r]
+  -r  repair the problems that are found
+
+Exit status: 0 = clean, 1 = problems found and repaired, 4 = problems left
+
+The image is locked exclusively for the duration of the check, so tools that
+modify it in other processes wait until the check is done.
+
+CS3113
+
+*/
+
+#include <stdio.h>
+#include <string.h>
+
+#include "oufs_lib.h"
+
+// The image, loaded in one read
+static BLOCK image[N_BLOCKS_IN_DISK];
+
+// Blocks that have been modified by a repair
+static unsigned char dirty[N_BLOCKS_IN_DISK];
+
+// What the tree walk found
+static unsigned char inode_reached[N_INODES];
+static unsigned char block_owned[N_BLOCKS_IN_DISK];
+static unsigned char file_block[N_BLOCKS_IN_DISK];
+static int inode_names[N_INODES];
+
+// Repair mode and problem count
+static int repair = 0;
+static int problems = 0;
+
+/**
+ * Report a problem found by the checker
+ */
+#define PROBLEM(...) do { ++problems; printf(__VA_ARGS__); } while(0)
+
+/**
+ * The master block of the loaded image
+ */
+static OUFS_MASTER *fsck_master()
+{
+  return((OUFS_MASTER *) &image[MASTER_BLOCK_REFERENCE]);
+}
+
+/**
+ * Locate an inode inside of the loaded image
+ *
+ * @param i Inode reference
+ * @return Pointer to the inode within its inode block
+ */
+static INODE *fsck_inode(INODE_REFERENCE i)
+{
+  return(&image[i / INODES_PER_BLOCK + 1].inodes.inode[i % INODES_PER_BLOCK]);
+}
+
+/**
+ * Mark the inode block holding an inode as modified
+ *
+ * @param i Inode reference
+ */
+static void fsck_inode_dirty(INODE_REFERENCE i)
+{
+  dirty[i / INODES_PER_BLOCK + 1] = 1;
+}
+
+/**
+ * Test a bit in one of the master block bitmaps
+ */
+static int fsck_test_bit(unsigned char *table, int index)
+{
+  return((table[index >> 3] >> (index & 0x7)) & 1);
+}
+
+/**
+ * Set or clear a bit in one of the master block bitmaps
+ */
+static void fsck_set_bit(unsigned char *table, int index, int value)
+{
+  if(value)
+    table[index >> 3] |= (1 << (index & 0x7));
+  else
+    table[index >> 3] &= ~(1 << (index & 0x7));
+  dirty[MASTER_BLOCK_REFERENCE] = 1;
+}
+
+/**
+ * Record that a block is owned by an inode.  A deduplicated block may have
+ * as many owners as it has shares, plus one
+ *
+ * @param owner Inode that refers to the block
+ * @param block_ref The referenced block
+ * @return 1 if the block may be used by the owner; 0 if the reference is bad
+ */
+static int fsck_claim_block(INODE_REFERENCE owner, BLOCK_REFERENCE block_ref)
+{
+  if(block_ref <= N_INODE_BLOCKS || block_ref >= N_BLOCKS_IN_DISK) {
+    PROBLEM("Inode %d: bad block reference %d\n", owner, block_ref);
+    return(0);
+  }
+  if(block_owned[block_ref] > fsck_master()->block_shares[block_ref] ||
+     (block_owned[block_ref] && !file_block[block_ref])) {
+    PROBLEM("Inode %d: block %d is already in use\n", owner, block_ref);
+    return(0);
+  }
+  block_owned[block_ref]++;
+  return(1);
+}
+
+/**
+ * Check the cluster map of a compressed file and the blocks it refers to
+ *
+ * @param i The file's inode reference
+ */
+static void fsck_check_compressed_file(INODE_REFERENCE i)
+{
+  INODE *inode = fsck_inode(i);
+
+  for(int b = 1; b < BLOCKS_PER_INODE; ++b) {
+    if(inode->data[b] != UNALLOCATED_BLOCK) {
+      PROBLEM("Inode %d: compressed file refers to block %d outside of its map\n", i, inode->data[b]);
+      if(repair) {
+        inode->data[b] = UNALLOCATED_BLOCK;
+        fsck_inode_dirty(i);
+      }
+    }
+  }
+
+  if(inode->data[0] == UNALLOCATED_BLOCK)
+    return;
+  if(!fsck_claim_block(i, inode->data[0])) {
+    if(repair) {
+      inode->data[0] = UNALLOCATED_BLOCK;
+      inode->size = 0;
+      fsck_inode_dirty(i);
+    }
+    return;
+  }
+
+  OUFS_CLUSTER_MAP *map = (OUFS_CLUSTER_MAP *) &image[inode->data[0]];
+  for(int c = 0; c < OUFS_CLUSTERS_PER_MAP; ++c) {
+    OUFS_CLUSTER *cluster = &map->cluster[c];
+    if(cluster->stored_length > OUFS_CLUSTER_SIZE) {
+      PROBLEM("Inode %d: cluster %d has stored length %d\n", i, c, cluster->stored_length);
+      if(repair) {
+        cluster->stored_length = 0;
+        dirty[inode->data[0]] = 1;
+      }
+    }
+
+    for(int b = 0; b < OUFS_CLUSTER_BLOCKS; ++b) {
+      if(cluster->block[b] == UNALLOCATED_BLOCK) {
+        if(b * BLOCK_SIZE < cluster->stored_length) {
+          PROBLEM("Inode %d: cluster %d is missing block %d\n", i, c, b);
+          if(repair) {
+            cluster->stored_length = 0;
+            dirty[inode->data[0]] = 1;
+          }
+        }
+        continue;
+      }
+      if(block_owned[cluster->block[b]] == 0)
+        file_block[cluster->block[b]] = 1;
+      if(!fsck_claim_block(i, cluster->block[b]) && repair) {
+        cluster->block[b] = UNALLOCATED_BLOCK;
+        cluster->stored_length = 0;
+        dirty[inode->data[0]] = 1;
+      }
+    }
+  }
+
+  if(inode->size > OUFS_COMPRESSED_MAX_SIZE) {
+    PROBLEM("Inode %d: file size %u is too large\n", i, inode->size);
+    if(repair) {
+      inode->size = OUFS_COMPRESSED_MAX_SIZE;
+      fsck_inode_dirty(i);
+    }
+  }
+}
+
+/**
+ * Check the blocks of a file inode
+ *
+ * @param i The file's inode reference
+ */
+static void fsck_check_file(INODE_REFERENCE i)
+{
+  INODE *inode = fsck_inode(i);
+
+  if(inode->type == IT_COMPRESSED_FILE) {
+    fsck_check_compressed_file(i);
+    return;
+  }
+
+  for(int b = 0; b < BLOCKS_PER_INODE; ++b) {
+    if(inode->data[b] == UNALLOCATED_BLOCK)
+      continue;
+    if(block_owned[inode->data[b]] == 0)
+      file_block[inode->data[b]] = 1;
+    if(!fsck_claim_block(i, inode->data[b])) {
+      if(repair) {
+        inode->data[b] = UNALLOCATED_BLOCK;
+        fsck_inode_dirty(i);
+      }
+    }
+  }
+
+  if(inode->size > BLOCKS_PER_INODE * BLOCK_SIZE) {
+    PROBLEM("Inode %d: file size %u is too large\n", i, inode->size);
+    if(repair) {
+      inode->size = BLOCKS_PER_INODE * BLOCK_SIZE;
+      fsck_inode_dirty(i);
+    }
+  }
+}
+
+/**
+ * Walk the directory tree breadth first from the root directory, checking
+ * every directory block and recording what is reachable
+ */
+static void fsck_walk_tree()
+{
+  INODE_REFERENCE queue[N_INODES];
+  INODE_REFERENCE parents[N_INODES];
+  int head = 0;
+  int tail = 0;
+
+  if(fsck_inode(0)->type != IT_DIRECTORY) {
+    PROBLEM("Root inode is not a directory\n");
+    return;
+  }
+
+  // The root is its own parent
+  queue[tail] = 0;
+  parents[tail++] = 0;
+  inode_reached[0] = 1;
+  inode_names[0] = 1;
+
+  while(head < tail) {
+    INODE_REFERENCE self = queue[head];
+    INODE_REFERENCE parent = parents[head++];
+    INODE *inode = fsck_inode(self);
+    BLOCK_REFERENCE block_ref = inode->data[0];
+
+    if(!fsck_claim_block(self, block_ref))
+      continue;
+
+    DIRECTORY_BLOCK *dir = &image[block_ref].directory;
+    unsigned int entries = 0;
+
+    for(int e = 0; e < DIRECTORY_ENTRIES_PER_BLOCK; ++e) {
+      DIRECTORY_ENTRY *entry = &dir->entry[e];
+      INODE_REFERENCE ref = entry->inode_reference;
+
+      if(ref == UNALLOCATED_INODE)
+        continue;
+
+      // Dangling reference?
+      if(ref >= N_INODES || (fsck_inode(ref)->type != IT_DIRECTORY &&
+                             !OUFS_IS_FILE(fsck_inode(ref)->type))) {
+        PROBLEM("Directory %d: entry \"%.*s\" refers to unused inode %d\n",
+                self, (int) FILE_NAME_SIZE, entry->name, ref);
+        if(repair) {
+          oufs_clean_directory_entry(entry);
+          dirty[block_ref] = 1;
+        }
+        continue;
+      }
+      ++entries;
+
+      // The two fixed entries
+      if(!strcmp(entry->name, ".")) {
+        if(ref != self)
+          PROBLEM("Directory %d: \".\" refers to inode %d\n", self, ref);
+        continue;
+      }
+      if(!strcmp(entry->name, "..")) {
+        if(ref != parent)
+          PROBLEM("Directory %d: \"..\" refers to inode %d, not %d\n", self, ref, parent);
+        continue;
+      }
+
+      ++inode_names[ref];
+      if(inode_reached[ref]) {
+        if(fsck_inode(ref)->type == IT_DIRECTORY)
+          PROBLEM("Directory %d is linked from more than one place\n", ref);
+        continue;
+      }
+      inode_reached[ref] = 1;
+
+      if(fsck_inode(ref)->type == IT_DIRECTORY) {
+        queue[tail] = ref;
+        parents[tail++] = self;
+      }else{
+        fsck_check_file(ref);
+      }
+    }
+
+    if(inode->size != entries) {
+      PROBLEM("Directory %d: size is %u, but it has %u entries\n", self, inode->size, entries);
+      if(repair) {
+        inode->size = entries;
+        fsck_inode_dirty(self);
+      }
+    }
+  }
+}
+
+/**
+ * Check the inodes on the orphan list: each must be a file or directory
+ * that the walk did not reach.  Its blocks stay in use until it is reclaimed
+ */
+static void fsck_check_orphans()
+{
+  OUFS_MASTER *ext = fsck_master();
+
+  for(INODE_REFERENCE i = 0; i < N_INODES; ++i) {
+    if(!fsck_test_bit(ext->orphan_inode_flag, i))
+      continue;
+    INODE *inode = fsck_inode(i);
+
+    if(inode_reached[i] || !fsck_test_bit(ext->master.inode_allocated_flag, i) ||
+       (inode->type != IT_DIRECTORY && !OUFS_IS_FILE(inode->type))) {
+      PROBLEM("Inode %d is on the orphan list but is %s\n", i,
+              inode_reached[i] ? "named in a directory" : "not in use");
+      if(repair)
+        fsck_set_bit(ext->orphan_inode_flag, i, 0);
+      continue;
+    }
+
+    inode_reached[i] = 1;
+    if(inode->type == IT_DIRECTORY)
+      fsck_claim_block(i, inode->data[0]);
+    else
+      fsck_check_file(i);
+  }
+}
+
+/**
+ * Check the snapshot table, and that the blocks recorded as held by
+ * snapshots are the ones that they hold
+ */
+static void fsck_check_snapshots()
+{
+  OUFS_MASTER *ext = fsck_master();
+  BLOCK_REFERENCE table_ref = ext->snapshot_block;
+  OUFS_SNAPSHOT_BLOCK *table = NULL;
+
+  if(table_ref != 0) {
+    if(table_ref <= N_INODE_BLOCKS || table_ref >= N_BLOCKS_IN_DISK || block_owned[table_ref]) {
+      PROBLEM("Snapshot table block %d is not valid\n", table_ref);
+      if(repair) {
+        ext->snapshot_block = 0;
+        dirty[MASTER_BLOCK_REFERENCE] = 1;
+      }
+    }else{
+      block_owned[table_ref] = 1;
+      table = (OUFS_SNAPSHOT_BLOCK *) &image[table_ref];
+    }
+  }
+
+  unsigned char pinned[N_BLOCKS_IN_DISK >> 3];
+  unsigned char shared = 0;
+  memset(pinned, 0, sizeof(pinned));
+
+  for(int s = 0; table != NULL && s < OUFS_MAX_SNAPSHOTS; ++s) {
+    OUFS_SNAPSHOT *snapshot = &table->snapshot[s];
+    if(snapshot->name[0] == 0)
+      continue;
+
+    // Its inode blocks are either still the live ones or copies it holds
+    int damaged = 0;
+    for(int k = 0; k < N_INODE_BLOCKS; ++k) {
+      BLOCK_REFERENCE ref = snapshot->inode_block[k];
+      if(ref == k + 1) {
+        shared |= (1 << k);
+      }else if(ref <= N_INODE_BLOCKS || ref >= N_BLOCKS_IN_DISK ||
+               !fsck_test_bit(snapshot->master.block_allocated_flag, ref)) {
+        PROBLEM("Snapshot %.*s: inode block %d refers to block %d\n",
+                (int) FILE_NAME_SIZE, snapshot->name, k + 1, ref);
+        damaged = 1;
+      }
+    }
+    for(BLOCK_REFERENCE b = 0; b <= N_INODE_BLOCKS; ++b)
+      damaged |= fsck_test_bit(snapshot->master.block_allocated_flag, b);
+    if(fsck_test_bit(snapshot->master.block_allocated_flag, table_ref))
+      damaged = 1;
+
+    if(damaged) {
+      PROBLEM("Snapshot %.*s is damaged\n", (int) FILE_NAME_SIZE, snapshot->name);
+      if(repair) {
+        memset(snapshot, 0, sizeof(OUFS_SNAPSHOT));
+        dirty[table_ref] = 1;
+      }
+      continue;
+    }
+    for(int i = 0; i < (N_BLOCKS_IN_DISK >> 3); ++i)
+      pinned[i] |= snapshot->master.block_allocated_flag[i];
+  }
+
+  if(memcmp(pinned, ext->block_pinned_flag, sizeof(pinned)) != 0 || shared != ext->inode_blocks_shared) {
+    PROBLEM("The blocks held by snapshots are not recorded correctly\n");
+    if(repair) {
+      memcpy(ext->block_pinned_flag, pinned, sizeof(pinned));
+      ext->inode_blocks_shared = shared;
+      dirty[MASTER_BLOCK_REFERENCE] = 1;
+    }
+  }
+}
+
+/**
+ * Compare the free counters in the master block with its bitmaps.  An image
+ * written before the counters were kept has none to check
+ */
+static void fsck_check_counters()
+{
+  OUFS_MASTER *ext = fsck_master();
+  BLOCK counted = image[MASTER_BLOCK_REFERENCE];
+  OUFS_MASTER *expected = (OUFS_MASTER *) &counted;
+
+  if(!ext->counters_valid)
+    return;
+  oufs_update_counters(&counted);
+  if(ext->free_blocks != expected->free_blocks || ext->free_inodes != expected->free_inodes ||
+     memcmp(ext->group_free_blocks, expected->group_free_blocks, sizeof(ext->group_free_blocks))) {
+    PROBLEM("Free counters (%d blocks, %d inodes) do not match the bitmaps (%d blocks, %d inodes)\n",
+            ext->free_blocks, ext->free_inodes, expected->free_blocks, expected->free_inodes);
+    if(repair)
+      dirty[MASTER_BLOCK_REFERENCE] = 1;
+  }
+}
+
+/**
+ * Compare the reference counts and the master block bitmaps with the
+ * results of the tree walk
+ */
+static void fsck_reconcile()
+{
+  MASTER_BLOCK *master = &image[MASTER_BLOCK_REFERENCE].master;
+  OUFS_MASTER *ext = fsck_master();
+
+  for(INODE_REFERENCE i = 0; i < N_INODES; ++i) {
+    INODE *inode = fsck_inode(i);
+    int allocated = fsck_test_bit(master->inode_allocated_flag, i);
+
+    if(inode_reached[i]) {
+      if(inode->n_references != inode_names[i]) {
+        PROBLEM("Inode %d: n_references is %d, but it has %d names\n",
+                i, inode->n_references, inode_names[i]);
+        if(repair) {
+          inode->n_references = inode_names[i];
+          fsck_inode_dirty(i);
+        }
+      }
+      if(!allocated) {
+        PROBLEM("Inode %d is in use but not marked allocated\n", i);
+        if(repair)
+          fsck_set_bit(master->inode_allocated_flag, i, 1);
+      }
+    }else if(allocated) {
+      PROBLEM("Inode %d is marked allocated but is unreachable\n", i);
+      if(repair) {
+        inode->type = IT_NONE;
+        inode->n_references = 0;
+        fsck_inode_dirty(i);
+        fsck_set_bit(master->inode_allocated_flag, i, 0);
+      }
+    }
+  }
+
+  // The master block and the inode blocks are always in use, and so are the
+  // fingerprint index and the usage table
+  for(BLOCK_REFERENCE b = 0; b <= N_INODE_BLOCKS; ++b)
+    block_owned[b] = 1;
+  BLOCK_REFERENCE index_ref = ext->fingerprint_block;
+  if(index_ref != 0) {
+    if(index_ref <= N_INODE_BLOCKS || index_ref >= N_BLOCKS_IN_DISK || block_owned[index_ref]) {
+      PROBLEM("Fingerprint index block %d is not valid\n", index_ref);
+      index_ref = 0;
+      if(repair) {
+        ext->features &= ~OUFS_FEATURE_DEDUP;
+        ext->fingerprint_block = 0;
+        dirty[MASTER_BLOCK_REFERENCE] = 1;
+      }
+    }else{
+      block_owned[index_ref] = 1;
+    }
+  }
+  if(ext->usage_block[0] != 0) {
+    int valid = 1;
+    for(int k = 0; k < OUFS_USAGE_BLOCKS; ++k) {
+      BLOCK_REFERENCE usage_ref = ext->usage_block[k];
+      if(usage_ref <= N_INODE_BLOCKS || usage_ref >= N_BLOCKS_IN_DISK || block_owned[usage_ref]) {
+        PROBLEM("Usage table block %d is not valid\n", usage_ref);
+        valid = 0;
+      }
+    }
+    if(valid) {
+      for(int k = 0; k < OUFS_USAGE_BLOCKS; ++k)
+        block_owned[ext->usage_block[k]] = 1;
+    }else if(repair) {
+      // Usage is no longer kept; zdu -r starts it again
+      ext->features &= ~OUFS_FEATURE_USAGE;
+      memset(ext->usage_block, 0, sizeof(ext->usage_block));
+      dirty[MASTER_BLOCK_REFERENCE] = 1;
+    }
+  }
+
+  fsck_check_snapshots();
+
+  for(BLOCK_REFERENCE b = 0; b < N_BLOCKS_IN_DISK; ++b) {
+    int shares = block_owned[b] ? block_owned[b] - 1 : 0;
+    if(ext->block_shares[b] != shares) {
+      PROBLEM("Block %d has %d share(s) recorded, but %d in use\n", b, ext->block_shares[b], shares);
+      if(repair) {
+        ext->block_shares[b] = shares;
+        dirty[MASTER_BLOCK_REFERENCE] = 1;
+      }
+    }
+  }
+
+  // Only file data blocks have fingerprints
+  if(index_ref != 0) {
+    OUFS_FINGERPRINT_BLOCK *index = (OUFS_FINGERPRINT_BLOCK *) &image[index_ref];
+    for(BLOCK_REFERENCE b = 0; b < N_BLOCKS_IN_DISK; ++b) {
+      if(index->fingerprint[b] != 0 && !file_block[b]) {
+        PROBLEM("Block %d has a fingerprint but holds no file data\n", b);
+        if(repair) {
+          index->fingerprint[b] = 0;
+          ext->fingerprint_generation++;
+          dirty[index_ref] = 1;
+          dirty[MASTER_BLOCK_REFERENCE] = 1;
+        }
+      }
+    }
+  }
+
+  for(BLOCK_REFERENCE b = 0; b < N_BLOCKS_IN_DISK; ++b) {
+    int allocated = fsck_test_bit(master->block_allocated_flag, b);
+    if(block_owned[b] && !allocated) {
+      PROBLEM("Block %d is in use but not marked allocated\n", b);
+      if(repair)
+        fsck_set_bit(master->block_allocated_flag, b, 1);
+    }else if(!block_owned[b] && allocated) {
+      PROBLEM("Block %d is marked allocated but is not in use\n", b);
+      if(repair)
+        fsck_set_bit(master->block_allocated_flag, b, 0);
+    }
+  }
+}
+
+int main(int argc, char** argv) {
+  // Fetch the key environment vars
+  char cwd[MAX_PATH_LENGTH];
+  char disk_name[MAX_PATH_LENGTH];
+  oufs_get_environment(cwd, disk_name);
+
+  // Check arguments
+  if(argc == 2 && !strcmp(argv[1], "-r")) {
+    repair = 1;
+  }else if(argc != 1) {
+    fprintf(stderr, "Usage: zfsck [-r]\n");
+    return(4);
+  }
+
+  // Open the virtual disk and load it in one read
+  VDISK *disk = vdisk_disk_open(disk_name);
+  if(disk == NULL)
+    return(4);
+
+  // No other process may modify the image while it is checked
+  vdisk_lock_image(disk, VDISK_LOCK_EXCLUSIVE);
+
+  // Bring the home locations up to date with the journal; repairs are
+  // written directly, so nothing may be left in it to replay later
+  vdisk_journal_checkpoint(disk);
+  if(vdisk_read_blocks(disk, 0, N_BLOCKS_IN_DISK, image) != 0) {
+    vdisk_disk_close(disk);
+    return(4);
+  }
+
+  fsck_check_counters();
+  fsck_walk_tree();
+  fsck_check_orphans();
+  fsck_reconcile();
+
+  // Write back only the blocks that a repair touched; the counters follow
+  // any repair of the bitmaps
+  if(repair) {
+    if(dirty[MASTER_BLOCK_REFERENCE])
+      oufs_update_counters(&image[MASTER_BLOCK_REFERENCE]);
+    for(BLOCK_REFERENCE b = 0; b < N_BLOCKS_IN_DISK; ++b) {
+      if(dirty[b])
+        vdisk_write_block(disk, b, &image[b]);
+    }
+  }
+
+  // Clean up
+  vdisk_unlock_image(disk);
+  vdisk_disk_close(disk);
+
+  printf("%d problem(s) found%s\n", problems, (repair && problems) ? " and repaired" : "");
+  if(problems == 0)
+    return(0);
+  return(repair ? 1 : 4);
+}
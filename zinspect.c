@@ -9,7 +9,8 @@ int main(int argc, char** argv) {
   char disk_name[MAX_PATH_LENGTH];
   oufs_get_environment(cwd, disk_name);
 
-  if(vdisk_disk_open(disk_name) != 0) {
+  OUFS *fs = oufs_open(disk_name);
+  if(fs == NULL) {
     return(-1);
   }
 
@@ -17,7 +18,16 @@ int main(int argc, char** argv) {
     if(strncmp(argv[1], "-master", 8) == 0) {
       // Master record
       BLOCK block;
-      if(vdisk_read_block(0, &block) != 0) {
+      vdisk_lock_block(fs->disk, 0, VDISK_LOCK_SHARED);
+      int ret = vdisk_read_block(fs->disk, 0, &block);
+      vdisk_unlock_block(fs->disk, 0);
+      // A snapshot reports the tables as they were when it was taken
+      OUFS_SNAPSHOT snapshot;
+      if(ret == 0 && fs->snapshot >= 0) {
+	ret = oufs_snapshot_read(fs, fs->snapshot, &snapshot);
+	block.master = snapshot.master;
+      }
+      if(ret != 0) {
 	fprintf(stderr, "Error reading master block\n");
       }else{
 	// Block read: report state
@@ -29,8 +39,52 @@ int main(int argc, char** argv) {
 	for(int i = 0; i < N_BLOCKS_IN_DISK / 8; ++i) {
 	  printf("%02x\n", block.master.block_allocated_flag[i]);
 	}
+
+	// Deduplicated blocks and the number of extra files using them
+	OUFS_MASTER *master = (OUFS_MASTER *) &block;
+	if(master->features & OUFS_FEATURE_DEDUP) {
+	  printf("Fingerprint index: %d\n", master->fingerprint_block);
+	  printf("Shared blocks:\n");
+	  for(int i = 0; i < N_BLOCKS_IN_DISK; ++i) {
+	    if(master->block_shares[i] > 0)
+	      printf("%d: %d\n", i, master->block_shares[i]);
+	  }
+	}
+
+	// Blocks kept for snapshots
+	if(fs->snapshot >= 0) {
+	  printf("Snapshot: %s\n", snapshot.name);
+	  for(int k = 0; k < N_INODE_BLOCKS; ++k)
+	    printf("Inode block %d: %d\n", k + 1, snapshot.inode_block[k]);
+	}else if(master->snapshot_block != 0) {
+	  printf("Snapshot table: %d\n", master->snapshot_block);
+	  printf("Pinned table:\n");
+	  for(int i = 0; i < N_BLOCKS_IN_DISK / 8; ++i) {
+	    printf("%02x\n", master->block_pinned_flag[i]);
+	  }
+	}
+
+	// Removed inodes whose blocks have not been reclaimed yet
+	if(fs->snapshot < 0) {
+	  for(int i = 0; i < N_INODES; ++i) {
+	    if((master->orphan_inode_flag[i >> 3] >> (i & 0x7)) & 1)
+	      printf("Orphan: %d\n", i);
+	  }
+	}
       }
       
+    }else if(strncmp(argv[1], "-stats", 7) == 0) {
+      // Statistics accumulated in the ZSTATS file (this run's are added at close)
+      VDISK_STATS stats;
+      char *stats_name = getenv("ZSTATS");
+      if(stats_name == NULL || !strcmp(stats_name, "-")) {
+	fprintf(stderr, "Set ZSTATS to the file that collects the statistics\n");
+      }else if(vdisk_stats_load(stats_name, &stats) != 0) {
+	fprintf(stderr, "No statistics in %s\n", stats_name);
+      }else{
+	vdisk_stats_print(stdout, &stats);
+      }
+
     }else{
       fprintf(stderr, "Unknown argument (%s)\n", argv[1]);
     }
@@ -44,7 +98,7 @@ int main(int argc, char** argv) {
 	  fprintf(stderr, "Inode index out of range (%s)\n", argv[2]);
 	}else{
 	  INODE inode;
-	  oufs_read_inode_by_reference(index, &inode);
+	  oufs_read_inode_by_reference(fs, index, &inode);
 
 	  printf("Inode: %d\n", index);
 	  printf("Type: %c\n", inode.type);
@@ -52,6 +106,9 @@ int main(int argc, char** argv) {
 	    printf("Block %d: %d\n", i, inode.data[i]);
 	  }
 	  printf("Size: %d\n", inode.size);
+	  // Holes take no blocks; reserved blocks may lie past the size
+	  int blocks = oufs_inode_blocks(fs, &inode);
+	  printf("Allocated: %d blocks (%d bytes)\n", blocks, blocks * BLOCK_SIZE);
 	  
 	}
       }else{
@@ -65,7 +122,7 @@ int main(int argc, char** argv) {
 	  fprintf(stderr, "Inode index out of range (%s)\n", argv[2]);
 	}else{
 	  INODE inode;
-	  oufs_read_inode_by_reference(index, &inode);
+	  oufs_read_inode_by_reference(fs, index, &inode);
 
 	  printf("Inode: %d\n", index);
 	  printf("Type: %c\n", inode.type);
@@ -74,6 +131,9 @@ int main(int argc, char** argv) {
 	    printf("Block %d: %d\n", i, inode.data[i]);
 	  }
 	  printf("Size: %d\n", inode.size);
+	  // Holes take no blocks; reserved blocks may lie past the size
+	  int blocks = oufs_inode_blocks(fs, &inode);
+	  printf("Allocated: %d blocks (%d bytes)\n", blocks, blocks * BLOCK_SIZE);
 	  
 	}
       }else{
@@ -87,7 +147,9 @@ int main(int argc, char** argv) {
 	  fprintf(stderr, "Block index out of range (%s)\n", argv[2]);
 	}else{
 	  BLOCK block;
-	  vdisk_read_block(index, &block);
+	  vdisk_lock_block(fs->disk, index, VDISK_LOCK_SHARED);
+	  vdisk_read_block(fs->disk, index, &block);
+	  vdisk_unlock_block(fs->disk, index);
 	  printf("Directory at block %d:\n", index);
 	  for(int i = 0; i < DIRECTORY_ENTRIES_PER_BLOCK; ++i) {
 	    if(block.directory.entry[i].inode_reference != UNALLOCATED_INODE) {
@@ -97,6 +159,14 @@ int main(int argc, char** argv) {
 	  }
 	}
       }
+    }else if(strncmp(argv[1], "-save", 6) == 0) {
+      // Consistent copy of the whole image, journal included, to a file: how
+      // a mem: disk is saved before it is closed
+      if(vdisk_disk_snapshot(fs->disk, argv[2]) != 0) {
+	fprintf(stderr, "Unable to save the image to %s\n", argv[2]);
+      }else{
+	printf("Image saved to %s\n", argv[2]);
+      }
     }else if(strncmp(argv[1], "-raw", 4) == 0) {
       // Inspect raw block
       int index;
@@ -105,7 +175,9 @@ int main(int argc, char** argv) {
 	  fprintf(stderr, "Block index out of range (%s)\n", argv[2]);
 	}else{
 	  BLOCK block;
-	  vdisk_read_block(index, &block);
+	  vdisk_lock_block(fs->disk, index, VDISK_LOCK_SHARED);
+	  vdisk_read_block(fs->disk, index, &block);
+	  vdisk_unlock_block(fs->disk, index);
 	  printf("Raw data at block %d:\n", index);
 	  for(int i = 0; i < BLOCK_SIZE; ++i) {
 	    if(block.data.data[i] >= ' ' && block.data.data[i] <= '~')
@@ -119,6 +191,6 @@ int main(int argc, char** argv) {
 
   }
   
-  vdisk_disk_close();
+  oufs_close(fs);
 }
 
@@ -0,0 +1,42 @@
+/**
+Give a file another name (a hard link) in the OU File System.  Both names
+refer to the same contents; the file goes away with its last name.
+
+CS3113
+
+*/
+
+#include <stdio.h>
+#include <string.h>
+
+#include "oufs_lib.h"
+
+int main(int argc, char** argv) {
+  // Fetch the key environment vars
+  char cwd[MAX_PATH_LENGTH];
+  char disk_name[MAX_PATH_LENGTH];
+  oufs_get_environment(cwd, disk_name);
+
+  // Check arguments
+  if(argc == 3) {
+    // Open the virtual disk
+    OUFS *fs = oufs_open(disk_name);
+    if(fs == NULL) {
+      return(-1);
+    }
+
+    // Link the file under the new name
+    int ret = oufs_link(fs, cwd, argv[1], argv[2]);
+    if(ret != 0) {
+      fprintf(stderr, "Error (%d)\n", ret);
+    }
+
+    // Clean up
+    oufs_close(fs);
+    
+  }else{
+    // Wrong number of parameters
+    fprintf(stderr, "Usage: zlink <filename> <new name>\n");
+  }
+
+}
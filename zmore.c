@@ -0,0 +1,50 @@
+/**
+Print a file in the OU File System to standard output.
+
+CS3113
+
+*/
+
+#include <stdio.h>
+#include <string.h>
+
+#include "oufs_lib.h"
+
+int main(int argc, char** argv) {
+  // Fetch the key environment vars
+  char cwd[MAX_PATH_LENGTH];
+  char disk_name[MAX_PATH_LENGTH];
+  oufs_get_environment(cwd, disk_name);
+
+  // Check arguments
+  if(argc == 2) {
+    // Open the virtual disk
+    OUFS *fs = oufs_open(disk_name);
+    if(fs == NULL) {
+      return(-1);
+    }
+
+    // Open the file for reading
+    OUFILE *fp = oufs_fopen(fs, cwd, argv[1], "r");
+    if(fp == NULL) {
+      fprintf(stderr, "Error opening file\n");
+    }else{
+      // The whole file at once, without copying it if it can be mapped
+      const unsigned char *view;
+      int n = oufs_mmap(fs, fp, &view);
+      if(n > 0) {
+        fwrite(view, 1, n, stdout);
+      }
+      oufs_munmap(view, n);
+      oufs_fclose(fs, fp);
+    }
+
+    // Clean up
+    oufs_close(fs);
+    
+  }else{
+    // Wrong number of parameters
+    fprintf(stderr, "Usage: zmore <filename>\n");
+  }
+
+}
@@ -0,0 +1,41 @@
+/**
+Remove a file from the OU File System.
+
+CS3113
+
+*/
+
+#include <stdio.h>
+#include <string.h>
+
+#include "oufs_lib.h"
+
+int main(int argc, char** argv) {
+  // Fetch the key environment vars
+  char cwd[MAX_PATH_LENGTH];
+  char disk_name[MAX_PATH_LENGTH];
+  oufs_get_environment(cwd, disk_name);
+
+  // Check arguments
+  if(argc == 2) {
+    // Open the virtual disk
+    OUFS *fs = oufs_open(disk_name);
+    if(fs == NULL) {
+      return(-1);
+    }
+
+    // Remove the specified file
+    int ret = oufs_remove(fs, cwd, argv[1]);
+    if(ret != 0) {
+      fprintf(stderr, "Error (%d)\n", ret);
+    }
+
+    // Clean up
+    oufs_close(fs);
+    
+  }else{
+    // Wrong number of parameters
+    fprintf(stderr, "Usage: zremove <filename>\n");
+  }
+
+}
@@ -0,0 +1,198 @@
+/**
+Play back a trace of file system operations (recorded with ZTRACE=<trace>).
+
+Usage: zreplay [-f] [-p] <trace>
+
+  -f  format the disk first; otherwise the trace is played on the disk as it
+      is, such as a copy of the image that the trace was recorded on
+  -p  keep the pace of the recording; otherwise as fast as possible
+
+Files are written with made-up contents of the recorded sizes.  At the end,
+the number of operations of each kind, those that came out differently from
+the recording, the throughput and the blocks read and written are reported.
+
+CS3113
+
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+#include "oufs_lib.h"
+
+/**
+ * Current time in microseconds
+ */
+static unsigned long replay_now()
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return(ts.tv_sec * 1000000UL + ts.tv_nsec / 1000);
+}
+
+int main(int argc, char** argv) {
+  // Fetch the key environment vars
+  char cwd[MAX_PATH_LENGTH];
+  char disk_name[MAX_PATH_LENGTH];
+  oufs_get_environment(cwd, disk_name);
+
+  // Check arguments
+  int format = 0;
+  int paced = 0;
+  int a = 1;
+  for(; a < argc && argv[a][0] == '-'; ++a) {
+    if(!strcmp(argv[a], "-f"))
+      format = 1;
+    else if(!strcmp(argv[a], "-p"))
+      paced = 1;
+    else
+      break;
+  }
+  if(a != argc - 1) {
+    fprintf(stderr, "Usage: zreplay [-f] [-p] <trace>\n");
+    return(-1);
+  }
+
+  FILE *trace = fopen(argv[a], "r");
+  if(trace == NULL) {
+    perror(argv[a]);
+    return(-1);
+  }
+
+  // The replay itself is not traced
+  unsetenv("ZTRACE");
+  if(format && oufs_format_disk(disk_name, 0) != 0) {
+    fprintf(stderr, "Unable to format %s\n", disk_name);
+    return(-1);
+  }
+
+  // Open the virtual disk
+  OUFS *fs = oufs_open(disk_name);
+  if(fs == NULL) {
+    return(-1);
+  }
+
+  // Listings go nowhere
+  fflush(stdout);
+  int saved_stdout = dup(1);
+  int null_fd = open("/dev/null", O_WRONLY);
+  dup2(null_fd, 1);
+
+  // Files open in the recording, by their recorded inode
+  OUFILE *files[N_INODES];
+  memset(files, 0, sizeof(files));
+  unsigned char buf[BLOCKS_PER_INODE * BLOCK_SIZE];
+  for(int i = 0; i < sizeof(buf); ++i)
+    buf[i] = 'a' + i % 26;
+
+  unsigned long count[OUFS_N_TRACE_OPS] = { 0 };
+  unsigned long differ[OUFS_N_TRACE_OPS] = { 0 };
+  unsigned long skipped = 0;
+  unsigned long reads = fs->disk->n_block_reads;
+  unsigned long writes = fs->disk->n_block_writes;
+  unsigned long first_usec = 0;
+  unsigned long start = replay_now();
+
+  OUFS_TRACE_RECORD record;
+  char path[MAX_PATH_LENGTH];
+  int ret;
+  while((ret = oufs_trace_next(trace, &record, path)) == 1) {
+    if(first_usec == 0)
+      first_usec = record.usec;
+    if(paced && record.usec > first_usec) {
+      long wait = (long) (record.usec - first_usec) - (long) (replay_now() - start);
+      if(wait > 0)
+        usleep(wait);
+    }
+
+    OUFILE *fp = (record.inode < N_INODES) ? files[record.inode] : NULL;
+    int result = 0;
+    switch(record.op) {
+    case OUFS_TRACE_MKDIR:
+      result = oufs_mkdir(fs, "/", path);
+      break;
+    case OUFS_TRACE_RMDIR:
+      result = oufs_rmdir(fs, "/", path);
+      break;
+    case OUFS_TRACE_LIST:
+      result = oufs_list(fs, "/", path);
+      break;
+    case OUFS_TRACE_REMOVE:
+      result = oufs_remove(fs, "/", path);
+      break;
+    case OUFS_TRACE_FOPEN: {
+      char mode[sizeof(record.mode) + 1];
+      memcpy(mode, record.mode, sizeof(record.mode));
+      mode[sizeof(record.mode)] = 0;
+      OUFILE *opened = oufs_fopen(fs, "/", path, mode);
+      result = (opened != NULL) ? 0 : -1;
+      if(record.inode < N_INODES) {
+        oufs_fclose(fs, fp);
+        files[record.inode] = opened;
+      }else{
+        oufs_fclose(fs, opened);
+      }
+      break;
+    }
+    case OUFS_TRACE_FCLOSE:
+      if(fp == NULL) {
+        ++skipped;
+        continue;
+      }
+      oufs_fclose(fs, fp);
+      files[record.inode] = NULL;
+      break;
+    case OUFS_TRACE_READ:
+    case OUFS_TRACE_WRITE:
+      // Only files whose opening was recorded can be used
+      if(fp == NULL || record.length < 0) {
+        ++skipped;
+        continue;
+      }
+      fp->offset = record.offset;
+      if(record.op == OUFS_TRACE_READ)
+        result = oufs_fread(fs, fp, buf, MIN(record.length, (int) sizeof(buf)));
+      else
+        result = oufs_fwrite(fs, fp, buf, MIN(record.length, (int) sizeof(buf)));
+      break;
+    }
+
+    count[record.op]++;
+    if(result != record.result)
+      differ[record.op]++;
+  }
+
+  double elapsed = (replay_now() - start) / 1e6;
+  reads = fs->disk->n_block_reads - reads;
+  writes = fs->disk->n_block_writes - writes;
+
+  for(int i = 0; i < N_INODES; ++i)
+    oufs_fclose(fs, files[i]);
+
+  fflush(stdout);
+  dup2(saved_stdout, 1);
+  close(saved_stdout);
+  close(null_fd);
+
+  if(ret < 0)
+    fprintf(stderr, "The trace is damaged: stopped early\n");
+
+  unsigned long total = 0;
+  printf("%-8s %10s %10s\n", "op", "count", "differ");
+  for(int op = 1; op < OUFS_N_TRACE_OPS; ++op) {
+    if(count[op] == 0)
+      continue;
+    printf("%-8s %10lu %10lu\n", oufs_trace_op_names[op], count[op], differ[op]);
+    total += count[op];
+  }
+  printf("Skipped: %lu\n", skipped);
+  printf("Operations: %lu in %.3f s (%.0f/s)\n", total, elapsed, elapsed > 0 ? total / elapsed : 0.0);
+  printf("Blocks read: %lu (%.2f/op)\n", reads, total ? (double) reads / total : 0.0);
+  printf("Blocks written: %lu (%.2f/op)\n", writes, total ? (double) writes / total : 0.0);
+
+  // Clean up
+  fclose(trace);
+  oufs_close(fs);
+  return(0);
+}
@@ -11,16 +11,19 @@ int main(int argc, char** argv) {
   // Check arguments
   if(argc == 2) {
     // Open the virtual disk
-    vdisk_disk_open(disk_name);
+    OUFS *fs = oufs_open(disk_name);
+    if(fs == NULL) {
+      return(-1);
+    }
 
     // Make the specified directory
-    int ret = oufs_rmdir(cwd, argv[1]);
+    int ret = oufs_rmdir(fs, cwd, argv[1]);
     if(ret != 0) {
       fprintf(stderr, "Error (%d)\n", ret);
     }
 
     // Clean up
-    vdisk_disk_close();
+    oufs_close(fs);
     
   }else{
     // Wrong number of parameters
@@ -0,0 +1,53 @@
+/**
+Take, list and delete snapshots of the OU File System.
+
+Usage: zsnapshot            list the snapshots
+       zsnapshot <name>     take a snapshot
+       zsnapshot -d <name>  delete a snapshot
+
+A snapshot is read (but never changed) through the other tools by naming it
+after the disk: ZDISK=vdisk1@name zfilez
+
+CS3113
+
+*/
+
+#include <stdio.h>
+#include <string.h>
+
+#include "oufs_lib.h"
+
+int main(int argc, char** argv) {
+  // Fetch the key environment vars
+  char cwd[MAX_PATH_LENGTH];
+  char disk_name[MAX_PATH_LENGTH];
+  oufs_get_environment(cwd, disk_name);
+
+  // Check arguments
+  if(argc == 1 || argc == 2 || (argc == 3 && !strcmp(argv[1], "-d"))) {
+    // Open the virtual disk
+    OUFS *fs = oufs_open(disk_name);
+    if(fs == NULL) {
+      return(-1);
+    }
+
+    int ret;
+    if(argc == 1)
+      ret = oufs_snapshot_list(fs);
+    else if(argc == 2)
+      ret = oufs_snapshot_create(fs, argv[1]);
+    else
+      ret = oufs_snapshot_delete(fs, argv[2]);
+    if(ret != 0) {
+      fprintf(stderr, "Error (%d)\n", ret);
+    }
+
+    // Clean up
+    oufs_close(fs);
+    
+  }else{
+    // Wrong number of parameters
+    fprintf(stderr, "Usage: zsnapshot [[-d] <name>]\n");
+  }
+
+}